@@ -0,0 +1,422 @@
+/*
+ * Copyright (c) 2012 Conformal Systems LLC <info@conformal.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * BLAKE3, unkeyed, with the output cut to CT_DIGEST_LENGTH bytes. Input is
+ * split in 1k chunks that are hashed on their own and joined in a binary
+ * tree, so with AVX2 eight whole chunks go through at once, one per 32 bit
+ * lane. The tree is kept as a stack of chaining values, merged as soon as
+ * a subtree is known to be complete.
+ */
+
+#ifdef NEED_LIBCLENS
+#include <clens.h>
+#endif
+
+#include <sys/param.h>
+
+#include <string.h>
+#include <openssl/sha.h>
+
+#include "ctutil.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__clang__) || (defined(__GNUC__) && __GNUC__ >= 5))
+#define CT_BLAKE3_X86
+#include <immintrin.h>
+#endif
+
+#define B3_BLOCK_LEN	64
+#define B3_CHUNK_LEN	1024
+#define B3_LANES	8
+
+#define B3_CHUNK_START	(1<<0)
+#define B3_CHUNK_END	(1<<1)
+#define B3_PARENT	(1<<2)
+#define B3_ROOT		(1<<3)
+
+static const uint32_t ct_blake3_iv[8] = {
+	0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+	0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+
+static const uint8_t ct_blake3_sched[7][16] = {
+	{ 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 },
+	{ 2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8 },
+	{ 3, 4, 10, 12, 13, 2, 7, 14, 6, 5, 9, 0, 11, 15, 8, 1 },
+	{ 10, 7, 12, 9, 14, 3, 13, 15, 4, 0, 11, 2, 5, 8, 1, 6 },
+	{ 12, 13, 9, 11, 15, 10, 14, 8, 7, 2, 5, 3, 0, 1, 6, 4 },
+	{ 9, 14, 11, 5, 8, 12, 15, 1, 13, 3, 0, 10, 2, 6, 4, 7 },
+	{ 11, 15, 5, 0, 1, 9, 8, 6, 14, 10, 2, 12, 3, 4, 7, 13 },
+};
+
+static uint32_t
+ct_blake3_get32(const uint8_t *p)
+{
+	return ((uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 |
+	    (uint32_t)p[3] << 24);
+}
+
+static void
+ct_blake3_put32(uint8_t *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+#define B3_ROTR(x, n)	(((x) >> (n)) | ((x) << (32 - (n))))
+#define B3_G(s, a, b, c, d, x, y)					\
+	do {								\
+		s[a] = s[a] + s[b] + (x);				\
+		s[d] = B3_ROTR(s[d] ^ s[a], 16);			\
+		s[c] = s[c] + s[d];					\
+		s[b] = B3_ROTR(s[b] ^ s[c], 12);			\
+		s[a] = s[a] + s[b] + (y);				\
+		s[d] = B3_ROTR(s[d] ^ s[a], 8);				\
+		s[c] = s[c] + s[d];					\
+		s[b] = B3_ROTR(s[b] ^ s[c], 7);				\
+	} while (0)
+
+/* Compress one block, the chaining value is the first 8 words of out. */
+static void
+ct_blake3_compress(const uint32_t *cv, const uint8_t *block, uint32_t len,
+    uint64_t counter, uint32_t flags, uint32_t *out)
+{
+	uint32_t	m[16], s[16];
+	const uint8_t	*sc;
+	int		i, r;
+
+	for (i = 0; i < 16; i++)
+		m[i] = ct_blake3_get32(block + i * 4);
+	for (i = 0; i < 8; i++)
+		s[i] = cv[i];
+	for (i = 0; i < 4; i++)
+		s[i + 8] = ct_blake3_iv[i];
+	s[12] = counter;
+	s[13] = counter >> 32;
+	s[14] = len;
+	s[15] = flags;
+
+	for (r = 0; r < 7; r++) {
+		sc = ct_blake3_sched[r];
+		B3_G(s, 0, 4, 8, 12, m[sc[0]], m[sc[1]]);
+		B3_G(s, 1, 5, 9, 13, m[sc[2]], m[sc[3]]);
+		B3_G(s, 2, 6, 10, 14, m[sc[4]], m[sc[5]]);
+		B3_G(s, 3, 7, 11, 15, m[sc[6]], m[sc[7]]);
+		B3_G(s, 0, 5, 10, 15, m[sc[8]], m[sc[9]]);
+		B3_G(s, 1, 6, 11, 12, m[sc[10]], m[sc[11]]);
+		B3_G(s, 2, 7, 8, 13, m[sc[12]], m[sc[13]]);
+		B3_G(s, 3, 4, 9, 14, m[sc[14]], m[sc[15]]);
+	}
+
+	for (i = 0; i < 8; i++) {
+		out[i] = s[i] ^ s[i + 8];
+		out[i + 8] = s[i + 8] ^ cv[i];
+	}
+}
+
+/* Chaining value of a whole chunk that isn't the root. */
+static void
+ct_blake3_chunk(const uint8_t *p, uint64_t counter, uint8_t *cvbytes)
+{
+	uint32_t	cv[8], out[16];
+	int		b, i;
+
+	memcpy(cv, ct_blake3_iv, sizeof(cv));
+	for (b = 0; b < B3_CHUNK_LEN / B3_BLOCK_LEN; b++) {
+		ct_blake3_compress(cv, p + b * B3_BLOCK_LEN, B3_BLOCK_LEN,
+		    counter, (b == 0 ? B3_CHUNK_START : 0) |
+		    (b == B3_CHUNK_LEN / B3_BLOCK_LEN - 1 ? B3_CHUNK_END : 0),
+		    out);
+		memcpy(cv, out, sizeof(cv));
+	}
+	for (i = 0; i < 8; i++)
+		ct_blake3_put32(cvbytes + i * 4, cv[i]);
+}
+
+#ifdef CT_BLAKE3_X86
+#define B3_AVX2		__attribute__((target("avx2")))
+
+#define B3V_ROTR(x, n)							\
+	_mm256_or_si256(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - (n)))
+#define B3V_G(a, b, c, d, x, y)						\
+	do {								\
+		a = _mm256_add_epi32(_mm256_add_epi32(a, b), x);	\
+		d = _mm256_shuffle_epi8(_mm256_xor_si256(d, a), rot16);	\
+		c = _mm256_add_epi32(c, d);				\
+		b = B3V_ROTR(_mm256_xor_si256(b, c), 12);		\
+		a = _mm256_add_epi32(_mm256_add_epi32(a, b), y);	\
+		d = _mm256_shuffle_epi8(_mm256_xor_si256(d, a), rot8);	\
+		c = _mm256_add_epi32(c, d);				\
+		b = B3V_ROTR(_mm256_xor_si256(b, c), 7);		\
+	} while (0)
+
+/* Transpose an 8x8 matrix of words, row i to column i. */
+B3_AVX2
+static void
+ct_blake3_avx2_transpose(__m256i *w, const __m256i *r)
+{
+	__m256i		t[8], u[8];
+	int		i;
+
+	for (i = 0; i < 8; i += 2) {
+		t[i] = _mm256_unpacklo_epi32(r[i], r[i + 1]);
+		t[i + 1] = _mm256_unpackhi_epi32(r[i], r[i + 1]);
+	}
+	for (i = 0; i < 8; i += 4) {
+		u[i] = _mm256_unpacklo_epi64(t[i], t[i + 2]);
+		u[i + 1] = _mm256_unpackhi_epi64(t[i], t[i + 2]);
+		u[i + 2] = _mm256_unpacklo_epi64(t[i + 1], t[i + 3]);
+		u[i + 3] = _mm256_unpackhi_epi64(t[i + 1], t[i + 3]);
+	}
+	for (i = 0; i < 4; i++) {
+		w[i] = _mm256_permute2x128_si256(u[i], u[i + 4], 0x20);
+		w[i + 4] = _mm256_permute2x128_si256(u[i], u[i + 4], 0x31);
+	}
+}
+
+/* Chaining values of eight whole consecutive chunks at p. */
+B3_AVX2
+static void
+ct_blake3_avx2_chunks(const uint8_t *p, uint64_t counter, uint8_t *cvbytes)
+{
+	__m256i		v[16], h[8], m[16], r[8];
+	uint32_t	out[8][B3_LANES];
+	uint32_t	ctr_lo[B3_LANES], ctr_hi[B3_LANES];
+	const uint8_t	*sc;
+	const __m256i	rot16 = _mm256_setr_epi8(
+		2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13,
+		2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13);
+	const __m256i	rot8 = _mm256_setr_epi8(
+		1, 2, 3, 0, 5, 6, 7, 4, 9, 10, 11, 8, 13, 14, 15, 12,
+		1, 2, 3, 0, 5, 6, 7, 4, 9, 10, 11, 8, 13, 14, 15, 12);
+	int		b, i, j, rnd;
+	uint32_t	flags;
+
+	for (i = 0; i < B3_LANES; i++) {
+		ctr_lo[i] = counter + i;
+		ctr_hi[i] = (counter + i) >> 32;
+	}
+	for (i = 0; i < 8; i++)
+		h[i] = _mm256_set1_epi32(ct_blake3_iv[i]);
+
+	for (b = 0; b < B3_CHUNK_LEN / B3_BLOCK_LEN; b++) {
+		for (j = 0; j < 2; j++) {
+			for (i = 0; i < B3_LANES; i++)
+				r[i] = _mm256_loadu_si256((const __m256i *)(p +
+				    i * B3_CHUNK_LEN + b * B3_BLOCK_LEN +
+				    j * 32));
+			ct_blake3_avx2_transpose(m + j * 8, r);
+		}
+		flags = (b == 0 ? B3_CHUNK_START : 0) |
+		    (b == B3_CHUNK_LEN / B3_BLOCK_LEN - 1 ? B3_CHUNK_END : 0);
+
+		for (i = 0; i < 8; i++)
+			v[i] = h[i];
+		for (i = 0; i < 4; i++)
+			v[i + 8] = _mm256_set1_epi32(ct_blake3_iv[i]);
+		v[12] = _mm256_loadu_si256((const __m256i *)ctr_lo);
+		v[13] = _mm256_loadu_si256((const __m256i *)ctr_hi);
+		v[14] = _mm256_set1_epi32(B3_BLOCK_LEN);
+		v[15] = _mm256_set1_epi32(flags);
+
+		for (rnd = 0; rnd < 7; rnd++) {
+			sc = ct_blake3_sched[rnd];
+			B3V_G(v[0], v[4], v[8], v[12], m[sc[0]], m[sc[1]]);
+			B3V_G(v[1], v[5], v[9], v[13], m[sc[2]], m[sc[3]]);
+			B3V_G(v[2], v[6], v[10], v[14], m[sc[4]], m[sc[5]]);
+			B3V_G(v[3], v[7], v[11], v[15], m[sc[6]], m[sc[7]]);
+			B3V_G(v[0], v[5], v[10], v[15], m[sc[8]], m[sc[9]]);
+			B3V_G(v[1], v[6], v[11], v[12], m[sc[10]], m[sc[11]]);
+			B3V_G(v[2], v[7], v[8], v[13], m[sc[12]], m[sc[13]]);
+			B3V_G(v[3], v[4], v[9], v[14], m[sc[14]], m[sc[15]]);
+		}
+		for (i = 0; i < 8; i++)
+			h[i] = _mm256_xor_si256(v[i], v[i + 8]);
+	}
+
+	for (i = 0; i < 8; i++)
+		_mm256_storeu_si256((__m256i *)out[i], h[i]);
+	for (i = 0; i < B3_LANES; i++)
+		for (j = 0; j < 8; j++)
+			ct_blake3_put32(cvbytes + i * 32 + j * 4, out[j][i]);
+}
+#endif /* CT_BLAKE3_X86 */
+
+static void
+ct_blake3_parent(const uint8_t *block, uint8_t *cvbytes)
+{
+	uint32_t	out[16];
+	int		i;
+
+	ct_blake3_compress(ct_blake3_iv, block, B3_BLOCK_LEN, 0, B3_PARENT,
+	    out);
+	for (i = 0; i < 8; i++)
+		ct_blake3_put32(cvbytes + i * 4, out[i]);
+}
+
+/* Join complete subtrees until the stack has one per bit of chunks. */
+static void
+ct_blake3_merge(struct ct_blake3_ctx *ctx, uint64_t chunks)
+{
+	while (ctx->b3_stacklen > __builtin_popcountll(chunks)) {
+		ct_blake3_parent(ctx->b3_stack[ctx->b3_stacklen - 2],
+		    ctx->b3_stack[ctx->b3_stacklen - 2]);
+		ctx->b3_stacklen--;
+	}
+}
+
+static void
+ct_blake3_push(struct ct_blake3_ctx *ctx, const uint8_t *cv, uint64_t chunk)
+{
+	ct_blake3_merge(ctx, chunk);
+	memcpy(ctx->b3_stack[ctx->b3_stacklen++], cv, 32);
+}
+
+static size_t
+ct_blake3_chunklen(struct ct_blake3_ctx *ctx)
+{
+	return (ctx->b3_blocks * B3_BLOCK_LEN + ctx->b3_buflen);
+}
+
+/* Add to the chunk being built, never past its end. */
+static void
+ct_blake3_chunk_add(struct ct_blake3_ctx *ctx, const uint8_t *p, size_t len)
+{
+	uint32_t	out[16];
+	size_t		n;
+
+	while (len > 0) {
+		if (ctx->b3_buflen == B3_BLOCK_LEN) {
+			ct_blake3_compress(ctx->b3_cv, ctx->b3_buf,
+			    B3_BLOCK_LEN, ctx->b3_chunk,
+			    ctx->b3_blocks == 0 ? B3_CHUNK_START : 0, out);
+			memcpy(ctx->b3_cv, out, sizeof(ctx->b3_cv));
+			ctx->b3_blocks++;
+			ctx->b3_buflen = 0;
+		}
+		n = MIN(B3_BLOCK_LEN - ctx->b3_buflen, len);
+		memcpy(ctx->b3_buf + ctx->b3_buflen, p, n);
+		ctx->b3_buflen += n;
+		p += n;
+		len -= n;
+	}
+}
+
+/* Last block of the chunk being built, padded. */
+static void
+ct_blake3_chunk_last(struct ct_blake3_ctx *ctx, uint8_t *block,
+    uint32_t *flags)
+{
+	memcpy(block, ctx->b3_buf, ctx->b3_buflen);
+	memset(block + ctx->b3_buflen, 0, B3_BLOCK_LEN - ctx->b3_buflen);
+	*flags = B3_CHUNK_END | (ctx->b3_blocks == 0 ? B3_CHUNK_START : 0);
+}
+
+void
+ct_blake3_setup(struct ct_blake3_ctx *ctx)
+{
+	bzero(ctx, sizeof(*ctx));
+	memcpy(ctx->b3_cv, ct_blake3_iv, sizeof(ctx->b3_cv));
+}
+
+void
+ct_blake3_add(uint8_t *src, struct ct_blake3_ctx *ctx, size_t len)
+{
+	uint8_t		block[B3_BLOCK_LEN], cv[B3_LANES * 32];
+	uint32_t	out[16], flags;
+	size_t		n, i;
+
+	/* a chunk is only done once we know more input follows it */
+	if (ct_blake3_chunklen(ctx) > 0) {
+		n = MIN(B3_CHUNK_LEN - ct_blake3_chunklen(ctx), len);
+		ct_blake3_chunk_add(ctx, src, n);
+		src += n;
+		len -= n;
+		if (len == 0)
+			return;
+		ct_blake3_chunk_last(ctx, block, &flags);
+		ct_blake3_compress(ctx->b3_cv, block, ctx->b3_buflen,
+		    ctx->b3_chunk, flags, out);
+		for (i = 0; i < 8; i++)
+			ct_blake3_put32(cv + i * 4, out[i]);
+		ct_blake3_push(ctx, cv, ctx->b3_chunk);
+		memcpy(ctx->b3_cv, ct_blake3_iv, sizeof(ctx->b3_cv));
+		ctx->b3_chunk++;
+		ctx->b3_blocks = ctx->b3_buflen = 0;
+	}
+
+	while (len > B3_CHUNK_LEN) {
+		n = MIN((len - 1) / B3_CHUNK_LEN, B3_LANES);
+#ifdef CT_BLAKE3_X86
+		if (n == B3_LANES &&
+		    (ct_digest_features() & CT_DIGEST_F_AVX2))
+			ct_blake3_avx2_chunks(src, ctx->b3_chunk, cv);
+		else
+#endif
+			for (i = 0; i < n; i++)
+				ct_blake3_chunk(src + i * B3_CHUNK_LEN,
+				    ctx->b3_chunk + i, cv + i * 32);
+		for (i = 0; i < n; i++)
+			ct_blake3_push(ctx, cv + i * 32, ctx->b3_chunk++);
+		src += n * B3_CHUNK_LEN;
+		len -= n * B3_CHUNK_LEN;
+	}
+
+	ct_blake3_chunk_add(ctx, src, len);
+	ct_blake3_merge(ctx, ctx->b3_chunk);
+}
+
+void
+ct_blake3_final(uint8_t *dst, struct ct_blake3_ctx *ctx)
+{
+	uint8_t		block[B3_BLOCK_LEN];
+	uint32_t	cv[8], out[16], flags, blen;
+	uint64_t	counter;
+	int		i, n;
+
+	/* fold the stack into the last chunk from the top down */
+	ct_blake3_chunk_last(ctx, block, &flags);
+	memcpy(cv, ctx->b3_cv, sizeof(cv));
+	blen = ctx->b3_buflen;
+	counter = ctx->b3_chunk;
+	for (n = ctx->b3_stacklen; n > 0; n--) {
+		ct_blake3_compress(cv, block, blen, counter, flags, out);
+		memcpy(block, ctx->b3_stack[n - 1], 32);
+		for (i = 0; i < 8; i++)
+			ct_blake3_put32(block + 32 + i * 4, out[i]);
+		memcpy(cv, ct_blake3_iv, sizeof(cv));
+		blen = B3_BLOCK_LEN;
+		counter = 0;
+		flags = B3_PARENT;
+	}
+	ct_blake3_compress(cv, block, blen, counter, flags | B3_ROOT, out);
+	for (i = 0; i < CT_DIGEST_LENGTH / 4; i++)
+		ct_blake3_put32(dst + i * 4, out[i]);
+	bzero(ctx, sizeof(*ctx));
+}
+
+void
+ct_blake3(uint8_t *src, uint8_t *dst, size_t len)
+{
+	struct ct_blake3_ctx	ctx;
+
+	ct_blake3_setup(&ctx);
+	ct_blake3_add(src, &ctx, len);
+	ct_blake3_final(dst, &ctx);
+}
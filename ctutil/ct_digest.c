@@ -0,0 +1,203 @@
+/*
+ * Copyright (c) 2012 Conformal Systems LLC <info@conformal.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Digests that name chunks and files. SHA1 is what the server names chunks
+ * by, BLAKE3 is faster per core and hashes large chunks several lanes at a
+ * time. Either is cut to CT_DIGEST_LENGTH bytes so identities keep their
+ * size everywhere they are stored. The cpu features the backends use are
+ * detected here once.
+ */
+
+#ifdef NEED_LIBCLENS
+#include <clens.h>
+#endif
+
+#include <sys/param.h>
+
+#include <string.h>
+#include <openssl/sha.h>
+
+#include "ctutil.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__clang__) || (defined(__GNUC__) && __GNUC__ >= 5))
+#define CT_DIGEST_X86
+#include <cpuid.h>
+#endif
+
+#define CT_DIGEST_SLICE	(64 * 1024)
+
+#ifndef nitems
+#define nitems(_a)	(sizeof((_a)) / sizeof((_a)[0]))
+#endif
+
+static volatile int	ct_digest_have = -1;
+static int		ct_digest_allow = ~0;
+
+#ifdef CT_DIGEST_X86
+static int
+ct_digest_detect(void)
+{
+	unsigned int	eax, ebx, ecx, edx, xcr0_lo, xcr0_hi;
+	unsigned int	ssse3, sse41, osxsave;
+	int		features = 0;
+
+	if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) == 0)
+		return (0);
+	ssse3 = ecx & (1 << 9);
+	sse41 = ecx & (1 << 19);
+	osxsave = ecx & (1 << 27);
+	if (__get_cpuid_max(0, NULL) < 7)
+		return (0);
+	__cpuid_count(7, 0, eax, ebx, ecx, edx);
+
+	if ((ebx & (1 << 29)) && ssse3 && sse41)
+		features |= CT_DIGEST_F_SHANI;
+	if ((ebx & (1 << 5)) && osxsave) {
+		/* the os has to save the ymm registers too */
+		__asm__ volatile("xgetbv" : "=a" (xcr0_lo), "=d" (xcr0_hi) :
+		    "c" (0));
+		if ((xcr0_lo & 0x6) == 0x6)
+			features |= CT_DIGEST_F_AVX2;
+	}
+
+	return (features);
+}
+#else
+static int
+ct_digest_detect(void)
+{
+	return (0);
+}
+#endif
+
+int
+ct_digest_features(void)
+{
+	/* every thread detects the same thing, a race is harmless */
+	if (ct_digest_have == -1)
+		ct_digest_have = ct_digest_detect();
+	return (ct_digest_have & ct_digest_allow);
+}
+
+/* Limit the backends used to those in mask, for testing and benchmarks. */
+void
+ct_digest_restrict(int mask)
+{
+	ct_digest_allow = mask;
+}
+
+static const char *ct_digest_names[] = {
+	[CT_DIGEST_SHA1] = "sha1",
+	[CT_DIGEST_BLAKE3] = "blake3",
+};
+
+const char *
+ct_digest_name(int alg)
+{
+	if (alg < 0 || alg >= nitems(ct_digest_names))
+		return ("unknown");
+	return (ct_digest_names[alg]);
+}
+
+/* Algorithm by name, -1 if there is no such one. */
+int
+ct_digest_lookup(const char *name)
+{
+	int	alg;
+
+	for (alg = 0; alg < nitems(ct_digest_names); alg++)
+		if (strcmp(name, ct_digest_names[alg]) == 0)
+			return (alg);
+	return (-1);
+}
+
+void
+ct_digest(int alg, uint8_t *src, uint8_t *dst, size_t len)
+{
+	if (alg == CT_DIGEST_BLAKE3)
+		ct_blake3(src, dst, len);
+	else
+		ct_sha1(src, dst, len);
+}
+
+/* SHA1 spreads buffers over lanes, BLAKE3 the chunks within each one. */
+void
+ct_digest_multi(int alg, uint8_t **src, uint8_t **dst, size_t *len, int n)
+{
+	int	i;
+
+	if (alg != CT_DIGEST_BLAKE3) {
+		ct_sha1_multi(src, dst, len, n);
+		return;
+	}
+	for (i = 0; i < n; i++)
+		ct_blake3(src[i], dst[i], len[i]);
+}
+
+void
+ct_digest_setup(struct ct_digest_ctx *ctx, int alg)
+{
+	ctx->dc_alg = alg;
+	if (alg == CT_DIGEST_BLAKE3)
+		ct_blake3_setup(&ctx->dc_blake3);
+	else
+		ct_sha1_setup(&ctx->dc_sha1);
+}
+
+void
+ct_digest_add(uint8_t *src, struct ct_digest_ctx *ctx, size_t len)
+{
+	if (ctx->dc_alg == CT_DIGEST_BLAKE3)
+		ct_blake3_add(src, &ctx->dc_blake3, len);
+	else
+		ct_sha1_add(src, &ctx->dc_sha1, len);
+}
+
+void
+ct_digest_final(uint8_t *dst, struct ct_digest_ctx *ctx)
+{
+	if (ctx->dc_alg == CT_DIGEST_BLAKE3)
+		ct_blake3_final(dst, &ctx->dc_blake3);
+	else
+		ct_sha1_final(dst, &ctx->dc_sha1);
+}
+
+/*
+ * Digest a chunk with alg into dst and add it to the running digest in ctx,
+ * a slice at a time while it's still in cache unless both are SHA1 and can
+ * share a pass.
+ */
+void
+ct_digest_dual(int alg, uint8_t *src, uint8_t *dst, struct ct_digest_ctx *ctx,
+    size_t len)
+{
+	struct ct_digest_ctx	chunk;
+	size_t			off, n;
+
+	if (alg == CT_DIGEST_SHA1 && ctx->dc_alg == CT_DIGEST_SHA1) {
+		ct_sha1_dual(src, dst, &ctx->dc_sha1, len);
+		return;
+	}
+	ct_digest_setup(&chunk, alg);
+	for (off = 0; off < len; off += n) {
+		n = MIN(len - off, CT_DIGEST_SLICE);
+		ct_digest_add(src + off, &chunk, n);
+		ct_digest_add(src + off, ctx, n);
+	}
+	ct_digest_final(dst, &chunk);
+}
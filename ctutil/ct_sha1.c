@@ -0,0 +1,551 @@
+/*
+ * Copyright (c) 2012 Conformal Systems LLC <info@conformal.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * SHA1 with the backend picked at run time. On x86 cpus with the SHA
+ * extensions single digests go through them, otherwise through libcrypto.
+ * With AVX2, ct_sha1_multi() hashes up to eight buffers at once, one per
+ * 32 bit lane. Streaming digests keep libcrypto's SHA_CTX layout so either
+ * backend can finish a context.
+ */
+
+#ifdef NEED_LIBCLENS
+#include <clens.h>
+#endif
+
+#include <sys/param.h>
+
+#include <string.h>
+#include <openssl/sha.h>
+
+#include <clog.h>
+
+#include "ctutil.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__clang__) || (defined(__GNUC__) && __GNUC__ >= 5))
+#define CT_SHA1_X86
+#include <immintrin.h>
+#endif
+
+#define CT_SHA1_BLOCK	64
+#define CT_SHA1_LANES	8
+#define CT_SHA1_SLICE	(16 * 1024)	/* fits in L1 */
+
+#ifdef CT_SHA1_X86
+#define SHANI_ROUNDS4(e0, e1, m0, m1, m2, m3, f)			\
+	do {								\
+		e0 = _mm_sha1nexte_epu32(e0, m0);			\
+		e1 = abcd;						\
+		m1 = _mm_sha1msg2_epu32(m1, m0);			\
+		abcd = _mm_sha1rnds4_epu32(abcd, e0, f);		\
+		m3 = _mm_sha1msg1_epu32(m3, m0);			\
+		m2 = _mm_xor_si128(m2, m0);				\
+	} while (0)
+
+#define CT_SHANI	__attribute__((target("sha,ssse3,sse4.1")))
+
+struct ct_sha1_shani {
+	__m128i		abcd;
+	__m128i		e;
+};
+
+CT_SHANI __attribute__((always_inline))
+static inline void
+ct_sha1_shani_load(struct ct_sha1_shani *s, const uint32_t *h)
+{
+	s->abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)h), 0x1b);
+	s->e = _mm_set_epi32(h[4], 0, 0, 0);
+}
+
+CT_SHANI __attribute__((always_inline))
+static inline void
+ct_sha1_shani_store(struct ct_sha1_shani *s, uint32_t *h)
+{
+	_mm_storeu_si128((__m128i *)h, _mm_shuffle_epi32(s->abcd, 0x1b));
+	h[4] = _mm_extract_epi32(s->e, 3);
+}
+
+CT_SHANI __attribute__((always_inline))
+static inline void
+ct_sha1_shani_block(struct ct_sha1_shani *s, const uint8_t *p)
+{
+	__m128i		abcd, e0, e1, m0, m1, m2, m3;
+	const __m128i	bswap = _mm_set_epi64x(0x0001020304050607ULL,
+			    0x08090a0b0c0d0e0fULL);
+
+	abcd = s->abcd;
+
+	/* rounds 0-15 load the message */
+	m0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)p), bswap);
+	e0 = _mm_add_epi32(s->e, m0);
+	e1 = abcd;
+	abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+
+	m1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p + 16)),
+	    bswap);
+	e1 = _mm_sha1nexte_epu32(e1, m1);
+	e0 = abcd;
+	abcd = _mm_sha1rnds4_epu32(abcd, e1, 0);
+	m0 = _mm_sha1msg1_epu32(m0, m1);
+
+	m2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p + 32)),
+	    bswap);
+	e0 = _mm_sha1nexte_epu32(e0, m2);
+	e1 = abcd;
+	abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+	m1 = _mm_sha1msg1_epu32(m1, m2);
+	m0 = _mm_xor_si128(m0, m2);
+
+	m3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p + 48)),
+	    bswap);
+	SHANI_ROUNDS4(e1, e0, m3, m0, m1, m2, 0);
+
+	SHANI_ROUNDS4(e0, e1, m0, m1, m2, m3, 0);
+	SHANI_ROUNDS4(e1, e0, m1, m2, m3, m0, 1);
+	SHANI_ROUNDS4(e0, e1, m2, m3, m0, m1, 1);
+	SHANI_ROUNDS4(e1, e0, m3, m0, m1, m2, 1);
+	SHANI_ROUNDS4(e0, e1, m0, m1, m2, m3, 1);
+	SHANI_ROUNDS4(e1, e0, m1, m2, m3, m0, 1);
+	SHANI_ROUNDS4(e0, e1, m2, m3, m0, m1, 2);
+	SHANI_ROUNDS4(e1, e0, m3, m0, m1, m2, 2);
+	SHANI_ROUNDS4(e0, e1, m0, m1, m2, m3, 2);
+	SHANI_ROUNDS4(e1, e0, m1, m2, m3, m0, 2);
+	SHANI_ROUNDS4(e0, e1, m2, m3, m0, m1, 2);
+	SHANI_ROUNDS4(e1, e0, m3, m0, m1, m2, 3);
+	SHANI_ROUNDS4(e0, e1, m0, m1, m2, m3, 3);
+	/* the last three don't need more of the schedule */
+	e1 = _mm_sha1nexte_epu32(e1, m1);
+	e0 = abcd;
+	m2 = _mm_sha1msg2_epu32(m2, m1);
+	abcd = _mm_sha1rnds4_epu32(abcd, e1, 3);
+	m3 = _mm_xor_si128(m3, m1);
+
+	e0 = _mm_sha1nexte_epu32(e0, m2);
+	e1 = abcd;
+	m3 = _mm_sha1msg2_epu32(m3, m2);
+	abcd = _mm_sha1rnds4_epu32(abcd, e0, 3);
+
+	e1 = _mm_sha1nexte_epu32(e1, m3);
+	e0 = abcd;
+	abcd = _mm_sha1rnds4_epu32(abcd, e1, 3);
+
+	s->e = _mm_sha1nexte_epu32(e0, s->e);
+	s->abcd = _mm_add_epi32(abcd, s->abcd);
+}
+
+CT_SHANI
+static void
+ct_sha1_shani_blocks(uint32_t *h, const uint8_t *p, size_t nblocks)
+{
+	struct ct_sha1_shani	s;
+
+	ct_sha1_shani_load(&s, h);
+	for (; nblocks > 0; nblocks--, p += CT_SHA1_BLOCK)
+		ct_sha1_shani_block(&s, p);
+	ct_sha1_shani_store(&s, h);
+}
+
+/*
+ * Two independent streams of blocks. Each round waits on the one before
+ * it, so a second chain fills the time the first one stalls.
+ */
+CT_SHANI
+static void
+ct_sha1_shani_blocks2(uint32_t *ha, const uint8_t *pa, uint32_t *hb,
+    const uint8_t *pb, size_t nblocks)
+{
+	struct ct_sha1_shani	a, b;
+
+	ct_sha1_shani_load(&a, ha);
+	ct_sha1_shani_load(&b, hb);
+	for (; nblocks > 0; nblocks--) {
+		ct_sha1_shani_block(&a, pa);
+		ct_sha1_shani_block(&b, pb);
+		pa += CT_SHA1_BLOCK;
+		pb += CT_SHA1_BLOCK;
+	}
+	ct_sha1_shani_store(&a, ha);
+	ct_sha1_shani_store(&b, hb);
+}
+
+/* Same bit count in Nl/Nh as libcrypto's SHA1_Update() keeps. */
+static void
+ct_sha1_count(SHA_CTX *ctx, size_t len)
+{
+	uint32_t	l;
+
+	l = ctx->Nl + ((uint32_t)len << 3);
+	if (l < ctx->Nl)
+		ctx->Nh++;
+	ctx->Nh += (uint32_t)(len >> 29);
+	ctx->Nl = l;
+}
+
+static void
+ct_sha1_get(SHA_CTX *ctx, uint32_t *h)
+{
+	h[0] = ctx->h0; h[1] = ctx->h1; h[2] = ctx->h2;
+	h[3] = ctx->h3; h[4] = ctx->h4;
+}
+
+static void
+ct_sha1_set(SHA_CTX *ctx, uint32_t *h)
+{
+	ctx->h0 = h[0]; ctx->h1 = h[1]; ctx->h2 = h[2];
+	ctx->h3 = h[3]; ctx->h4 = h[4];
+}
+
+/* A partial block waits in data with num bytes of it used, as in libcrypto. */
+static void
+ct_sha1_shani_update(SHA_CTX *ctx, const uint8_t *src, size_t len)
+{
+	uint8_t		*buf = (uint8_t *)ctx->data;
+	uint32_t	 h[5];
+	size_t		 n;
+
+	if (len == 0)
+		return;
+	ct_sha1_count(ctx, len);
+
+	if (ctx->num != 0) {
+		n = CT_SHA1_BLOCK - ctx->num;
+		if (len < n) {
+			memcpy(buf + ctx->num, src, len);
+			ctx->num += len;
+			return;
+		}
+		memcpy(buf + ctx->num, src, n);
+		src += n;
+		len -= n;
+		ctx->num = 0;
+		ct_sha1_get(ctx, h);
+		ct_sha1_shani_blocks(h, buf, 1);
+	} else
+		ct_sha1_get(ctx, h);
+	if ((n = len / CT_SHA1_BLOCK) != 0) {
+		ct_sha1_shani_blocks(h, src, n);
+		src += n * CT_SHA1_BLOCK;
+		len -= n * CT_SHA1_BLOCK;
+	}
+	if (len != 0) {
+		memcpy(buf, src, len);
+		ctx->num = len;
+	}
+	ct_sha1_set(ctx, h);
+}
+
+static void
+ct_sha1_put32(uint8_t *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static void
+ct_sha1_shani_final(uint8_t *dst, SHA_CTX *ctx)
+{
+	uint8_t		*buf = (uint8_t *)ctx->data;
+	uint32_t	 h[5];
+	size_t		 n = ctx->num;
+	int		 i;
+
+	ct_sha1_get(ctx, h);
+	buf[n++] = 0x80;
+	if (n > CT_SHA1_BLOCK - 8) {
+		memset(buf + n, 0, CT_SHA1_BLOCK - n);
+		ct_sha1_shani_blocks(h, buf, 1);
+		n = 0;
+	}
+	memset(buf + n, 0, CT_SHA1_BLOCK - 8 - n);
+	ct_sha1_put32(buf + CT_SHA1_BLOCK - 8, ctx->Nh);
+	ct_sha1_put32(buf + CT_SHA1_BLOCK - 4, ctx->Nl);
+	ct_sha1_shani_blocks(h, buf, 1);
+
+	for (i = 0; i < 5; i++)
+		ct_sha1_put32(dst + i * 4, h[i]);
+	bzero(ctx, sizeof(*ctx));
+}
+
+#define AVX2_ROTL(x, n)							\
+	_mm256_or_si256(_mm256_slli_epi32(x, n), _mm256_srli_epi32(x, 32 - (n)))
+
+#define AVX2_ROUND(f, k, t)						\
+	do {								\
+		__m256i	 tmp;						\
+		if ((t) >= 16)						\
+			w[(t) & 15] = AVX2_ROTL(_mm256_xor_si256(	\
+			    _mm256_xor_si256(w[((t) - 3) & 15],		\
+			    w[((t) - 8) & 15]), _mm256_xor_si256(	\
+			    w[((t) - 14) & 15], w[(t) & 15])), 1);	\
+		tmp = _mm256_add_epi32(_mm256_add_epi32(AVX2_ROTL(a, 5),\
+		    f), _mm256_add_epi32(_mm256_add_epi32(e, k),	\
+		    w[(t) & 15]));					\
+		e = d;							\
+		d = c;							\
+		c = AVX2_ROTL(b, 30);					\
+		b = a;							\
+		a = tmp;						\
+	} while (0)
+
+/* d ^ (b & (c ^ d)), b ^ c ^ d and (b & c) | (d & (b | c)) */
+#define AVX2_CH		_mm256_xor_si256(d, _mm256_and_si256(b,		\
+			    _mm256_xor_si256(c, d)))
+#define AVX2_PARITY	_mm256_xor_si256(_mm256_xor_si256(b, c), d)
+#define AVX2_MAJ	_mm256_or_si256(_mm256_and_si256(b, c),		\
+			    _mm256_and_si256(d, _mm256_or_si256(b, c)))
+
+/* Load 32 bytes from each lane as eight vectors of one word per lane. */
+__attribute__((target("avx2")))
+static void
+ct_sha1_avx2_load(__m256i *w, const uint8_t **p, int off)
+{
+	__m256i		r[8], t[8], u[8];
+	const __m256i	bswap = _mm256_set_epi8(
+			    12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3,
+			    12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+	int		i;
+
+	for (i = 0; i < 8; i++)
+		r[i] = _mm256_loadu_si256((const __m256i *)(p[i] + off));
+	for (i = 0; i < 8; i += 2) {
+		t[i] = _mm256_unpacklo_epi32(r[i], r[i + 1]);
+		t[i + 1] = _mm256_unpackhi_epi32(r[i], r[i + 1]);
+	}
+	for (i = 0; i < 8; i += 4) {
+		u[i] = _mm256_unpacklo_epi64(t[i], t[i + 2]);
+		u[i + 1] = _mm256_unpackhi_epi64(t[i], t[i + 2]);
+		u[i + 2] = _mm256_unpacklo_epi64(t[i + 1], t[i + 3]);
+		u[i + 3] = _mm256_unpackhi_epi64(t[i + 1], t[i + 3]);
+	}
+	for (i = 0; i < 4; i++) {
+		w[i] = _mm256_shuffle_epi8(_mm256_permute2x128_si256(u[i],
+		    u[i + 4], 0x20), bswap);
+		w[i + 4] = _mm256_shuffle_epi8(_mm256_permute2x128_si256(u[i],
+		    u[i + 4], 0x31), bswap);
+	}
+}
+
+/*
+ * Hash n <= 8 whole buffers side by side. Each lane runs through its full
+ * blocks and then one or two padded tail blocks; lanes that are done are
+ * fed a zero block and keep their state.
+ */
+__attribute__((target("avx2")))
+static void
+ct_sha1_avx2(uint8_t **src, uint8_t **dst, size_t *len, int n)
+{
+	__m256i		 a, b, c, d, e, w[16], st[5], active;
+	uint8_t		 tail[CT_SHA1_LANES][2 * CT_SHA1_BLOCK];
+	uint32_t	 out[5][CT_SHA1_LANES];
+	int32_t		 mask[CT_SHA1_LANES];
+	const uint8_t	*p[CT_SHA1_LANES];
+	static const uint8_t zero[CT_SHA1_BLOCK];
+	size_t		 full[CT_SHA1_LANES], total[CT_SHA1_LANES];
+	size_t		 r, k, nblocks = 0;
+	uint64_t	 bits;
+	int		 i, j;
+	const __m256i	 k0 = _mm256_set1_epi32(0x5a827999);
+	const __m256i	 k1 = _mm256_set1_epi32(0x6ed9eba1);
+	const __m256i	 k2 = _mm256_set1_epi32(0x8f1bbcdc);
+	const __m256i	 k3 = _mm256_set1_epi32(0xca62c1d6);
+
+	for (i = 0; i < CT_SHA1_LANES; i++) {
+		if (i >= n) {
+			full[i] = total[i] = 0;
+			continue;
+		}
+		full[i] = len[i] / CT_SHA1_BLOCK;
+		r = len[i] % CT_SHA1_BLOCK;
+		total[i] = full[i] + (r < CT_SHA1_BLOCK - 8 ? 1 : 2);
+		memset(tail[i], 0, sizeof(tail[i]));
+		memcpy(tail[i], src[i] + full[i] * CT_SHA1_BLOCK, r);
+		tail[i][r] = 0x80;
+		bits = (uint64_t)len[i] << 3;
+		k = (total[i] - full[i]) * CT_SHA1_BLOCK;
+		ct_sha1_put32(tail[i] + k - 8, bits >> 32);
+		ct_sha1_put32(tail[i] + k - 4, bits);
+		if (total[i] > nblocks)
+			nblocks = total[i];
+	}
+
+	st[0] = _mm256_set1_epi32(0x67452301);
+	st[1] = _mm256_set1_epi32(0xefcdab89);
+	st[2] = _mm256_set1_epi32(0x98badcfe);
+	st[3] = _mm256_set1_epi32(0x10325476);
+	st[4] = _mm256_set1_epi32(0xc3d2e1f0);
+
+	for (k = 0; k < nblocks; k++) {
+		for (i = 0; i < CT_SHA1_LANES; i++) {
+			mask[i] = k < total[i] ? -1 : 0;
+			if (k < full[i])
+				p[i] = src[i] + k * CT_SHA1_BLOCK;
+			else if (k < total[i])
+				p[i] = tail[i] + (k - full[i]) * CT_SHA1_BLOCK;
+			else
+				p[i] = zero;
+		}
+		active = _mm256_loadu_si256((const __m256i *)mask);
+		ct_sha1_avx2_load(w, p, 0);
+		ct_sha1_avx2_load(w + 8, p, 32);
+
+		a = st[0];
+		b = st[1];
+		c = st[2];
+		d = st[3];
+		e = st[4];
+		for (j = 0; j < 20; j++)
+			AVX2_ROUND(AVX2_CH, k0, j);
+		for (; j < 40; j++)
+			AVX2_ROUND(AVX2_PARITY, k1, j);
+		for (; j < 60; j++)
+			AVX2_ROUND(AVX2_MAJ, k2, j);
+		for (; j < 80; j++)
+			AVX2_ROUND(AVX2_PARITY, k3, j);
+
+		st[0] = _mm256_blendv_epi8(st[0], _mm256_add_epi32(st[0], a),
+		    active);
+		st[1] = _mm256_blendv_epi8(st[1], _mm256_add_epi32(st[1], b),
+		    active);
+		st[2] = _mm256_blendv_epi8(st[2], _mm256_add_epi32(st[2], c),
+		    active);
+		st[3] = _mm256_blendv_epi8(st[3], _mm256_add_epi32(st[3], d),
+		    active);
+		st[4] = _mm256_blendv_epi8(st[4], _mm256_add_epi32(st[4], e),
+		    active);
+	}
+
+	for (j = 0; j < 5; j++)
+		_mm256_storeu_si256((__m256i *)out[j], st[j]);
+	for (i = 0; i < n; i++)
+		for (j = 0; j < 5; j++)
+			ct_sha1_put32(dst[i] + j * 4, out[j][i]);
+}
+#endif /* CT_SHA1_X86 */
+
+void
+ct_sha1(uint8_t *src, uint8_t *dst, size_t len)
+{
+	SHA_CTX		ctx;
+
+	SHA1_Init(&ctx);
+	ct_sha1_add(src, &ctx, len);
+	ct_sha1_final(dst, &ctx);
+}
+
+/*
+ * Digest n independent buffers. With AVX2 they go eight at a time, similar
+ * lengths keep all the lanes busy. A full set of lanes still beats the SHA
+ * extensions, half of them beats libcrypto without them.
+ */
+void
+ct_sha1_multi(uint8_t **src, uint8_t **dst, size_t *len, int n)
+{
+	int		i = 0;
+#ifdef CT_SHA1_X86
+	int		features = ct_digest_features(), lanes, m;
+
+	if (features & CT_DIGEST_F_AVX2) {
+		lanes = (features & CT_DIGEST_F_SHANI) ? CT_SHA1_LANES :
+		    CT_SHA1_LANES / 2;
+		for (; n - i >= lanes; i += m) {
+			m = MIN(n - i, CT_SHA1_LANES);
+			ct_sha1_avx2(src + i, dst + i, len + i, m);
+		}
+	}
+#endif
+	for (; i < n; i++)
+		ct_sha1(src[i], dst[i], len[i]);
+}
+
+/*
+ * Digest a chunk into dst and add it to the running digest in ctx with one
+ * pass over the data. With the SHA extensions the two chains run side by
+ * side, otherwise the second pass goes a slice at a time while it's still
+ * in cache.
+ */
+void
+ct_sha1_dual(uint8_t *src, uint8_t *dst, SHA_CTX *ctx, size_t len)
+{
+	SHA_CTX		chunk;
+	size_t		off, n;
+#ifdef CT_SHA1_X86
+	uint32_t	hc[5], hf[5];
+	size_t		skip = 0;
+
+	if (ct_digest_features() & CT_DIGEST_F_SHANI) {
+		SHA1_Init(&chunk);
+		/* line the running digest up on a block first */
+		if (ctx->num != 0) {
+			skip = MIN(len, CT_SHA1_BLOCK - ctx->num);
+			ct_sha1_shani_update(ctx, src, skip);
+		}
+		if ((n = (len - skip) / CT_SHA1_BLOCK) != 0) {
+			ct_sha1_get(&chunk, hc);
+			ct_sha1_get(ctx, hf);
+			ct_sha1_shani_blocks2(hc, src, hf, src + skip, n);
+			ct_sha1_set(&chunk, hc);
+			ct_sha1_set(ctx, hf);
+			ct_sha1_count(&chunk, n * CT_SHA1_BLOCK);
+			ct_sha1_count(ctx, n * CT_SHA1_BLOCK);
+		}
+		off = n * CT_SHA1_BLOCK;
+		ct_sha1_shani_update(&chunk, src + off, len - off);
+		ct_sha1_shani_update(ctx, src + skip + off, len - skip - off);
+		ct_sha1_shani_final(dst, &chunk);
+		return;
+	}
+#endif
+	SHA1_Init(&chunk);
+	for (off = 0; off < len; off += n) {
+		n = MIN(len - off, CT_SHA1_SLICE);
+		SHA1_Update(&chunk, src + off, n);
+		ct_sha1_add(src + off, ctx, n);
+	}
+	SHA1_Final(dst, &chunk);
+}
+
+void
+ct_sha1_setup(SHA_CTX *ctx)
+{
+	SHA1_Init(ctx);
+}
+
+void
+ct_sha1_add(uint8_t *src, SHA_CTX *ctx, size_t len)
+{
+#ifdef CT_SHA1_X86
+	if (ct_digest_features() & CT_DIGEST_F_SHANI) {
+		ct_sha1_shani_update(ctx, src, len);
+		return;
+	}
+#endif
+	SHA1_Update(ctx, src, len);
+}
+
+void
+ct_sha1_final(uint8_t *dst, SHA_CTX *ctx)
+{
+#ifdef CT_SHA1_X86
+	if (ct_digest_features() & CT_DIGEST_F_SHANI) {
+		ct_sha1_shani_final(dst, ctx);
+		return;
+	}
+#endif
+	SHA1_Final(dst, ctx);
+}
@@ -33,34 +33,6 @@
 #include "ctutil.h"
 
 
-void
-ct_sha1(uint8_t *src, uint8_t *dst, size_t len)
-{
-	SHA_CTX		ctx;
-
-	SHA1_Init(&ctx);
-	SHA1_Update(&ctx, src, len);
-	SHA1_Final(dst, &ctx);
-}
-
-void
-ct_sha1_setup(SHA_CTX *ctx)
-{
-	SHA1_Init(ctx);
-}
-
-void
-ct_sha1_add(uint8_t *src, SHA_CTX *ctx, size_t len)
-{
-	SHA1_Update(ctx, src, len);
-}
-
-void
-ct_sha1_final(uint8_t *dst, SHA_CTX *ctx)
-{
-	SHA1_Final(dst, ctx);
-}
-
 void
 ct_sha1_encode(uint8_t *sha, char *s)
 {
@@ -43,6 +43,34 @@
 #ifndef CT_LOCK_RELEASE
 #define CT_LOCK_RELEASE(var) pthread_mutex_destroy(var)
 #endif
+#ifndef CT_COND_STORE
+#define CT_COND_STORE(var) pthread_cond_t var
+#endif
+#ifndef CT_COND_WAIT
+#define CT_COND_WAIT(var, lock) pthread_cond_wait(var, lock)
+#endif
+#ifndef CT_COND_BROADCAST
+#define CT_COND_BROADCAST(var) pthread_cond_broadcast(var)
+#endif
+#ifndef CT_COND_INIT
+#define CT_COND_INIT(var)  pthread_cond_init(var, NULL)
+#endif
+#ifndef CT_COND_RELEASE
+#define CT_COND_RELEASE(var) pthread_cond_destroy(var)
+#endif
+/* Word sized atomics for the lock free queues. */
+#if defined(__ATOMIC_ACQUIRE)
+#define CT_ATOMIC_LOAD(p)	__atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define CT_ATOMIC_STORE(p, v)	__atomic_store_n(p, v, __ATOMIC_RELEASE)
+#else
+#define CT_ATOMIC_LOAD(p)	__sync_fetch_and_add(p, 0)
+#define CT_ATOMIC_STORE(p, v)	do {					\
+	__sync_synchronize();						\
+	*(p) = (v);							\
+} while (0)
+#endif
+#define CT_ATOMIC_CAS(p, o, n)	__sync_bool_compare_and_swap(p, o, n)
+#define CT_ATOMIC_ADD(p, v)	__sync_fetch_and_add(p, v)
 #else
 #ifndef CT_LOCK_STORE
 #define CT_LOCK_STORE(var) /* empty */
@@ -59,6 +87,25 @@
 #ifndef CT_LOCK_RELEASE
 #define CT_LOCK_RELEASE(var) /* empty */
 #endif
+#ifndef CT_COND_STORE
+#define CT_COND_STORE(var) /* empty */
+#endif
+#ifndef CT_COND_WAIT
+#define CT_COND_WAIT(var, lock) /* empty */
+#endif
+#ifndef CT_COND_BROADCAST
+#define CT_COND_BROADCAST(var) /* empty */
+#endif
+#ifndef CT_COND_INIT
+#define CT_COND_INIT(var)  /* empty */
+#endif
+#ifndef CT_COND_RELEASE
+#define CT_COND_RELEASE(var) /* empty */
+#endif
+#define CT_ATOMIC_LOAD(p)	(*(p))
+#define CT_ATOMIC_STORE(p, v)	(*(p) = (v))
+#define CT_ATOMIC_CAS(p, o, n)	(*(p) == (o) ? (*(p) = (n), 1) : 0)
+#define CT_ATOMIC_ADD(p, v)	((*(p) += (v)) - (v))
 #endif
 
 #endif /* _CT_THREADS_H_ */
@@ -210,6 +210,50 @@ void		ct_sha512_encode(uint8_t *, char *);
 void		ct_sha1_setup(SHA_CTX *);
 void		ct_sha1_add(uint8_t *, SHA_CTX *, size_t);
 void		ct_sha1_final(uint8_t *, SHA_CTX *);
+void		ct_sha1_multi(uint8_t **, uint8_t **, size_t *, int);
+void		ct_sha1_dual(uint8_t *, uint8_t *, SHA_CTX *, size_t);
+
+struct ct_blake3_ctx {
+	uint32_t	b3_cv[8];		/* chunk being built */
+	uint64_t	b3_chunk;		/* its number */
+	uint8_t		b3_buf[64];
+	uint8_t		b3_buflen;
+	uint8_t		b3_blocks;		/* of the chunk done */
+	uint8_t		b3_stacklen;
+	uint8_t		b3_stack[54][32];	/* complete subtrees */
+};
+void		ct_blake3(uint8_t *, uint8_t *, size_t);
+void		ct_blake3_setup(struct ct_blake3_ctx *);
+void		ct_blake3_add(uint8_t *, struct ct_blake3_ctx *, size_t);
+void		ct_blake3_final(uint8_t *, struct ct_blake3_ctx *);
+
+/* algorithms chunks and files are named with */
+#define CT_DIGEST_SHA1		0
+#define CT_DIGEST_BLAKE3	1
+#define CT_DIGEST_LENGTH	SHA_DIGEST_LENGTH
+struct ct_digest_ctx {
+	int			dc_alg;
+	union {
+		SHA_CTX			dcu_sha1;
+		struct ct_blake3_ctx	dcu_blake3;
+	}			dc_u;
+#define dc_sha1		dc_u.dcu_sha1
+#define dc_blake3	dc_u.dcu_blake3
+};
+const char	*ct_digest_name(int);
+int		ct_digest_lookup(const char *);
+void		ct_digest(int, uint8_t *, uint8_t *, size_t);
+void		ct_digest_multi(int, uint8_t **, uint8_t **, size_t *, int);
+void		ct_digest_setup(struct ct_digest_ctx *, int);
+void		ct_digest_add(uint8_t *, struct ct_digest_ctx *, size_t);
+void		ct_digest_final(uint8_t *, struct ct_digest_ctx *);
+void		ct_digest_dual(int, uint8_t *, uint8_t *,
+		    struct ct_digest_ctx *, size_t);
+
+#define CT_DIGEST_F_SHANI	(1<<0)	/* x86 sha extensions */
+#define CT_DIGEST_F_AVX2	(1<<1)	/* eight lanes at once */
+int		ct_digest_features(void);
+void		ct_digest_restrict(int);
 
 #define SHA512_DIGEST_STRING_LENGTH ((SHA512_DIGEST_LENGTH *2) + 1)
 void		ct_sha512_setup(SHA512_CTX *);
@@ -47,6 +47,8 @@ void secrets_upload(struct ct_cli_cmd *, int, char **);
 void secrets_generate(struct ct_cli_cmd *, int, char **);
 void secrets_delete(struct ct_cli_cmd *, int, char **);
 void config_generate(struct ct_cli_cmd *, int, char **);
+void watch_inotify(struct ct_cli_cmd *, int, char **);
+void watch_fanotify(struct ct_cli_cmd *, int, char **);
 
 char		 *ctctl_configfile;
 struct ct_config *ctctl_config;
@@ -198,10 +200,17 @@ struct ct_cli_cmd	cmd_config[] = {
 	{ NULL, NULL, 0, NULL, NULL, 0}
 };
 
+struct ct_cli_cmd	cmd_watch[] = {
+	{ "inotify", NULL, CLI_CMD_UNKNOWN, "<path> ...", watch_inotify },
+	{ "fanotify", NULL, CLI_CMD_UNKNOWN, "<path> ...", watch_fanotify },
+	{ NULL, NULL, 0, NULL, NULL, 0}
+};
+
 struct ct_cli_cmd	cmd_list[] = {
 	{ "cull", NULL, 0, "", cull },
 	{ "secrets", cmd_secrets, CLI_CMD_SUBCOMMAND, "<action> ...", NULL },
 	{ "config", cmd_config, CLI_CMD_SUBCOMMAND, "<action> ...", NULL },
+	{ "watch", cmd_watch, CLI_CMD_SUBCOMMAND, "<action> ...", NULL },
 #ifdef CT_EXT_CTCTL_CMDS
 	CT_EXT_CTCTL_CMDS
 #endif
@@ -863,3 +872,31 @@ crypto_passphrase:
 		e_free(&config.ct_localdb);
 	ctctl_config = NULL; /* global no longer valid */
 }
+
+/* watch - keep the change journal archives of these trees can use */
+static void
+ctctl_watch(struct ct_cli_cmd *c, int argc, char **argv, int fanotify)
+{
+	int	ret;
+
+	if (argc == 0)
+		ct_cli_usage(cmd_list, c);
+	if (ctctl_config->ct_change_journal == NULL)
+		CFATALX("change_journal not set in %s", ctctl_configfile);
+
+	ret = ct_journal_watch(ctctl_config->ct_change_journal, argv,
+	    fanotify);
+	CFATALX("%s: %s", ctctl_config->ct_change_journal, ct_strerror(ret));
+}
+
+void
+watch_inotify(struct ct_cli_cmd *c, int argc, char **argv)
+{
+	ctctl_watch(c, argc, argv, 0);
+}
+
+void
+watch_fanotify(struct ct_cli_cmd *c, int argc, char **argv)
+{
+	ctctl_watch(c, argc, argv, 1);
+}
@@ -663,25 +663,17 @@ void
 ct_display_queues(struct ct_global_state *state)
 {
 	if (ct_verbose > 1) {
-		CT_LOCK(&state->ct_sha_lock);
-		CT_LOCK(&state->ct_comp_lock);
-		CT_LOCK(&state->ct_crypt_lock);
-		CT_LOCK(&state->ct_csha_lock);
-		CT_LOCK(&state->ct_write_lock);
-		CT_LOCK(&state->ct_queued_lock);
-		CT_LOCK(&state->ct_complete_lock);
+		/* the stage rings need no lock to be measured */
 		fprintf(stderr, "Sha      queue len %d\n",
-		    state->ct_sha_qlen);
-		CT_UNLOCK(&state->ct_sha_lock);
+		    ct_ring_len(&state->ct_sha_ring));
 		fprintf(stderr, "Comp     queue len %d\n",
-		    state->ct_comp_qlen);
-		CT_UNLOCK(&state->ct_comp_lock);
+		    ct_ring_len(&state->ct_comp_ring));
 		fprintf(stderr, "Crypt    queue len %d\n",
-		    state->ct_crypt_qlen);
-		CT_UNLOCK(&state->ct_crypt_lock);
+		    ct_ring_len(&state->ct_crypt_ring));
 		fprintf(stderr, "Csha     queue len %d\n",
-		    state->ct_csha_qlen);
-		CT_UNLOCK(&state->ct_csha_lock);
+		    ct_ring_len(&state->ct_csha_ring));
+		CT_LOCK(&state->ct_write_lock);
+		CT_LOCK(&state->ct_queued_lock);
 		fprintf(stderr, "Write    queue len %d\n",
 		    state->ct_write_qlen);
 		CT_UNLOCK(&state->ct_write_lock);
@@ -692,8 +684,7 @@ ct_display_queues(struct ct_global_state *state)
 		fprintf(stderr, "Inflight queue len %d\n",
 		    state->ct_inflight_rblen);
 		fprintf(stderr, "Complete queue len %d\n",
-		    state->ct_complete_rblen);
-		CT_UNLOCK(&state->ct_complete_lock);
+		    ct_reorder_len(&state->ct_complete));
 		fprintf(stderr, "Free     queue len %d\n",
 		    state->ct_trans_free);
 	}
@@ -752,7 +743,8 @@ ct_dump_stats(struct ct_global_state *state, FILE *outfh)
 	int64_t sec;
 	int64_t val;
 	char *sign;
-	uint64_t sent, total;
+	uint64_t sent, total, usec;
+	int i;
 
 	gettimeofday(&time_end, NULL);
 
@@ -837,6 +829,34 @@ ct_dump_stats(struct ct_global_state *state, FILE *outfh)
 		fprintf(outfh, "Files completed\t\t%12" PRIu64 "\n",
 		    state->ct_stats->st_files_completed);
 
+		/* busy time against wall clock, for sizing the thread pools */
+		usec = (uint64_t)time_delta.tv_sec * 1000000 +
+		    time_delta.tv_usec;
+		for (i = 0; i < state->ct_stats->st_comp_workers; i++)
+			fprintf(outfh, "Compress worker %2d\t%12" PRIu64
+			    " chunks\t(%" PRIu64 "%% busy)\n", i,
+			    state->ct_stats->st_comp_chunks[i],
+			    usec == 0 ? (uint64_t)0 :
+			    state->ct_stats->st_comp_busy[i] * 100 / usec);
+		for (i = 0; i < state->ct_stats->st_crypt_workers; i++)
+			fprintf(outfh, "Crypto worker %2d\t%12" PRIu64
+			    " chunks\t(%" PRIu64 "%% busy)\n", i,
+			    state->ct_stats->st_crypt_chunks[i],
+			    usec == 0 ? (uint64_t)0 :
+			    state->ct_stats->st_crypt_busy[i] * 100 / usec);
+		for (i = 0; i < state->ct_stats->st_fused_workers; i++)
+			fprintf(outfh, "Fused worker %2d\t\t%12" PRIu64
+			    " chunks\t(%" PRIu64 "%% busy)\n", i,
+			    state->ct_stats->st_fused_chunks[i],
+			    usec == 0 ? (uint64_t)0 :
+			    state->ct_stats->st_fused_busy[i] * 100 / usec);
+		for (i = 0; i < state->ct_stats->st_sched_workers; i++)
+			fprintf(outfh, "Sched worker %2d\t\t%12" PRIu64
+			    " chunks\t(%" PRIu64 "%% busy)\n", i,
+			    state->ct_stats->st_sched_chunks[i],
+			    usec == 0 ? (uint64_t)0 :
+			    state->ct_stats->st_sched_busy[i] * 100 / usec);
+
 		if (ct_action == CT_A_ARCHIVE)
 			print_time_scaled(outfh, "Scan Time\t\t    ",
 			    &scan_delta);
@@ -1018,8 +1038,12 @@ ct_print_ctfile_info(void *state, const char *filename,
 	if (*verbose) {
 		ltime = gh->cmg_created;
 		printf("file: %s version: %d level: %d block size: %d "
-		    "created: %s", filename, gh->cmg_version, gh->cmg_cur_lvl,
-		    gh->cmg_chunk_size, ctime(&ltime));
+		    "chunking: %s%s%s digest: %s created: %s", filename,
+		    gh->cmg_version, gh->cmg_cur_lvl, gh->cmg_chunk_size,
+		    (gh->cmg_flags & CT_MD_CDC) ? "cdc" : "fixed",
+		    (gh->cmg_flags & CT_MD_PACK) ? ",packed" : "",
+		    (gh->cmg_flags & CT_MD_SPARSE) ? ",sparse" : "",
+		    ct_digest_name(CTFILE_DIGEST(gh)), ctime(&ltime));
 	}
 }
 
@@ -1298,6 +1322,10 @@ next_file:
 				}
 			}
 			break;
+		case XS_RET_ZERO:
+			if (doprint && verbose > 2)
+				printf(" zero %" PRIu64 "\n", xs_ctx.xs_zero);
+			break;
 		case XS_RET_EOF:
 			break;
 		case XS_RET_FAIL:
@@ -13,6 +13,9 @@
  * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
+#include <sys/types.h>
+#include <sys/stat.h>
+
 #include <string.h>
 #include <errno.h>
 
@@ -21,6 +24,7 @@
 
 #include <cyphertite.h>
 #include <ct_ctfile.h>
+#include <ct_internal.h>
 #include "ct_archive.h"
 
 static inline int
@@ -37,7 +41,9 @@ ct_basis_setup(struct ct_archive_state *state, struct ct_archive_args *caa,
 	struct ctfile_parse_state	 xs_ctx;
 	struct ct_archive_dnode		*adnode;
 	struct ct_archive_file		*af = NULL;
-	char				**fptr;
+	struct ct_statidx		*si;
+	struct stat			 sb;
+	char				**fptr, *idxpath;
 	time_t				 prev_backup_time = 0;
 	int				 nextlvl, i, rooted = 1, ret, s_errno;
 
@@ -90,6 +96,20 @@ ct_basis_setup(struct ct_archive_state *state, struct ct_archive_args *caa,
 	if (nextlvl == 0)
 		goto done;
 
+	/* the stat index written along with the ctfile saves reading it all */
+	if (stat(caa->caa_basis, &sb) == 0) {
+		e_asprintf(&idxpath, "%s%s", caa->caa_basis, CT_STATIDX_SUFFIX);
+		ret = ct_statidx_open(&si, idxpath, xs_ctx.xs_gh.cmg_created,
+		    sb.st_size);
+		if (ret == 0) {
+			CNDBG(CT_LOG_FILE, "using stat index %s", idxpath);
+			ct_archive_set_statidx(state, si);
+		}
+		e_free(&idxpath);
+		if (ret == 0)
+			goto done;
+	}
+
 	while ((ret = ctfile_parse(&xs_ctx)) != XS_RET_EOF) {
 		if (ret == XS_RET_FILE /* && 3factor */) {
 			struct fnode	sfnode;
@@ -21,3 +21,4 @@ int	ct_basis_setup(struct ct_archive_state *, struct ct_archive_args *,
 void	ct_archive_set_level(struct ct_archive_state *, int);
 int	ct_archive_get_level(struct ct_archive_state *);
 void	ct_archive_set_prev_backup_time(struct ct_archive_state *, time_t);
+void	ct_archive_set_statidx(struct ct_archive_state *, struct ct_statidx *);
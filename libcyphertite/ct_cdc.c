@@ -0,0 +1,113 @@
+/*
+ * Copyright (c) 2012 Conformal Systems LLC <info@conformal.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Content defined chunking, FastCDC style. A gear hash is rolled over the
+ * data and a chunk ends where its top bits are all zero, so cut points
+ * depend on the last 64 bytes only and move along with the data when
+ * something is inserted or removed in front of them. The first cdc_min
+ * bytes of a chunk are not looked at, up to cdc_avg a harder mask is used
+ * and after it an easier one, which keeps chunk sizes close to cdc_avg.
+ *
+ * The gear table and masks decide where every chunk of every backup is
+ * cut; changing them loses dedup against all existing backups.
+ */
+
+#include <sys/types.h>
+
+#include <stdint.h>
+#include <string.h>
+
+#include <clog.h>
+
+#include <cyphertite.h>
+#include <ct_internal.h>
+
+static uint64_t	ct_cdc_gear[256];
+static int	ct_cdc_gear_ready;
+
+/* splitmix64, fixed seed; all that matters is that it never changes */
+static void
+ct_cdc_gear_init(void)
+{
+	uint64_t	x = 0x6379706865727469ULL, z;
+	int		i;
+
+	for (i = 0; i < 256; i++) {
+		z = (x += 0x9e3779b97f4a7c15ULL);
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		ct_cdc_gear[i] = z ^ (z >> 31);
+	}
+	ct_cdc_gear_ready = 1;
+}
+
+/* The top bits bits of a 64 bit hash set. */
+static uint64_t
+ct_cdc_mask(int bits)
+{
+	return (~0ULL << (64 - bits));
+}
+
+/*
+ * Set cdc up for chunks of at most max bytes, averaging a quarter of that.
+ * Not thread safe the first time round.
+ */
+void
+ct_cdc_init(struct ct_cdc *cdc, size_t max)
+{
+	int	bits;
+
+	if (!ct_cdc_gear_ready)
+		ct_cdc_gear_init();
+
+	cdc->cdc_max = max;
+	cdc->cdc_avg = max / CT_CDC_AVG_DIV;
+	cdc->cdc_min = max / CT_CDC_MIN_DIV;
+	for (bits = 0; (2ULL << bits) <= cdc->cdc_avg; bits++)
+		;
+	if (bits < 2)
+		CABORTX("chunk size %zu too small to chunk by content", max);
+	cdc->cdc_mask_s = ct_cdc_mask(bits + 1);
+	cdc->cdc_mask_l = ct_cdc_mask(bits - 1);
+}
+
+/* Length of the chunk at the start of the len bytes at p. */
+size_t
+ct_cdc_cut(const struct ct_cdc *cdc, const uint8_t *p, size_t len)
+{
+	uint64_t	fp = 0;
+	size_t		i, normal;
+
+	if (len <= cdc->cdc_min)
+		return (len);
+	if (len > cdc->cdc_max)
+		len = cdc->cdc_max;
+	normal = cdc->cdc_avg < len ? cdc->cdc_avg : len;
+
+	for (i = cdc->cdc_min; i < normal; i++) {
+		fp = (fp << 1) + ct_cdc_gear[p[i]];
+		if ((fp & cdc->cdc_mask_s) == 0)
+			return (i + 1);
+	}
+	for (; i < len; i++) {
+		fp = (fp << 1) + ct_cdc_gear[p[i]];
+		if ((fp & cdc->cdc_mask_l) == 0)
+			return (i + 1);
+	}
+
+	return (len);
+}
@@ -357,6 +357,10 @@ ct_load_config(struct ct_config **config, char **configfile)
 	struct ct_config	 conf;
 	char			*ct_compression_type = NULL;
 	char			*ct_polltype = NULL;
+	char			*ct_wakeuptype = NULL;
+	char			*ct_chunking = NULL;
+	char			*ct_read_order = NULL;
+	char			*ct_digest = NULL;
 	char			*ctfile_mode_str = NULL;
 	char			*config_path = NULL;
 	char			 ct_fullcachedir[PATH_MAX];
@@ -384,6 +388,10 @@ ct_load_config(struct ct_config **config, char **configfile)
 		{ "session_compression", CT_S_STR, NULL, &ct_compression_type,
 		   NULL, NULL },
 		{ "polltype", CT_S_STR, NULL, &ct_polltype, NULL, NULL },
+		{ "wakeuptype", CT_S_STR, NULL, &ct_wakeuptype, NULL, NULL },
+		{ "chunking", CT_S_STR, NULL, &ct_chunking, NULL, NULL },
+		{ "read_order", CT_S_STR, NULL, &ct_read_order, NULL, NULL },
+		{ "digest", CT_S_STR, NULL, &ct_digest, NULL, NULL },
 		{ "upload_crypto_secrets" , CT_S_INT, &conf.ct_secrets_upload,
 		    NULL, NULL, NULL },
 		{ "ctfile_cull_keep_days" , CT_S_INT, &conf.ct_ctfile_keep_days,
@@ -422,6 +430,32 @@ ct_load_config(struct ct_config **config, char **configfile)
 		    NULL, NULL, NULL },
 		{ "socket_sndbuf" , CT_S_INT, &conf.ct_sock_sndbuf,
 		    NULL, NULL, NULL },
+		{ "sha_threads" , CT_S_INT, &conf.ct_sha_threads,
+		    NULL, NULL, NULL },
+		{ "compress_threads" , CT_S_INT, &conf.ct_compress_threads,
+		    NULL, NULL, NULL },
+		{ "crypto_threads" , CT_S_INT, &conf.ct_crypto_threads,
+		    NULL, NULL, NULL },
+		{ "crypto_stitch" , CT_S_INT, &conf.ct_crypto_stitch,
+		    NULL, NULL, NULL },
+		{ "sched_threads" , CT_S_INT, &conf.ct_sched_threads,
+		    NULL, NULL, NULL },
+		{ "readahead_threads" , CT_S_INT, &conf.ct_readahead_threads,
+		    NULL, NULL, NULL },
+		{ "io_uring" , CT_S_INT, &conf.ct_io_uring,
+		    NULL, NULL, NULL },
+		{ "fused_threads" , CT_S_INT, &conf.ct_fused_threads,
+		    NULL, NULL, NULL },
+		{ "trans_hugepages" , CT_S_INT, &conf.ct_trans_hugepages,
+		    NULL, NULL, NULL },
+		{ "pack_threshold" , CT_S_INT, &conf.ct_pack_threshold,
+		    NULL, NULL, NULL },
+		{ "sparse_files" , CT_S_INT, &conf.ct_sparse_files,
+		    NULL, NULL, NULL },
+		{ "traverse_threads" , CT_S_INT, &conf.ct_traverse_threads,
+		    NULL, NULL, NULL },
+		{ "change_journal", CT_S_DIR, NULL, &conf.ct_change_journal,
+		    NULL, NULL },
 #if defined(CT_EXT_SETTINGS)
 		CT_EXT_SETTINGS
 #endif	/* CT_EXT_SETTINGS */
@@ -474,6 +508,47 @@ ct_load_config(struct ct_config **config, char **configfile)
 		return (CTE_MISSING_CONFIG_VALUE);
 	}
 
+	if (ct_wakeuptype != NULL) {
+		if (strcmp(ct_wakeuptype, "pipe") == 0)
+			conf.ct_wakeup_type = CT_WAKEUP_PIPE;
+		else if (strcmp(ct_wakeuptype, "futex") == 0)
+			conf.ct_wakeup_type = CT_WAKEUP_FUTEX;
+		else {
+			CWARNX("wakeuptype: %s",
+			    ct_strerror(CTE_INVALID_CONFIG_VALUE));
+			return (CTE_INVALID_CONFIG_VALUE);
+		}
+	}
+	if (ct_chunking != NULL) {
+		if (strcmp(ct_chunking, "fixed") == 0)
+			conf.ct_chunking = CT_CHUNK_FIXED;
+		else if (strcmp(ct_chunking, "cdc") == 0)
+			conf.ct_chunking = CT_CHUNK_CDC;
+		else {
+			CWARNX("chunking: %s",
+			    ct_strerror(CTE_INVALID_CONFIG_VALUE));
+			return (CTE_INVALID_CONFIG_VALUE);
+		}
+	}
+	if (ct_read_order != NULL) {
+		if (strcmp(ct_read_order, "scan") == 0)
+			conf.ct_read_order = CT_READ_SCAN;
+		else if (strcmp(ct_read_order, "inode") == 0)
+			conf.ct_read_order = CT_READ_INODE;
+		else if (strcmp(ct_read_order, "extent") == 0)
+			conf.ct_read_order = CT_READ_EXTENT;
+		else {
+			CWARNX("read_order: %s",
+			    ct_strerror(CTE_INVALID_CONFIG_VALUE));
+			return (CTE_INVALID_CONFIG_VALUE);
+		}
+	}
+	if (ct_digest != NULL &&
+	    (conf.ct_digest = ct_digest_lookup(ct_digest)) == -1) {
+		CWARNX("digest: %s", ct_strerror(CTE_INVALID_CONFIG_VALUE));
+		return (CTE_INVALID_CONFIG_VALUE);
+	}
+
 	if (ctfile_mode_str != NULL) {
 		if (strcmp(ctfile_mode_str, "remote") == 0)
 			conf.ct_ctfile_mode = CT_MDMODE_REMOTE;
@@ -540,6 +615,69 @@ ct_load_config(struct ct_config **config, char **configfile)
 		return (CTE_MISSING_CONFIG_VALUE);
 	}
 
+	if (conf.ct_sha_threads < 1 ||
+	    conf.ct_sha_threads > CT_MAX_WORKERS) {
+		CWARNX("sha_threads: %s",
+		    ct_strerror(CTE_INVALID_CONFIG_VALUE));
+		return (CTE_INVALID_CONFIG_VALUE);
+	}
+	if (conf.ct_compress_threads < 1 ||
+	    conf.ct_compress_threads > CT_MAX_WORKERS) {
+		CWARNX("compress_threads: %s",
+		    ct_strerror(CTE_INVALID_CONFIG_VALUE));
+		return (CTE_INVALID_CONFIG_VALUE);
+	}
+	if (conf.ct_crypto_threads < 1 ||
+	    conf.ct_crypto_threads > CT_MAX_WORKERS) {
+		CWARNX("crypto_threads: %s",
+		    ct_strerror(CTE_INVALID_CONFIG_VALUE));
+		return (CTE_INVALID_CONFIG_VALUE);
+	}
+	if (conf.ct_crypto_stitch < 0 || conf.ct_crypto_stitch > 1) {
+		CWARNX("crypto_stitch: %s",
+		    ct_strerror(CTE_INVALID_CONFIG_VALUE));
+		return (CTE_INVALID_CONFIG_VALUE);
+	}
+	if (conf.ct_fused_threads < 0 ||
+	    conf.ct_fused_threads > CT_MAX_WORKERS) {
+		CWARNX("fused_threads: %s",
+		    ct_strerror(CTE_INVALID_CONFIG_VALUE));
+		return (CTE_INVALID_CONFIG_VALUE);
+	}
+	if (conf.ct_sched_threads < 0 ||
+	    conf.ct_sched_threads > CT_MAX_WORKERS) {
+		CWARNX("sched_threads: %s",
+		    ct_strerror(CTE_INVALID_CONFIG_VALUE));
+		return (CTE_INVALID_CONFIG_VALUE);
+	}
+	if (conf.ct_readahead_threads < 0 ||
+	    conf.ct_readahead_threads > CT_MAX_WORKERS) {
+		CWARNX("readahead_threads: %s",
+		    ct_strerror(CTE_INVALID_CONFIG_VALUE));
+		return (CTE_INVALID_CONFIG_VALUE);
+	}
+	if (conf.ct_io_uring < 0 || conf.ct_io_uring > 1) {
+		CWARNX("io_uring: %s",
+		    ct_strerror(CTE_INVALID_CONFIG_VALUE));
+		return (CTE_INVALID_CONFIG_VALUE);
+	}
+	if (conf.ct_pack_threshold < 0) {
+		CWARNX("pack_threshold: %s",
+		    ct_strerror(CTE_INVALID_CONFIG_VALUE));
+		return (CTE_INVALID_CONFIG_VALUE);
+	}
+	if (conf.ct_sparse_files < 0 || conf.ct_sparse_files > 1) {
+		CWARNX("sparse_files: %s",
+		    ct_strerror(CTE_INVALID_CONFIG_VALUE));
+		return (CTE_INVALID_CONFIG_VALUE);
+	}
+	if (conf.ct_traverse_threads < 0 ||
+	    conf.ct_traverse_threads > CT_MAX_WORKERS) {
+		CWARNX("traverse_threads: %s",
+		    ct_strerror(CTE_INVALID_CONFIG_VALUE));
+		return (CTE_INVALID_CONFIG_VALUE);
+	}
+
 	/*
 	 * XXX - The bw limiting code algorithm isn't quite accurate right now,
 	 * so tweak it slightly until we fix that.
@@ -577,6 +715,22 @@ ct_default_config(struct ct_config *config)
 	config->ct_max_trans = 100;
 	config->ct_sock_rcvbuf = CT_DEFAULT_RCVBUF;
 	config->ct_sock_sndbuf = CT_DEFAULT_SNDBUF;
+	config->ct_sha_threads = 1;
+	config->ct_compress_threads = 1;
+	config->ct_crypto_threads = 1;
+	config->ct_crypto_stitch = 0;
+	config->ct_fused_threads = 0;
+	config->ct_sched_threads = 0;
+	config->ct_readahead_threads = 0;
+	config->ct_io_uring = 0;
+	config->ct_chunking = CT_CHUNK_FIXED;
+	config->ct_pack_threshold = 0;
+	config->ct_sparse_files = 0;
+	config->ct_traverse_threads = 0;
+	config->ct_read_order = CT_READ_SCAN;
+	config->ct_digest = CT_DIGEST_SHA1;
+	config->ct_wakeup_type = CT_WAKEUP_PIPE;
+	config->ct_trans_hugepages = 0;
 }
 
 /* slow as anything, but meh, we are writing out the config file. */
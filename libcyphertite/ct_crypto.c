@@ -20,6 +20,7 @@
 
 #include <string.h>
 #include <limits.h>
+#include <sys/param.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
@@ -33,6 +34,7 @@
 #include <arpa/inet.h>
 
 #include <clog.h>
+#include <exude.h>
 
 #include <ct_crypto.h>
 #include <ct_types.h>
@@ -64,6 +66,9 @@ const EVP_CIPHER *EVP_aes_xts(void);
 
 #define C_FILE_VERSION		(1)
 
+/* output hashed per slice by ct_crypto_ctx_crypt_sha(), fits in L1 */
+#define CT_CRYPTO_SHA_SLICE	(16 * 1024)
+
 int	ct_crypto_init(EVP_CIPHER_CTX *, const EVP_CIPHER *, uint8_t *, size_t,
 	    uint8_t *, size_t, int);
 int	ct_crypto_update(EVP_CIPHER_CTX *, uint8_t *, size_t, uint8_t *, size_t);
@@ -238,6 +243,213 @@ ct_create_iv_ctfile(uint32_t chunkno, uint8_t *iv, size_t ivlen)
 
 	return (0);
 }
+
+/*
+ * Long lived iv context for the chunk data path. The key only changes with
+ * the secrets, so the hmac-sha256 inner and outer pads are hashed once here
+ * and every iv starts from a copy of them. The ivs are the same as those of
+ * ct_create_iv().
+ */
+struct ct_iv_ctx {
+	SHA256_CTX		civ_inner;
+	SHA256_CTX		civ_outer;
+};
+
+struct ct_iv_ctx *
+ct_init_iv(uint8_t *key, size_t keylen)
+{
+	struct ct_iv_ctx	*civ;
+	uint8_t			 k[SHA256_CBLOCK];
+	uint8_t			 pad[SHA256_CBLOCK];
+	int			 i;
+
+	bzero(k, sizeof(k));
+	if (keylen > sizeof(k))
+		SHA256(key, keylen, k);
+	else
+		memcpy(k, key, keylen);
+
+	civ = e_calloc(1, sizeof(*civ));
+	for (i = 0; i < sizeof(pad); i++)
+		pad[i] = k[i] ^ 0x36;
+	SHA256_Init(&civ->civ_inner);
+	SHA256_Update(&civ->civ_inner, pad, sizeof(pad));
+	for (i = 0; i < sizeof(pad); i++)
+		pad[i] = k[i] ^ 0x5c;
+	SHA256_Init(&civ->civ_outer);
+	SHA256_Update(&civ->civ_outer, pad, sizeof(pad));
+
+	bzero(k, sizeof(k));
+	bzero(pad, sizeof(pad));
+
+	return (civ);
+}
+
+int
+ct_iv_ctx_create(struct ct_iv_ctx *civ, uint8_t *src, size_t srclen,
+    uint8_t *iv, size_t ivlen)
+{
+	return (ct_iv_ctx_create_batch(civ, &src, &srclen, &iv, ivlen, 1));
+}
+
+/* The ivs of n chunks, each into the ivlen bytes at iv[i]. */
+int
+ct_iv_ctx_create_batch(struct ct_iv_ctx *civ, uint8_t **src, size_t *srclen,
+    uint8_t **iv, size_t ivlen, int n)
+{
+	SHA256_CTX		ctx;
+	uint8_t			inner[SHA256_DIGEST_LENGTH];
+	int			i;
+
+	if (ivlen != SHA256_DIGEST_LENGTH) {
+		CNDBG(CT_LOG_CRYPTO, "invalid iv length");
+		return (CTE_INVALID_IV_LENGTH);
+	}
+
+	for (i = 0; i < n; i++) {
+		ctx = civ->civ_inner;
+		SHA256_Update(&ctx, src[i], srclen[i] >= ivlen ?
+		    ivlen : srclen[i]);
+		SHA256_Final(inner, &ctx);
+		ctx = civ->civ_outer;
+		SHA256_Update(&ctx, inner, sizeof(inner));
+		SHA256_Final(iv[i], &ctx);
+	}
+	bzero(&ctx, sizeof(ctx));
+
+	return (0);
+}
+
+void
+ct_cleanup_iv(struct ct_iv_ctx *civ)
+{
+	if (civ == NULL)
+		return;
+	bzero(civ, sizeof(*civ));
+	e_free(&civ);
+}
+
+/*
+ * Long lived cipher context for the chunk data path. The aes-xts key
+ * schedule is done once here and only the tweak is reset per chunk.
+ */
+struct ct_crypto_ctx {
+	EVP_CIPHER_CTX		ccc_ctx;
+	int			ccc_enc;
+};
+
+struct ct_crypto_ctx *
+ct_init_crypto(uint8_t *key, size_t keylen, int enc)
+{
+	struct ct_crypto_ctx	*ccc;
+
+	ccc = e_calloc(1, sizeof(*ccc));
+	ccc->ccc_enc = enc;
+	if (ct_crypto_init(&ccc->ccc_ctx, EVP_aes_xts(), key, keylen, NULL, 0,
+	    enc)) {
+		CNDBG(CT_LOG_CRYPTO, "can't init crypto engine");
+		ct_cleanup_crypto(ccc);
+		return (NULL);
+	}
+
+	return (ccc);
+}
+
+/*
+ * Run a chunk through ccc. With a sha ctx the output is fed to it as well, a
+ * slice at a time while the slice is still in cache. The xts tweak carries
+ * over from one update to the next, so slicing doesn't change the output.
+ */
+static int
+ct_crypto_ctx_run(struct ct_crypto_ctx *ccc, uint8_t *iv, size_t ivlen,
+    uint8_t *src, size_t srclen, uint8_t *dst, size_t dstlen, SHA_CTX *sha)
+{
+	size_t			off, n;
+	int			len, final, blocksz, l;
+
+	/* sanity, as in ct_crypto_crypt() */
+	if (iv == NULL || src == NULL || dst == NULL) {
+		CNDBG(CT_LOG_CRYPTO, "invalid pointers");
+		return (-1);
+	}
+	if (srclen <= 0) {
+		CNDBG(CT_LOG_CRYPTO, "invalid srclen");
+		return (-1);
+	}
+	blocksz = EVP_CIPHER_CTX_block_size(&ccc->ccc_ctx);
+	if (ccc->ccc_enc && dstlen < srclen + blocksz) {
+		CNDBG(CT_LOG_CRYPTO, "invalid dstlen while encrypting");
+		return (-1);
+	}
+	if (ccc->ccc_enc == 0 && dstlen < srclen - blocksz) {
+		CNDBG(CT_LOG_CRYPTO, "invalid dstlen while decrypting");
+		return (-1);
+	}
+
+	/* new tweak, keep the key schedule */
+	if (!EVP_CipherInit_ex(&ccc->ccc_ctx, NULL, NULL, NULL, iv, -1)) {
+		CNDBG(CT_LOG_CRYPTO, "can't set iv");
+		return (-1);
+	}
+
+	for (off = len = 0; off < srclen; off += n) {
+		n = sha == NULL ? srclen : MIN(srclen - off,
+		    CT_CRYPTO_SHA_SLICE);
+		if ((l = ct_crypto_update(&ccc->ccc_ctx, src + off, n,
+		    dst + len, dstlen - len)) == -1) {
+			CNDBG(CT_LOG_CRYPTO, "can't encrypt");
+			return (-1);
+		}
+		if (sha != NULL)
+			ct_sha1_add(dst + len, sha, l);
+		len += l;
+	}
+
+	if ((final = ct_crypto_final(&ccc->ccc_ctx, dst + len)) == -1) {
+		CNDBG(CT_LOG_CRYPTO, "can't finalize encryption");
+		return (-1);
+	}
+	if (sha != NULL)
+		ct_sha1_add(dst + len, sha, final);
+
+	return (final + len);
+}
+
+int
+ct_crypto_ctx_crypt(struct ct_crypto_ctx *ccc, uint8_t *iv, size_t ivlen,
+    uint8_t *src, size_t srclen, uint8_t *dst, size_t dstlen)
+{
+	return (ct_crypto_ctx_run(ccc, iv, ivlen, src, srclen, dst, dstlen,
+	    NULL));
+}
+
+/*
+ * ct_crypto_ctx_crypt() that also leaves the sha1 of the output in sha, in
+ * the same pass instead of reading the output again.
+ */
+int
+ct_crypto_ctx_crypt_sha(struct ct_crypto_ctx *ccc, uint8_t *iv, size_t ivlen,
+    uint8_t *src, size_t srclen, uint8_t *dst, size_t dstlen, uint8_t *sha)
+{
+	SHA_CTX			ctx;
+	int			rv;
+
+	ct_sha1_setup(&ctx);
+	if ((rv = ct_crypto_ctx_run(ccc, iv, ivlen, src, srclen, dst, dstlen,
+	    &ctx)) != -1)
+		ct_sha1_final(sha, &ctx);
+	return (rv);
+}
+
+void
+ct_cleanup_crypto(struct ct_crypto_ctx *ccc)
+{
+	if (ccc == NULL)
+		return;
+	EVP_CIPHER_CTX_cleanup(&ccc->ccc_ctx);
+	e_free(&ccc);
+}
+
 int
 ct_encrypt(uint8_t *key, size_t keylen, uint8_t *iv, size_t ivlen,
     uint8_t *src, size_t srclen, uint8_t *dst, size_t dstlen)
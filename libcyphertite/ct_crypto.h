@@ -28,9 +28,24 @@ int			ct_encrypt(uint8_t *, size_t, uint8_t *, size_t,
 			    uint8_t *, size_t, uint8_t *, size_t);
 int			ct_decrypt(uint8_t *, size_t, uint8_t *, size_t,
 			    uint8_t *, size_t, uint8_t *, size_t);
+struct ct_crypto_ctx;
+struct ct_crypto_ctx	*ct_init_crypto(uint8_t *, size_t, int);
+int			ct_crypto_ctx_crypt(struct ct_crypto_ctx *, uint8_t *,
+			    size_t, uint8_t *, size_t, uint8_t *, size_t);
+int			ct_crypto_ctx_crypt_sha(struct ct_crypto_ctx *,
+			    uint8_t *, size_t, uint8_t *, size_t, uint8_t *,
+			    size_t, uint8_t *);
+void			ct_cleanup_crypto(struct ct_crypto_ctx *);
 int			ct_create_iv(uint8_t *, size_t, uint8_t *, size_t,
 			    uint8_t *, size_t);
 int			ct_create_iv_ctfile(uint32_t, uint8_t *, size_t);
+struct ct_iv_ctx;
+struct ct_iv_ctx	*ct_init_iv(uint8_t *, size_t);
+int			ct_iv_ctx_create(struct ct_iv_ctx *, uint8_t *,
+			    size_t, uint8_t *, size_t);
+int			ct_iv_ctx_create_batch(struct ct_iv_ctx *,
+			    uint8_t **, size_t *, uint8_t **, size_t, int);
+void			ct_cleanup_iv(struct ct_iv_ctx *);
 int			ct_create_secrets(const char *, const char *, uint8_t *, uint8_t *);
 int			ct_unlock_secrets(const char *, const char *, uint8_t *, size_t,
 			    uint8_t *, size_t);
@@ -26,7 +26,8 @@ struct ctfile_gheader {
 #define CT_MD_V1		(1)
 #define CT_MD_V2		(2)
 #define CT_MD_V3		(3)
-#define CT_MD_VERSION		CT_MD_V3
+#define CT_MD_V4		(4)
+#define CT_MD_VERSION		CT_MD_V4
 	int			cmg_chunk_size;	/* chunk size */
 	int64_t			cmg_created;	/* date created */
 	int			cmg_type;	/* normal, stdin or crypto */
@@ -37,6 +38,14 @@ struct ctfile_gheader {
 #define CT_MD_CRYPTO		(1)
 #define CT_MD_MLB_ALLFILES	(2)
 #define CT_MD_STRIP_SLASH	(4)	/* ignore rootedness */
+#define CT_MD_CDC		(8)	/* chunked by content, not size */
+#define CT_MD_PACK		(16)	/* small files may share a chunk */
+#define CT_MD_SPARSE		(32)	/* files may have runs of zeros */
+#define CT_MD_BLAKE3		(64)	/* named by blake3, not sha1 */
+/* flags a v3 reader would get the file wrong with */
+#define CT_MD_V4_FLAGS		(CT_MD_PACK | CT_MD_SPARSE | CT_MD_BLAKE3)
+#define CT_MD_FLAGS		(CT_MD_CRYPTO | CT_MD_MLB_ALLFILES |	\
+	CT_MD_STRIP_SLASH | CT_MD_CDC | CT_MD_V4_FLAGS)
 	char			*cmg_prevlvl_filename;
 	int			cmg_cur_lvl;
 	char			*cmg_cwd;
@@ -44,6 +53,10 @@ struct ctfile_gheader {
 	char			**cmg_paths;
 };
 
+/* digest a ctfile's chunks and files are named with */
+#define CTFILE_DIGEST(gh)						\
+	(((gh)->cmg_flags & CT_MD_BLAKE3) ? CT_DIGEST_BLAKE3 : CT_DIGEST_SHA1)
+
 /* XDR for metadata header */
 struct ctfile_header {
 	int			cmh_beacon;	/* magic marker */
@@ -67,6 +80,8 @@ struct ctfile_header {
 #define C_TY_LINK		(6)
 #define C_TY_SOCK		(7)
 #define C_TY_MASK		(0xf)		/* extra bit for future */
+#define C_TY_PACKED		(0x10)		/* data is a slice of a chunk */
+#define C_TY_SPARSE		(0x20)		/* shas may be runs of zeros */
 	char			*cmh_filename;	/* original filename */
 };
 
@@ -84,6 +99,18 @@ struct ctfile_stdin {
 	uint8_t			cms_sha[SHA_DIGEST_LENGTH];
 };
 
+/* XDR for where a packed file is in its chunk, follows its only sha */
+struct ctfile_pack {
+	uint32_t		cmp_offset;
+	uint32_t		cmp_len;
+};
+
+/*
+ * In C_TY_SPARSE files every sha is preceded by an xdr uint64. It is 0 for
+ * a sha; otherwise it is the length of a run of zeros and no sha follows.
+ * Zero runs are not part of the file sha in the trailer.
+ */
+
 /* XDR for metadata trailer */
 struct ctfile_trailer {
 	uint64_t		cmt_orig_size;	/* original size */
@@ -111,6 +138,10 @@ struct ctfile_parse_state {
 	int			 xs_wasfile;
 	int64_t			 xs_sha_cnt;
 	size_t			 xs_sha_sz;
+	int			 xs_packed;	/* xs_hdr was C_TY_PACKED */
+	struct ctfile_pack	 xs_pack;	/* valid with the sha if so */
+	int			 xs_sparse;	/* xs_hdr was C_TY_SPARSE */
+	uint64_t		 xs_zero;	/* valid if XS_RET_ZERO */
 
 	uint8_t			 xs_sha[SHA_DIGEST_LENGTH];
 	uint8_t			 xs_csha[SHA_DIGEST_LENGTH];
@@ -125,6 +156,7 @@ struct ctfile_parse_state {
 #define	XS_RET_FILE_END		2
 #define	XS_RET_EOF		3
 #define	XS_RET_FAIL		4
+#define	XS_RET_ZERO		5
 	int			xs_errno;	/* valid if XS_RET_FAIL */
 };
 
@@ -143,14 +175,19 @@ struct dnode *ctfile_parse_insertdir(struct ctfile_parse_state *, struct dnode *
 struct ctfile_write_state;
 int	 ctfile_write_init(struct ctfile_write_state **, const char *,
 	     const char *, int, const char *, int, char *, char **, int,
-	     int, int);
+	     int, int, int, int, int, int);
 int	 ctfile_write_special(struct ctfile_write_state *, struct fnode *);
 int	 ctfile_write_file_start(struct ctfile_write_state *, struct fnode *);
 int	 ctfile_write_file_sha(struct ctfile_write_state *, uint8_t *,
 	     uint8_t *, uint8_t *);
 int	 ctfile_write_file_pad(struct ctfile_write_state *, struct fnode *);
+int	 ctfile_write_file_zero(struct ctfile_write_state *, uint64_t);
+int	 ctfile_write_file_packed(struct ctfile_write_state *, struct fnode *,
+	     uint8_t *, uint8_t *, uint8_t *);
 int	 ctfile_write_file_end(struct ctfile_write_state *, struct fnode *);
 int	 ctfile_write_close(struct ctfile_write_state *);
+void	 ctfile_write_set_journal(struct ctfile_write_state *, uint64_t,
+	     off_t);
 void	 ctfile_write_abort(struct ctfile_write_state *);
 
 int	 ctfile_get_previous(const char *, const char *, char **);
@@ -104,6 +104,7 @@ ctfile_cache_trim_aliens(const char *cachedir,
 	struct ctfile_list_file	 sfile;
 	struct dirent		*dp;
 	DIR			*dirp;
+	size_t			 len;
 
 	CNDBG(CT_LOG_CTFILE, "triming files not found on server");
 
@@ -115,6 +116,12 @@ ctfile_cache_trim_aliens(const char *cachedir,
 		    strcmp(dp->d_name, "..") == 0)
 			continue;
 		strlcpy(sfile.mlf_name, dp->d_name, sizeof(sfile.mlf_name));
+		/* stat indices live and die with their ctfile */
+		if ((len = strlen(sfile.mlf_name)) > sizeof(CT_STATIDX_SUFFIX) &&
+		    strcmp(sfile.mlf_name + len - sizeof(CT_STATIDX_SUFFIX) + 1,
+		    CT_STATIDX_SUFFIX) == 0)
+			sfile.mlf_name[len - sizeof(CT_STATIDX_SUFFIX) + 1] =
+			    '\0';
 		if ((RB_FIND(ctfile_list_tree, keepfiles, &sfile)) == NULL) {
 			CNDBG(CT_LOG_CTFILE, "Trimming %s from ctfile cache: "
 			    "not found on server", dp->d_name); 
@@ -38,6 +38,7 @@
 #include <cyphertite.h>
 #include <ct_types.h>
 #include <ct_crypto.h>
+#include <ct_internal.h>
 #include "ct_fts.h"
 
 /* Taken from OpenBSD ls */
@@ -240,7 +241,11 @@ ctfile_cache_remove(const char *file, const char *cachedir)
 		ret = CTE_ERRNO;
 		s_errno = errno;
 	}
+	e_free(&cachename);
 
+	/* and the stat index that may have been written next to it */
+	e_asprintf(&cachename, "%s%s%s", cachedir, file, CT_STATIDX_SUFFIX);
+	(void)unlink(cachename);
 	e_free(&cachename);
 
 	errno = s_errno;
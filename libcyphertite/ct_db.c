@@ -30,7 +30,7 @@ static void		ctdb_cleanup(struct ctdb_state *);
 static int		ctdb_create(struct ctdb_state *);
 static int		ctdb_check_db_mode(struct ctdb_state *);
 
-#define CT_DB_VERSION	1
+#define CT_DB_VERSION	2
 #define OPS_PER_TRANSACTION	(100)
 struct ctdb_state {
 	sqlite3			*ctdb_db;
@@ -39,6 +39,7 @@ struct ctdb_state {
 	sqlite3_stmt		*ctdb_stmt_insert;
 	sqlite3_stmt		*ctdb_stmt_update;
 	int			 ctdb_crypt;
+	int			 ctdb_digest;	/* of the shas */
 	int			 ctdb_genid;
 	int			 ctdb_in_transaction;
 	int			 ctdb_trans_commit_rem;
@@ -81,7 +82,7 @@ ctdb_end_transaction(struct ctdb_state *state)
 }
 
 struct ctdb_state *
-ctdb_setup(const char *path, int crypt_enabled)
+ctdb_setup(const char *path, int crypt_enabled, int digest)
 {
 	struct ctdb_state	*state;
 	if (path == NULL)
@@ -90,6 +91,7 @@ ctdb_setup(const char *path, int crypt_enabled)
 
 	state->ctdb_genid = -1;
 	state->ctdb_crypt = crypt_enabled;
+	state->ctdb_digest = digest;
 	state->ctdb_dbfile = e_strdup(path);
 	if (ctdb_open(state) != 0) {
 		e_free(&state->ctdb_dbfile);
@@ -145,7 +147,7 @@ ctdb_create(struct ctdb_state *state)
 		return (rc);
 	}
 	snprintf(sql, sizeof sql,
-	    "CREATE TABLE mode (crypto TEXT, version INTEGER);");
+	    "CREATE TABLE mode (crypto TEXT, version INTEGER, digest TEXT);");
 	rc = sqlite3_exec(state->ctdb_db, sql, NULL, 0, &errmsg);
 	if (rc) {
 		CNDBG(CT_LOG_DB, "mode table creation failed");
@@ -154,8 +156,10 @@ ctdb_create(struct ctdb_state *state)
 		return (rc);
 	}
 	snprintf(sql, sizeof sql,
-	    "INSERT INTO mode (crypto, version) VALUES ('%c', %d);",
-		state->ctdb_crypt ? 'Y': 'N', CT_DB_VERSION);
+	    "INSERT INTO mode (crypto, version, digest) "
+	    "VALUES ('%c', %d, '%s');",
+		state->ctdb_crypt ? 'Y': 'N', CT_DB_VERSION,
+		ct_digest_name(state->ctdb_digest));
 	rc = sqlite3_exec(state->ctdb_db, sql, NULL, 0, &errmsg);
 	if (rc) {
 		CNDBG(CT_LOG_DB, "mode table init failed");
@@ -212,6 +216,18 @@ ctdb_upgrade_db(struct ctdb_state *state, int oldversion)
 			goto abort;
 		}
 		/* FALLTHROUGH */
+	case 1:
+		/* everything before had sha1 digests */
+		if (sqlite3_exec(state->ctdb_db,
+		    "ALTER TABLE mode ADD COLUMN digest TEXT", NULL, 0,
+		    &errmsg)) {
+			goto abort;
+		}
+		if (sqlite3_exec(state->ctdb_db,
+		    "UPDATE mode SET digest = 'sha1'", NULL, 0, &errmsg)) {
+			goto abort;
+		}
+		/* FALLTHROUGH */
 	case CT_DB_VERSION:
 		newversion = CT_DB_VERSION;
 		break;
@@ -290,14 +306,40 @@ ctdb_check_db_mode(struct ctdb_state *state)
 	}
 
 	/* early version of localdb didn't fill in version correctly */
-	if (sqlite3_column_type(stmt, 1) == SQLITE_NULL ||
-	    (ver = sqlite3_column_int(stmt, 1)) < CT_DB_VERSION) {
-		if (ctdb_upgrade_db(state, ver)) {
-			CNDBG(CT_LOG_DB,"failed to upgrade db!");
-			goto fail;
-		}
+	if (sqlite3_column_type(stmt, 1) != SQLITE_NULL)
+		ver = sqlite3_column_int(stmt, 1);
+	/* mode can't be altered while it is being read */
+	rc = sqlite3_finalize(stmt);
+	stmt = NULL;
+	if (rc) {
+		CNDBG(CT_LOG_DB, "can't finalise statement");
+		goto fail;
 	}
-	if (sqlite3_finalize(stmt)) {
+	if (ver < CT_DB_VERSION && ctdb_upgrade_db(state, ver)) {
+		CNDBG(CT_LOG_DB,"failed to upgrade db!");
+		goto fail;
+	}
+
+	/* shas of another digest are of no use */
+	if (sqlite3_prepare_v2(state->ctdb_db, "SELECT digest FROM mode",
+	    -1, &stmt, NULL)) {
+		CNDBG(CT_LOG_DB, "can't prepare digest query statement");
+		goto fail;
+	}
+	if (sqlite3_step(stmt) != SQLITE_ROW) {
+		CNDBG(CT_LOG_DB, "ctdb digest not found");
+		goto fail;
+	}
+	p = (char *)sqlite3_column_text(stmt, 0);
+	if (p == NULL ||
+	    strcmp(p, ct_digest_name(state->ctdb_digest)) != 0) {
+		CNDBG(CT_LOG_DB, "ctdb digest differs %s %s",
+		    p ? p : "none", ct_digest_name(state->ctdb_digest));
+		goto fail;
+	}
+	rc = sqlite3_finalize(stmt);
+	stmt = NULL;
+	if (rc) {
 		CNDBG(CT_LOG_DB, "can't finalise statement");
 		goto fail;
 	}
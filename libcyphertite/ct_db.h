@@ -19,7 +19,7 @@
 /* localdb interface */
 struct ctdb_state;
 
-struct ctdb_state		*ctdb_setup(const char *, int);
+struct ctdb_state		*ctdb_setup(const char *, int, int);
 void				 ctdb_shutdown(struct ctdb_state *);
 int				 ctdb_insert_sha(struct ctdb_state *,
 				     uint8_t *, uint8_t *, uint8_t *, int32_t);
@@ -22,6 +22,16 @@
 #include <event2/event.h>
 #include <signal.h>
 #include <ct_threads.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <limits.h>
+#define CT_HAVE_EVENTFD
+#if CT_ENABLE_PTHREADS
+#define CT_HAVE_FUTEX
+#endif
+#endif
 
 #include <clog.h>
 #include <exude.h>
@@ -44,9 +54,13 @@ struct ct_ctx {
 #if CT_ENABLE_PTHREADS
 	pthread_mutex_t 	ctx_mtx;
 	pthread_cond_t 		ctx_cv;
-	pthread_t		ctx_thread;
+	pthread_t		*ctx_threads;
+	int			ctx_nthreads;
+	int			ctx_nrunning;
 	int			ctx_exiting;
+	uint32_t		ctx_nwaiting;	/* threads in futex wait */
 #endif
+	uint32_t		ctx_pending;	/* wakeups not yet served */
 	int			ctx_type;
 	int                     ctx_pipe[2];
 
@@ -55,6 +69,7 @@ struct ct_ctx {
 
 struct ct_event_state {
 	struct event_base	*ct_evt_base;
+	int			 ct_wakeup_type;
 	struct ct_ctx		 ct_ctx_file;
 	struct ct_ctx		 ct_ctx_sha;
 	struct ct_ctx		 ct_ctx_compress;
@@ -75,10 +90,25 @@ void ct_wakeup_x_pipe(struct ct_ctx *);
 void ct_shutdown_x_pipe(struct ct_ctx *);
 #if CT_ENABLE_THREADS
 void ct_wakeup_x_cv(struct ct_ctx *);
-int ct_setup_wakeup_cv(struct ct_ctx *ctx, void *vctx, ct_func_cb *func_cb);
+int ct_setup_wakeup_cv(struct ct_ctx *ctx, void *vctx, ct_func_cb *func_cb,
+    int nthreads);
 #endif
 int ct_setup_wakeup_pipe(struct event_base *, struct ct_ctx *ctx, void *vctx,
     ct_func_cb *func_cb);
+#ifdef CT_HAVE_EVENTFD
+void ct_handle_wakeup_eventfd(int, short, void *);
+void ct_wakeup_x_eventfd(struct ct_ctx *);
+void ct_shutdown_x_eventfd(struct ct_ctx *);
+int ct_setup_wakeup_eventfd(struct event_base *, struct ct_ctx *ctx,
+    void *vctx, ct_func_cb *func_cb);
+#endif
+#ifdef CT_HAVE_FUTEX
+void ct_wakeup_x_futex(struct ct_ctx *);
+void ct_shutdown_futex(struct ct_ctx *);
+int ct_setup_wakeup_futex(struct ct_ctx *ctx, void *vctx, ct_func_cb *func_cb,
+    int nthreads);
+void *ct_futex_thread(void *);
+#endif
 void ct_keepalive(evutil_socket_t, short, void *);
 void ct_set_keepalive_timeout(struct ct_event_state *, int);
 void *ct_cb_thread(void *);
@@ -111,59 +141,115 @@ ct_setup_wakeup_pipe(struct event_base *base, struct ct_ctx *ctx, void *vctx,
 	return (0);
 }
 
+/*
+ * Contexts serviced by the event loop itself are woken through a pipe, or an
+ * eventfd if the futex wakeup type was selected.
+ */
+static int
+ct_setup_wakeup_loop(struct ct_event_state *ev_st, struct ct_ctx *ctx,
+    void *vctx, ct_func_cb *func_cb)
+{
+#ifdef CT_HAVE_EVENTFD
+	if (ev_st->ct_wakeup_type == CT_WAKEUP_FUTEX)
+		return ct_setup_wakeup_eventfd(ev_st->ct_evt_base, ctx, vctx,
+		    func_cb);
+#endif
+	return ct_setup_wakeup_pipe(ev_st->ct_evt_base, ctx, vctx, func_cb);
+}
+
+/* Stages with their own threads sleep on a condvar or a futex. */
+static int
+ct_setup_wakeup_thread(struct ct_event_state *ev_st, struct ct_ctx *ctx,
+    void *vctx, ct_func_cb *func_cb, int nthreads)
+{
+#if CT_ENABLE_THREADS
+#ifdef CT_HAVE_FUTEX
+	if (ev_st->ct_wakeup_type == CT_WAKEUP_FUTEX)
+		return ct_setup_wakeup_futex(ctx, vctx, func_cb, nthreads);
+#endif
+	return ct_setup_wakeup_cv(ctx, vctx, func_cb, nthreads);
+#else
+	return ct_setup_wakeup_loop(ev_st, ctx, vctx, func_cb);
+#endif
+}
+
 int
 ct_setup_wakeup_file(struct ct_event_state *ev_st, void *vctx,
     ct_func_cb *func_cb)
 {
-	return ct_setup_wakeup_pipe(ev_st->ct_evt_base, &ev_st->ct_ctx_file,
-	    vctx, func_cb);
+	return ct_setup_wakeup_loop(ev_st, &ev_st->ct_ctx_file, vctx, func_cb);
 }
 
+/*
+ * The sha, compress and encrypt stages may be serviced by several threads,
+ * ct_compute_sha() takes care of keeping per file state in order.
+ */
 int
 ct_setup_wakeup_sha(struct ct_event_state *ev_st, void *vctx,
-    ct_func_cb *func_cb)
+    ct_func_cb *func_cb, int nthreads)
 {
-#if CT_ENABLE_THREADS
-	return ct_setup_wakeup_cv(&ev_st->ct_ctx_sha, vctx, func_cb);
-#else
-	return ct_setup_wakeup_pipe(ev_st->ct_evt_base, &ev_st->ct_ctx_sha,
-	    vctx, func_cb);
-#endif
+	return ct_setup_wakeup_thread(ev_st, &ev_st->ct_ctx_sha, vctx, func_cb,
+	    nthreads);
 }
 
 int
 ct_setup_wakeup_compress(struct ct_event_state *ev_st, void *vctx,
-    ct_func_cb *func_cb)
+    ct_func_cb *func_cb, int nthreads)
 {
-#if CT_ENABLE_THREADS
-	return ct_setup_wakeup_cv(&ev_st->ct_ctx_compress, vctx, func_cb);
-#else
-	return ct_setup_wakeup_pipe(ev_st->ct_evt_base,
-	    &ev_st->ct_ctx_compress, vctx, func_cb);
-#endif
+	return ct_setup_wakeup_thread(ev_st, &ev_st->ct_ctx_compress, vctx,
+	    func_cb, nthreads);
 }
 
 int
 ct_setup_wakeup_csha(struct ct_event_state *ev_st, void *vctx,
     ct_func_cb *func_cb)
 {
-#if CT_ENABLE_THREADS
-	return ct_setup_wakeup_cv(&ev_st->ct_ctx_csha, vctx, func_cb);
-#else
-	return ct_setup_wakeup_pipe(ev_st->ct_evt_base, &ev_st->ct_ctx_csha,
-	    vctx, func_cb);
-#endif
+	return ct_setup_wakeup_thread(ev_st, &ev_st->ct_ctx_csha, vctx,
+	    func_cb, 1);
 }
 
 int
 ct_setup_wakeup_encrypt(struct ct_event_state *ev_st, void *vctx,
-    ct_func_cb *func_cb)
+    ct_func_cb *func_cb, int nthreads)
+{
+	return ct_setup_wakeup_thread(ev_st, &ev_st->ct_ctx_encrypt, vctx,
+	    func_cb, nthreads);
+}
+
+#if CT_ENABLE_THREADS
+static void
+ct_wakeup_x_sched(struct ct_ctx *ctx)
+{
+	ct_sched_wakeup(ctx->ctx_varg);
+}
+#endif
+
+/*
+ * All the cpu stages are run by the scheduler; waking any of them just
+ * means making sure a scheduler worker goes and looks.
+ */
+int
+ct_setup_wakeup_sched(struct ct_event_state *ev_st, struct ct_sched *sched)
 {
 #if CT_ENABLE_THREADS
-	return ct_setup_wakeup_cv(&ev_st->ct_ctx_encrypt, vctx, func_cb);
+	struct ct_ctx	*ctx[4];
+	int		 i;
+
+	ctx[0] = &ev_st->ct_ctx_sha;
+	ctx[1] = &ev_st->ct_ctx_compress;
+	ctx[2] = &ev_st->ct_ctx_csha;
+	ctx[3] = &ev_st->ct_ctx_encrypt;
+	for (i = 0; i < 4; i++) {
+		ctx[i]->ctx_type = 4;
+		ctx[i]->ctx_varg = sched;
+		ctx[i]->ctx_fn = NULL;
+		ctx[i]->ctx_wakeup = ct_wakeup_x_sched;
+		/* the scheduler is shut down by ct_cleanup_eventloop() */
+		ctx[i]->ctx_shutdown = NULL;
+	}
+	return (0);
 #else
-	return ct_setup_wakeup_pipe(ev_st->ct_evt_base, &ev_st->ct_ctx_encrypt,
-	    vctx, func_cb);
+	return (CTE_INVALID_CONFIG_VALUE);
 #endif
 }
 
@@ -171,16 +257,16 @@ int
 ct_setup_wakeup_complete(struct ct_event_state *ev_st, void *vctx,
     ct_func_cb *func_cb)
 {
-	return ct_setup_wakeup_pipe(ev_st->ct_evt_base,
-	    &ev_st->ct_ctx_complete, vctx, func_cb);
+	return ct_setup_wakeup_loop(ev_st, &ev_st->ct_ctx_complete, vctx,
+	    func_cb);
 }
 
 int
 ct_setup_wakeup_write(struct ct_event_state *ev_st, void *vctx,
     ct_func_cb *func_cb)
 {
-	return ct_setup_wakeup_pipe(ev_st->ct_evt_base, &ev_st->ct_ctx_write,
-	    vctx, func_cb);
+	return ct_setup_wakeup_loop(ev_st, &ev_st->ct_ctx_write, vctx,
+	    func_cb);
 }
 
 void
@@ -220,6 +306,69 @@ ct_shutdown_x_pipe(struct ct_ctx *ctx)
 	ctx->ctx_ev = NULL;
 }
 
+#ifdef CT_HAVE_EVENTFD
+/*
+ * Like the pipe, but a wakeup only costs a write(2) if the loop has not
+ * been woken since it last ran the callback.
+ */
+int
+ct_setup_wakeup_eventfd(struct event_base *base, struct ct_ctx *ctx,
+    void *vctx, ct_func_cb *func_cb)
+{
+	ctx->ctx_type = 2;
+	ctx->ctx_varg = vctx;
+	ctx->ctx_fn = func_cb;
+	ctx->ctx_wakeup = ct_wakeup_x_eventfd;
+	ctx->ctx_shutdown = ct_shutdown_x_eventfd;
+	ctx->ctx_pending = 0;
+
+	if ((ctx->ctx_pipe[0] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1)
+		return (CTE_ERRNO);
+	ctx->ctx_pipe[1] = ctx->ctx_pipe[0];
+
+	ctx->ctx_ev = event_new(base, ctx->ctx_pipe[0],
+	    EV_READ|EV_PERSIST, ct_handle_wakeup_eventfd, ctx);
+	event_add(ctx->ctx_ev, NULL);
+
+	return (0);
+}
+
+void
+ct_handle_wakeup_eventfd(int fd, short event, void *vctx)
+{
+	struct ct_ctx	*ctx = vctx;
+	uint64_t	 cnt;
+
+	if (read(fd, &cnt, sizeof(cnt)) == -1) { /* ignore */ }
+	/* anything queued from here on needs a new wakeup */
+	CT_ATOMIC_STORE(&ctx->ctx_pending, 0);
+	ctx->ctx_fn(ctx->ctx_varg);
+}
+
+void
+ct_wakeup_x_eventfd(struct ct_ctx *ctx)
+{
+	uint64_t	one = 1;
+
+	if (CT_ATOMIC_LOAD(&ctx->ctx_pending) != 0 ||
+	    !CT_ATOMIC_CAS(&ctx->ctx_pending, 0, 1))
+		return;
+	if (write(ctx->ctx_pipe[1], &one, sizeof(one)) == -1) { /* ignore */ }
+}
+
+void
+ct_shutdown_x_eventfd(struct ct_ctx *ctx)
+{
+	event_free(ctx->ctx_ev);
+	close(ctx->ctx_pipe[0]);
+	ctx->ctx_pipe[0] = ctx->ctx_pipe[1] = -1;
+	ctx->ctx_fn = NULL;
+	ctx->ctx_wakeup = NULL;
+	ctx->ctx_shutdown = NULL;
+	ctx->ctx_ev = NULL;
+}
+#endif /* CT_HAVE_EVENTFD */
+
 void
 ct_wakeup_file(struct ct_event_state *ev_st)
 {
@@ -293,6 +442,11 @@ ct_event_init(struct ct_global_state *state,
 	struct ct_event_state	*ev_st;
 
 	ev_st = e_calloc(1, sizeof(*ev_st));
+	ev_st->ct_wakeup_type = state->ct_config->ct_wakeup_type;
+#ifndef CT_HAVE_FUTEX
+	if (ev_st->ct_wakeup_type == CT_WAKEUP_FUTEX)
+		CNDBG(CT_LOG_NET, "futex wakeups unavailable, using pipes");
+#endif
 
 	ev_st->ct_evt_base = event_base_new();
 	if (ev_st->ct_evt_base == NULL) {
@@ -444,6 +598,13 @@ void
 ct_wakeup_x_cv(struct ct_ctx *ctx)
 {
 	pthread_mutex_lock(&ctx->ctx_mtx);
+	/*
+	 * Remember the wakeup in case every thread is busy in the callback,
+	 * otherwise work queued after a thread found its queue empty could
+	 * sit there until the next wakeup. More than one per thread is moot.
+	 */
+	if (ctx->ctx_pending < ctx->ctx_nthreads)
+		ctx->ctx_pending++;
 	pthread_cond_signal(&ctx->ctx_cv);
 	pthread_mutex_unlock(&ctx->ctx_mtx);
 }
@@ -451,36 +612,54 @@ ct_wakeup_x_cv(struct ct_ctx *ctx)
 void
 ct_shutdown_cv(struct ct_ctx *ctx)
 {
+	int	i;
+
 	pthread_mutex_lock(&ctx->ctx_mtx);
 	ctx->ctx_exiting = 1;
 	ctx->ctx_fn = NULL;
 	ctx->ctx_wakeup = NULL;
 	ctx->ctx_shutdown = NULL;
-	pthread_cond_signal(&ctx->ctx_cv);
+	pthread_cond_broadcast(&ctx->ctx_cv);
 	pthread_mutex_unlock(&ctx->ctx_mtx);
 
-	if (ctx->ctx_thread != pthread_self() &&
-	    pthread_join(ctx->ctx_thread, NULL) != 0)
-		CABORT("can't join on thread");
+	for (i = 0; i < ctx->ctx_nthreads; i++) {
+		if (ctx->ctx_threads[i] != pthread_self() &&
+		    pthread_join(ctx->ctx_threads[i], NULL) != 0)
+			CABORT("can't join on thread");
+	}
+	e_free(&ctx->ctx_threads);
+	ctx->ctx_nthreads = 0;
 }
 
 int
-ct_setup_wakeup_cv(struct ct_ctx *ctx, void *vctx, ct_func_cb *func_cb)
+ct_setup_wakeup_cv(struct ct_ctx *ctx, void *vctx, ct_func_cb *func_cb,
+    int nthreads)
 {
 	pthread_attr_t	 attr;
+	int		 i;
+
+	if (nthreads < 1)
+		nthreads = 1;
 
 	ctx->ctx_type = 1;
 	ctx->ctx_varg = vctx;
 	ctx->ctx_fn = func_cb;
 	ctx->ctx_wakeup = ct_wakeup_x_cv;
 	ctx->ctx_shutdown = ct_shutdown_cv;
+	ctx->ctx_threads = e_calloc(nthreads, sizeof(*ctx->ctx_threads));
+	ctx->ctx_nthreads = nthreads;
+	ctx->ctx_nrunning = nthreads;
+	ctx->ctx_pending = 0;
 
 	pthread_mutex_init(&ctx->ctx_mtx, NULL);
 	pthread_cond_init (&ctx->ctx_cv, NULL);
 
 	pthread_attr_init(&attr);
 	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
-	pthread_create(&ctx->ctx_thread, &attr, ct_cb_thread, (void *)ctx);
+	for (i = 0; i < nthreads; i++)
+		pthread_create(&ctx->ctx_threads[i], &attr, ct_cb_thread,
+		    (void *)ctx);
+	pthread_attr_destroy(&attr);
 
 	return (0);
 }
@@ -488,15 +667,19 @@ ct_setup_wakeup_cv(struct ct_ctx *ctx, void *vctx, ct_func_cb *func_cb)
 void *
 ct_cb_thread(void *vctx)
 {
-	struct ct_ctx *ctx = vctx;
+	struct ct_ctx	*ctx = vctx;
+	int		 last = 0;
 
 	do {
 		ct_func_cb	*callback;
 		void		*arg;
 
 		pthread_mutex_lock(&ctx->ctx_mtx);
-		pthread_cond_wait(&ctx->ctx_cv, &ctx->ctx_mtx);
+		/* shutdown may have been broadcast while we were busy */
+		while (ctx->ctx_exiting == 0 && ctx->ctx_pending == 0)
+			pthread_cond_wait(&ctx->ctx_cv, &ctx->ctx_mtx);
 		if (ctx->ctx_exiting) {
+			last = (--ctx->ctx_nrunning == 0);
 			pthread_mutex_unlock(&ctx->ctx_mtx);
 			break;
 		}
@@ -511,15 +694,122 @@ ct_cb_thread(void *vctx)
 		 */
 		callback = ctx->ctx_fn;
 		arg = ctx->ctx_varg;
+		ctx->ctx_pending--;
 		pthread_mutex_unlock(&ctx->ctx_mtx);
 
 		callback(arg);
 
 	} while (1);
 
-	pthread_cond_destroy(&ctx->ctx_cv);
-	pthread_mutex_destroy(&ctx->ctx_mtx);
+	/* last one out turns off the lights */
+	if (last) {
+		pthread_cond_destroy(&ctx->ctx_cv);
+		pthread_mutex_destroy(&ctx->ctx_mtx);
+	}
+
+	pthread_exit(NULL);
+}
+
+#ifdef CT_HAVE_FUTEX
+/*
+ * Futex backed stage threads. ctx_pending counts wakeups not yet picked up,
+ * capped at one per thread, so a burst of wakeups while every thread is busy
+ * costs nothing but an atomic. The futex is only poked when a thread is
+ * actually asleep on it.
+ */
+static long
+ct_futex(uint32_t *uaddr, int op, uint32_t val)
+{
+	return (syscall(SYS_futex, uaddr, op, val, NULL, NULL, 0));
+}
+
+void
+ct_wakeup_x_futex(struct ct_ctx *ctx)
+{
+	uint32_t	p;
+
+	do {
+		p = CT_ATOMIC_LOAD(&ctx->ctx_pending);
+		if (p >= (uint32_t)ctx->ctx_nthreads)
+			return;
+	} while (!CT_ATOMIC_CAS(&ctx->ctx_pending, p, p + 1));
+
+	if (CT_ATOMIC_LOAD(&ctx->ctx_nwaiting) != 0)
+		ct_futex(&ctx->ctx_pending, FUTEX_WAKE_PRIVATE, 1);
+}
+
+void
+ct_shutdown_futex(struct ct_ctx *ctx)
+{
+	int	i;
+
+	CT_ATOMIC_STORE(&ctx->ctx_exiting, 1);
+	CT_ATOMIC_ADD(&ctx->ctx_pending, 1);
+	ct_futex(&ctx->ctx_pending, FUTEX_WAKE_PRIVATE, INT_MAX);
+
+	for (i = 0; i < ctx->ctx_nthreads; i++) {
+		if (ctx->ctx_threads[i] != pthread_self() &&
+		    pthread_join(ctx->ctx_threads[i], NULL) != 0)
+			CABORT("can't join on thread");
+	}
+	e_free(&ctx->ctx_threads);
+	ctx->ctx_nthreads = 0;
+	ctx->ctx_fn = NULL;
+	ctx->ctx_wakeup = NULL;
+	ctx->ctx_shutdown = NULL;
+}
+
+int
+ct_setup_wakeup_futex(struct ct_ctx *ctx, void *vctx, ct_func_cb *func_cb,
+    int nthreads)
+{
+	pthread_attr_t	 attr;
+	int		 i;
+
+	if (nthreads < 1)
+		nthreads = 1;
+
+	ctx->ctx_type = 3;
+	ctx->ctx_varg = vctx;
+	ctx->ctx_fn = func_cb;
+	ctx->ctx_wakeup = ct_wakeup_x_futex;
+	ctx->ctx_shutdown = ct_shutdown_futex;
+	ctx->ctx_threads = e_calloc(nthreads, sizeof(*ctx->ctx_threads));
+	ctx->ctx_nthreads = nthreads;
+	ctx->ctx_exiting = 0;
+	ctx->ctx_pending = 0;
+	ctx->ctx_nwaiting = 0;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
+	for (i = 0; i < nthreads; i++)
+		pthread_create(&ctx->ctx_threads[i], &attr, ct_futex_thread,
+		    (void *)ctx);
+	pthread_attr_destroy(&attr);
+
+	return (0);
+}
+
+void *
+ct_futex_thread(void *vctx)
+{
+	struct ct_ctx	*ctx = vctx;
+	uint32_t	 p;
+
+	/* shutdown joins us before the callback goes away */
+	while (CT_ATOMIC_LOAD(&ctx->ctx_exiting) == 0) {
+		p = CT_ATOMIC_LOAD(&ctx->ctx_pending);
+		if (p == 0) {
+			CT_ATOMIC_ADD(&ctx->ctx_nwaiting, 1);
+			ct_futex(&ctx->ctx_pending, FUTEX_WAIT_PRIVATE, 0);
+			CT_ATOMIC_ADD(&ctx->ctx_nwaiting, -1);
+			continue;
+		}
+		if (CT_ATOMIC_CAS(&ctx->ctx_pending, p, p - 1))
+			ctx->ctx_fn(ctx->ctx_varg);
+	}
 
 	pthread_exit(NULL);
 }
+#endif /* CT_HAVE_FUTEX */
 #endif /* CT_ENABLE_PTHREADS */
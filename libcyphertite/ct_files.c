@@ -34,6 +34,12 @@
 #include <pwd.h>
 #include <limits.h>
 
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#endif
+
 #include <clog.h>
 #include <exude.h>
 
@@ -58,14 +64,45 @@ struct flist {
 	struct fnode		*fl_node;
 	dev_t			fl_dev;
 	ino_t			fl_ino;
+	uint64_t		fl_key;		/* read order, see ct_scan_order */
 #define C_FF_FORCEDIR	0x1
 #define C_FF_CLOSEDIR	0x2
 #define C_FF_WASDIR	0x4
+#define C_FF_HLTREE	0x8	/* kept as a possible hardlink target */
+#define C_FF_ORDER	0x10	/* may be moved to be read in disk order */
+#define C_FF_EXTENT	0x20	/* fl_key is a physical offset, not an inode */
+#define C_FF_CLEAN	0x40	/* unchanged since the basis, per the journal */
 	int			fl_flags;
 };
 RB_HEAD(fl_tree, flist);
 TAILQ_HEAD(flist_head, flist);
 
+/*
+ * The scan runs ahead of the archive by at most cs_window entries, topped up
+ * as files are taken off cs_flist, so memory does not grow with the size of
+ * the tree.  Entries are freed once archived unless a later one may turn out
+ * to be a hardlink of them.
+ */
+struct ct_scan {
+	struct flist_head	 cs_flist;	/* scanned, not yet archived */
+	struct flist		*cs_cur;	/* being archived */
+	struct fl_tree		 cs_ino_tree;
+	CT_FTS			*cs_fts;	/* NULL once the scan is done */
+	int			 cs_window;	/* 0 to scan it all at once */
+	int			 cs_nflist;
+	int			 cs_cnt;	/* accessible entries */
+	int			 cs_follow_root_symlink;
+	int			 cs_follow_symlinks;
+	int			 cs_order;	/* CT_READ_* */
+	int			 cs_ordered;	/* at the head, already ordered */
+	int			 cs_noextent;	/* cs_noextent_dev has no FIEMAP */
+	dev_t			 cs_noextent_dev;
+};
+
+#define CT_SCAN_WINDOW		(16384)	/* entries scanned ahead */
+#define CT_ORDER_SEGMENT	(4096)	/* entries reordered at a time */
+#define CT_ORDER_MAXDIRS	(128)	/* directories that holds open */
+
 /* tree for hardlink calculations */
 int			 fl_inode_sort(struct flist *, struct flist *);
 RB_PROTOTYPE(fl_tree, flist, fl_inode_entry, fl_inode_sort);
@@ -73,20 +110,25 @@ RB_GENERATE(fl_tree, flist, fl_inode_entry, fl_inode_sort);
 
 /* Directory traversal and transformation of generated data */
 static int		 ct_traverse(struct ct_global_state *,
-			     struct ct_archive_state *, char **,
-			     struct flist_head *, int, int, int,
+			     struct ct_scan *, char **, int, int, int, int);
+static int		 ct_traverse_fill(struct ct_global_state *,
+			     struct ct_archive_state *, struct ct_scan *,
 			     struct ct_statistics *);
+static void		 ct_scan_cleanup(struct ct_scan *);
+static int		 ct_scan_order(struct ct_scan *);
+static void		 ct_scan_order_key(struct ct_scan *, struct flist *,
+			     const char *, struct stat *);
 static void		 ct_sched_backup_file(struct ct_archive_state *,
-			     struct stat *, char *, int, int,
-			     struct flist_head *, struct fl_tree *,
-			     struct ct_statistics *);
+			     struct stat *, char *, int, int, int,
+			     struct ct_scan *, struct ct_statistics *);
 static struct fnode	*ct_populate_fnode_from_flist(struct ct_archive_state *,
 			     struct flist *, int);
+static int		 ct_archive_clean_stat(void *, const char *,
+			     struct stat *);
 
 /* Helper functions for the above */
 static int		 backup_prefix(struct ct_archive_state *, char *,
-			     struct flist_head *, struct fl_tree *,
-			     struct ct_statistics *);
+			     struct ct_scan *, struct ct_statistics *);
 static char		*gen_fname(struct flist *);
 static int		 s_to_e_type(int);
 
@@ -127,17 +169,191 @@ ct_dname_cmp(struct dnode *d1, struct dnode *d2)
 }
 
 static void
-ct_flnode_cleanup(struct flist_head *head)
+ct_flnode_free(struct flist *flnode)
+{
+	if (flnode->fl_fname)
+		e_free(&flnode->fl_fname);
+	e_free(&flnode);
+}
+
+/* Take an archived entry off the list, hardlink targets stay in the tree. */
+static void
+ct_scan_release(struct ct_scan *cs, struct flist *flnode)
+{
+	TAILQ_REMOVE(&cs->cs_flist, flnode, fl_list);
+	cs->cs_nflist--;
+	if ((flnode->fl_flags & C_FF_HLTREE) == 0)
+		ct_flnode_free(flnode);
+}
+
+static void
+ct_scan_cleanup(struct ct_scan *cs)
 {
 	struct flist *flnode;
 
-	while (!TAILQ_EMPTY(head)) {
-		flnode = TAILQ_FIRST(head);
-		TAILQ_REMOVE(head, flnode, fl_list);
-		if (flnode->fl_fname)
-			e_free(&flnode->fl_fname);
-		e_free(&flnode);
+	if (cs->cs_fts != NULL) {
+		(void)ct_fts_close(cs->cs_fts);
+		cs->cs_fts = NULL;
+	}
+	while ((flnode = TAILQ_FIRST(&cs->cs_flist)) != NULL)
+		ct_scan_release(cs, flnode);
+	cs->cs_cur = NULL;
+	while ((flnode = RB_ROOT(&cs->cs_ino_tree)) != NULL) {
+		RB_REMOVE(fl_tree, &cs->cs_ino_tree, flnode);
+		ct_flnode_free(flnode);
+	}
+}
+
+/*
+ * Find where the data of path starts on disk. Returns 0 with the byte
+ * offset in *physical, 1 if there is nothing to go by (no data, data kept
+ * in the inode or not allocated yet) and -1 with errno set if it can't be
+ * asked, EOPNOTSUPP or ENOTTY meaning not on this filesystem.
+ */
+int
+ct_extent_start(const char *path, int follow_symlinks, off_t *physical)
+{
+#if defined(__linux__) && defined(FS_IOC_FIEMAP)
+	uint64_t		 buf[(sizeof(struct fiemap) +
+				     sizeof(struct fiemap_extent)) /
+				     sizeof(uint64_t)];
+	struct fiemap		*fm = (struct fiemap *)buf;
+	struct fiemap_extent	*fe = &fm->fm_extents[0];
+	int			 fd, ret, s_errno;
+
+	/* nonblocking in case it was swapped for a fifo since the stat */
+	if ((fd = open(path, O_RDONLY | O_NONBLOCK | O_NOCTTY |
+	    (follow_symlinks ? 0 : O_NOFOLLOW))) == -1)
+		return (-1);
+	memset(buf, 0, sizeof(buf));
+	fm->fm_start = 0;
+	fm->fm_length = FIEMAP_MAX_OFFSET;
+	fm->fm_extent_count = 1;
+	ret = ioctl(fd, FS_IOC_FIEMAP, fm);
+	s_errno = errno;
+	close(fd);
+	if (ret == -1) {
+		errno = s_errno;
+		return (-1);
 	}
+	if (fm->fm_mapped_extents == 0 || fe->fe_flags &
+	    (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DATA_INLINE))
+		return (1);
+	*physical = fe->fe_physical;
+
+	return (0);
+#else
+	errno = EOPNOTSUPP;
+	return (-1);
+#endif
+}
+
+/*
+ * Key a regular file for ct_scan_order(): where its data starts on disk if
+ * that is wanted and can be found out, else its inode, which is roughly
+ * where the filesystem put it.
+ */
+static void
+ct_scan_order_key(struct ct_scan *cs, struct flist *flnode, const char *path,
+    struct stat *sb)
+{
+	off_t	physical;
+
+	flnode->fl_flags |= C_FF_ORDER;
+	flnode->fl_key = sb->st_ino;
+	if (cs->cs_order != CT_READ_EXTENT || sb->st_size == 0 ||
+	    (cs->cs_noextent && cs->cs_noextent_dev == sb->st_dev))
+		return;
+
+	switch (ct_extent_start(path, cs->cs_follow_symlinks, &physical)) {
+	case 0:
+		flnode->fl_key = physical;
+		flnode->fl_flags |= C_FF_EXTENT;
+		break;
+	case -1:
+		/* don't ask again for every file on the filesystem */
+		if (errno == EOPNOTSUPP || errno == ENOTTY) {
+			CNDBG(CT_LOG_FILE, "no extents for %s, using inode "
+			    "order", path);
+			cs->cs_noextent = 1;
+			cs->cs_noextent_dev = sb->st_dev;
+		}
+		break;
+	}
+}
+
+static int
+ct_scan_order_cmp(const void *a, const void *b)
+{
+	const struct flist	*f1 = *(struct flist * const *)a;
+	const struct flist	*f2 = *(struct flist * const *)b;
+
+	if (f1->fl_dev != f2->fl_dev)
+		return (f1->fl_dev < f2->fl_dev ? -1 : 1);
+	/* those placed by extent first, the rest by inode */
+	if ((f1->fl_flags ^ f2->fl_flags) & C_FF_EXTENT)
+		return (f1->fl_flags & C_FF_EXTENT ? -1 : 1);
+	if (f1->fl_key != f2->fl_key)
+		return (f1->fl_key < f2->fl_key ? -1 : 1);
+	if (f1->fl_ino != f2->fl_ino)
+		return (f1->fl_ino < f2->fl_ino ? -1 : 1);
+
+	return (0);
+}
+
+/*
+ * Reorder the next segment of the list so that its files are read in disk
+ * order, returning how many entries it has. A file needs its directory open
+ * from the directory's entry until its close entry, so the directories of
+ * the segment move to the front and the closes to the back, each in scan
+ * order, with the files sorted in between. Hardlinks and entries with no
+ * data stay in scan order after the files, so links still come after their
+ * targets. Segments end early rather than hold too many directories open.
+ */
+static int
+ct_scan_order(struct ct_scan *cs)
+{
+	struct flist	**seg, **out, *flnode;
+	int		 nseg = 0, nout = 0, nfiles, ndirs = 0, i;
+
+	if (TAILQ_EMPTY(&cs->cs_flist))
+		return (0);
+
+	seg = e_calloc(CT_ORDER_SEGMENT, sizeof(*seg));
+	out = e_calloc(CT_ORDER_SEGMENT, sizeof(*out));
+	while (nseg < CT_ORDER_SEGMENT &&
+	    (flnode = TAILQ_FIRST(&cs->cs_flist)) != NULL) {
+		if (flnode->fl_flags & C_FF_WASDIR) {
+			if (ndirs == CT_ORDER_MAXDIRS)
+				break;
+			ndirs++;
+		}
+		TAILQ_REMOVE(&cs->cs_flist, flnode, fl_list);
+		seg[nseg++] = flnode;
+	}
+
+	for (i = 0; i < nseg; i++)
+		if (seg[i]->fl_flags & C_FF_WASDIR)
+			out[nout++] = seg[i];
+	nfiles = nout;
+	for (i = 0; i < nseg; i++)
+		if (seg[i]->fl_flags & C_FF_ORDER)
+			out[nout++] = seg[i];
+	qsort(out + nfiles, nout - nfiles, sizeof(*out), ct_scan_order_cmp);
+	for (i = 0; i < nseg; i++)
+		if ((seg[i]->fl_flags &
+		    (C_FF_WASDIR | C_FF_ORDER | C_FF_CLOSEDIR)) == 0)
+			out[nout++] = seg[i];
+	for (i = 0; i < nseg; i++)
+		if (seg[i]->fl_flags & C_FF_CLOSEDIR)
+			out[nout++] = seg[i];
+
+	for (i = nout - 1; i >= 0; i--)
+		TAILQ_INSERT_HEAD(&cs->cs_flist, out[i], fl_list);
+	e_free(&out);
+	e_free(&seg);
+
+	return (nseg);
 }
 
 void
@@ -229,28 +445,39 @@ gen_fname(struct flist *flnode)
 	return name;
 }
 
+/*
+ * Returns NULL once everything scanned has been handed out, or if the scan
+ * failed, in which case ct_fatal has been called.
+ */
 struct fnode *
-ct_get_next_fnode(struct ct_archive_state *cas, struct flist_head *head,
-    struct flist **flist, struct ct_match *include, struct ct_match *exclude,
-    int follow_symlinks)
+ct_get_next_fnode(struct ct_global_state *state, struct ct_scan *cs,
+    struct ct_match *include, struct ct_match *exclude, int follow_symlinks)
 {
-	struct fnode	*fnode;
+	struct ct_archive_state	*cas = state->archive_state;
+	struct fnode		*fnode;
 again:
-	if (*flist == NULL)
-		*flist = TAILQ_FIRST(head);
-	else
-		*flist = TAILQ_NEXT(*flist, fl_list);
-	if (*flist == NULL)
+	if (cs->cs_cur != NULL) {
+		ct_scan_release(cs, cs->cs_cur);
+		cs->cs_cur = NULL;
+	}
+	/* top up once half the window has been used */
+	if (cs->cs_fts != NULL && cs->cs_nflist <= cs->cs_window / 2 &&
+	    ct_traverse_fill(state, cas, cs, state->ct_stats) != 0)
 		return (NULL);
+	if (cs->cs_order != CT_READ_SCAN && cs->cs_ordered == 0)
+		cs->cs_ordered = ct_scan_order(cs);
+	if ((cs->cs_cur = TAILQ_FIRST(&cs->cs_flist)) == NULL)
+		return (NULL);
+	if (cs->cs_ordered > 0)
+		cs->cs_ordered--;
 	/*
 	 * Deleted files will return NULL here, so keep looking until
 	 * we find a valid file or we run out of options.
 	 */
-	while ((fnode = ct_populate_fnode_from_flist(cas, *flist,
-	    follow_symlinks)) == NULL && (*flist = TAILQ_NEXT(*flist, fl_list)) != NULL)
-		;
-	if (fnode == NULL)
-		return (NULL);
+	if ((fnode = ct_populate_fnode_from_flist(cas, cs->cs_cur,
+	    follow_symlinks)) == NULL)
+		goto again;
+	ct_digest_setup(&fnode->fn_shactx, state->ct_config->ct_digest);
 
 	if (include && ct_match(include, fnode->fn_fullname)) {
 		CNDBG(CT_LOG_FILE, "%s not in include list, skipping",
@@ -296,6 +523,13 @@ ct_populate_fnode_from_flist(struct ct_archive_state *cas,
 	}
 
 	sb = &sbstore;
+	if (flnode->fl_flags & C_FF_CLEAN) {
+		dname = gen_fname(flnode);
+		ret = ct_archive_clean_stat(cas, dname, sb);
+		e_free(&dname);
+		if (ret == 0)
+			goto clean;
+	}
 #ifdef CT_NO_OPENAT
 	char	*fname;
 	char	 path[PATH_MAX];
@@ -323,6 +557,7 @@ ct_populate_fnode_from_flist(struct ct_archive_state *cas,
 		return NULL;
 	}
 
+clean:
 	fnode = ct_alloc_fnode();
 
 	fnode->fn_name = e_strdup(flnode->fl_fname);
@@ -335,8 +570,10 @@ ct_populate_fnode_from_flist(struct ct_archive_state *cas,
 	fnode->fn_uid = sb->st_uid;
 	fnode->fn_gid = sb->st_gid;
 	fnode->fn_mode = sb->st_mode;
+	fnode->fn_nlink = sb->st_nlink;
 	fnode->fn_atime = sb->st_atime;
 	fnode->fn_mtime = sb->st_mtime;
+	fnode->fn_ctime = sb->st_ctime;
 	fnode->fn_type = s_to_e_type(sb->st_mode);
 	fnode->fn_size = sb->st_size;
 	fnode->fn_offset = 0;
@@ -360,7 +597,6 @@ ct_populate_fnode_from_flist(struct ct_archive_state *cas,
 	fnode->fn_parent_dir = flnode->fl_parent_dir;
 
 	fnode->fn_state = CT_FILE_START;
-	ct_sha1_setup(&fnode->fn_shactx);
 
 	if (C_ISDIR(fnode->fn_type)) {
 		dname = gen_fname(flnode);
@@ -403,6 +639,10 @@ ct_populate_fnode_from_flist(struct ct_archive_state *cas,
 		fnode->fn_hlname = e_strdup(mylink);
 	}
 
+	/* nothing to open, the archive counts it as skipped */
+	if ((flnode->fl_flags & C_FF_CLEAN) && C_ISREG(fnode->fn_type))
+		fnode->fn_skip_file = 1;
+
 	return fnode;
 }
 
@@ -411,6 +651,9 @@ struct ct_archive_state {
 	struct d_name_tree	 cas_dname_head;
 	time_t			 cas_prev_backup_time;
 	int			 cas_level;
+	struct ct_statidx	*cas_statidx;	/* of the basis, if it had one */
+	struct ct_journal	*cas_journal;	/* change journal, if kept */
+	int			 cas_journal_clean; /* it covers since the basis */
 };
 
 int
@@ -484,6 +727,119 @@ ct_archive_set_prev_backup_time(struct ct_archive_state *cas,
 	cas->cas_prev_backup_time = backup_time;
 }
 
+/* Check files against si rather than the trees, which stay empty. */
+void
+ct_archive_set_statidx(struct ct_archive_state *cas, struct ct_statidx *si)
+{
+	cas->cas_statidx = si;
+}
+
+/*
+ * Pick up the change journal at path. If the basis' stat index was made
+ * with the same one, files the journal has nothing for since then are as
+ * the index has them. Either way this archive records where it got to.
+ */
+static void
+ct_archive_open_journal(struct ct_archive_state *cas, const char *path,
+    char **filelist, const char *cwd)
+{
+	uint64_t	 session = 0;
+	off_t		 off = -1;
+	int		 ret;
+
+	if ((ret = ct_journal_open(&cas->cas_journal, path, filelist,
+	    cwd)) != 0) {
+		CWARNX("%s: %s", path, ct_strerror(ret));
+		return;
+	}
+	if (cas->cas_statidx != NULL)
+		ct_statidx_journal(cas->cas_statidx, &session, &off);
+	if (session != 0 && session == ct_journal_session(cas->cas_journal) &&
+	    ct_journal_read(cas->cas_journal, off) == 0) {
+		CNDBG(CT_LOG_FILE, "journal %s covers the basis", path);
+		cas->cas_journal_clean = 1;
+	} else if ((ret = ct_journal_read(cas->cas_journal, -1)) != 0) {
+		CWARNX("%s: %s", path, ct_strerror(ret));
+		ct_journal_close(cas->cas_journal);
+		cas->cas_journal = NULL;
+	}
+}
+
+/*
+ * fts stat hook: the stat of path as the basis' index has it, if the
+ * journal has no change for it. Runs on the traverse threads.
+ */
+static int
+ct_archive_clean_stat(void *arg, const char *path, struct stat *sb)
+{
+	struct ct_archive_state		*cas = arg;
+	const struct ct_statidx_ent	*se;
+	char				 dir[PATH_MAX];
+	const char			*p;
+
+	if ((p = strrchr(path, '/')) == NULL || p - path >= sizeof(dir))
+		return (-1);
+	if (p == path) {
+		strlcpy(dir, "/", sizeof(dir));
+	} else {
+		memcpy(dir, path, p - path);
+		dir[p - path] = '\0';
+	}
+	if (ct_journal_dirty(cas->cas_journal, path) ||
+	    (se = ct_statidx_find(cas->cas_statidx, dir, p + 1)) == NULL)
+		return (-1);
+
+	bzero(sb, sizeof(*sb));
+	sb->st_mode = se->se_mode;
+	sb->st_uid = se->se_uid;
+	sb->st_gid = se->se_gid;
+	sb->st_nlink = se->se_nlink;
+	sb->st_size = se->se_size;
+	sb->st_atime = se->se_atime;
+	sb->st_mtime = se->se_mtime;
+	sb->st_ctime = se->se_ctime;
+	sb->st_ino = se->se_ino;
+	sb->st_dev = se->se_dev;
+	if (!S_ISREG(sb->st_mode))
+		return (-1);
+
+	return (0);
+}
+
+/*
+ * ct_archive_needs_archive() with a stat index. It also has the inode and
+ * ctime, which catch a file replaced by another or changed with its mtime
+ * put back.
+ */
+static int
+ct_archive_needs_archive_idx(struct ct_archive_state *cas,
+    struct fnode *fnode)
+{
+	const struct ct_statidx_ent	*se;
+	struct dnode			*dnode = fnode->fn_parent_dir;
+
+	if ((se = ct_statidx_find(cas->cas_statidx, dnode->d_num == -3 ?
+	    "" : dnode->d_name, fnode->fn_name)) == NULL) {
+		CNDBG(CT_LOG_FILE, "%s not in previous (%s)",
+		    fnode->fn_fullname, dnode->d_name);
+		return (1);
+	}
+	if (se->se_size != fnode->fn_size ||
+	    se->se_mtime != fnode->fn_mtime ||
+	    se->se_ctime != fnode->fn_ctime ||
+	    se->se_ino != (uint64_t)fnode->fn_ino) {
+		CNDBG(CT_LOG_FILE, "%s changed: size %" PRId64 " vs %" PRId64
+		    " mtime %" PRId64 " vs %" PRId64 " ctime %" PRId64
+		    " vs %" PRId64, fnode->fn_fullname, se->se_size,
+		    (int64_t)fnode->fn_size, se->se_mtime, fnode->fn_mtime,
+		    se->se_ctime, fnode->fn_ctime);
+		return (1);
+	}
+	CNDBG(CT_LOG_FILE, "%s incremental unneeded", fnode->fn_fullname);
+
+	return (0);
+}
+
 int
 ct_archive_needs_archive(struct ct_archive_state *cas, struct fnode *fnode)
 {
@@ -501,6 +857,9 @@ ct_archive_needs_archive(struct ct_archive_state *cas, struct fnode *fnode)
 		return (1);
 	}
 
+	if (cas->cas_statidx != NULL)
+		return (ct_archive_needs_archive_idx(cas, fnode));
+
 	/*
 	 * 3 factor checking:
 	 * factor 1: existance in previous backup
@@ -551,6 +910,8 @@ ct_archive_cleanup(struct ct_archive_state *cas)
 
 	if (cas->cas_rootdir.ad_dnode.d_name != NULL)
 		e_free(&cas->cas_rootdir.ad_dnode.d_name);
+	ct_statidx_close(cas->cas_statidx);
+	ct_journal_close(cas->cas_journal);
 	/*
 	 * ct -cf foo.md foo/bar/baz will have foo and foo/bar open at this
 	 * point (no fts postorder visiting), close them since we have just
@@ -586,8 +947,8 @@ ct_archive_cleanup(struct ct_archive_state *cas)
 
 static void
 ct_sched_backup_file(struct ct_archive_state *cas, struct stat *sb,
-    char *filename, int forcedir, int closedir, struct flist_head *flist,
-    struct fl_tree *ino_tree, struct ct_statistics *ct_stats)
+    char *filename, int forcedir, int closedir, int clean, struct ct_scan *cs,
+    struct ct_statistics *ct_stats)
 {
 	struct flist		*flnode;
 	struct flist		*flnode_exists;
@@ -675,8 +1036,18 @@ ct_sched_backup_file(struct ct_archive_state *cas, struct stat *sb,
 		flnode->fl_flags |= C_FF_FORCEDIR;
 
 	flnode->fl_hlnode = NULL;
-	/* deal with hardlink */
-	flnode_exists = RB_INSERT(fl_tree, ino_tree, flnode);
+	/*
+	 * deal with hardlink. Walking physically only a file with more than
+	 * one link can be seen again, so only those are remembered after
+	 * they are archived; following symlinks anything can.
+	 */
+	flnode_exists = NULL;
+	if (cs->cs_follow_symlinks ||
+	    (!S_ISDIR(sb->st_mode) && sb->st_nlink > 1)) {
+		if ((flnode_exists = RB_INSERT(fl_tree, &cs->cs_ino_tree,
+		    flnode)) == NULL)
+			flnode->fl_flags |= C_FF_HLTREE;
+	}
 	if (flnode_exists != NULL) {
 		flnode->fl_hlnode = flnode_exists;
 		CNDBG(CT_LOG_CTFILE, "found %s as hardlink of %s", filename,
@@ -684,27 +1055,74 @@ ct_sched_backup_file(struct ct_archive_state *cas, struct stat *sb,
 	} else {
 		if (S_ISREG(sb->st_mode))
 			ct_stats->st_bytes_tot += sb->st_size;
+		/* a clean file is never read, so needn't be in any order */
+		if (clean && S_ISREG(sb->st_mode))
+			flnode->fl_flags |= C_FF_CLEAN;
+		else if (cs->cs_order != CT_READ_SCAN && S_ISREG(sb->st_mode))
+			ct_scan_order_key(cs, flnode, filename, sb);
 	}
 	ct_stats->st_files_scanned++;
 
 insert:
-	TAILQ_INSERT_TAIL(flist, flnode, fl_list);
+	TAILQ_INSERT_TAIL(&cs->cs_flist, flnode, fl_list);
+	cs->cs_nflist++;
 
 	return;
 }
 
+/* A file in the read-ahead window, see ct_archive_readahead(). */
+struct ct_archive_ra {
+	TAILQ_ENTRY(ct_archive_ra)	 car_entry;
+	struct fnode			*car_fnode;
+	struct ct_ra_file		*car_raf;	/* regular files only */
+	int				 car_status;	/* CT_RA_* */
+	int				 car_errno;
+	int				 car_notreg;	/* not regular at open */
+	int				 car_started;	/* file start queued */
+	int				 car_issued;	/* every chunk handed out */
+	off_t				 car_next;	/* offset of next read */
+};
+
 struct ct_archive_priv {
-	struct flist_head		 cap_flist;
+	struct ct_scan			 cap_scan;
 	struct ctfile_write_state	*cap_cws;
 	struct ct_match			*cap_include;
 	struct ct_match			*cap_exclude;
 	struct fnode			*cap_curnode;
-	struct flist			*cap_curlist;
 	int				 cap_fd;
 	int				 cap_cull_occurred;
 	int				 cap_done;
+
+	struct ct_readahead		*cap_ra;
+	TAILQ_HEAD(, ct_archive_ra)	 cap_ra_window;
+	int				 cap_ra_nwindow;
+	int				 cap_ra_maxwindow;
+	int				 cap_ra_nreads;	/* reads with the pool */
+	int				 cap_ra_speculate;
+	int				 cap_ra_eof;	/* no more fnodes */
+
+	/* chunking by content, see ct_archive_cdc() */
+	int				 cap_cdc_on;
+	struct ct_cdc			 cap_cdc;
+	uint8_t				*cap_cdc_buf;
+	size_t				 cap_cdc_bufsz;
+	size_t				 cap_cdc_start;	/* next chunk */
+	size_t				 cap_cdc_end;	/* of what was read */
+	off_t				 cap_cdc_read;	/* of the file so far */
+	int				 cap_cdc_eof;	/* nothing more to read */
+
+	/* packing small files, see ct_archive_pack() */
+	off_t				 cap_pack_max;	/* largest file packed */
+	struct ct_trans			*cap_pack;	/* chunk being filled */
+	struct fnode			**cap_pack_tail;
+	int				 cap_pack_used;
+
+	int				 cap_sparse;	/* see ct_archive_zeros() */
 };
 
+/* the content defined chunker reads this many blocks at a time */
+#define CT_CDC_BUF_BLOCKS	4
+
 int
 ct_archive_complete_special(struct ct_global_state *state,
     struct ct_trans *trans)
@@ -753,13 +1171,19 @@ int
 ct_archive_complete_write_chunk(struct ct_global_state *state,
     struct ct_trans *trans)
 {
-	state->ct_stats->st_chunks_completed++;
+	if (trans->tr_zero == 0)
+		state->ct_stats->st_chunks_completed++;
 	if (trans->tr_eof < 2) {
 		CNDBG(CT_LOG_CTFILE, "XoX sha sz %d eof %d",
 		    trans->tr_size[(int)trans->tr_dataslot],
 		    trans->tr_eof);
 
-		if (ctfile_write_file_sha(trans->tr_ctfile,
+		if (trans->tr_zero != 0) {
+			if (ctfile_write_file_zero(trans->tr_ctfile,
+			    trans->tr_zero) != 0)
+				CWARNX("failed to write zero run for %s",
+				    trans->tr_fl_node->fn_fullname);
+		} else if (ctfile_write_file_sha(trans->tr_ctfile,
 		    trans->tr_sha, trans->tr_csha, trans->tr_iv) != 0)
 			CWARNX("failed to write sha for %s",
 			    trans->tr_fl_node->fn_fullname);
@@ -782,6 +1206,40 @@ ct_archive_complete_write_chunk(struct ct_global_state *state,
 	return (0);
 }
 
+int
+ct_archive_complete_pack(struct ct_global_state *state,
+    struct ct_trans *trans)
+{
+	struct fnode	*fnode;
+
+	state->ct_stats->st_chunks_completed++;
+	for (fnode = trans->tr_pack; fnode != NULL;
+	    fnode = fnode->fn_pack_next) {
+		state->ct_print_file_start(state->ct_print_state, fnode);
+		if (ctfile_write_file_packed(trans->tr_ctfile, fnode,
+		    trans->tr_sha, trans->tr_csha, trans->tr_iv) != 0)
+			CWARNX("failed to write packed entry for %s",
+			    fnode->fn_fullname);
+		state->ct_stats->st_files_completed++;
+		state->ct_print_file_end(state->ct_print_state, fnode,
+		    state->ct_max_block_size);
+	}
+
+	return (0);
+}
+
+void
+ct_archive_cleanup_pack(struct ct_global_state *state,
+    struct ct_trans *trans)
+{
+	struct fnode	*fnode;
+
+	while ((fnode = trans->tr_pack) != NULL) {
+		trans->tr_pack = fnode->fn_pack_next;
+		ct_free_fnode(fnode);
+	}
+}
+
 int
 ct_archive_complete_done(struct ct_global_state *state,
     struct ct_trans *trans)
@@ -898,6 +1356,692 @@ ct_check_rearchive(struct ct_global_state *state, struct ct_op *op)
 	return (0);
 }
 
+/*
+ * Queue the ctfile entry for a non regular file, trans takes over our
+ * reference to fnode.
+ */
+static void
+ct_archive_special(struct ct_global_state *state, struct ct_archive_priv *cap,
+    struct fnode *fnode, struct ct_trans *trans)
+{
+	if (C_ISDIR(fnode->fn_type)) {
+		/*
+		 * we do want to skip old directories with
+		 * no (new) files in them
+		 */
+		if (!ct_archive_needs_archive(state->archive_state, fnode)) {
+			CNDBG(CT_LOG_FILE, "skipping dir based on mtime %s",
+			    fnode->fn_fullname);
+			ct_free_fnode(fnode);
+			ct_trans_free(state, trans);
+			return;
+		}
+	}
+	trans->tr_ctfile = cap->cap_cws;
+	trans->tr_fl_node = fnode;
+	fnode->fn_state = CT_FILE_FINISHED;
+	fnode->fn_size = 0;
+	trans->tr_state = TR_S_SPECIAL;
+	trans->tr_type = TR_T_SPECIAL;
+	trans->tr_complete = ct_archive_complete_special;
+	trans->tr_cleanup = ct_archive_cleanup_fnode;
+	trans->tr_eof = 0;
+	/* we give our reference to the transaction */
+	ct_queue_first(state, trans);
+}
+
+/* Fill in fnode from the stat of the open file and see if we can skip it. */
+static void
+ct_archive_stat_fnode(struct ct_global_state *state, struct fnode *fnode,
+    struct stat *sb)
+{
+	fnode->fn_dev = sb->st_dev;
+	fnode->fn_rdev = sb->st_rdev;
+	fnode->fn_ino = sb->st_ino;
+	fnode->fn_uid = sb->st_uid;
+	fnode->fn_gid = sb->st_gid;
+	fnode->fn_mode = sb->st_mode;
+	fnode->fn_nlink = sb->st_nlink;
+	fnode->fn_atime = sb->st_atime;
+	fnode->fn_mtime = sb->st_mtime;
+	fnode->fn_ctime = sb->st_ctime;
+	fnode->fn_size = sb->st_size;
+
+	if (!ct_archive_needs_archive(state->archive_state, fnode)) {
+		fnode->fn_skip_file = 1;
+		state->ct_stats->st_bytes_skipped += fnode->fn_size;
+	}
+}
+
+/*
+ * Set trans up as the file start of fnode. Returns 1 if there is nothing
+ * to read, in which case our reference to fnode has been given up.
+ */
+static int
+ct_archive_file_start(struct ct_global_state *state,
+    struct ct_archive_priv *cap, struct fnode *fnode, struct ct_trans *trans)
+{
+	trans->tr_ctfile = cap->cap_cws;
+	ct_ref_fnode(fnode);
+	trans->tr_fl_node = fnode;
+	trans->tr_cleanup = ct_archive_cleanup_fnode;
+	trans->tr_state = TR_S_FILE_START;
+	trans->tr_type = TR_T_WRITE_HEADER;
+	trans->tr_complete = ct_archive_complete_file_start;
+	if (fnode->fn_size == 0 || fnode->fn_skip_file) {
+		trans->tr_eof = 1;
+		/* give up our reference, trans took one above */
+		ct_free_fnode(fnode);
+		fnode->fn_state = CT_FILE_FINISHED;
+		return (1);
+	}
+	trans->tr_eof = 0;
+
+	return (0);
+}
+
+/* Set trans up as a chunk of rlen bytes of fnode. */
+static void
+ct_archive_chunk(struct ct_global_state *state, struct ct_archive_priv *cap,
+    struct fnode *fnode, struct ct_trans *trans, ssize_t rlen)
+{
+	if (rlen > 0)
+		state->ct_stats->st_bytes_read += rlen;
+
+	trans->tr_ctfile = cap->cap_cws;
+	ct_ref_fnode(fnode);
+	trans->tr_fl_node = fnode;
+	trans->tr_cleanup = ct_archive_cleanup_fnode;
+	trans->tr_dataslot = 0;
+	trans->tr_size[0] = rlen;
+	trans->tr_chsize = rlen;
+	trans->tr_state = TR_S_READ;
+	trans->tr_type = TR_T_WRITE_CHUNK;
+	trans->tr_complete = ct_archive_complete_write_chunk;
+	trans->tr_eof = 0;
+	trans->hdr.c_flags = C_HDR_F_ENCRYPTED;
+}
+
+/*
+ * trans is the last chunk of fnode; error is the errno of restatting the
+ * file for modifications, sb the result. Gives up our reference to fnode.
+ */
+static void
+ct_archive_chunk_eof(struct fnode *fnode, struct ct_trans *trans, int error,
+    struct stat *sb)
+{
+	trans->tr_eof = 1;
+	fnode->fn_state = CT_FILE_FINISHED;
+
+	if (error) {
+		errno = error;
+		CWARN("archive: file %s stat error", fnode->fn_fullname);
+	} else if (sb->st_size != fnode->fn_size) {
+		CWARNX("\"%s\" %s during backup", fnode->fn_fullname,
+		    (sb->st_size > fnode->fn_size) ? "grew" : "truncated");
+		trans->tr_state = TR_S_WMD_READY;
+		trans->tr_eof = 2;
+	}
+	/* give up our reference, took one for trans above */
+	ct_free_fnode(fnode);
+}
+
+/* Queue the chunk small files have been packed into, if there is one. */
+static void
+ct_archive_pack_flush(struct ct_global_state *state,
+    struct ct_archive_priv *cap)
+{
+	struct ct_trans	*trans = cap->cap_pack;
+
+	if (trans == NULL)
+		return;
+	cap->cap_pack = NULL;
+	/* every file meant for it was emptied before it was read */
+	if (cap->cap_pack_used == 0) {
+		ct_trans_free(state, trans);
+		return;
+	}
+
+	trans->tr_ctfile = cap->cap_cws;
+	trans->tr_fl_node = NULL;
+	trans->tr_cleanup = ct_archive_cleanup_pack;
+	trans->tr_dataslot = 0;
+	trans->tr_size[0] = cap->cap_pack_used;
+	trans->tr_chsize = cap->cap_pack_used;
+	trans->tr_state = TR_S_READ;
+	trans->tr_type = TR_T_WRITE_CHUNK;
+	trans->tr_complete = ct_archive_complete_pack;
+	trans->tr_eof = 0;
+	trans->hdr.c_flags = C_HDR_F_ENCRYPTED;
+	ct_queue_first(state, trans);
+	CNDBG(CT_LOG_FILE, "packed %d bytes for block %" PRIu64,
+	    cap->cap_pack_used, trans->tr_trans_id);
+}
+
+/*
+ * Read the just opened cap_curnode into the chunk being packed if it is
+ * small enough, its entry is written when the chunk completes. Returns 1
+ * if the file has to be archived on its own instead.
+ */
+static int
+ct_archive_pack(struct ct_global_state *state, struct ct_archive_priv *cap)
+{
+	struct fnode	*fnode = cap->cap_curnode;
+	struct ct_trans	*trans;
+	struct stat	 sb;
+	ssize_t		 rlen;
+
+	if (fnode->fn_skip_file || fnode->fn_size == 0 ||
+	    fnode->fn_size > cap->cap_pack_max)
+		return (1);
+
+	if (cap->cap_pack != NULL && cap->cap_pack_used + fnode->fn_size >
+	    state->ct_max_block_size)
+		ct_archive_pack_flush(state, cap);
+	if (cap->cap_pack == NULL) {
+		/* not worth waiting for */
+		if ((trans = ct_trans_alloc(state)) == NULL)
+			return (1);
+		trans->tr_statemachine = ct_state_archive;
+		cap->cap_pack = trans;
+		cap->cap_pack_tail = &trans->tr_pack;
+		cap->cap_pack_used = 0;
+	}
+	trans = cap->cap_pack;
+
+	/* let the usual path deal with errors */
+	if ((rlen = read(cap->cap_fd, trans->tr_data[0] + cap->cap_pack_used,
+	    fnode->fn_size)) == -1)
+		return (1);
+	/*
+	 * Emptied since the stat. A member of no length can't be told from
+	 * a whole chunk on extract, so leave it to be an empty file.
+	 */
+	if (rlen == 0)
+		return (1);
+	if (fstat(cap->cap_fd, &sb) != 0) {
+		CWARN("archive: file %s stat error", fnode->fn_fullname);
+	} else if (sb.st_size != fnode->fn_size || rlen != fnode->fn_size) {
+		CWARNX("\"%s\" %s during backup", fnode->fn_fullname,
+		    (sb.st_size > fnode->fn_size) ? "grew" : "truncated");
+	}
+	close(cap->cap_fd);
+	cap->cap_fd = -1;
+
+	state->ct_stats->st_bytes_read += rlen;
+	ct_digest_add(trans->tr_data[0] + cap->cap_pack_used, &fnode->fn_shactx,
+	    rlen);
+	fnode->fn_size = fnode->fn_offset = rlen;
+	fnode->fn_pack_off = cap->cap_pack_used;
+	fnode->fn_state = CT_FILE_FINISHED;
+	cap->cap_pack_used += rlen;
+
+	/* the pack takes over our reference */
+	*cap->cap_pack_tail = fnode;
+	cap->cap_pack_tail = &fnode->fn_pack_next;
+	cap->cap_curnode = NULL;
+
+	return (0);
+}
+
+/* Whether the len bytes at p are all zero, memcmp does it a vector at a time. */
+static int
+ct_iszero(const uint8_t *p, size_t len)
+{
+	return (len == 0 || (p[0] == 0 && memcmp(p, p + 1, len - 1) == 0));
+}
+
+/*
+ * Length of the run of zeros at the offset of a sparse file. Holes are
+ * skipped without reading them, blocks that are read are checked. If there
+ * is no run the block read is left in buf and its length in *rlenp, else
+ * the file is left at the end of the run.
+ */
+static off_t
+ct_archive_zeros(struct ct_archive_priv *cap, struct fnode *fnode,
+    uint8_t *buf, off_t blocksz, ssize_t *rlenp)
+{
+	off_t	start = fnode->fn_offset, end = start, rsz;
+	ssize_t	rlen = 0;
+#ifdef SEEK_DATA
+	off_t	data;
+#endif
+
+	while (end < fnode->fn_size) {
+#ifdef SEEK_DATA
+		/* leaves the file at data, errors just mean read it */
+		data = lseek(cap->cap_fd, end, SEEK_DATA);
+		if (data == -1 && errno == ENXIO)
+			data = fnode->fn_size;
+		if (data > end) {
+			end = data < fnode->fn_size ? data : fnode->fn_size;
+			continue;
+		}
+#endif
+		rsz = fnode->fn_size - end;
+		if (rsz > blocksz)
+			rsz = blocksz;
+		rlen = read(cap->cap_fd, buf, rsz);
+		if (rlen != rsz || !ct_iszero(buf, rlen))
+			break;
+		end += rlen;
+		rlen = 0;
+	}
+
+	/* the block after the run is read again as a chunk of its own */
+	if (end != start && rlen != 0 &&
+	    lseek(cap->cap_fd, end, SEEK_SET) == -1)
+		CWARN("archive: can't seek in %s", fnode->fn_fullname);
+	*rlenp = rlen;
+
+	return (end - start);
+}
+
+/* Queue trans as a run of len zeros of the current file. */
+static void
+ct_archive_zero_run(struct ct_global_state *state,
+    struct ct_archive_priv *cap, struct ct_trans *trans, off_t len)
+{
+	struct fnode	*fnode = cap->cap_curnode;
+	struct stat	 sb;
+	int		 error;
+
+	ct_archive_chunk(state, cap, fnode, trans, 0);
+	trans->tr_zero = len;
+	trans->tr_state = TR_S_WMD_READY;
+	if (fnode->fn_offset + len == fnode->fn_size) {
+		error = fstat(cap->cap_fd, &sb) != 0 ? errno : 0;
+		close(cap->cap_fd);
+		cap->cap_fd = -1;
+		ct_archive_chunk_eof(fnode, trans, error, &sb);
+		cap->cap_curnode = NULL;
+	} else {
+		fnode->fn_offset += len;
+	}
+	ct_queue_first(state, trans);
+}
+
+/* Drop car from the read-ahead window along with anything it still holds. */
+static void
+ct_archive_ra_drop(struct ct_global_state *state, struct ct_archive_priv *cap,
+    struct ct_archive_ra *car)
+{
+	struct ct_ra_reads	 reads;
+	struct ct_trans		*trans;
+
+	TAILQ_INIT(&reads);
+	if (car->car_raf != NULL)
+		ct_readahead_close(cap->cap_ra, car->car_raf, &reads);
+	while ((trans = TAILQ_FIRST(&reads)) != NULL) {
+		TAILQ_REMOVE(&reads, trans, tr_next);
+		ct_trans_free(state, trans);
+		cap->cap_ra_nreads--;
+	}
+	if (car->car_fnode != NULL)
+		ct_free_fnode(car->car_fnode);
+	TAILQ_REMOVE(&cap->cap_ra_window, car, car_entry);
+	cap->cap_ra_nwindow--;
+	e_free(&car);
+}
+
+/* Free the reads of dropped files the readers were still busy with. */
+static void
+ct_archive_ra_reap(struct ct_global_state *state, struct ct_archive_priv *cap,
+    int shutdown)
+{
+	struct ct_ra_reads	 reads;
+	struct ct_trans		*trans;
+
+	TAILQ_INIT(&reads);
+	if (shutdown) {
+		ct_readahead_cleanup(cap->cap_ra, &reads);
+		cap->cap_ra = NULL;
+	} else {
+		(void)ct_readahead_reap(cap->cap_ra, &reads);
+	}
+	while ((trans = TAILQ_FIRST(&reads)) != NULL) {
+		TAILQ_REMOVE(&reads, trans, tr_next);
+		ct_trans_free(state, trans);
+		cap->cap_ra_nreads--;
+	}
+}
+
+static void
+ct_archive_ra_cleanup(struct ct_global_state *state,
+    struct ct_archive_priv *cap)
+{
+	struct ct_archive_ra	*car;
+
+	while ((car = TAILQ_FIRST(&cap->cap_ra_window)) != NULL)
+		ct_archive_ra_drop(state, cap, car);
+	ct_archive_ra_reap(state, cap, 1);
+}
+
+/* Top the window up with the next files, starting the regular ones. */
+static void
+ct_archive_ra_fill(struct ct_global_state *state, struct ct_archive_priv *cap,
+    struct ct_archive_args *caa)
+{
+	struct ct_archive_ra	*car;
+	struct fnode		*fnode;
+	char			*path;
+	int			 dfd, flags;
+#ifdef CT_NO_OPENAT
+	char			 pathbuf[PATH_MAX];
+#endif
+
+	while (!cap->cap_ra_eof && cap->cap_ra_nwindow < cap->cap_ra_maxwindow) {
+		/* ct_archive() already fetched the first one */
+		if ((fnode = cap->cap_curnode) != NULL) {
+			cap->cap_curnode = NULL;
+		} else if ((fnode = ct_get_next_fnode(state, &cap->cap_scan,
+		    cap->cap_include, cap->cap_exclude,
+		    caa->caa_follow_symlinks)) == NULL) {
+			CNDBG(CT_LOG_FILE, "no more files");
+			cap->cap_ra_eof = 1;
+			break;
+		}
+
+		car = e_calloc(1, sizeof(*car));
+		car->car_fnode = fnode;
+		car->car_status = CT_RA_PENDING;
+		TAILQ_INSERT_TAIL(&cap->cap_ra_window, car, car_entry);
+		cap->cap_ra_nwindow++;
+		if (!C_ISREG(fnode->fn_type))
+			continue;
+		/* the journal says it is as it was, nothing to open */
+		if (fnode->fn_skip_file) {
+			state->ct_stats->st_bytes_skipped += fnode->fn_size;
+			car->car_status = CT_RA_OPEN;
+			car->car_issued = 1;
+			continue;
+		}
+
+		/* as ct_open(), but the directory may be closed by then */
+		flags = O_RDONLY | (caa->caa_follow_symlinks ? 0 : O_NOFOLLOW);
+#ifdef CT_NO_OPENAT
+		if (ct_absolute_path(fnode->fn_fullname)) {
+			strlcpy(pathbuf, fnode->fn_fullname, sizeof(pathbuf));
+		} else {
+			snprintf(pathbuf, sizeof(pathbuf), "%s%c%s",
+			    ct_archive_get_rootdir(state->archive_state)->d_name,
+			    CT_PATHSEP, fnode->fn_fullname);
+		}
+		dfd = -1;
+		path = pathbuf;
+#else
+		dfd = dup(fnode->fn_parent_dir->d_fd);
+		path = fnode->fn_name;
+#endif
+		fnode->fn_state = CT_FILE_PROCESSING;
+		car->car_raf = ct_readahead_open(cap->cap_ra, dfd, path,
+		    flags);
+	}
+}
+
+/* Pick up the result of opening car if it is in. */
+static int
+ct_archive_ra_poll(struct ct_global_state *state, struct ct_archive_priv *cap,
+    struct ct_archive_ra *car)
+{
+	struct stat	sb;
+
+	if (car->car_status != CT_RA_PENDING)
+		return (car->car_status);
+
+	car->car_status = ct_readahead_status(cap->cap_ra, car->car_raf, &sb,
+	    &car->car_errno);
+	if (car->car_status == CT_RA_OPEN) {
+		/*
+		 * Now we have actually statted the file atomically
+		 * confirm the permissions bits that we got with the last
+		 * stat.
+		 */
+		if (!S_ISREG(sb.st_mode))
+			car->car_notreg = 1;
+		else
+			ct_archive_stat_fnode(state, car->car_fnode, &sb);
+	}
+
+	return (car->car_status);
+}
+
+/*
+ * Hand out transactions to read the files in the window into. Files that
+ * haven't been queued yet only get a share of the transactions so that
+ * there are always some left to queue the one at the head. Before a file
+ * is open we don't know its size yet, but unless this is an incremental,
+ * where it may well be skipped, its first chunk is worth reading anyway.
+ */
+static void
+ct_archive_ra_issue(struct ct_global_state *state,
+    struct ct_archive_priv *cap)
+{
+	struct ct_archive_ra	*car;
+	struct ct_trans		*trans;
+	off_t			 end;
+	int			 share, status;
+
+	share = state->ct_max_trans / 2;
+	if (share < 1)
+		share = 1;
+
+	TAILQ_FOREACH(car, &cap->cap_ra_window, car_entry) {
+		if (car->car_raf == NULL || car->car_issued)
+			continue;
+		if (!car->car_started && cap->cap_ra_nreads >= share)
+			break;
+
+		status = ct_archive_ra_poll(state, cap, car);
+		if (status == CT_RA_PENDING) {
+			if (!cap->cap_ra_speculate || car->car_next != 0)
+				continue;
+			end = state->ct_max_block_size;
+		} else if (status != CT_RA_OPEN || car->car_notreg ||
+		    car->car_fnode->fn_skip_file) {
+			car->car_issued = 1;
+			continue;
+		} else {
+			end = car->car_fnode->fn_size;
+		}
+
+		while (car->car_next < end &&
+		    (car->car_started || cap->cap_ra_nreads < share)) {
+			if ((trans = ct_trans_alloc(state)) == NULL) {
+				CNDBG(CT_LOG_TRANS, "ran out of transactions, "
+				    "waiting");
+				ct_set_file_state(state, CT_S_WAITING_TRANS);
+				return;
+			}
+			trans->tr_statemachine = ct_state_archive;
+			ct_readahead_read(cap->cap_ra, car->car_raf, trans,
+			    car->car_next);
+			car->car_next += state->ct_max_block_size;
+			cap->cap_ra_nreads++;
+		}
+		if (status == CT_RA_OPEN && car->car_next >= end)
+			car->car_issued = 1;
+	}
+}
+
+/* A local transaction for a file start or special file. */
+static struct ct_trans *
+ct_archive_ra_trans(struct ct_global_state *state)
+{
+	struct ct_trans	*trans;
+
+	if ((trans = ct_trans_alloc(state)) == NULL) {
+		CNDBG(CT_LOG_TRANS, "ran out of transactions, waiting");
+		ct_set_file_state(state, CT_S_WAITING_TRANS);
+		return (NULL);
+	}
+	trans->tr_statemachine = ct_state_archive;
+
+	return (ct_trans_realloc_local(state, trans));
+}
+
+/*
+ * ct_archive() when reading ahead. The window holds the next files in
+ * archive order; the pool opens and reads them while we queue whatever is
+ * ready at the head, so the ctfile sees exactly what it would have without
+ * read-ahead. Returns 1 once everything has been queued.
+ */
+static int
+ct_archive_readahead(struct ct_global_state *state,
+    struct ct_archive_priv *cap, struct ct_archive_args *caa)
+{
+	struct ct_archive_ra	*car;
+	struct ct_trans		*trans;
+	struct fnode		*fnode;
+	struct stat		 sb;
+	ssize_t			 rlen;
+	int			 final, error;
+
+	ct_archive_ra_reap(state, cap, 0);
+	for (;;) {
+		ct_archive_ra_fill(state, cap, caa);
+		ct_archive_ra_issue(state, cap);
+		ct_readahead_flush(cap->cap_ra);
+		if ((car = TAILQ_FIRST(&cap->cap_ra_window)) == NULL)
+			return (1);
+		fnode = car->car_fnode;
+
+		if (!C_ISREG(fnode->fn_type)) {
+			if ((trans = ct_archive_ra_trans(state)) == NULL)
+				return (0);
+			car->car_fnode = NULL;
+			ct_archive_ra_drop(state, cap, car);
+			ct_archive_special(state, cap, fnode, trans);
+			continue;
+		}
+
+		if (car->car_started == 0) {
+			switch (ct_archive_ra_poll(state, cap, car)) {
+			case CT_RA_PENDING:
+				return (0);
+			case CT_RA_EOPEN:
+				errno = car->car_errno;
+				CWARN("archive: unable to open file '%s'",
+				    fnode->fn_fullname);
+				ct_archive_ra_drop(state, cap, car);
+				continue;
+			case CT_RA_ESTAT:
+				errno = car->car_errno;
+				CWARN("archive: file %s stat error",
+				    fnode->fn_fullname);
+				ct_archive_ra_drop(state, cap, car);
+				continue;
+			}
+			if (car->car_notreg) {
+				CWARNX("%s is no longer a regular file, "
+				    "skipping", fnode->fn_fullname);
+				ct_archive_ra_drop(state, cap, car);
+				continue;
+			}
+
+			if ((trans = ct_archive_ra_trans(state)) == NULL)
+				return (0);
+			if (ct_archive_file_start(state, cap, fnode, trans)) {
+				/* file start gave up our reference */
+				car->car_fnode = NULL;
+				ct_archive_ra_drop(state, cap, car);
+			} else {
+				car->car_started = 1;
+			}
+			ct_queue_first(state, trans);
+			continue;
+		}
+
+		if ((trans = ct_readahead_next(cap->cap_ra, car->car_raf,
+		    &final, &sb, &error)) == NULL)
+			return (0);
+		cap->cap_ra_nreads--;
+
+		rlen = trans->tr_size[0];
+		ct_archive_chunk(state, cap, fnode, trans, rlen);
+		if (final) {
+			ct_archive_chunk_eof(fnode, trans, error, &sb);
+			car->car_fnode = NULL;
+			ct_archive_ra_drop(state, cap, car);
+		} else {
+			fnode->fn_offset += rlen;
+		}
+		ct_queue_first(state, trans);
+		CNDBG(CT_LOG_FILE, "read %ld for block %" PRIu64 " eof %d",
+		    (long)rlen, trans->tr_trans_id, trans->tr_eof);
+	}
+}
+
+/*
+ * Chunk the current file by content. The file is read a few blocks at a
+ * time into cap_cdc_buf and each chunk is copied out of it into trans, so
+ * chunks can end anywhere without reading anything twice.
+ */
+static void
+ct_archive_cdc(struct ct_global_state *state, struct ct_archive_priv *cap,
+    struct ct_trans *trans)
+{
+	struct fnode	*fnode = cap->cap_curnode;
+	struct stat	 sb;
+	ssize_t		 rlen = 0, clen;
+	off_t		 rsz;
+	size_t		 avail;
+	int		 error;
+
+	avail = cap->cap_cdc_end - cap->cap_cdc_start;
+	if (!cap->cap_cdc_eof && avail < cap->cap_cdc.cdc_max) {
+		memmove(cap->cap_cdc_buf, cap->cap_cdc_buf +
+		    cap->cap_cdc_start, avail);
+		cap->cap_cdc_start = 0;
+		cap->cap_cdc_end = avail;
+
+		rsz = fnode->fn_size - cap->cap_cdc_read;
+		if (rsz > cap->cap_cdc_bufsz - avail)
+			rsz = cap->cap_cdc_bufsz - avail;
+		if (rsz > 0)
+			rlen = read(cap->cap_fd, cap->cap_cdc_buf + avail, rsz);
+		if (rlen > 0) {
+			cap->cap_cdc_end += rlen;
+			cap->cap_cdc_read += rlen;
+		}
+		/* short read, file truncated, or end of file */
+		if (rsz != rlen || rlen == 0 ||
+		    cap->cap_cdc_read == fnode->fn_size)
+			cap->cap_cdc_eof = 1;
+		avail = cap->cap_cdc_end - cap->cap_cdc_start;
+	}
+
+	if (rlen == -1)
+		clen = -1;
+	else if (cap->cap_cdc_eof && avail <= cap->cap_cdc.cdc_max)
+		clen = avail;
+	else
+		clen = ct_cdc_cut(&cap->cap_cdc, cap->cap_cdc_buf +
+		    cap->cap_cdc_start, avail);
+	if (clen > 0) {
+		memcpy(trans->tr_data[0], cap->cap_cdc_buf +
+		    cap->cap_cdc_start, clen);
+		cap->cap_cdc_start += clen;
+	}
+
+	ct_archive_chunk(state, cap, fnode, trans, clen);
+	if (clen == -1 || (cap->cap_cdc_eof &&
+	    cap->cap_cdc_start == cap->cap_cdc_end)) {
+		/* restat file for modifications */
+		error = fstat(cap->cap_fd, &sb) != 0 ? errno : 0;
+
+		close(cap->cap_fd);
+		cap->cap_fd = -1;
+		ct_archive_chunk_eof(fnode, trans, error, &sb);
+		cap->cap_curnode = NULL;
+	} else {
+		fnode->fn_offset += clen;
+	}
+	ct_queue_first(state, trans);
+	CNDBG(CT_LOG_FILE, "cut %ld for block %" PRIu64 " eof %d",
+	    (long)clen, trans->tr_trans_id, trans->tr_eof);
+}
+
 void
 ct_archive(struct ct_global_state *state, struct ct_op *op)
 {
@@ -905,7 +2049,7 @@ ct_archive(struct ct_global_state *state, struct ct_op *op)
 	const char		*ctfile = caa->caa_local_ctfile;
 	char			**filelist = caa->caa_filelist;
 	ssize_t			rlen;
-	off_t			rsz;
+	off_t			rsz, zlen;
 	struct stat		sb;
 	struct ct_trans		*ct_trans;
 	struct ct_archive_priv	*cap = op->op_priv;
@@ -1006,7 +2150,8 @@ ct_archive(struct ct_global_state *state, struct ct_op *op)
 
 		cap = e_calloc(1, sizeof(*cap));
 		cap->cap_fd = -1;
-		TAILQ_INIT(&cap->cap_flist);
+		TAILQ_INIT(&cap->cap_scan.cs_flist);
+		RB_INIT(&cap->cap_scan.cs_ino_tree);
 		op->op_priv = cap;
 		if (caa->caa_includelist) {
 			if ((error = ct_match_compile(&cap->cap_include,
@@ -1048,17 +2193,29 @@ ct_archive(struct ct_global_state *state, struct ct_op *op)
 				e_free(&caa->caa_basis);
 		}
 
+		/* the journal has absolute paths and doesn't follow links */
+		if (state->ct_config->ct_change_journal != NULL &&
+		    caa->caa_tdir == NULL && !caa->caa_follow_symlinks)
+			ct_archive_open_journal(state->archive_state,
+			    state->ct_config->ct_change_journal, filelist, cwd);
+
 		if (caa->caa_tdir && chdir(caa->caa_tdir) != 0) {
 			ct_fatal(state, "can't chdir to tmpdir",
 			    CTE_ERRNO);
 			goto dying;
 		}
 		state->ct_print_traverse_start(state->ct_print_state, filelist);
-		/* ct_traverse does ct_fatal for us if it fails */
-		if (ct_traverse(state, state->archive_state, filelist,
-		    &cap->cap_flist, caa->caa_no_cross_mounts,
-		    caa->caa_follow_root_symlink, caa->caa_follow_symlinks,
-		    state->ct_stats) != 0)
+		/*
+		 * The scan carries on as files are archived, except with a
+		 * tmpdir whose relative paths only hold until we chdir back.
+		 * ct_traverse does ct_fatal for us if it fails.
+		 */
+		if (ct_traverse(state, &cap->cap_scan, filelist,
+		    caa->caa_tdir ? 0 : CT_SCAN_WINDOW,
+		    caa->caa_no_cross_mounts, caa->caa_follow_root_symlink,
+		    caa->caa_follow_symlinks) != 0 ||
+		    ct_traverse_fill(state, state->archive_state,
+		    &cap->cap_scan, state->ct_stats) != 0)
 			goto dying;
 		state->ct_print_traverse_end(state->ct_print_state, filelist);
 		if (caa->caa_tdir && chdir(cwd) != 0) {
@@ -1072,10 +2229,9 @@ ct_archive(struct ct_global_state *state, struct ct_op *op)
 		 * Do this before we open the ctfile for writing so
 		 * if all are excluded we don't then have to unlink it.
 		 */
-		cap->cap_curlist = NULL;
-		if ((cap->cap_curnode = ct_get_next_fnode(state->archive_state,
-		    &cap->cap_flist, &cap->cap_curlist, cap->cap_include,
-		    cap->cap_exclude, caa->caa_follow_symlinks)) == NULL) {
+		if ((cap->cap_curnode = ct_get_next_fnode(state, &cap->cap_scan,
+		    cap->cap_include, cap->cap_exclude,
+		    caa->caa_follow_symlinks)) == NULL) {
 			ct_fatal(state, NULL, CTE_ALL_FILES_EXCLUDED);
 			goto dying;
 		}
@@ -1085,7 +2241,12 @@ ct_archive(struct ct_global_state *state, struct ct_op *op)
 		if ((error = ctfile_write_init(&cap->cap_cws, ctfile,
 		    caa->caa_ctfile_basedir, CT_MD_REGULAR, caa->caa_basis,
 		    ct_archive_get_level(state->archive_state), cwd, filelist,
-		    1, state->ct_max_block_size, caa->caa_strip_slash)) != 0) {
+		    1, state->ct_max_block_size, caa->caa_strip_slash,
+		    state->ct_config->ct_chunking == CT_CHUNK_CDC,
+		    state->ct_config->ct_pack_threshold != 0,
+		    state->ct_config->ct_sparse_files &&
+		    state->ct_config->ct_chunking != CT_CHUNK_CDC,
+		    state->ct_config->ct_digest)) != 0) {
 			/* XXX put name in string */
 			ct_fatal(state, "can't create ctfile %s", error);
 			goto dying;
@@ -1093,6 +2254,42 @@ ct_archive(struct ct_global_state *state, struct ct_op *op)
 
 		if (caa->caa_basis != NULL)
 			e_free(&caa->caa_basis);
+		if (state->archive_state->cas_journal != NULL)
+			ctfile_write_set_journal(cap->cap_cws, ct_journal_session(
+			    state->archive_state->cas_journal), ct_journal_end(
+			    state->archive_state->cas_journal));
+
+		if (state->ct_config->ct_chunking == CT_CHUNK_CDC) {
+			cap->cap_cdc_on = 1;
+			ct_cdc_init(&cap->cap_cdc, state->ct_max_block_size);
+			cap->cap_cdc_bufsz = CT_CDC_BUF_BLOCKS *
+			    state->ct_max_block_size;
+			cap->cap_cdc_buf = e_malloc(cap->cap_cdc_bufsz);
+		}
+		/* a file the size of a block gains nothing from packing */
+		cap->cap_pack_max = state->ct_config->ct_pack_threshold;
+		if (cap->cap_pack_max >= state->ct_max_block_size)
+			cap->cap_pack_max = state->ct_max_block_size - 1;
+
+		/* zero runs stand in for fixed size blocks only */
+		cap->cap_sparse = state->ct_config->ct_sparse_files &&
+		    !cap->cap_cdc_on;
+
+		TAILQ_INIT(&cap->cap_ra_window);
+		/* the chunker, packer and sparse reads do it themselves */
+		if (!cap->cap_cdc_on && cap->cap_pack_max == 0 &&
+		    !cap->cap_sparse &&
+		    (state->ct_config->ct_readahead_threads > 0 ||
+		    state->ct_config->ct_io_uring) &&
+		    (cap->cap_ra = ct_readahead_init(state->event_state,
+		    state->ct_config->ct_readahead_threads,
+		    state->ct_max_block_size,
+		    state->ct_config->ct_io_uring)) != NULL) {
+			cap->cap_ra_maxwindow =
+			    ct_readahead_window(cap->cap_ra);
+			cap->cap_ra_speculate =
+			    ct_archive_get_level(state->archive_state) == 0;
+		}
 		break;
 	case CT_S_FINISHED:
 		return;
@@ -1103,6 +2300,13 @@ ct_archive(struct ct_global_state *state, struct ct_op *op)
 
 	if (cap->cap_done)
 		goto done;
+	if (cap->cap_ra != NULL) {
+		if (ct_archive_readahead(state, cap, caa) == 0)
+			return;
+		ct_archive_ra_cleanup(state, cap);
+		cap->cap_done = 1;
+		goto done;
+	}
 	if (cap->cap_curnode == NULL)
 		goto next_file;
 loop:
@@ -1115,6 +2319,8 @@ loop:
 	if (ct_trans == NULL) {
 		/* system busy, return */
 		CNDBG(CT_LOG_TRANS, "ran out of transactions, waiting");
+		/* the pack may be holding the last one */
+		ct_archive_pack_flush(state, cap);
 		ct_set_file_state(state, CT_S_WAITING_TRANS);
 		return;
 	}
@@ -1129,34 +2335,11 @@ loop:
 
 	/* handle special files */
 	if (!C_ISREG(cap->cap_curnode->fn_type)) {
-		if (C_ISDIR(cap->cap_curnode->fn_type)) {
-			/*
-			 * we do want to skip old directories with
-			 * no (new) files in them
-			 */
-			if (!ct_archive_needs_archive(state->archive_state,
-			    cap->cap_curnode)) {
-				CNDBG(CT_LOG_FILE, "skipping dir"
-				    " based on mtime %s",
-				    cap->cap_curnode->fn_fullname);
-				ct_free_fnode(cap->cap_curnode);
-				ct_trans_free(state, ct_trans);
-				cap->cap_curnode = NULL;
-				goto skip;
-			}
-		}
-		ct_trans->tr_ctfile = cap->cap_cws;
-		ct_trans->tr_fl_node = cap->cap_curnode;
-		cap->cap_curnode->fn_state = CT_FILE_FINISHED;
-		cap->cap_curnode->fn_size = 0;
-		ct_trans->tr_state = TR_S_SPECIAL;
-		ct_trans->tr_type = TR_T_SPECIAL;
-		ct_trans->tr_complete = ct_archive_complete_special;
-		ct_trans->tr_cleanup = ct_archive_cleanup_fnode;
+		/* the file linked to must come first in the ctfile */
+		if (cap->cap_curnode->fn_hardlink)
+			ct_archive_pack_flush(state, cap);
+		ct_archive_special(state, cap, cap->cap_curnode, ct_trans);
 		cap->cap_curnode = NULL;
-		ct_trans->tr_eof = 0;
-		/* we give our reference to the transaction */
-		ct_queue_first(state, ct_trans);
 		goto next_file;
 	}
 
@@ -1170,6 +2353,18 @@ loop:
 			    (int64_t) cap->cap_curnode->fn_offset);
 		}
 
+		/* the journal says it is as it was, nothing to open */
+		if (cap->cap_curnode->fn_skip_file) {
+			state->ct_stats->st_bytes_skipped +=
+			    cap->cap_curnode->fn_size;
+			/* gives up our reference */
+			ct_archive_file_start(state, cap, cap->cap_curnode,
+			    ct_trans);
+			cap->cap_curnode = NULL;
+			ct_queue_first(state, ct_trans);
+			goto next_file;
+		}
+
 		if ((cap->cap_fd = ct_open(state->archive_state,
 		    cap->cap_curnode, O_RDONLY,
 		    caa->caa_follow_symlinks)) == -1) {
@@ -1206,42 +2401,22 @@ loop:
 			cap->cap_curnode = NULL;
 			goto skip;
 		}
-		cap->cap_curnode->fn_dev = sb.st_dev;
-		cap->cap_curnode->fn_rdev = sb.st_rdev;
-		cap->cap_curnode->fn_ino = sb.st_ino;
-		cap->cap_curnode->fn_uid = sb.st_uid;
-		cap->cap_curnode->fn_gid = sb.st_gid;
-		cap->cap_curnode->fn_mode = sb.st_mode;
-		cap->cap_curnode->fn_atime = sb.st_atime;
-		cap->cap_curnode->fn_mtime = sb.st_mtime;
-		cap->cap_curnode->fn_size = sb.st_size;
-
-		/* Now we have filled in fnode, see if we can skip it */
-		if (!ct_archive_needs_archive(state->archive_state,
-		    cap->cap_curnode)) {
-			cap->cap_curnode->fn_skip_file = 1;
-			state->ct_stats->st_bytes_skipped +=
-			    cap->cap_curnode->fn_size;
+		ct_archive_stat_fnode(state, cap->cap_curnode, &sb);
+		cap->cap_cdc_start = cap->cap_cdc_end = 0;
+		cap->cap_cdc_read = 0;
+		cap->cap_cdc_eof = 0;
+		if (ct_archive_pack(state, cap) == 0) {
+			ct_trans_free(state, ct_trans);
+			goto next_file;
 		}
-
-		ct_trans->tr_ctfile = cap->cap_cws;
-		ct_ref_fnode(cap->cap_curnode);
-		ct_trans->tr_fl_node = cap->cap_curnode;
-		ct_trans->tr_cleanup = ct_archive_cleanup_fnode;
-		ct_trans->tr_state = TR_S_FILE_START;
-		ct_trans->tr_type = TR_T_WRITE_HEADER;
-		ct_trans->tr_complete = ct_archive_complete_file_start;
-		if (cap->cap_curnode->fn_size == 0 ||
-		    cap->cap_curnode->fn_skip_file) {
+		/* a smaller file can't have a whole block of zeros */
+		cap->cap_curnode->fn_sparse = cap->cap_sparse &&
+		    cap->cap_curnode->fn_size >= state->ct_max_block_size;
+		if (ct_archive_file_start(state, cap, cap->cap_curnode,
+		    ct_trans)) {
 			close(cap->cap_fd);
 			cap->cap_fd = -1;
-			ct_trans->tr_eof = 1;
-			/* give up our reference, trans took one above */
-			ct_free_fnode(cap->cap_curnode);
-			cap->cap_curnode->fn_state = CT_FILE_FINISHED;
 			cap->cap_curnode = NULL;
-		} else {
-			ct_trans->tr_eof = 0;
 		}
 
 		ct_queue_first(state, ct_trans);
@@ -1258,6 +2433,11 @@ loop:
 		}
 	}
 
+	if (cap->cap_cdc_on) {
+		ct_archive_cdc(state, cap, ct_trans);
+		goto next_file;
+	}
+
 	/* perform read */
 	rsz = cap->cap_curnode->fn_size - cap->cap_curnode->fn_offset;
 	CNDBG(CT_LOG_FILE, "rsz %lu max %d", (unsigned long) rsz,
@@ -1265,50 +2445,29 @@ loop:
 	if (rsz > state->ct_max_block_size) {
 		rsz = state->ct_max_block_size;
 	}
-	ct_trans->tr_dataslot = 0;
 	rlen = 0;
-	if (rsz > 0)
+	if (cap->cap_curnode->fn_sparse) {
+		if ((zlen = ct_archive_zeros(cap, cap->cap_curnode,
+		    ct_trans->tr_data[0], state->ct_max_block_size,
+		    &rlen)) != 0) {
+			ct_trans = ct_trans_realloc_local(state, ct_trans);
+			ct_archive_zero_run(state, cap, ct_trans, zlen);
+			goto next_file;
+		}
+	} else if (rsz > 0)
 		rlen = read(cap->cap_fd, ct_trans->tr_data[0], rsz);
 
-	if (rlen > 0)
-		state->ct_stats->st_bytes_read += rlen;
-
-	ct_trans->tr_ctfile = cap->cap_cws;
-	ct_ref_fnode(cap->cap_curnode);
-	ct_trans->tr_fl_node = cap->cap_curnode;
-	ct_trans->tr_cleanup = ct_archive_cleanup_fnode;
-	ct_trans->tr_size[0] = rlen;
-	ct_trans->tr_chsize = rlen;
-	ct_trans->tr_state = TR_S_READ;
-	ct_trans->tr_type = TR_T_WRITE_CHUNK;
-	ct_trans->tr_complete = ct_archive_complete_write_chunk;
-	ct_trans->tr_eof = 0;
-	ct_trans->hdr.c_flags = C_HDR_F_ENCRYPTED;
+	ct_archive_chunk(state, cap, cap->cap_curnode, ct_trans, rlen);
 	/* update offset */
 	if (rsz != rlen || rlen == 0 || ((cap->cap_curnode->fn_offset + rlen) ==
 	    cap->cap_curnode->fn_size)) {
 		/* short read, file truncated, or end of file */
 		/* restat file for modifications */
-		error = fstat(cap->cap_fd, &sb);
+		error = fstat(cap->cap_fd, &sb) != 0 ? errno : 0;
 
 		close(cap->cap_fd);
 		cap->cap_fd = -1;
-		ct_trans->tr_eof = 1;
-		cap->cap_curnode->fn_state = CT_FILE_FINISHED;
-
-		if (error) {
-			CWARN("archive: file %s stat error",
-			    cap->cap_curnode->fn_fullname);
-		} else if (sb.st_size != cap->cap_curnode->fn_size) {
-			CWARNX("\"%s\" %s during backup",
-			    cap->cap_curnode->fn_fullname,
-			    (sb.st_size > cap->cap_curnode->fn_size) ? "grew" :
-				"truncated");
-			ct_trans->tr_state = TR_S_WMD_READY;
-			ct_trans->tr_eof = 2;
-		}
-		/* give up our reference, took one for trans above */
-		ct_free_fnode(cap->cap_curnode);
+		ct_archive_chunk_eof(cap->cap_curnode, ct_trans, error, &sb);
 		cap->cap_curnode = NULL;
 	} else {
 		cap->cap_curnode->fn_offset += rlen;
@@ -1324,9 +2483,9 @@ next_file:
 	/* XXX should node be removed from list at this time? */
 	if (cap->cap_curnode == NULL) {
 skip:
-		if ((cap->cap_curnode = ct_get_next_fnode(state->archive_state,
-		    &cap->cap_flist, &cap->cap_curlist, cap->cap_include,
-		    cap->cap_exclude, caa->caa_follow_symlinks)) == NULL) {
+		if ((cap->cap_curnode = ct_get_next_fnode(state, &cap->cap_scan,
+		    cap->cap_include, cap->cap_exclude,
+		    caa->caa_follow_symlinks)) == NULL) {
 			CNDBG(CT_LOG_FILE, "no more files");
 			cap->cap_done = 1;
 		} else {
@@ -1339,8 +2498,12 @@ skip:
 		goto loop;
 
 done:
+	/* the scan failed under us, don't write out a partial ctfile */
+	if (state->ct_dying)
+		return;
 	CNDBG(CT_LOG_FILE, "last file read");
 	/* done with backup */
+	ct_archive_pack_flush(state, cap);
 
 	ct_trans = ct_trans_alloc(state);
 	if (ct_trans == NULL) {
@@ -1362,7 +2525,9 @@ done:
 		ct_match_unwind(cap->cap_include);
 	if (cap->cap_exclude)
 		ct_match_unwind(cap->cap_exclude);
-	ct_flnode_cleanup(&cap->cap_flist);
+	ct_scan_cleanup(&cap->cap_scan);
+	if (cap->cap_cdc_buf != NULL)
+		e_free(&cap->cap_cdc_buf);
 	/* cws is cleaned up by the completion handler */
 	e_free(&cap);
 	op->op_priv = NULL;
@@ -1379,10 +2544,18 @@ dying:
 			ct_match_unwind(cap->cap_include);
 		if (cap->cap_exclude)
 			ct_match_unwind(cap->cap_exclude);
-		ct_flnode_cleanup(&cap->cap_flist);
+		ct_scan_cleanup(&cap->cap_scan);
 		/* release local reference */
 		if (cap->cap_curnode)
 			ct_free_fnode(cap->cap_curnode);
+		if (cap->cap_ra != NULL)
+			ct_archive_ra_cleanup(state, cap);
+		if (cap->cap_cdc_buf != NULL)
+			e_free(&cap->cap_cdc_buf);
+		if (cap->cap_pack != NULL) {
+			ct_archive_cleanup_pack(state, cap->cap_pack);
+			ct_trans_free(state, cap->cap_pack);
+		}
 		/*
 		 * this doesn't race with completion handler because
 		 * for now they are in the same thread
@@ -1399,17 +2572,14 @@ dying:
 	}
 }
 
+/* Start scanning paths, ct_traverse_fill does the walking. */
 static int
-ct_traverse(struct ct_global_state *state, struct ct_archive_state *cas,
-    char **paths, struct flist_head *files, int no_cross_mounts,
-    int follow_root_symlink, int follow_symlinks, struct ct_statistics *ct_stats)
+ct_traverse(struct ct_global_state *state, struct ct_scan *cs, char **paths,
+    int window, int no_cross_mounts, int follow_root_symlink,
+    int follow_symlinks)
 {
-	CT_FTS			*ftsp;
-	CT_FTSENT		*fe;
-	struct fl_tree		 ino_tree;
-	int			 fts_options, cnt, forcedir, ret;
+	int			 fts_options;
 
-	RB_INIT(&ino_tree);
 	fts_options = CT_FTS_NOCHDIR;
 	if (follow_symlinks)
 		fts_options |= CT_FTS_LOGICAL;
@@ -1421,14 +2591,43 @@ ct_traverse(struct ct_global_state *state, struct ct_archive_state *cas,
 	if (no_cross_mounts)
 		fts_options |= CT_FTS_XDEV;
 	CDBG("options =  %d", fts_options);
-	ftsp = ct_fts_open(paths, fts_options, NULL);
-	if (ftsp == NULL) {
+	cs->cs_fts = ct_fts_open(paths, fts_options, NULL);
+	if (cs->cs_fts == NULL) {
 		ct_fatal(state, "ct_fts_open", CTE_ERRNO);
 		return (1);
 	}
+	/* files the journal has nothing for are taken from the basis */
+	if (state->archive_state->cas_journal_clean)
+		ct_fts_set_stat(cs->cs_fts, ct_archive_clean_stat,
+		    state->archive_state);
+	/* same order either way, this only gets the stats in early */
+	if (ct_fts_prefetch(cs->cs_fts, state->ct_config->ct_traverse_threads))
+		CWARN("can't start traverse threads, scanning inline");
+
+	cs->cs_window = window;
+	cs->cs_order = state->ct_config->ct_read_order;
+	cs->cs_follow_root_symlink = follow_root_symlink;
+	cs->cs_follow_symlinks = follow_symlinks;
+
+	return (0);
+}
 
-	cnt = 0;
-	while ((fe = ct_fts_read(ftsp)) != NULL) {
+/*
+ * Scan until there are cs_window entries waiting to be archived, or to the
+ * end if there is no window.  Calls ct_fatal and returns 1 on failure.
+ */
+static int
+ct_traverse_fill(struct ct_global_state *state, struct ct_archive_state *cas,
+    struct ct_scan *cs, struct ct_statistics *ct_stats)
+{
+	CT_FTSENT		*fe;
+	int			 forcedir, ret;
+
+	if (cs->cs_fts == NULL)
+		return (0);
+
+	while ((cs->cs_window == 0 || cs->cs_nflist < cs->cs_window) &&
+	    (fe = ct_fts_read(cs->cs_fts)) != NULL) {
 		forcedir = 0;
 		switch (fe->fts_info) {
 		case CT_FTS_D:
@@ -1436,7 +2635,7 @@ ct_traverse(struct ct_global_state *state, struct ct_archive_state *cas,
 		case CT_FTS_F:
 		case CT_FTS_SL:
 		case CT_FTS_SLNONE:
-			cnt++;
+			cs->cs_cnt++;
 			/* these are ok */
 			/* FALLTHROUGH */
 		case CT_FTS_DP: /* Setup for close dir, no stats */
@@ -1458,10 +2657,11 @@ ct_traverse(struct ct_global_state *state, struct ct_archive_state *cas,
 		/* backup dirs above fts starting point */
 		if (fe->fts_level == 0) {
 			/* XXX technically this should apply to files too */
-			if (follow_root_symlink && fe->fts_info == CT_FTS_D)
+			if (cs->cs_follow_root_symlink &&
+			    fe->fts_info == CT_FTS_D)
 				forcedir = 1;
-			if ((ret = backup_prefix(cas, fe->fts_path, files,
-			    &ino_tree, ct_stats)) != 0) {
+			if ((ret = backup_prefix(cas, fe->fts_path, cs,
+			    ct_stats)) != 0) {
 				ct_fatal(state, "backup_prefix", ret);
 				return (1);
 			}
@@ -1471,21 +2671,26 @@ ct_traverse(struct ct_global_state *state, struct ct_archive_state *cas,
 		/* backup all other files */
 sched:
 		ct_sched_backup_file(cas, fe->fts_statp, fe->fts_path,
-		    forcedir, fe->fts_info == CT_FTS_DP ? 1 : 0, files,
-		    &ino_tree, ct_stats);
+		    forcedir, fe->fts_info == CT_FTS_DP ? 1 : 0,
+		    (fe->fts_flags & CT_FTS_STATFN) != 0, cs, ct_stats);
 
 	}
+	if (cs->cs_window != 0 && cs->cs_nflist >= cs->cs_window)
+		return (0);
 
-	if (cnt == 0) {
+	/* the walk is over */
+	if (cs->cs_cnt == 0) {
 		ct_fatal(state, NULL, CTE_NO_FILES_ACCESSIBLE);
 		return (1);
 	}
 
-	if (fe == NULL && errno) {
+	if (errno) {
 		ct_fatal(state, "ct_fts_read", CTE_ERRNO);
 		return (1);
 	}
-	if (ct_fts_close(ftsp)) {
+	ret = ct_fts_close(cs->cs_fts);
+	cs->cs_fts = NULL;
+	if (ret) {
 		ct_fatal(state, "ct_fts_close", CTE_ERRNO);
 		return (1);
 	}
@@ -1495,8 +2700,8 @@ sched:
 }
 
 static int
-backup_prefix(struct ct_archive_state *cas, char *root,
-    struct flist_head *flist, struct fl_tree *ino_tree, struct ct_statistics *ct_stats)
+backup_prefix(struct ct_archive_state *cas, char *root, struct ct_scan *cs,
+    struct ct_statistics *ct_stats)
 {
 	char			dir[PATH_MAX], rbuf[PATH_MAX], pfx[PATH_MAX];
 	char			*cp, *p;
@@ -1532,7 +2737,7 @@ backup_prefix(struct ct_archive_state *cas, char *root,
 			return (CTE_ERRNO);
 		}
 
-		ct_sched_backup_file(cas, &sb, dir, 1, 0, flist, ino_tree, ct_stats);
+		ct_sched_backup_file(cas, &sb, dir, 1, 0, 0, cs, ct_stats);
 	}
 
 	return (0);
@@ -1561,6 +2766,10 @@ s_to_e_type(int mode)
 	return (rv);
 }
 
+/* writes in flight per restored file, and how many to submit at once */
+#define CT_EXTRACT_URING_BUFS	16
+#define CT_EXTRACT_URING_BATCH	8
+
 struct ct_extract_state {
 	int			 ces_fd;
 	int			 ces_attr;
@@ -1572,6 +2781,23 @@ struct ct_extract_state {
 	struct d_name_tree	 ces_dname_head;
 	void			*ces_log_state;
 	ct_log_chown_failed_fn	*ces_log_chown_failed;
+
+	/* writes through io_uring, see ct_file_extract_uring() */
+	struct ct_uring		*ces_uring;
+	uint8_t			*ces_wbuf[CT_EXTRACT_URING_BUFS];
+	size_t			 ces_wlen[CT_EXTRACT_URING_BUFS];
+	int			 ces_wfree[CT_EXTRACT_URING_BUFS];
+	int			 ces_nwfree;
+	int			 ces_wunsent;
+	size_t			 ces_wbufsz;
+	off_t			 ces_woff;
+	int			 ces_werror;	/* first failed write */
+	off_t			 ces_hole_end;	/* if the file ends in a hole */
+
+	/* the chunk packed files are sliced out of */
+	uint8_t			*ces_pack;
+	size_t			 ces_pack_len;
+	size_t			 ces_pack_bufsz;
 };
 
 void	ct_file_extract_nextdir(struct ct_extract_state *, struct dnode *);
@@ -1673,10 +2899,119 @@ ct_file_extract_lookup_dir(struct ct_extract_state *ces, const char *path)
 	return (RB_FIND(d_name_tree, &ces->ces_dname_head, &dsearch));
 }
 
+/*
+ * Write restored files through an io_uring: data is copied into one of a
+ * few staging buffers and queued, so that the writes of a file are
+ * submitted in batches and the extract does not wait on each one. The
+ * file is closed from the ring as well. Without io_uring this is a no-op
+ * and files are written as usual.
+ */
+void
+ct_file_extract_uring(struct ct_extract_state *ces, size_t blocksz)
+{
+	int	i;
+
+	if (ces->ces_uring != NULL)
+		return;
+	if ((ces->ces_uring = ct_uring_init(2 *
+	    CT_EXTRACT_URING_BUFS)) == NULL) {
+		CNDBG(CT_LOG_FILE, "no io_uring, writing files directly");
+		return;
+	}
+	for (i = 0; i < CT_EXTRACT_URING_BUFS; i++) {
+		ces->ces_wbuf[i] = e_malloc(blocksz);
+		ces->ces_wfree[i] = i;
+	}
+	ces->ces_nwfree = CT_EXTRACT_URING_BUFS;
+	ces->ces_wbufsz = blocksz;
+}
+
+/* Submit what is queued, wait for wait completions and collect them. */
+static void
+ct_file_extract_uring_reap(struct ct_extract_state *ces, unsigned wait)
+{
+	uint64_t	data;
+	int		res, slot, error;
+
+	ces->ces_wunsent = 0;
+	if ((error = ct_uring_submit(ces->ces_uring, wait)) != 0)
+		CABORTX("io_uring submit: %s", strerror(error));
+	while (ct_uring_reap(ces->ces_uring, &data, &res)) {
+		if (data == 0)	/* close, nobody checks those */
+			continue;
+		slot = data - 1;
+		if (ces->ces_werror != 0)
+			;
+		else if (res < 0)
+			ces->ces_werror = -res;
+		else if ((size_t)res != ces->ces_wlen[slot])
+			ces->ces_werror = ENOSPC;
+		ces->ces_wfree[ces->ces_nwfree++] = slot;
+	}
+}
+
+/* Wait for every write of the current file. */
+static void
+ct_file_extract_uring_drain(struct ct_extract_state *ces)
+{
+	while (ces->ces_nwfree != CT_EXTRACT_URING_BUFS)
+		ct_file_extract_uring_reap(ces, 1);
+}
+
+static int
+ct_file_extract_uring_write(struct ct_extract_state *ces, uint8_t *buf,
+    size_t size)
+{
+	ssize_t	len;
+	int	slot;
+
+	if (size > ces->ces_wbufsz) {
+		ct_file_extract_uring_drain(ces);
+		if (ces->ces_werror == 0) {
+			len = pwrite(ces->ces_fd, buf, size, ces->ces_woff);
+			if (len == -1)
+				ces->ces_werror = errno;
+			else if ((size_t)len != size)
+				ces->ces_werror = ENOSPC;
+		}
+		ces->ces_woff += size;
+		goto out;
+	}
+
+	while (ces->ces_nwfree == 0)
+		ct_file_extract_uring_reap(ces, 1);
+	slot = ces->ces_wfree[--ces->ces_nwfree];
+	memcpy(ces->ces_wbuf[slot], buf, size);
+	ces->ces_wlen[slot] = size;
+	/* one slot per buffer plus as many again for closes */
+	while (ct_uring_pwrite(ces->ces_uring, ces->ces_fd, ces->ces_wbuf[slot],
+	    size, ces->ces_woff, slot + 1) == -1)
+		ct_file_extract_uring_reap(ces, 1);
+	ces->ces_woff += size;
+	if (++ces->ces_wunsent == CT_EXTRACT_URING_BATCH)
+		ct_file_extract_uring_reap(ces, 0);
+out:
+	if (ces->ces_werror != 0) {
+		errno = ces->ces_werror;
+		return (CTE_ERRNO);
+	}
+	return (0);
+}
+
 void
 ct_file_extract_cleanup(struct ct_extract_state *ces)
 {
 	struct dnode *dnode;
+	int	i;
+
+	if (ces->ces_uring != NULL) {
+		ct_file_extract_uring_drain(ces);
+		while (ct_uring_inflight(ces->ces_uring) != 0)
+			ct_file_extract_uring_reap(ces, 1);
+		ct_uring_cleanup(ces->ces_uring);
+		for (i = 0; i < CT_EXTRACT_URING_BUFS; i++)
+			e_free(&ces->ces_wbuf[i]);
+	}
 	/* Close all open directories, we are switching files */
 	if (ces->ces_prevdir_list != NULL) {
 		ct_file_extract_closefrom(ces, ces->ces_prevdir_list[0],
@@ -1687,6 +3022,8 @@ ct_file_extract_cleanup(struct ct_extract_state *ces)
 		RB_REMOVE(d_name_tree, &ces->ces_dname_head, dnode);
 		ct_free_dnode(dnode);
 	}
+	if (ces->ces_pack != NULL)
+		e_free(&ces->ces_pack);
 	if (ces->ces_rootdir->d_name)
 		e_free(&ces->ces_rootdir->d_name);
 #ifndef CT_NO_OPENAT
@@ -1806,6 +3143,9 @@ ct_file_extract_open(struct ct_extract_state *ces, struct fnode *fnode)
 #endif
 	if (ces->ces_fd == -1)
 		return (1);
+	ces->ces_woff = 0;
+	ces->ces_werror = 0;
+	ces->ces_hole_end = 0;
 	return (0);
 }
 
@@ -1818,6 +3158,9 @@ ct_file_extract_write(struct ct_extract_state *ces, struct fnode *fnode,
 
 	if (fnode == NULL)
 		CABORTX("file write on non open file");
+	ces->ces_hole_end = 0;
+	if (ces->ces_uring != NULL)
+		return (ct_file_extract_uring_write(ces, buf, size));
 
 	len = write(ces->ces_fd, buf, size);
 	if (len != size)
@@ -1825,6 +3168,54 @@ ct_file_extract_write(struct ct_extract_state *ces, struct fnode *fnode,
 	return (ret);
 }
 
+/*
+ * Leave a hole of size bytes. The file is new so there is nothing to punch
+ * out, it only has to be grown on close if it ends in a hole.
+ */
+int
+ct_file_extract_hole(struct ct_extract_state *ces, struct fnode *fnode,
+    off_t size)
+{
+	off_t	end;
+
+	if (fnode == NULL)
+		CABORTX("file hole on non open file");
+	if (ces->ces_uring != NULL) {
+		ces->ces_woff += size;
+		ces->ces_hole_end = ces->ces_woff;
+		return (0);
+	}
+
+	if ((end = lseek(ces->ces_fd, size, SEEK_CUR)) == -1)
+		return (CTE_ERRNO);
+	ces->ces_hole_end = end;
+	return (0);
+}
+
+/* Keep a copy of the chunk the following packed files are in. */
+void
+ct_file_extract_setpack(struct ct_extract_state *ces, uint8_t *buf,
+    size_t size)
+{
+	if (size > ces->ces_pack_bufsz) {
+		if (ces->ces_pack != NULL)
+			e_free(&ces->ces_pack);
+		ces->ces_pack = e_malloc(size);
+		ces->ces_pack_bufsz = size;
+	}
+	memcpy(ces->ces_pack, buf, size);
+	ces->ces_pack_len = size;
+}
+
+/* The size bytes at off of the kept chunk, NULL if it is too short. */
+uint8_t *
+ct_file_extract_getpack(struct ct_extract_state *ces, size_t off, size_t size)
+{
+	if (off > ces->ces_pack_len || size > ces->ces_pack_len - off)
+		return (NULL);
+	return (ces->ces_pack + off);
+}
+
 void
 ct_file_extract_close(struct ct_extract_state *ces, struct fnode *fnode)
 {
@@ -1832,6 +3223,13 @@ ct_file_extract_close(struct ct_extract_state *ces, struct fnode *fnode)
 	struct timeval           tv[2];
 	int                      safe_mode;
 
+	/* a failed write has normally been reported already */
+	if (ces->ces_uring != NULL)
+		ct_file_extract_uring_drain(ces);
+	if (ces->ces_hole_end != 0 && ces->ces_werror == 0 &&
+	    ftruncate(ces->ces_fd, ces->ces_hole_end) == -1)
+		ces->ces_werror = errno;
+
 	safe_mode = S_IRWXU | S_IRWXG | S_IRWXO;
 	if (ces->ces_attr) {
 		if (fchown(ces->ces_fd, fnode->fn_uid, fnode->fn_gid) == -1) {
@@ -1850,7 +3248,11 @@ ct_file_extract_close(struct ct_extract_state *ces, struct fnode *fnode)
 		if (futimes(ces->ces_fd, tv) == -1)
 			CWARN("utimes on %s failed", fnode->fn_fullname);
 	}
-	if (ct_rename(ces, fnode) != 0) {
+	if (ces->ces_werror != 0) {
+		errno = ces->ces_werror;
+		CWARN("write to %s failed", fnode->fn_fullname);
+		(void)ct_unlink(ces, fnode);
+	} else if (ct_rename(ces, fnode) != 0) {
 		CWARN("rename to %s failed", fnode->fn_fullname);
 		/* nuke temp file */
 		(void)ct_unlink(ces, fnode);
@@ -1868,7 +3270,13 @@ ct_file_extract_close(struct ct_extract_state *ces, struct fnode *fnode)
 		ct_free_fnode(hardlink);
 	}
 
-	close(ces->ces_fd);
+	if (ces->ces_uring != NULL) {
+		while (ct_uring_close(ces->ces_uring, ces->ces_fd, 0) == -1)
+			ct_file_extract_uring_reap(ces, 1);
+		ct_file_extract_uring_reap(ces, 0);
+	} else {
+		close(ces->ces_fd);
+	}
 	ces->ces_fd = -1;
 }
 
@@ -2687,7 +4095,8 @@ ct_populate_fnode(struct ct_extract_state *ces, struct ctfile_parse_state *ctx,
 		CNDBG(CT_LOG_CTFILE, "inserting %s as %" PRId64,
 		    dnode->d_name, dnode->d_num );
 	}
-
+	/* checked against the digest its ctfile was made with */
+	ct_digest_setup(&fnode->fn_shactx, CTFILE_DIGEST(&ctx->xs_gh));
 
 	return 0;
 }
@@ -35,6 +35,7 @@
 
 #include <sys/param.h>
 #include <sys/stat.h>
+#include <sys/queue.h>
 
 #include <dirent.h>
 #include <errno.h>
@@ -43,10 +44,14 @@
 #include <string.h>
 #include <unistd.h>
 
+#include <ct_threads.h>
+
 #include "ct_fts.h"
 
 static CT_FTSENT	*ct_fts_alloc(CT_FTS *, char *, size_t);
+static CT_FTSENT	*ct_fts_nalloc(int, char *, size_t);
 static CT_FTSENT	*ct_fts_build(CT_FTS *, int);
+static void	 	ct_fts_free(CT_FTSENT *);
 static void	 	ct_fts_lfree(CT_FTSENT *);
 static void	 	ct_fts_load(CT_FTS *, CT_FTSENT *);
 static size_t	 	ct_fts_maxarglen(char * const *);
@@ -56,6 +61,12 @@ static CT_FTSENT	*ct_fts_sort(CT_FTS *, CT_FTSENT *, int);
 static u_short	 	ct_fts_stat(CT_FTS *, CT_FTSENT *, int);
 static int	 	ct_fts_safe_changedir(CT_FTS *, CT_FTSENT *, int,
 			    char *);
+#if CT_ENABLE_PTHREADS
+static CT_FTSENT	*ct_fts_pf_read(CT_FTS *);
+static void		 ct_fts_pf_stop(struct ct_fts_pf *);
+static void		 ct_fts_pf_free(struct ct_fts_pf *);
+static void		 ct_fts_pj_drop(struct ct_fts_pj *);
+#endif
 
 #define	ISDOT(a)	(a[0] == '.' && (!a[1] || (a[1] == '.' && !a[2])))
 
@@ -215,13 +226,18 @@ ct_fts_close(CT_FTS *sp)
 	 * points to the root list, so we step through to the end of the root
 	 * list which has a valid parent pointer.
 	 */
+#if CT_ENABLE_PTHREADS
+	/* Let the prefetch threads finish, what they built is freed below. */
+	if (sp->fts_pf)
+		ct_fts_pf_stop(sp->fts_pf);
+#endif
 	if (sp->fts_cur) {
 		for (p = sp->fts_cur; p->fts_level >= CT_FTS_ROOTLEVEL;) {
 			freep = p;
 			p = p->fts_link ? p->fts_link : p->fts_parent;
-			free(freep);
+			ct_fts_free(freep);
 		}
-		free(p);
+		ct_fts_free(p);
 	}
 
 	/* Stash the original directory fd if needed. */
@@ -233,6 +249,10 @@ ct_fts_close(CT_FTS *sp)
 	if (sp->fts_array)
 		free(sp->fts_array);
 	free(sp->fts_path);
+#if CT_ENABLE_PTHREADS
+	if (sp->fts_pf)
+		ct_fts_pf_free(sp->fts_pf);
+#endif
 	free(sp);
 
 	/* Return to original directory, checking for error. */
@@ -354,7 +374,7 @@ ct_fts_read(CT_FTS *sp)
 	/* Move to the next node on this level. */
 next:	tmp = p;
 	if ((p = p->fts_link)) {
-		free(tmp);
+		ct_fts_free(tmp);
 
 		/*
 		 * If reached the top, return to the original directory (or
@@ -397,7 +417,7 @@ name:		t = sp->fts_path + NAPPEND(p->fts_parent);
 
 	/* Move up to the parent node. */
 	p = tmp->fts_parent;
-	free(tmp);
+	ct_fts_free(tmp);
 
 	if (p->fts_level == CT_FTS_ROOTPARENTLEVEL) {
 		/*
@@ -462,6 +482,23 @@ ct_fts_set(CT_FTS *sp, CT_FTSENT *p, int instr)
 	return (0);
 }
 
+/*
+ * Have fn stat regular files found while reading directories instead of
+ * lstat(2), returning 0 if it did.  It is called with the path of the
+ * file, from the prefetch threads too, so must be before ct_fts_prefetch
+ * and safe to call from any thread.  Entries stat this way are marked
+ * CT_FTS_STATFN.  Only for physical walks that don't chdir.
+ */
+void
+ct_fts_set_stat(CT_FTS *sp, int (*fn)(void *, const char *, struct stat *),
+    void *arg)
+{
+	if (ISSET(CT_FTS_LOGICAL) || !ISSET(CT_FTS_NOCHDIR))
+		return;
+	sp->fts_statfn = fn;
+	sp->fts_statarg = arg;
+}
+
 CT_FTSENT *
 ct_fts_children(CT_FTS *sp, int instr)
 {
@@ -557,6 +594,12 @@ ct_fts_build(CT_FTS *sp, int type)
 	int saved_errno;
 	char *cp = NULL;
 
+#if CT_ENABLE_PTHREADS
+	/* Prefetched, or built the same way if the threads didn't get to it. */
+	if (sp->fts_pf && type == BREAD)
+		return (ct_fts_pf_read(sp));
+#endif
+
 	/* Set current node pointer. */
 	cur = sp->fts_cur;
 
@@ -726,6 +769,14 @@ mem1:				saved_errno = errno;
 			} else
 				p->fts_accpath = p->fts_name;
 			/* Stat it. */
+#ifdef DT_REG
+			if (sp->fts_statfn != NULL && dp->d_type == DT_REG &&
+			    sp->fts_statfn(sp->fts_statarg, p->fts_accpath,
+			    p->fts_statp) == 0) {
+				p->fts_flags |= CT_FTS_STATFN;
+				p->fts_info = CT_FTS_F;
+			} else
+#endif
 			p->fts_info = ct_fts_stat(sp, p, 0);
 
 			/* Decrement link count if applicable. */
@@ -900,6 +951,18 @@ ct_fts_sort(CT_FTS *sp, CT_FTSENT *head, int nitems)
 
 static CT_FTSENT *
 ct_fts_alloc(CT_FTS *sp, char *name, size_t namelen)
+{
+	CT_FTSENT *p;
+
+	if ((p = ct_fts_nalloc(sp->fts_options, name, namelen)) == NULL)
+		return (NULL);
+	p->fts_path = sp->fts_path;
+	return (p);
+}
+
+/* Like ct_fts_alloc, but without the stream, for the prefetch threads. */
+static CT_FTSENT *
+ct_fts_nalloc(int options, char *name, size_t namelen)
 {
 	CT_FTSENT *p;
 	size_t len;
@@ -908,27 +971,37 @@ ct_fts_alloc(CT_FTS *sp, char *name, size_t namelen)
 	 * The file name is a variable length array and no stat structure is
 	 * necessary if the user has set the nostat bit.  Allocate the FTSENT
 	 * structure, the file name and the stat structure in one chunk, but
-	 * be careful that the stat structure is reasonably aligned.  Since the
-	 * fts_name field is declared to be of size 1, the fts_name pointer is
-	 * namelen + 2 before the first possible address of the stat structure.
+	 * be careful that the stat structure is reasonably aligned.  The
+	 * fts_name field is a flexible array, so the stat structure goes at
+	 * the first aligned address after the name and its NUL.
 	 */
 	len = sizeof(CT_FTSENT) + namelen + 1;
-	if (!ISSET(CT_FTS_NOSTAT))
+	if (!(options & CT_FTS_NOSTAT))
 		len += sizeof(struct stat) + ALIGNBYTES;
 	if ((p = malloc(len)) == NULL)
 		return (NULL);
 
 	memset(p, 0, len);
-	p->fts_path = sp->fts_path;
 	p->fts_namelen = namelen;
 	p->fts_instr = CT_FTS_NOINSTR;
-	if (!ISSET(CT_FTS_NOSTAT))
-		p->fts_statp = (struct stat *)ALIGN(p->fts_name + namelen + 2);
+	if (!(options & CT_FTS_NOSTAT))
+		p->fts_statp = (struct stat *)ALIGN(p->fts_name + namelen + 1);
 	memcpy(p->fts_name, name, namelen);
 
 	return (p);
 }
 
+static void
+ct_fts_free(CT_FTSENT *p)
+{
+#if CT_ENABLE_PTHREADS
+	/* A directory never descended into may still have a prefetch. */
+	if (p->fts_pj)
+		ct_fts_pj_drop(p->fts_pj);
+#endif
+	free(p);
+}
+
 static void
 ct_fts_lfree(CT_FTSENT *head)
 {
@@ -937,7 +1010,7 @@ ct_fts_lfree(CT_FTSENT *head)
 	/* Free a linked list of structures. */
 	while ((p = head)) {
 		head = head->fts_link;
-		free(p);
+		ct_fts_free(p);
 	}
 }
 
@@ -1047,3 +1120,504 @@ bail:
 	errno = oerrno;
 	return (ret);
 }
+
+/*
+ * Directory prefetch.  The walk itself stays single threaded and in the
+ * order above; a pool of threads reads and stats the directories it is
+ * about to descend into, each entry relative to its directory with
+ * fstatat(2), and ct_fts_build hands over the finished lists.  Jobs are
+ * kept on a stack with the first child on top, so the threads work through
+ * the tree in roughly the order the walk will get to it, and stop once
+ * CT_FTS_PF_MAXPENDING entries are waiting to be read.  A directory the
+ * walk gets to before the threads do is built inline, like any other.
+ *
+ * Only for walks that stat and don't chdir, which is how cyphertite walks.
+ */
+#if CT_ENABLE_PTHREADS
+
+#define CT_FTS_PF_MAXPENDING	65536	/* entries built but not yet read */
+
+#define CT_FTS_PJ_NEW		0
+#define CT_FTS_PJ_QUEUED	1
+#define CT_FTS_PJ_RUNNING	2
+#define CT_FTS_PJ_DONE		3
+
+struct ct_fts_pj {
+	TAILQ_ENTRY(ct_fts_pj)	 pj_entry;
+	struct ct_fts_pf	*pj_pf;
+	CT_FTSENT		*pj_dir;
+	char			*pj_path;
+	dev_t			 pj_dev;	/* of the root, for XDEV */
+	int			 pj_state;	/* CT_FTS_PJ_* */
+	int			 pj_cancel;
+	int			 pj_errno;	/* opening the directory */
+	int			 pj_fatal;	/* out of memory */
+	CT_FTSENT		*pj_head;
+	int			 pj_nitems;
+	size_t			 pj_maxname;
+	size_t			 pj_pending;	/* counted in pf_pending */
+};
+
+struct ct_fts_pf {
+	pthread_t		*pf_threads;
+	int			 pf_nthreads;
+	int			 pf_options;
+	int			(*pf_statfn)(void *, const char *,
+				    struct stat *);
+	void			*pf_statarg;
+	pthread_mutex_t		 pf_mtx;
+	pthread_cond_t		 pf_cv;		/* work or room for it */
+	pthread_cond_t		 pf_donecv;	/* a job finished */
+	TAILQ_HEAD(, ct_fts_pj)	 pf_stack;
+	size_t			 pf_pending;
+	int			 pf_exiting;
+};
+
+static void	*ct_fts_pf_thread(void *);
+
+static struct ct_fts_pj *
+ct_fts_pj_new(struct ct_fts_pf *pf, CT_FTSENT *dir, const char *path,
+    size_t pathlen, const char *name, dev_t dev)
+{
+	struct ct_fts_pj *pj;
+	size_t len;
+
+	if ((pj = calloc(1, sizeof(*pj))) == NULL)
+		return (NULL);
+	len = pathlen + (name ? strlen(name) + 1 : 0) + 1;
+	if ((pj->pj_path = malloc(len)) == NULL) {
+		free(pj);
+		return (NULL);
+	}
+	memcpy(pj->pj_path, path, pathlen);
+	pj->pj_path[pathlen] = '\0';
+	if (name) {
+		/* As NAPPEND, don't double a trailing slash. */
+		if (pathlen == 0 || path[pathlen - 1] != '/')
+			pj->pj_path[pathlen++] = '/';
+		memcpy(pj->pj_path + pathlen, name, strlen(name) + 1);
+	}
+	pj->pj_pf = pf;
+	pj->pj_dir = dir;
+	pj->pj_dev = dev;
+	pj->pj_state = CT_FTS_PJ_NEW;
+	dir->fts_pj = pj;
+	return (pj);
+}
+
+static void
+ct_fts_pj_free(struct ct_fts_pj *pj)
+{
+	pj->pj_dir->fts_pj = NULL;
+	free(pj->pj_path);
+	free(pj);
+}
+
+/* As ct_fts_stat, relative to the directory being read. */
+static u_short
+ct_fts_pf_stat(int options, int dfd, CT_FTSENT *p)
+{
+	CT_FTSENT *t;
+	struct stat *sbp = p->fts_statp;
+
+	if (options & CT_FTS_LOGICAL) {
+		if (fstatat(dfd, p->fts_name, sbp, 0)) {
+			p->fts_errno = errno;
+			if (!fstatat(dfd, p->fts_name, sbp,
+			    AT_SYMLINK_NOFOLLOW)) {
+				p->fts_errno = 0;
+				return (CT_FTS_SLNONE);
+			}
+			goto err;
+		}
+	} else if (fstatat(dfd, p->fts_name, sbp, AT_SYMLINK_NOFOLLOW)) {
+		p->fts_errno = errno;
+err:		memset(sbp, 0, sizeof(struct stat));
+		return (CT_FTS_NS);
+	}
+
+	if (S_ISDIR(sbp->st_mode)) {
+		p->fts_dev = sbp->st_dev;
+		p->fts_ino = sbp->st_ino;
+		p->fts_nlink = sbp->st_nlink;
+
+		if (ISDOT(p->fts_name))
+			return (CT_FTS_DOT);
+
+		/* The ancestors are not freed while we are working below. */
+		for (t = p->fts_parent;
+		    t->fts_level >= CT_FTS_ROOTLEVEL; t = t->fts_parent)
+			if (p->fts_ino == t->fts_ino &&
+			    p->fts_dev == t->fts_dev) {
+				p->fts_cycle = t;
+				return (CT_FTS_DC);
+			}
+		return (CT_FTS_D);
+	}
+	if (S_ISLNK(sbp->st_mode))
+		return (CT_FTS_SL);
+	if (S_ISREG(sbp->st_mode))
+		return (CT_FTS_F);
+	return (CT_FTS_DEFAULT);
+}
+
+/*
+ * Read one directory into pj_head, in directory order, and make (but don't
+ * queue) jobs for the directories in it.  Runs without the lock, on a
+ * prefetch thread or inline on the walk.
+ */
+static void
+ct_fts_pf_build(struct ct_fts_pf *pf, struct ct_fts_pj *pj)
+{
+	struct dirent *dp;
+	CT_FTSENT *p, *tail = NULL;
+	DIR *dirp;
+	size_t namelen, pathlen, len;
+	int dfd, level;
+	char path[PATH_MAX];
+
+	if ((dfd = open(pj->pj_path, O_RDONLY | O_DIRECTORY, 0)) < 0) {
+		pj->pj_errno = errno;
+		return;
+	}
+	if ((dirp = fdopendir(dfd)) == NULL) {
+		pj->pj_errno = errno;
+		(void)close(dfd);
+		return;
+	}
+
+	level = pj->pj_dir->fts_level;
+	if (level < CT_FTS_MAXLEVEL)
+		level++;
+	pathlen = strlen(pj->pj_path);
+
+	while ((dp = readdir(dirp)) != NULL) {
+		if (!(pf->pf_options & CT_FTS_SEEDOT) && ISDOT(dp->d_name))
+			continue;
+
+		namelen = strlen(dp->d_name);
+		if ((p = ct_fts_nalloc(pf->pf_options, dp->d_name,
+		    namelen)) == NULL)
+			goto mem;
+		p->fts_level = level;
+		p->fts_parent = pj->pj_dir;
+#ifdef DT_REG
+		if (pf->pf_statfn != NULL && dp->d_type == DT_REG &&
+		    pathlen + namelen + 1 < sizeof(path)) {
+			len = pathlen;
+			memcpy(path, pj->pj_path, len);
+			if (len == 0 || path[len - 1] != '/')
+				path[len++] = '/';
+			memcpy(path + len, dp->d_name, namelen + 1);
+			if (pf->pf_statfn(pf->pf_statarg, path,
+			    p->fts_statp) == 0) {
+				p->fts_flags |= CT_FTS_STATFN;
+				p->fts_info = CT_FTS_F;
+			} else
+				p->fts_info = ct_fts_pf_stat(pf->pf_options,
+				    dfd, p);
+		} else
+#endif
+		p->fts_info = ct_fts_pf_stat(pf->pf_options, dfd, p);
+
+		if (p->fts_info == CT_FTS_D && (!(pf->pf_options &
+		    CT_FTS_XDEV) || p->fts_dev == pj->pj_dev) &&
+		    ct_fts_pj_new(pf, p, pj->pj_path, pathlen, p->fts_name,
+		    pj->pj_dev) == NULL) {
+			free(p);
+			goto mem;
+		}
+
+		if (pj->pj_head == NULL)
+			pj->pj_head = tail = p;
+		else {
+			tail->fts_link = p;
+			tail = p;
+		}
+		if (namelen > pj->pj_maxname)
+			pj->pj_maxname = namelen;
+		pj->pj_nitems++;
+	}
+	(void)closedir(dirp);
+	return;
+
+mem:
+	pj->pj_fatal = errno;
+	ct_fts_lfree(pj->pj_head);
+	pj->pj_head = NULL;
+	pj->pj_nitems = 0;
+	(void)closedir(dirp);
+}
+
+/* Push the directories of a finished job, first one on top.  Locked. */
+static void
+ct_fts_pf_push(struct ct_fts_pf *pf, struct ct_fts_pj *pj)
+{
+	struct ct_fts_pj *prev = NULL;
+	CT_FTSENT *p;
+
+	for (p = pj->pj_head; p; p = p->fts_link) {
+		if (p->fts_pj == NULL)
+			continue;
+		if (prev == NULL)
+			TAILQ_INSERT_HEAD(&pf->pf_stack, p->fts_pj, pj_entry);
+		else
+			TAILQ_INSERT_AFTER(&pf->pf_stack, prev, p->fts_pj,
+			    pj_entry);
+		p->fts_pj->pj_state = CT_FTS_PJ_QUEUED;
+		prev = p->fts_pj;
+	}
+	if (prev)
+		pthread_cond_broadcast(&pf->pf_cv);
+}
+
+static void *
+ct_fts_pf_thread(void *arg)
+{
+	struct ct_fts_pf *pf = arg;
+	struct ct_fts_pj *pj;
+
+	pthread_mutex_lock(&pf->pf_mtx);
+	for (;;) {
+		while (!pf->pf_exiting && (TAILQ_EMPTY(&pf->pf_stack) ||
+		    pf->pf_pending >= CT_FTS_PF_MAXPENDING))
+			pthread_cond_wait(&pf->pf_cv, &pf->pf_mtx);
+		if (pf->pf_exiting)
+			break;
+		pj = TAILQ_FIRST(&pf->pf_stack);
+		TAILQ_REMOVE(&pf->pf_stack, pj, pj_entry);
+		pj->pj_state = CT_FTS_PJ_RUNNING;
+		pthread_mutex_unlock(&pf->pf_mtx);
+
+		ct_fts_pf_build(pf, pj);
+
+		pthread_mutex_lock(&pf->pf_mtx);
+		pj->pj_state = CT_FTS_PJ_DONE;
+		pj->pj_pending = pj->pj_nitems;
+		pf->pf_pending += pj->pj_pending;
+		/* The walk is skipping it and frees the lot. */
+		if (!pj->pj_cancel)
+			ct_fts_pf_push(pf, pj);
+		pthread_cond_broadcast(&pf->pf_donecv);
+	}
+	pthread_mutex_unlock(&pf->pf_mtx);
+
+	return (NULL);
+}
+
+/*
+ * Start nthreads threads prefetching directories for the walk.  Must be
+ * called before the first ct_fts_read.  Walks that chdir or don't stat
+ * stay single threaded.
+ */
+int
+ct_fts_prefetch(CT_FTS *sp, int nthreads)
+{
+	struct ct_fts_pf *pf;
+	int i, saved_errno;
+
+	if (nthreads < 1 || ISSET(CT_FTS_NOSTAT) || !ISSET(CT_FTS_NOCHDIR))
+		return (0);
+	if (sp->fts_pf != NULL) {
+		errno = EINVAL;
+		return (-1);
+	}
+
+	if ((pf = calloc(1, sizeof(*pf))) == NULL)
+		return (-1);
+	if ((pf->pf_threads = calloc(nthreads,
+	    sizeof(*pf->pf_threads))) == NULL) {
+		free(pf);
+		return (-1);
+	}
+	pf->pf_options = sp->fts_options & CT_FTS_OPTIONMASK;
+	pf->pf_statfn = sp->fts_statfn;
+	pf->pf_statarg = sp->fts_statarg;
+	pthread_mutex_init(&pf->pf_mtx, NULL);
+	pthread_cond_init(&pf->pf_cv, NULL);
+	pthread_cond_init(&pf->pf_donecv, NULL);
+	TAILQ_INIT(&pf->pf_stack);
+
+	for (i = 0; i < nthreads; i++) {
+		if ((errno = pthread_create(&pf->pf_threads[i], NULL,
+		    ct_fts_pf_thread, pf)) != 0) {
+			saved_errno = errno;
+			ct_fts_pf_stop(pf);
+			ct_fts_pf_free(pf);
+			errno = saved_errno;
+			return (-1);
+		}
+		pf->pf_nthreads++;
+	}
+	sp->fts_pf = pf;
+
+	return (0);
+}
+
+/* Stop the threads; jobs left over are freed with their directories. */
+static void
+ct_fts_pf_stop(struct ct_fts_pf *pf)
+{
+	int i, saved_errno;
+
+	saved_errno = errno;
+	pthread_mutex_lock(&pf->pf_mtx);
+	pf->pf_exiting = 1;
+	pthread_cond_broadcast(&pf->pf_cv);
+	pthread_mutex_unlock(&pf->pf_mtx);
+	for (i = 0; i < pf->pf_nthreads; i++)
+		(void)pthread_join(pf->pf_threads[i], NULL);
+	pf->pf_nthreads = 0;
+	errno = saved_errno;
+}
+
+static void
+ct_fts_pf_free(struct ct_fts_pf *pf)
+{
+	pthread_cond_destroy(&pf->pf_donecv);
+	pthread_cond_destroy(&pf->pf_cv);
+	pthread_mutex_destroy(&pf->pf_mtx);
+	free(pf->pf_threads);
+	free(pf);
+}
+
+/* Get the finished job for the current directory, building it if need be. */
+static struct ct_fts_pj *
+ct_fts_pf_take(CT_FTS *sp, CT_FTSENT *cur)
+{
+	struct ct_fts_pf *pf = sp->fts_pf;
+	struct ct_fts_pj *pj;
+	int inline_build = 0;
+
+	if ((pj = cur->fts_pj) == NULL && (pj = ct_fts_pj_new(pf, cur,
+	    cur->fts_accpath, strlen(cur->fts_accpath), NULL,
+	    sp->fts_dev)) == NULL)
+		return (NULL);
+
+	pthread_mutex_lock(&pf->pf_mtx);
+	switch (pj->pj_state) {
+	case CT_FTS_PJ_QUEUED:
+		TAILQ_REMOVE(&pf->pf_stack, pj, pj_entry);
+		/* FALLTHROUGH */
+	case CT_FTS_PJ_NEW:
+		pj->pj_state = CT_FTS_PJ_RUNNING;
+		inline_build = 1;
+		break;
+	default:
+		while (pj->pj_state == CT_FTS_PJ_RUNNING)
+			pthread_cond_wait(&pf->pf_donecv, &pf->pf_mtx);
+		pf->pf_pending -= pj->pj_pending;
+		pj->pj_pending = 0;
+		pthread_cond_broadcast(&pf->pf_cv);
+		break;
+	}
+	pthread_mutex_unlock(&pf->pf_mtx);
+
+	if (inline_build) {
+		ct_fts_pf_build(pf, pj);
+		pthread_mutex_lock(&pf->pf_mtx);
+		pj->pj_state = CT_FTS_PJ_DONE;
+		ct_fts_pf_push(pf, pj);
+		pthread_mutex_unlock(&pf->pf_mtx);
+	}
+
+	return (pj);
+}
+
+/* The prefetch side of ct_fts_build, for fts_read. */
+static CT_FTSENT *
+ct_fts_pf_read(CT_FTS *sp)
+{
+	struct ct_fts_pj *pj;
+	CT_FTSENT *cur, *head, *p;
+	void *oldaddr;
+	size_t len;
+	int nitems;
+
+	cur = sp->fts_cur;
+	if ((pj = ct_fts_pf_take(sp, cur)) == NULL) {
+		cur->fts_info = CT_FTS_ERR;
+		SET(CT_FTS_STOP);
+		return (NULL);
+	}
+	head = pj->pj_head;
+	nitems = pj->pj_nitems;
+	pj->pj_head = NULL;
+
+	if (pj->pj_fatal || pj->pj_errno) {
+		if (pj->pj_fatal) {
+			cur->fts_info = CT_FTS_ERR;
+			SET(CT_FTS_STOP);
+			errno = pj->pj_fatal;
+		} else {
+			cur->fts_info = CT_FTS_DNR;
+			cur->fts_errno = pj->pj_errno;
+		}
+		ct_fts_pj_free(pj);
+		return (NULL);
+	}
+
+	/* Make room for the longest name, as ct_fts_build would have. */
+	len = NAPPEND(cur) + 1;
+	if (nitems && pj->pj_maxname >= sp->fts_pathlen - len) {
+		oldaddr = sp->fts_path;
+		if (ct_fts_palloc(sp, pj->pj_maxname + len + 1)) {
+			ct_fts_pj_free(pj);
+			ct_fts_lfree(head);
+			cur->fts_info = CT_FTS_ERR;
+			SET(CT_FTS_STOP);
+			return (NULL);
+		}
+		if (oldaddr != sp->fts_path)
+			ct_fts_padjust(sp, cur);
+	}
+	ct_fts_pj_free(pj);
+
+	for (p = head; p; p = p->fts_link) {
+		p->fts_accpath = p->fts_path = sp->fts_path;
+		p->fts_pathlen = len + p->fts_namelen;
+	}
+
+	if (!nitems) {
+		cur->fts_info = CT_FTS_DP;
+		return (NULL);
+	}
+
+	if (sp->fts_compar && nitems > 1)
+		head = ct_fts_sort(sp, head, nitems);
+	return (head);
+}
+
+/* Drop the prefetch of a directory the walk won't descend into. */
+static void
+ct_fts_pj_drop(struct ct_fts_pj *pj)
+{
+	struct ct_fts_pf *pf = pj->pj_pf;
+
+	pthread_mutex_lock(&pf->pf_mtx);
+	if (pj->pj_state == CT_FTS_PJ_QUEUED)
+		TAILQ_REMOVE(&pf->pf_stack, pj, pj_entry);
+	pj->pj_cancel = 1;
+	while (pj->pj_state == CT_FTS_PJ_RUNNING)
+		pthread_cond_wait(&pf->pf_donecv, &pf->pf_mtx);
+	if (pj->pj_pending) {
+		pf->pf_pending -= pj->pj_pending;
+		pj->pj_pending = 0;
+		pthread_cond_broadcast(&pf->pf_cv);
+	}
+	pthread_mutex_unlock(&pf->pf_mtx);
+
+	ct_fts_lfree(pj->pj_head);
+	ct_fts_pj_free(pj);
+}
+
+#else /* CT_ENABLE_PTHREADS */
+
+/* ARGSUSED */
+int
+ct_fts_prefetch(CT_FTS *sp, int nthreads)
+{
+	return (0);
+}
+
+#endif /* CT_ENABLE_PTHREADS */
@@ -35,6 +35,9 @@
 #ifndef	_CT_FTS_H_
 #define	_CT_FTS_H_
 
+struct ct_fts_pf;
+struct ct_fts_pj;
+
 typedef struct {
 	struct _ftsent *fts_cur;	/* current node */
 	struct _ftsent *fts_child;	/* linked list of children */
@@ -45,6 +48,10 @@ typedef struct {
 	size_t fts_pathlen;		/* sizeof(path) */
 	int fts_nitems;			/* elements in the sort array */
 	int (*fts_compar)();		/* compare function */
+	struct ct_fts_pf *fts_pf;	/* directory prefetch pool */
+					/* stat for regular files, if set */
+	int (*fts_statfn)(void *, const char *, struct stat *);
+	void *fts_statarg;
 
 #define	CT_FTS_COMFOLLOW	0x0001	/* follow command line symlinks */
 #define	CT_FTS_LOGICAL		0x0002	/* logical walk */
@@ -99,6 +106,7 @@ typedef struct _ftsent {
 
 #define	CT_FTS_DONTCHDIR	 0x01		/* don't chdir .. to the parent */
 #define	CT_FTS_SYMFOLLOW	 0x02		/* followed a symlink to get here */
+#define	CT_FTS_STATFN		 0x04		/* stat is from fts_statfn */
 	unsigned short fts_flags;	/* private flags for FTSENT structure */
 
 #define	CT_FTS_AGAIN	 1		/* read node again */
@@ -109,6 +117,7 @@ typedef struct _ftsent {
 
 	unsigned short fts_spare;	/* unused */
 
+	struct ct_fts_pj *fts_pj;	/* prefetch of this directory */
 	struct stat *fts_statp;		/* stat(2) information */
 	char fts_name[];		/* file name */
 } CT_FTSENT;
@@ -118,6 +127,9 @@ CT_FTSENT	*ct_fts_children(CT_FTS *, int);
 int	 	 ct_fts_close(CT_FTS *);
 CT_FTS		*ct_fts_open(char * const *, int,
 	    	 int (*)(const CT_FTSENT **, const CT_FTSENT **));
+int		 ct_fts_prefetch(CT_FTS *, int);
+void		 ct_fts_set_stat(CT_FTS *,
+		     int (*)(void *, const char *, struct stat *), void *);
 CT_FTSENT	*ct_fts_read(CT_FTS *);
 int	 	 ct_fts_set(CT_FTS *, CT_FTSENT *, int);
 __END_DECLS
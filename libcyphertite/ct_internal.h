@@ -35,16 +35,156 @@ int			ct_xml_file_open_polled(
 
 typedef void (ct_func_cb)(void *);
 int	ct_setup_wakeup_file(struct ct_event_state *, void *, ct_func_cb *);
-int	ct_setup_wakeup_sha(struct ct_event_state *, void *, ct_func_cb *);
-int	ct_setup_wakeup_compress(struct ct_event_state *, void *, ct_func_cb *);
+int	ct_setup_wakeup_sha(struct ct_event_state *, void *, ct_func_cb *,
+	    int);
+int	ct_setup_wakeup_compress(struct ct_event_state *, void *, ct_func_cb *,
+	    int);
 int	ct_setup_wakeup_csha(struct ct_event_state *, void *, ct_func_cb *);
-int	ct_setup_wakeup_encrypt(struct ct_event_state *, void *, ct_func_cb *);
+int	ct_setup_wakeup_encrypt(struct ct_event_state *, void *, ct_func_cb *,
+	    int);
 int	ct_setup_wakeup_write(struct ct_event_state *, void *, ct_func_cb *);
 int	ct_setup_wakeup_complete(struct ct_event_state *, void *, ct_func_cb *);
 void	ct_set_reconnect_timeout(struct ct_event_state *, int);
 
 void ctfile_extract_handle_eof(struct ct_global_state *, struct ct_trans *);
 
+void		 ct_init_queues(struct ct_global_state *);
+void		 ct_cleanup_queues(struct ct_global_state *);
+void		 ct_worker_pool_init(struct ct_worker_pool *, int);
+void		 ct_worker_pool_cleanup(struct ct_worker_pool *);
+struct ct_worker *ct_worker_get(struct ct_worker_pool *);
+void		 ct_worker_put(struct ct_worker_pool *, struct ct_worker *);
+
+/* work stealing scheduler, ct_sched.c */
+struct ct_sched;
+typedef void	(ct_sched_run_cb)(void *, int, struct ct_trans *);
+typedef int	(ct_sched_poll_cb)(void *, int);
+struct ct_sched	*ct_sched_init(int, ct_sched_run_cb *, ct_sched_poll_cb *,
+		    void *);
+void		 ct_sched_cleanup(struct ct_sched *);
+int		 ct_sched_nworkers(struct ct_sched *);
+void		 ct_sched_push(struct ct_sched *, struct ct_trans *);
+void		 ct_sched_wakeup(struct ct_sched *);
+#define CT_SCHED_COMPRESS	(0)
+#define CT_SCHED_ENCRYPT	(1)
+#define CT_SCHED_CSHA		(2)
+struct ct_sched	*ct_setup_sched(struct ct_global_state *);
+int		 ct_setup_wakeup_sched(struct ct_event_state *,
+		    struct ct_sched *);
+
+/* archive read-ahead pool, ct_readahead.c */
+struct ct_readahead;
+struct ct_ra_file;
+struct stat;
+TAILQ_HEAD(ct_ra_reads, ct_trans);
+#define CT_RA_PENDING		(0)	/* not opened yet */
+#define CT_RA_OPEN		(1)
+#define CT_RA_EOPEN		(2)	/* open failed */
+#define CT_RA_ESTAT		(3)	/* stat after open failed */
+#define CT_RA_DONE		(1)	/* tr_ra_done, chunk read */
+#define CT_RA_DONE_FINAL	(2)	/* tr_ra_done, last chunk of the file */
+struct ct_readahead *ct_readahead_init(struct ct_event_state *, int, int,
+		     int);
+void		 ct_readahead_cleanup(struct ct_readahead *,
+		     struct ct_ra_reads *);
+int		 ct_readahead_window(struct ct_readahead *);
+void		 ct_readahead_flush(struct ct_readahead *);
+struct ct_ra_file *ct_readahead_open(struct ct_readahead *, int,
+		     const char *, int);
+void		 ct_readahead_read(struct ct_readahead *, struct ct_ra_file *,
+		     struct ct_trans *, off_t);
+int		 ct_readahead_status(struct ct_readahead *,
+		     struct ct_ra_file *, struct stat *, int *);
+struct ct_trans	*ct_readahead_next(struct ct_readahead *, struct ct_ra_file *,
+		     int *, struct stat *, int *);
+void		 ct_readahead_close(struct ct_readahead *, struct ct_ra_file *,
+		     struct ct_ra_reads *);
+int		 ct_readahead_reap(struct ct_readahead *, struct ct_ra_reads *);
+
+/* archive read ordering, ct_files.c */
+int		 ct_extent_start(const char *, int, off_t *);
+
+/* stat index written next to a ctfile, ct_statidx.c */
+#define CT_STATIDX_SUFFIX	".idx"
+struct ct_statidx_ent {
+	uint64_t	se_dir;		/* string table offsets */
+	uint64_t	se_name;
+	int64_t		se_size;
+	int64_t		se_mtime;
+	int64_t		se_ctime;
+	int64_t		se_atime;
+	uint64_t	se_ino;
+	uint64_t	se_dev;
+	uint32_t	se_mode;
+	uint32_t	se_uid;
+	uint32_t	se_gid;
+	uint32_t	se_nlink;
+};
+struct ct_statidx;
+struct ct_statidx_build;
+struct ct_statidx_build *ct_statidx_build_init(void);
+void		 ct_statidx_build_add(struct ct_statidx_build *, const char *,
+		     const char *, const struct ct_statidx_ent *);
+void		 ct_statidx_build_journal(struct ct_statidx_build *, uint64_t,
+		     off_t);
+int		 ct_statidx_build_write(struct ct_statidx_build *,
+		     const char *, int64_t, off_t);
+void		 ct_statidx_build_free(struct ct_statidx_build *);
+int		 ct_statidx_open(struct ct_statidx **, const char *, int64_t,
+		     off_t);
+void		 ct_statidx_close(struct ct_statidx *);
+const struct ct_statidx_ent *ct_statidx_find(struct ct_statidx *,
+		     const char *, const char *);
+void		 ct_statidx_journal(struct ct_statidx *, uint64_t *, off_t *);
+
+/* change journal kept by ct_journal_watch(), ct_journal.c */
+struct ct_journal;
+int		 ct_journal_open(struct ct_journal **, const char *, char **,
+		     const char *);
+int		 ct_journal_read(struct ct_journal *, off_t);
+uint64_t	 ct_journal_session(struct ct_journal *);
+off_t		 ct_journal_end(struct ct_journal *);
+int		 ct_journal_dirty(struct ct_journal *, const char *);
+void		 ct_journal_close(struct ct_journal *);
+
+/* batched file i/o on linux, ct_uring.c */
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define CT_HAVE_URING
+#endif
+#endif
+struct ct_uring;
+struct ct_uring	*ct_uring_init(unsigned);
+void		 ct_uring_cleanup(struct ct_uring *);
+unsigned	 ct_uring_inflight(struct ct_uring *);
+unsigned	 ct_uring_unsent(struct ct_uring *);
+int		 ct_uring_nop(struct ct_uring *, uint64_t);
+int		 ct_uring_openat(struct ct_uring *, int, const char *, int,
+		     uint64_t);
+int		 ct_uring_fstatx(struct ct_uring *, int, unsigned, void *,
+		     uint64_t);
+int		 ct_uring_pread(struct ct_uring *, int, void *, size_t, off_t,
+		     uint64_t);
+int		 ct_uring_pwrite(struct ct_uring *, int, const void *, size_t,
+		     off_t, uint64_t);
+int		 ct_uring_close(struct ct_uring *, int, uint64_t);
+int		 ct_uring_submit(struct ct_uring *, unsigned);
+void		 ct_uring_wait(struct ct_uring *);
+int		 ct_uring_reap(struct ct_uring *, uint64_t *, int *);
+
+/* content defined chunking, ct_cdc.c */
+#define CT_CDC_AVG_DIV	4	/* average chunk is a quarter of a block */
+#define CT_CDC_MIN_DIV	16
+struct ct_cdc {
+	size_t		cdc_min;
+	size_t		cdc_avg;
+	size_t		cdc_max;
+	uint64_t	cdc_mask_s;	/* below cdc_avg */
+	uint64_t	cdc_mask_l;	/* above it */
+};
+void		 ct_cdc_init(struct ct_cdc *, size_t);
+size_t		 ct_cdc_cut(const struct ct_cdc *, const uint8_t *, size_t);
+
 struct ct_trans *ct_fatal_alloc_trans(struct ct_global_state *);
 void		 ct_fatal(struct ct_global_state *, const char *, int);
 
@@ -57,6 +197,19 @@ void	ct_queue_csha(struct ct_global_state *, struct ct_trans *);
 void	ct_queue_write(struct ct_global_state *, struct ct_trans *);
 void	ct_queue_queued(struct ct_global_state *, struct ct_trans *);
 void	ct_queue_complete(struct ct_global_state *, struct ct_trans *);
+struct ct_trans	*ct_dequeue_complete(struct ct_global_state *);
+
+/* most transactions a stage pulls off its queue in one go */
+#define CT_DEQUEUE_BATCH	16
+int	ct_dequeue_sha_batch(struct ct_global_state *, struct ct_trans **, int);
+int	ct_dequeue_compress_batch(struct ct_global_state *, struct ct_trans **,
+	    int);
+int	ct_dequeue_encrypt_batch(struct ct_global_state *, struct ct_trans **,
+	    int);
+int	ct_dequeue_csha_batch(struct ct_global_state *, struct ct_trans **,
+	    int);
+int	ct_dequeue_write_batch(struct ct_global_state *, struct ct_trans **,
+	    int);
 
 /* Platform-specific compatibility functions implemented in ct_platform.c */
 FILE 	*ct_fopen(const char *, const char *);
@@ -0,0 +1,844 @@
+/*
+ * Copyright (c) 2012 Conformal Systems LLC <info@conformal.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Change journal. ct_journal_watch() follows a set of trees with inotify or
+ * fanotify and appends the paths that change in them to a journal file. An
+ * archive whose basis looked at the same journal only has to look at what
+ * was appended since; any other file is as the basis' stat index has it.
+ *
+ * The journal is a run of NUL terminated records: "CTJOURNAL <version>
+ * <session>", the trees watched as "R<path>", then "F<path>" for a path
+ * that changed and "T<path>" for a tree that turned up whole, all paths
+ * absolute. The watcher holds an exclusive lock on it for as long as it is
+ * watching. Whenever it may have missed something it starts over with a
+ * new session; the next archive doesn't know that one and scans everything,
+ * the one after can use it again.
+ */
+
+#ifdef NEED_LIBCLENS
+#include <clens.h>
+#endif
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/file.h>
+#include <sys/tree.h>
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <inttypes.h>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <sys/fanotify.h>
+#include <sys/vfs.h>
+#include <poll.h>
+#endif
+
+#include <clog.h>
+#include <exude.h>
+
+#include <ctutil.h>
+
+#include <cyphertite.h>
+#include <ct_internal.h>
+#include "ct_fts.h"
+
+#define CT_JOURNAL_MAGIC	"CTJOURNAL"
+#define CT_JOURNAL_VERSION	1
+#define CT_JOURNAL_MAXSIZE	(64 * 1024 * 1024)	/* start over past this */
+#define CT_JOURNAL_SETTLE	200	/* ms a change may wait to be written */
+
+struct ct_journal_rec {
+	RB_ENTRY(ct_journal_rec)	 jr_entry;
+	char				 jr_type;	/* 'F' or 'T' */
+	char				 jr_path[];
+};
+RB_HEAD(ct_journal_recs, ct_journal_rec);
+
+static int
+ct_journal_rec_cmp(struct ct_journal_rec *r1, struct ct_journal_rec *r2)
+{
+	return (strcmp(r1->jr_path, r2->jr_path));
+}
+RB_PROTOTYPE_STATIC(ct_journal_recs, ct_journal_rec, jr_entry,
+    ct_journal_rec_cmp);
+RB_GENERATE_STATIC(ct_journal_recs, ct_journal_rec, jr_entry,
+    ct_journal_rec_cmp);
+
+/* Add path to recs, a tree wins over a path in it. */
+static void
+ct_journal_rec_add(struct ct_journal_recs *recs, char type, const char *path)
+{
+	struct ct_journal_rec	*jr, *ojr;
+	size_t			 len = strlen(path) + 1;
+
+	jr = e_malloc(sizeof(*jr) + len);
+	jr->jr_type = type;
+	memcpy(jr->jr_path, path, len);
+	if ((ojr = RB_INSERT(ct_journal_recs, recs, jr)) != NULL) {
+		if (type == 'T')
+			ojr->jr_type = 'T';
+		e_free(&jr);
+	}
+}
+
+static void
+ct_journal_rec_free(struct ct_journal_recs *recs)
+{
+	struct ct_journal_rec	*jr;
+
+	while ((jr = RB_ROOT(recs)) != NULL) {
+		RB_REMOVE(ct_journal_recs, recs, jr);
+		e_free(&jr);
+	}
+}
+
+/* Is path in or under one of roots? */
+static int
+ct_journal_covers(char **roots, int nroots, const char *path)
+{
+	size_t	len;
+	int	i;
+
+	for (i = 0; i < nroots; i++) {
+		len = strlen(roots[i]);
+		if (strcmp(roots[i], "/") == 0 ||
+		    (strncmp(roots[i], path, len) == 0 &&
+		    (path[len] == '/' || path[len] == '\0')))
+			return (1);
+	}
+
+	return (0);
+}
+
+/*
+ * The archive's side of the journal.
+ */
+struct ct_journal {
+	int			 cj_fd;
+	uint64_t		 cj_session;
+	char			**cj_roots;
+	int			 cj_nroots;
+	off_t			 cj_start;	/* of the first change */
+	off_t			 cj_end;	/* past the last whole record */
+	char			 cj_cwd[PATH_MAX];
+	struct ct_journal_recs	 cj_dirty;
+};
+
+/*
+ * Hand fn each whole record from off on with the offset it starts at,
+ * until it returns nonzero. Leaves cj_end after the last one it took.
+ */
+static int
+ct_journal_scan(struct ct_journal *cj, off_t off,
+    int (*fn)(struct ct_journal *, const char *, off_t))
+{
+	char		*buf, *p, *nul;
+	size_t		 have = 0, bufsz = 4 * PATH_MAX;
+	ssize_t		 n;
+	int		 ret = 0, s_errno;
+
+	buf = e_malloc(bufsz);
+	for (;;) {
+		if ((n = pread(cj->cj_fd, buf + have, bufsz - have,
+		    off + have)) == -1) {
+			ret = CTE_ERRNO;
+			break;
+		}
+		if (n == 0)
+			break;	/* anything left is being written */
+		have += n;
+		for (p = buf; (nul = memchr(p, '\0', have - (p - buf))) !=
+		    NULL; p = nul + 1) {
+			if (fn(cj, p, off + (p - buf)) != 0)
+				goto done;
+		}
+		if (p == buf) {
+			/* no record is that long */
+			ret = CTE_CTFILE_CORRUPT;
+			break;
+		}
+		have -= p - buf;
+		off += p - buf;
+		memmove(buf, p, have);
+	}
+	p = buf;
+done:
+	cj->cj_end = off + (p - buf);
+	s_errno = errno;
+	e_free(&buf);
+	errno = s_errno;
+
+	return (ret);
+}
+
+static int
+ct_journal_header(struct ct_journal *cj, const char *rec, off_t off)
+{
+	char	magic[16];
+	int	version;
+
+	if (off == 0) {
+		if (sscanf(rec, "%15s %d %" SCNx64, magic, &version,
+		    &cj->cj_session) != 3 ||
+		    strcmp(magic, CT_JOURNAL_MAGIC) != 0 ||
+		    version != CT_JOURNAL_VERSION)
+			cj->cj_session = 0;
+		return (cj->cj_session == 0);
+	}
+	if (rec[0] != 'R')
+		return (1);
+	cj->cj_roots = e_realloc(cj->cj_roots, (cj->cj_nroots + 1) *
+	    sizeof(*cj->cj_roots));
+	cj->cj_roots[cj->cj_nroots++] = e_strdup(rec + 1);
+
+	return (0);
+}
+
+static int
+ct_journal_change(struct ct_journal *cj, const char *rec, off_t off)
+{
+	if ((rec[0] == 'F' || rec[0] == 'T') && rec[1] == '/')
+		ct_journal_rec_add(&cj->cj_dirty, rec[0], rec + 1);
+
+	return (0);
+}
+
+/*
+ * Open the journal at path if it is being kept and covers all of
+ * filelist, relative paths being to cwd. ct_journal_read() then reads the
+ * changes.
+ */
+int
+ct_journal_open(struct ct_journal **cjp, const char *path, char **filelist,
+    const char *cwd)
+{
+	struct ct_journal	*cj;
+	char			 abs[PATH_MAX], real[PATH_MAX];
+	int			 ret = CTE_JOURNAL_INVALID;
+
+	*cjp = NULL;
+	cj = e_calloc(1, sizeof(*cj));
+	RB_INIT(&cj->cj_dirty);
+	strlcpy(cj->cj_cwd, cwd, sizeof(cj->cj_cwd));
+	if ((cj->cj_fd = open(path, O_RDONLY)) == -1) {
+		ret = CTE_ERRNO;
+		goto fail;
+	}
+	/* the watcher holds it exclusively */
+	if (flock(cj->cj_fd, LOCK_SH | LOCK_NB) == 0) {
+		CNDBG(CT_LOG_FILE, "%s: not being kept", path);
+		goto fail;
+	}
+	if (errno != EWOULDBLOCK) {
+		ret = CTE_ERRNO;
+		goto fail;
+	}
+	/* what changed just before we got here may not be written yet */
+	usleep(2 * CT_JOURNAL_SETTLE * 1000);
+	if ((ret = ct_journal_scan(cj, 0, ct_journal_header)) != 0)
+		goto fail;
+	ret = CTE_JOURNAL_INVALID;
+	if (cj->cj_session == 0 || cj->cj_nroots == 0) {
+		CNDBG(CT_LOG_FILE, "%s: not a journal", path);
+		goto fail;
+	}
+	cj->cj_start = cj->cj_end;
+
+	/* the walk won't follow symlinks, so the paths have to be real */
+	for (; *filelist != NULL; filelist++) {
+		if (ct_absolute_path(*filelist))
+			strlcpy(abs, *filelist, sizeof(abs));
+		else if (strlcpy(abs, cwd, sizeof(abs)) >= sizeof(abs) ||
+		    (strcmp(cwd, "/") != 0 &&
+		    strlcat(abs, "/", sizeof(abs)) >= sizeof(abs)) ||
+		    strlcat(abs, *filelist, sizeof(abs)) >= sizeof(abs))
+			goto fail;
+		if (realpath(abs, real) == NULL || strcmp(abs, real) != 0 ||
+		    !ct_journal_covers(cj->cj_roots, cj->cj_nroots, abs)) {
+			CNDBG(CT_LOG_FILE, "%s: doesn't cover %s", path, abs);
+			goto fail;
+		}
+	}
+	*cjp = cj;
+
+	return (0);
+fail:
+	ct_journal_close(cj);
+	return (ret);
+}
+
+/*
+ * Read the changes from off, where the basis got to. Negative off just
+ * finds the end for the archive to record.
+ */
+int
+ct_journal_read(struct ct_journal *cj, off_t off)
+{
+	struct stat	 sb;
+	char		 buf[PATH_MAX + 2];
+	ssize_t		 n;
+
+	if (off >= 0) {
+		if (off < cj->cj_start)
+			return (CTE_JOURNAL_INVALID);
+		return (ct_journal_scan(cj, off, ct_journal_change));
+	}
+
+	/* no record is longer than buf */
+	if (fstat(cj->cj_fd, &sb) != 0)
+		return (CTE_ERRNO);
+	off = sb.st_size > (off_t)sizeof(buf) ? sb.st_size - sizeof(buf) : 0;
+	if (off < cj->cj_start)
+		off = cj->cj_start;
+	if ((n = pread(cj->cj_fd, buf, sizeof(buf), off)) == -1)
+		return (CTE_ERRNO);
+	while (n > 0 && buf[n - 1] != '\0')
+		n--;
+	cj->cj_end = off + n;
+
+	return (0);
+}
+
+uint64_t
+ct_journal_session(struct ct_journal *cj)
+{
+	return (cj->cj_session);
+}
+
+off_t
+ct_journal_end(struct ct_journal *cj)
+{
+	return (cj->cj_end);
+}
+
+/* May path, as the walk has it, have changed since the offset read from? */
+int
+ct_journal_dirty(struct ct_journal *cj, const char *path)
+{
+	struct ct_journal_rec	*jr;
+	union {
+		struct ct_journal_rec	jr;
+		char			buf[sizeof(struct ct_journal_rec) +
+					    PATH_MAX];
+	} key;
+	char			*p, *abs = key.jr.jr_path;
+	size_t			 len = PATH_MAX;
+
+	while (path[0] == '.' && path[1] == '/')
+		path += 2;
+	if (ct_absolute_path(path)) {
+		if (strlcpy(abs, path, len) >= len)
+			return (1);
+	} else if (strlcpy(abs, cj->cj_cwd, len) >= len ||
+	    (strcmp(cj->cj_cwd, "/") != 0 && strlcat(abs, "/", len) >= len) ||
+	    strlcat(abs, path, len) >= len) {
+		return (1);
+	}
+
+	if (RB_FIND(ct_journal_recs, &cj->cj_dirty, &key.jr) != NULL)
+		return (1);
+	while ((p = strrchr(abs, '/')) != NULL) {
+		if (p == abs) {
+			p[1] = '\0';
+		} else {
+			*p = '\0';
+		}
+		if ((jr = RB_FIND(ct_journal_recs, &cj->cj_dirty,
+		    &key.jr)) != NULL && jr->jr_type == 'T')
+			return (1);
+		if (p == abs)
+			break;
+	}
+
+	return (0);
+}
+
+void
+ct_journal_close(struct ct_journal *cj)
+{
+	int	i;
+
+	if (cj == NULL)
+		return;
+	if (cj->cj_fd != -1)
+		close(cj->cj_fd);
+	for (i = 0; i < cj->cj_nroots; i++)
+		e_free(&cj->cj_roots[i]);
+	if (cj->cj_roots != NULL)
+		e_free(&cj->cj_roots);
+	ct_journal_rec_free(&cj->cj_dirty);
+	e_free(&cj);
+}
+
+#ifdef __linux__
+/*
+ * The watcher's side.
+ */
+struct ct_journal_wd {
+	RB_ENTRY(ct_journal_wd)	 jw_entry;
+	int			 jw_wd;
+	char			*jw_path;
+};
+RB_HEAD(ct_journal_wds, ct_journal_wd);
+
+static int
+ct_journal_wd_cmp(struct ct_journal_wd *w1, struct ct_journal_wd *w2)
+{
+	return (w1->jw_wd < w2->jw_wd ? -1 : w1->jw_wd > w2->jw_wd);
+}
+RB_PROTOTYPE_STATIC(ct_journal_wds, ct_journal_wd, jw_entry,
+    ct_journal_wd_cmp);
+RB_GENERATE_STATIC(ct_journal_wds, ct_journal_wd, jw_entry,
+    ct_journal_wd_cmp);
+
+struct ct_journal_w {
+	const char		*w_path;	/* of the journal */
+	char			**w_roots;
+	int			 w_nroots;
+	int			 w_fanotify;
+	int			 w_fd;		/* inotify or fanotify */
+	int			*w_rootfd;	/* fanotify, to open handles */
+	fsid_t			*w_fsid;	/* fanotify, of each root */
+	FILE			*w_f;
+	struct ct_journal_wds	 w_wds;		/* inotify */
+	struct ct_journal_recs	 w_batch;	/* changes not yet written */
+};
+
+#define CT_JOURNAL_INOTIFY	(IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | \
+				    IN_CREATE | IN_DELETE | IN_MOVED_FROM | \
+				    IN_MOVED_TO | IN_DELETE_SELF | \
+				    IN_MOVE_SELF | IN_DONT_FOLLOW | \
+				    IN_ONLYDIR | IN_EXCL_UNLINK)
+#define CT_JOURNAL_FANOTIFY	(FAN_MODIFY | FAN_ATTRIB | FAN_CLOSE_WRITE | \
+				    FAN_CREATE | FAN_DELETE | FAN_MOVED_FROM | \
+				    FAN_MOVED_TO | FAN_ONDIR)
+
+/* Watch every directory in the tree at path. */
+static int
+ct_journal_watch_tree(struct ct_journal_w *w, const char *path)
+{
+	struct ct_journal_wd	*jwd, *ojwd;
+	CT_FTS			*fts;
+	CT_FTSENT		*fe;
+	char			*paths[2];
+	int			 wd, ret = 0;
+
+	paths[0] = (char *)path;
+	paths[1] = NULL;
+	if ((fts = ct_fts_open(paths, CT_FTS_PHYSICAL | CT_FTS_NOCHDIR |
+	    CT_FTS_NOSTAT, NULL)) == NULL)
+		return (CTE_ERRNO);
+	while ((fe = ct_fts_read(fts)) != NULL) {
+		if (fe->fts_info != CT_FTS_D)
+			continue;
+		if ((wd = inotify_add_watch(w->w_fd, fe->fts_path,
+		    CT_JOURNAL_INOTIFY)) == -1) {
+			/* gone already, its parent's event says so */
+			if (errno == ENOENT || errno == ENOTDIR)
+				continue;
+			CWARN("can't watch %s", fe->fts_path);
+			ret = CTE_ERRNO;
+			break;
+		}
+		jwd = e_calloc(1, sizeof(*jwd));
+		jwd->jw_wd = wd;
+		jwd->jw_path = e_strdup(fe->fts_path);
+		if ((ojwd = RB_INSERT(ct_journal_wds, &w->w_wds, jwd)) !=
+		    NULL) {
+			e_free(&ojwd->jw_path);
+			ojwd->jw_path = jwd->jw_path;
+			e_free(&jwd);
+		}
+	}
+	if (ret == 0 && errno != 0)
+		ret = CTE_ERRNO;
+	ct_fts_close(fts);
+
+	return (ret);
+}
+
+static void
+ct_journal_unwatch(struct ct_journal_w *w)
+{
+	struct ct_journal_wd	*jwd;
+	int			 i;
+
+	while ((jwd = RB_ROOT(&w->w_wds)) != NULL) {
+		RB_REMOVE(ct_journal_wds, &w->w_wds, jwd);
+		e_free(&jwd->jw_path);
+		e_free(&jwd);
+	}
+	for (i = 0; w->w_rootfd != NULL && i < w->w_nroots; i++) {
+		if (w->w_rootfd[i] != -1)
+			close(w->w_rootfd[i]);
+		w->w_rootfd[i] = -1;
+	}
+	if (w->w_fd != -1)
+		close(w->w_fd);
+	w->w_fd = -1;
+	if (w->w_f != NULL)
+		fclose(w->w_f);	/* and the lock with it */
+	w->w_f = NULL;
+	ct_journal_rec_free(&w->w_batch);
+}
+
+/* Set up the watches and start a new journal. */
+static int
+ct_journal_start(struct ct_journal_w *w)
+{
+	struct statfs	 sfs;
+	uint64_t	 session = 0;
+	char		*tmp;
+	int		 i, ret = 0;
+
+	if (w->w_fanotify) {
+		if ((w->w_fd = fanotify_init(FAN_CLASS_NOTIF |
+		    FAN_REPORT_DFID_NAME | FAN_CLOEXEC | FAN_NONBLOCK,
+		    O_RDONLY | O_LARGEFILE)) == -1) {
+			CWARN("fanotify");
+			return (CTE_ERRNO);
+		}
+		for (i = 0; i < w->w_nroots; i++) {
+			if (fanotify_mark(w->w_fd, FAN_MARK_ADD |
+			    FAN_MARK_FILESYSTEM, CT_JOURNAL_FANOTIFY,
+			    AT_FDCWD, w->w_roots[i]) == -1 ||
+			    (w->w_rootfd[i] = open(w->w_roots[i],
+			    O_RDONLY | O_DIRECTORY)) == -1 ||
+			    fstatfs(w->w_rootfd[i], &sfs) == -1) {
+				CWARN("can't watch %s", w->w_roots[i]);
+				return (CTE_ERRNO);
+			}
+			w->w_fsid[i] = sfs.f_fsid;
+		}
+	} else {
+		if ((w->w_fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK)) == -1) {
+			CWARN("inotify");
+			return (CTE_ERRNO);
+		}
+		for (i = 0; i < w->w_nroots; i++)
+			if ((ret = ct_journal_watch_tree(w,
+			    w->w_roots[i])) != 0)
+				return (ret);
+	}
+
+	/* anything changed before now the next full scan sees */
+	while (session == 0)
+		arc4random_buf(&session, sizeof(session));
+	e_asprintf(&tmp, "%s.tmp", w->w_path);
+	if ((w->w_f = fopen(tmp, "w")) == NULL ||
+	    flock(fileno(w->w_f), LOCK_EX | LOCK_NB) != 0 ||
+	    fprintf(w->w_f, "%s %d %" PRIx64 "%c", CT_JOURNAL_MAGIC,
+	    CT_JOURNAL_VERSION, session, '\0') < 0) {
+		ret = CTE_ERRNO;
+		goto done;
+	}
+	for (i = 0; i < w->w_nroots; i++)
+		fprintf(w->w_f, "R%s%c", w->w_roots[i], '\0');
+	if (fflush(w->w_f) != 0 || rename(tmp, w->w_path) != 0)
+		ret = CTE_ERRNO;
+done:
+	if (ret != 0) {
+		CWARN("can't write %s", tmp);
+		unlink(tmp);
+	}
+	e_free(&tmp);
+	if (ret == 0)
+		CNDBG(CT_LOG_FILE, "journal %s session %" PRIx64, w->w_path,
+		    session);
+
+	return (ret);
+}
+
+/*
+ * Take in a buffer of inotify events. Returns 1 if the journal has to
+ * start over.
+ */
+static int
+ct_journal_inotify(struct ct_journal_w *w, char *buf, ssize_t len)
+{
+	struct inotify_event	*ev;
+	struct ct_journal_wd	*jwd, sjwd;
+	char			 path[PATH_MAX];
+	char			*p;
+
+	for (p = buf; p < buf + len; p += sizeof(*ev) + ev->len) {
+		ev = (struct inotify_event *)p;
+		if (ev->mask & (IN_Q_OVERFLOW | IN_UNMOUNT | IN_MOVE_SELF)) {
+			CNDBG(CT_LOG_FILE, "lost track, mask 0x%x", ev->mask);
+			return (1);
+		}
+		sjwd.jw_wd = ev->wd;
+		if ((jwd = RB_FIND(ct_journal_wds, &w->w_wds, &sjwd)) == NULL)
+			continue;
+		if (ev->mask & IN_IGNORED) {
+			RB_REMOVE(ct_journal_wds, &w->w_wds, jwd);
+			e_free(&jwd->jw_path);
+			e_free(&jwd);
+			continue;
+		}
+		if (snprintf(path, sizeof(path), "%s%s%s", jwd->jw_path,
+		    ev->len ? "/" : "", ev->len ? ev->name : "") >=
+		    (int)sizeof(path))
+			return (1);
+
+		if ((ev->mask & IN_ISDIR) == 0) {
+			ct_journal_rec_add(&w->w_batch, 'F', path);
+		} else if (ev->mask & IN_MOVED_FROM) {
+			/* the watches below have the wrong paths now */
+			CNDBG(CT_LOG_FILE, "%s moved", path);
+			return (1);
+		} else if (ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+			/* watch first, so nothing in it goes unseen */
+			if (ct_journal_watch_tree(w, path) != 0)
+				return (1);
+			ct_journal_rec_add(&w->w_batch, 'T', path);
+		} else {
+			ct_journal_rec_add(&w->w_batch, 'F', path);
+		}
+	}
+
+	return (0);
+}
+
+/* Take in a buffer of fanotify events, as ct_journal_inotify(). */
+static int
+ct_journal_fanotify(struct ct_journal_w *w, char *buf, ssize_t len)
+{
+	struct fanotify_event_metadata	*md;
+	struct fanotify_event_info_fid	*fid;
+	struct file_handle		*fh;
+	char				 proc[64], dir[PATH_MAX];
+	char				 path[PATH_MAX];
+	const char			*name;
+	ssize_t				 dlen;
+	int				 i, dfd;
+
+	for (md = (struct fanotify_event_metadata *)buf;
+	    FAN_EVENT_OK(md, len); md = FAN_EVENT_NEXT(md, len)) {
+		if (md->vers != FANOTIFY_METADATA_VERSION ||
+		    (md->mask & FAN_Q_OVERFLOW)) {
+			CNDBG(CT_LOG_FILE, "lost track, mask 0x%llx",
+			    (unsigned long long)md->mask);
+			return (1);
+		}
+		fid = (struct fanotify_event_info_fid *)(md + 1);
+		if (md->event_len < sizeof(*md) + sizeof(*fid) ||
+		    fid->hdr.info_type != FAN_EVENT_INFO_TYPE_DFID_NAME)
+			continue;
+		fh = (struct file_handle *)fid->handle;
+		name = (const char *)fh->f_handle + fh->handle_bytes;
+
+		/* a filesystem mark sees it all, find which root it's on */
+		for (i = 0; i < w->w_nroots; i++)
+			if (memcmp(&w->w_fsid[i], &fid->fsid,
+			    sizeof(fid->fsid)) == 0)
+				break;
+		if (i == w->w_nroots)
+			continue;
+		if ((dfd = open_by_handle_at(w->w_rootfd[i], fh,
+		    O_PATH)) == -1) {
+			/* the directory is gone, and with it what was in it */
+			if (errno == ESTALE)
+				continue;
+			CWARN("open_by_handle_at");
+			return (1);
+		}
+		snprintf(proc, sizeof(proc), "/proc/self/fd/%d", dfd);
+		dlen = readlink(proc, dir, sizeof(dir) - 1);
+		close(dfd);
+		if (dlen <= 0 || dir[0] != '/')
+			continue;
+		dir[dlen] = '\0';
+		if (strcmp(name, ".") == 0)
+			name = "";
+		if (snprintf(path, sizeof(path), "%s%s%s",
+		    strcmp(dir, "/") == 0 ? "" : dir, name[0] ? "/" : "",
+		    name) >= (int)sizeof(path))
+			return (1);
+		if (!ct_journal_covers(w->w_roots, w->w_nroots, path))
+			continue;
+
+		if ((md->mask & FAN_ONDIR) &&
+		    (md->mask & (FAN_CREATE | FAN_MOVED_TO)))
+			ct_journal_rec_add(&w->w_batch, 'T', path);
+		else
+			ct_journal_rec_add(&w->w_batch, 'F', path);
+	}
+
+	return (0);
+}
+
+/* Write out the batch. Returns 1 if the journal has to start over. */
+static int
+ct_journal_flush(struct ct_journal_w *w)
+{
+	struct ct_journal_rec	*jr;
+
+	while ((jr = RB_MIN(ct_journal_recs, &w->w_batch)) != NULL) {
+		RB_REMOVE(ct_journal_recs, &w->w_batch, jr);
+		fprintf(w->w_f, "%c%s%c", jr->jr_type, jr->jr_path, '\0');
+		e_free(&jr);
+	}
+	if (fflush(w->w_f) != 0) {
+		CWARN("can't write %s", w->w_path);
+		return (-1);
+	}
+
+	return (ftello(w->w_f) > CT_JOURNAL_MAXSIZE);
+}
+
+/*
+ * Follow the changes until the journal has to start over or fails. A burst
+ * of changes is gathered into one batch, but the batch is written at most
+ * CT_JOURNAL_SETTLE ms after its first change however busy the tree is; an
+ * archive started after a change must find it in the journal.
+ */
+static int
+ct_journal_follow(struct ct_journal_w *w)
+{
+	struct pollfd	 pfd;
+	struct timeval	 first, now;
+	char		 buf[64 * 1024]
+			     __attribute__((aligned(sizeof(uint64_t))));
+	ssize_t		 len;
+	long		 waited;
+	int		 timeout, rv;
+
+	pfd.fd = w->w_fd;
+	pfd.events = POLLIN;
+	for (;;) {
+		timeout = -1;
+		if (!RB_EMPTY(&w->w_batch)) {
+			gettimeofday(&now, NULL);
+			timersub(&now, &first, &now);
+			waited = now.tv_sec * 1000 + now.tv_usec / 1000;
+			/* a clock stepped back counts as having waited */
+			if (waited < 0 || waited >= CT_JOURNAL_SETTLE) {
+				if ((rv = ct_journal_flush(w)) != 0)
+					return (rv == 1 ? 0 : CTE_ERRNO);
+				continue;
+			}
+			timeout = CT_JOURNAL_SETTLE - waited;
+		}
+		if ((rv = poll(&pfd, 1, timeout)) == -1) {
+			if (errno == EINTR)
+				continue;
+			return (CTE_ERRNO);
+		}
+		if (rv == 0)
+			continue;
+		if (RB_EMPTY(&w->w_batch))
+			gettimeofday(&first, NULL);
+		while ((len = read(w->w_fd, buf, sizeof(buf))) > 0) {
+			if (w->w_fanotify)
+				rv = ct_journal_fanotify(w, buf, len);
+			else
+				rv = ct_journal_inotify(w, buf, len);
+			if (rv != 0)
+				return (0);
+		}
+		if (len == -1 && errno != EAGAIN && errno != EINTR)
+			return (CTE_ERRNO);
+	}
+}
+
+/*
+ * Keep the journal at path for the trees in paths, with fanotify if asked
+ * to and inotify otherwise. Only returns on failure.
+ */
+int
+ct_journal_watch(const char *path, char **paths, int fanotify)
+{
+	struct ct_journal_w	 w;
+	char			 real[PATH_MAX];
+	struct stat		 sb;
+	int			 i, ret;
+
+	bzero(&w, sizeof(w));
+	w.w_path = path;
+	w.w_fanotify = fanotify;
+	w.w_fd = -1;
+	RB_INIT(&w.w_wds);
+	RB_INIT(&w.w_batch);
+	for (; *paths != NULL; paths++) {
+		if (realpath(*paths, real) == NULL ||
+		    stat(real, &sb) != 0) {
+			CWARN("%s", *paths);
+			ret = CTE_ERRNO;
+			goto done;
+		}
+		if (!S_ISDIR(sb.st_mode)) {
+			CWARNX("%s: %s", *paths, ct_strerror(CTE_INVALID_PATH));
+			ret = CTE_INVALID_PATH;
+			goto done;
+		}
+		w.w_roots = e_realloc(w.w_roots, (w.w_nroots + 1) *
+		    sizeof(*w.w_roots));
+		w.w_roots[w.w_nroots++] = e_strdup(real);
+	}
+	if (w.w_nroots == 0) {
+		ret = CTE_NO_FILES_SPECIFIED;
+		goto done;
+	}
+	if (fanotify) {
+		w.w_rootfd = e_calloc(w.w_nroots, sizeof(*w.w_rootfd));
+		w.w_fsid = e_calloc(w.w_nroots, sizeof(*w.w_fsid));
+		for (i = 0; i < w.w_nroots; i++)
+			w.w_rootfd[i] = -1;
+	}
+
+	for (;;) {
+		if ((ret = ct_journal_start(&w)) != 0 ||
+		    (ret = ct_journal_follow(&w)) != 0)
+			break;
+		CINFO("%s: starting a new journal", path);
+		ct_journal_unwatch(&w);
+	}
+	ct_journal_unwatch(&w);
+done:
+	for (i = 0; i < w.w_nroots; i++)
+		e_free(&w.w_roots[i]);
+	if (w.w_roots != NULL)
+		e_free(&w.w_roots);
+	if (w.w_rootfd != NULL)
+		e_free(&w.w_rootfd);
+	if (w.w_fsid != NULL)
+		e_free(&w.w_fsid);
+
+	return (ret);
+}
+
+#else /* __linux__ */
+
+/* ARGSUSED */
+int
+ct_journal_watch(const char *path, char **paths, int fanotify)
+{
+	errno = EOPNOTSUPP;
+	return (CTE_ERRNO);
+}
+
+#endif /* __linux__ */
@@ -289,7 +289,6 @@ int
 ct_extract_complete_file_start(struct ct_global_state *state,
     struct ct_trans *trans)
 {
-	ct_sha1_setup(&trans->tr_fl_node->fn_shactx);
 	if (ct_file_extract_open(state->extract_state,
 	    trans->tr_fl_node) == 0) {
 		state->ct_print_file_start(state->ct_print_state,
@@ -303,11 +302,67 @@ ct_extract_complete_file_start(struct ct_global_state *state,
 	return (0);
 }
 
+static void
+ct_extract_write_data(struct ct_global_state *state, struct ct_trans *trans,
+    uint8_t *buf, size_t size)
+{
+	int	ret;
+
+	if (trans->tr_fl_node->fn_skip_file == 0) {
+		ct_digest_add(buf, &trans->tr_fl_node->fn_shactx, size);
+		if ((ret = ct_file_extract_write(state->extract_state,
+		    trans->tr_fl_node, buf, size)) != 0) {
+			/*
+			 * XXX really this shouldn't be fatal, just make us skip
+			 * the file in future and CWARNX.
+			 */
+			ct_fatal(state, "Failed to write file", ret);
+			return;
+		}
+		state->ct_stats->st_bytes_written += size;
+	}
+}
+
+/* Slice a packed file out of the chunk last read. */
+int
+ct_extract_complete_packed(struct ct_global_state *state,
+    struct ct_trans *trans)
+{
+	uint8_t	*buf;
+
+	if ((buf = ct_file_extract_getpack(state->extract_state,
+	    trans->tr_pack_off, trans->tr_pack_len)) == NULL) {
+		ct_fatal(state, trans->tr_fl_node->fn_fullname,
+		    CTE_CTFILE_CORRUPT);
+		return (0);
+	}
+	ct_extract_write_data(state, trans, buf, trans->tr_pack_len);
+
+	return (0);
+}
+
+/* A run of zeros is a hole in the file. */
+int
+ct_extract_complete_zero(struct ct_global_state *state,
+    struct ct_trans *trans)
+{
+	int	ret;
+
+	if (trans->tr_fl_node->fn_skip_file == 0 &&
+	    (ret = ct_file_extract_hole(state->extract_state,
+	    trans->tr_fl_node, trans->tr_zero)) != 0)
+		ct_fatal(state, "Failed to write file", ret);
+
+	return (0);
+}
+
 int
 ct_extract_complete_file_read(struct ct_global_state *state,
     struct ct_trans *trans)
 {
-	int	slot, ret;
+	uint8_t	*buf;
+	size_t	 size;
+	int	 slot;
 
 	state->ct_stats->st_chunks_completed++;
 	if (trans->tr_errno != 0) {
@@ -325,24 +380,15 @@ ct_extract_complete_file_read(struct ct_global_state *state,
 		return (0);
 	}
 
-	if (trans->tr_fl_node->fn_skip_file == 0) {
-		slot = trans->tr_dataslot;
-		ct_sha1_add(trans->tr_data[slot],
-		    &trans->tr_fl_node->fn_shactx,
-		    trans->tr_size[slot]);
-		if ((ret = ct_file_extract_write(state->extract_state,
-		    trans->tr_fl_node, trans->tr_data[slot],
-		    trans->tr_size[slot])) != 0) {
-			/*
-			 * XXX really this shouldn't be fatal, just make us skip
-			 * the file in future and CWARNX.
-			 */
-			ct_fatal(state, "Failed to write file", ret);
-			return (0);
-		}
-		state->ct_stats->st_bytes_written +=
-		    trans->tr_size[slot];
+	slot = trans->tr_dataslot;
+	buf = trans->tr_data[slot];
+	size = trans->tr_size[slot];
+	if (trans->tr_pack_len != 0) {
+		/* files packed after this one come out of the same chunk */
+		ct_file_extract_setpack(state->extract_state, buf, size);
+		return (ct_extract_complete_packed(state, trans));
 	}
+	ct_extract_write_data(state, trans, buf, size);
 
 	return (0);
 }
@@ -352,7 +398,7 @@ ct_extract_complete_file_end(struct ct_global_state *state,
     struct ct_trans *trans)
 {
 	if (trans->tr_fl_node->fn_skip_file == 0) {
-		ct_sha1_final(trans->tr_csha,
+		ct_digest_final(trans->tr_csha,
 		    &trans->tr_fl_node->fn_shactx);
 		if (memcmp(trans->tr_csha, trans->tr_sha,
 		    sizeof(trans->tr_sha)) != 0)
@@ -394,6 +440,8 @@ struct ct_extract_priv {
 	int				 fillrb;
 	int				 haverb;
 	int				 allfiles;
+	int				 havepack;
+	uint8_t				 pack_sha[SHA_DIGEST_LENGTH];
 };
 
 /*
@@ -581,6 +629,9 @@ ct_extract(struct ct_global_state *state, struct ct_op *op)
 			    ret);
 			goto dying;
 		}
+		if (state->ct_config->ct_io_uring)
+			ct_file_extract_uring(state->extract_state,
+			    state->ct_max_block_size);
 
 		if (ct_extract_calculate_total(state, cea, ex_priv->inc_match,
 		    ex_priv->ex_match) != 0) {
@@ -771,6 +822,28 @@ skip:
 			/* use saved fnode */
 			trans->tr_fl_node = ex_priv->fl_ex_node;
 
+			/*
+			 * Files packed together follow each other, only the
+			 * first needs to fetch the chunk.
+			 */
+			if (ex_priv->xdr_ctx.xs_packed && ex_priv->havepack &&
+			    memcmp(ex_priv->pack_sha,
+			    (ex_priv->xdr_ctx.xs_gh.cmg_flags & CT_MD_CRYPTO) ?
+			    ex_priv->xdr_ctx.xs_csha : ex_priv->xdr_ctx.xs_sha,
+			    sizeof(ex_priv->pack_sha)) == 0) {
+				trans = ct_trans_realloc_local(state, trans);
+				trans->tr_pack_off =
+				    ex_priv->xdr_ctx.xs_pack.cmp_offset;
+				trans->tr_pack_len =
+				    ex_priv->xdr_ctx.xs_pack.cmp_len;
+				trans->tr_state = TR_S_EX_UNCOMPRESSED;
+				trans->tr_complete = ct_extract_complete_packed;
+				ct_ref_fnode(trans->tr_fl_node);
+				trans->tr_cleanup = ct_extract_cleanup_fnode;
+				ct_queue_first(state, trans);
+				break;
+			}
+
 			if (memcmp(zerosha, ex_priv->xdr_ctx.xs_sha,
 				SHA_DIGEST_LENGTH) == 0) {
 				CWARNX("\"%s\" truncated during backup",
@@ -805,6 +878,15 @@ skip:
 				ct_sha1_encode(trans->tr_sha, shat);
 				CNDBG(CT_LOG_SHA, "extracting sha %s", shat);
 			}
+			if (ex_priv->xdr_ctx.xs_packed) {
+				trans->tr_pack_off =
+				    ex_priv->xdr_ctx.xs_pack.cmp_offset;
+				trans->tr_pack_len =
+				    ex_priv->xdr_ctx.xs_pack.cmp_len;
+				bcopy(trans->tr_sha, ex_priv->pack_sha,
+				    sizeof(ex_priv->pack_sha));
+				ex_priv->havepack = 1;
+			}
 			trans->tr_state = TR_S_EX_SHA;
 			trans->tr_complete = ct_extract_complete_file_read;
 			trans->tr_dataslot = 0;
@@ -812,6 +894,28 @@ skip:
 			trans->tr_cleanup = ct_extract_cleanup_fnode;
 			ct_queue_first(state, trans);
 			break;
+		case XS_RET_ZERO:
+			if (ex_priv->doextract == 0 ||
+			    ex_priv->fl_ex_node->fn_skip_file != 0) {
+				if (ctfile_parse_seek(&ex_priv->xdr_ctx)) {
+					ct_fatal(state, "Can't seek past shas",
+					    ex_priv->xdr_ctx.xs_errno);
+					goto dying;
+				}
+				ct_trans_free(state, trans);
+				continue;
+			}
+
+			/* nothing to fetch, just skip ahead in the file */
+			trans = ct_trans_realloc_local(state, trans);
+			trans->tr_fl_node = ex_priv->fl_ex_node;
+			trans->tr_zero = ex_priv->xdr_ctx.xs_zero;
+			trans->tr_state = TR_S_EX_UNCOMPRESSED;
+			trans->tr_complete = ct_extract_complete_zero;
+			ct_ref_fnode(trans->tr_fl_node);
+			trans->tr_cleanup = ct_extract_cleanup_fnode;
+			ct_queue_first(state, trans);
+			break;
 		case XS_RET_FILE_END:
 			trans = ct_trans_realloc_local(state, trans);
 
@@ -1010,6 +1114,9 @@ ct_extract_file(struct ct_global_state *state, struct ct_op *op)
 			e_free(&ex_priv);
 			goto dying;
 		}
+		if (state->ct_config->ct_io_uring)
+			ct_file_extract_uring(state->extract_state,
+			    state->ct_max_block_size);
 		op->op_priv = ex_priv;
 		break;
 	case CT_S_FINISHED:
@@ -1115,12 +1222,27 @@ ct_extract_file(struct ct_global_state *state, struct ct_op *op)
 				ct_sha1_encode(trans->tr_sha, shat);
 				CNDBG(CT_LOG_SHA, "extracting sha %s", shat);
 			}
+			if (ex_priv->xdr_ctx.xs_packed) {
+				trans->tr_pack_off =
+				    ex_priv->xdr_ctx.xs_pack.cmp_offset;
+				trans->tr_pack_len =
+				    ex_priv->xdr_ctx.xs_pack.cmp_len;
+			}
 			trans->tr_state = TR_S_EX_SHA;
 			trans->tr_complete = ct_extract_complete_file_read;
 			trans->tr_cleanup = ct_extract_cleanup_fnode;
 			trans->tr_dataslot = 0;
 			ct_ref_fnode(trans->tr_fl_node);
 			break;
+		case XS_RET_ZERO:
+			trans = ct_trans_realloc_local(state, trans);
+			trans->tr_fl_node = ex_priv->fl_ex_node; /* reload */
+			trans->tr_zero = ex_priv->xdr_ctx.xs_zero;
+			trans->tr_state = TR_S_EX_UNCOMPRESSED;
+			trans->tr_complete = ct_extract_complete_zero;
+			trans->tr_cleanup = ct_extract_cleanup_fnode;
+			ct_ref_fnode(trans->tr_fl_node);
+			break;
 		case XS_RET_FILE_END:
 			trans = ct_trans_realloc_local(state, trans);
 			trans->tr_fl_node = ex_priv->fl_ex_node; /* reload */
@@ -1296,6 +1418,7 @@ ct_exists_file(struct ct_global_state *state, struct ct_op *op)
 		switch ((ret = ctfile_parse(&ex_priv->xdr_ctx))) {
 		case XS_RET_FILE:
 		case XS_RET_FILE_END:
+		case XS_RET_ZERO:
 			ct_trans_free(state, trans);
 			break;
 		case XS_RET_SHA:
@@ -13,7 +13,13 @@
  * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
+#include <sys/time.h>
+
+#include <sys/types.h>
+#include <sys/mman.h>
+
 #include <unistd.h>
+#include <sched.h>
 #include <inttypes.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -43,18 +49,7 @@ void ct_handle_read_reply(struct ct_global_state *, struct ct_trans *,
 
 static struct ct_trans *ct_trans_alloc_local(struct ct_global_state *);
 
-/* RedBlack completion queue, also used for wait queue. */
-
-int ct_cmp_trans(struct ct_trans *c1, struct ct_trans *c2);
-
-RB_GENERATE(ct_trans_lookup, ct_trans, tr_trans_rbnode, ct_cmp_trans);
-
-int
-ct_cmp_trans(struct ct_trans *c1, struct ct_trans *c2)
-{
-	return ((c1->tr_trans_id < c2->tr_trans_id)
-	    ? -1 : (c1->tr_trans_id > c2->tr_trans_id));
-}
+/* RedBlack inflight queue, keyed by packet tag. */
 
 int ct_cmp_iotrans(struct ct_trans *c1, struct ct_trans *c2);
 
@@ -71,6 +66,7 @@ int
 ct_setup_state(struct ct_global_state **statep, struct ct_config *conf)
 {
 	struct ct_global_state *state;
+	struct ct_compress_ctx *ccc;
 
 	/* unless we have shared memory, init is simple */
 	state = e_calloc(1, sizeof(*state));
@@ -79,6 +75,7 @@ ct_setup_state(struct ct_global_state **statep, struct ct_config *conf)
 	state->ct_stats = e_calloc(1, sizeof(*state->ct_stats));
 
 	TAILQ_INIT(&state->ct_trans_free_head);
+	TAILQ_INIT(&state->ct_trans_local_free_head);
 	state->ct_trans_id = 0;
 	state->ct_packet_id = 0;
 	state->ct_tr_tag = 0;
@@ -90,19 +87,38 @@ ct_setup_state(struct ct_global_state **statep, struct ct_config *conf)
 	/* default max trans, modified by negotiation */
 	state->ct_max_trans = conf->ct_max_trans;
 
+	ct_worker_pool_init(&state->ct_comp_pool, conf->ct_compress_threads);
+	state->ct_stats->st_comp_workers = state->ct_comp_pool.wp_nworkers;
+	ct_worker_pool_init(&state->ct_crypt_pool, conf->ct_crypto_threads);
+	state->ct_stats->st_crypt_workers = state->ct_crypt_pool.wp_nworkers;
+	if (conf->ct_fused_threads > 0) {
+		ct_worker_pool_init(&state->ct_fused_pool,
+		    conf->ct_fused_threads);
+		state->ct_stats->st_fused_workers =
+		    state->ct_fused_pool.wp_nworkers;
+	}
+	if (conf->ct_sched_threads > 0) {
+		ct_worker_pool_init(&state->ct_sched_pool,
+		    conf->ct_sched_threads);
+		state->ct_stats->st_sched_workers =
+		    state->ct_sched_pool.wp_nworkers;
+	}
+
 	if (conf->ct_compress) {
-		state->ct_compress_state =
-		    ct_init_compression(conf->ct_compress);
-		if (state->ct_compress_state == NULL) {
+		/* the other workers set theirs up on first use */
+		if ((ccc = ct_init_compression(conf->ct_compress)) == NULL) {
+			ct_worker_pool_cleanup(&state->ct_comp_pool);
+			ct_worker_pool_cleanup(&state->ct_crypt_pool);
+			ct_worker_pool_cleanup(&state->ct_fused_pool);
+			ct_worker_pool_cleanup(&state->ct_sched_pool);
 			e_free(&state->ct_stats);
 			e_free(&state);
 			return (CTE_SHRINK_INIT);
 		}
+		state->ct_comp_pool.wp_workers[0].w_comp_ctx = ccc;
 		state->ct_alloc_block_size =
-		    ct_compress_bounds(state->ct_compress_state,
-		    state->ct_max_block_size);
+		    ct_compress_bounds(ccc, state->ct_max_block_size);
 	} else {
-		state->ct_compress_state = NULL;
 		state->ct_alloc_block_size = state->ct_max_block_size;
 	}
 
@@ -114,23 +130,15 @@ ct_setup_state(struct ct_global_state **statep, struct ct_config *conf)
 	/* XXX: We need this? */
 	/* state->ct_write_state = CT_S_WAITING_TRANS; */
 
-	TAILQ_INIT(&state->ct_sha_queue);
-	TAILQ_INIT(&state->ct_comp_queue);
-	TAILQ_INIT(&state->ct_crypt_queue);
-	TAILQ_INIT(&state->ct_csha_queue);
 	TAILQ_INIT(&state->ct_write_queue);
 	TAILQ_INIT(&state->ct_queued);
 	RB_INIT(&state->ct_inflight);
-	RB_INIT(&state->ct_complete);
 	TAILQ_INIT(&state->ct_operations);
 
-	state->ct_sha_qlen = 0;
-	state->ct_comp_qlen = 0;
-	state->ct_crypt_qlen = 0;
-	state->ct_csha_qlen = 0;
+	state->ct_sha_ticket = 0;
+	state->ct_sha_ticket_done = 0;
 	state->ct_write_qlen = 0;
 	state->ct_inflight_rblen = 0;
-	state->ct_complete_rblen = 0;
 
 	state->ct_disconnected = 0;
 	state->ct_reconnect_pending = 0;
@@ -142,6 +150,88 @@ ct_setup_state(struct ct_global_state **statep, struct ct_config *conf)
 	return (0);
 }
 
+void
+ct_worker_pool_init(struct ct_worker_pool *wp, int nworkers)
+{
+	struct ct_worker	*w;
+	int			 i;
+
+	if (nworkers < 1)
+		nworkers = 1;
+	if (nworkers > CT_MAX_WORKERS)
+		nworkers = CT_MAX_WORKERS;
+
+	CT_LOCK_INIT(&wp->wp_lock);
+	TAILQ_INIT(&wp->wp_idle);
+	wp->wp_nworkers = nworkers;
+	wp->wp_workers = e_calloc(nworkers, sizeof(*wp->wp_workers));
+	for (i = 0; i < nworkers; i++) {
+		w = &wp->wp_workers[i];
+		w->w_id = i;
+		TAILQ_INSERT_TAIL(&wp->wp_idle, w, w_link);
+	}
+}
+
+void
+ct_worker_pool_cleanup(struct ct_worker_pool *wp)
+{
+	struct ct_worker	*w;
+	int			 i;
+
+	if (wp->wp_workers == NULL)
+		return;
+
+	for (i = 0; i < wp->wp_nworkers; i++) {
+		w = &wp->wp_workers[i];
+		ct_cleanup_compression(w->w_comp_ctx);
+		ct_cleanup_crypto(w->w_enc_ctx);
+		ct_cleanup_crypto(w->w_dec_ctx);
+		ct_cleanup_iv(w->w_iv_ctx);
+	}
+	e_free(&wp->wp_workers);
+	wp->wp_nworkers = 0;
+	TAILQ_INIT(&wp->wp_idle);
+	CT_LOCK_RELEASE(&wp->wp_lock);
+}
+
+/*
+ * A thread servicing a stage borrows a worker for the length of one pass
+ * over the stage's queue.
+ */
+struct ct_worker *
+ct_worker_get(struct ct_worker_pool *wp)
+{
+	struct ct_worker	*w;
+
+	CT_LOCK(&wp->wp_lock);
+	if ((w = TAILQ_FIRST(&wp->wp_idle)) == NULL)
+		CABORTX("more threads than workers in pool");
+	TAILQ_REMOVE(&wp->wp_idle, w, w_link);
+	CT_UNLOCK(&wp->wp_lock);
+
+	return (w);
+}
+
+void
+ct_worker_put(struct ct_worker_pool *wp, struct ct_worker *w)
+{
+	CT_LOCK(&wp->wp_lock);
+	TAILQ_INSERT_HEAD(&wp->wp_idle, w, w_link);
+	CT_UNLOCK(&wp->wp_lock);
+}
+
+/* Only the thread holding a worker touches that worker's counters. */
+static void
+ct_worker_account(uint64_t *busy, uint64_t *chunks, struct timeval *start)
+{
+	struct timeval		end;
+
+	gettimeofday(&end, NULL);
+	timersub(&end, start, &end);
+	*busy += (uint64_t)end.tv_sec * 1000000 + end.tv_usec;
+	(*chunks)++;
+}
+
 void
 ct_set_file_state(struct ct_global_state *state, int newstate)
 {
@@ -154,104 +244,360 @@ ct_get_file_state(struct ct_global_state *state)
 	return (state->ct_file_state);
 }
 
+/*
+ * Bounded MPMC ring (after Vyukov). Each cell carries a sequence number:
+ * seq == pos means the cell is free for the producer claiming pos,
+ * seq == pos + 1 means it holds an entry for the consumer claiming pos.
+ */
+void
+ct_ring_init(struct ct_ring *r, int nelem)
+{
+	uint64_t	size, i;
+
+	for (size = 2; size < (uint64_t)nelem; size <<= 1)
+		;
+	r->r_cells = e_calloc(size, sizeof(*r->r_cells));
+	for (i = 0; i < size; i++)
+		r->r_cells[i].rc_seq = i;
+	r->r_mask = size - 1;
+	r->r_head = 0;
+	r->r_tail = 0;
+}
+
 void
-ct_queue_sha(struct ct_global_state *state, struct ct_trans *trans)
+ct_ring_cleanup(struct ct_ring *r)
 {
-	CT_LOCK(&state->ct_sha_lock);
-	TAILQ_INSERT_TAIL(&state->ct_sha_queue, trans, tr_next);
-	state->ct_sha_qlen++;
-	ct_wakeup_sha(state->event_state);
-	CT_UNLOCK(&state->ct_sha_lock);
+	if (r->r_cells == NULL)
+		return;
+	e_free(&r->r_cells);
+	r->r_mask = 0;
+}
+
+/* Returns non zero if the ring is full. */
+int
+ct_ring_put(struct ct_ring *r, struct ct_trans *trans)
+{
+	struct ct_ring_cell	*c;
+	uint64_t		 pos, seq;
+
+	pos = CT_ATOMIC_LOAD(&r->r_head);
+	for (;;) {
+		c = &r->r_cells[pos & r->r_mask];
+		seq = CT_ATOMIC_LOAD(&c->rc_seq);
+		if (seq == pos) {
+			if (CT_ATOMIC_CAS(&r->r_head, pos, pos + 1))
+				break;
+			pos = CT_ATOMIC_LOAD(&r->r_head);
+		} else if ((int64_t)(seq - pos) < 0) {
+			return (1);
+		} else {
+			pos = CT_ATOMIC_LOAD(&r->r_head);
+		}
+	}
+	c->rc_trans = trans;
+	CT_ATOMIC_STORE(&c->rc_seq, pos + 1);
+
+	return (0);
 }
 
 struct ct_trans *
-ct_dequeue_sha(struct ct_global_state *state)
+ct_ring_get(struct ct_ring *r)
 {
-	struct ct_trans *trans;
+	struct ct_ring_cell	*c;
+	struct ct_trans		*trans;
+	uint64_t		 pos, seq;
+
+	pos = CT_ATOMIC_LOAD(&r->r_tail);
+	for (;;) {
+		c = &r->r_cells[pos & r->r_mask];
+		seq = CT_ATOMIC_LOAD(&c->rc_seq);
+		if (seq == pos + 1) {
+			if (CT_ATOMIC_CAS(&r->r_tail, pos, pos + 1))
+				break;
+			pos = CT_ATOMIC_LOAD(&r->r_tail);
+		} else if ((int64_t)(seq - (pos + 1)) < 0) {
+			return (NULL);
+		} else {
+			pos = CT_ATOMIC_LOAD(&r->r_tail);
+		}
+	}
+	trans = c->rc_trans;
+	CT_ATOMIC_STORE(&c->rc_seq, pos + r->r_mask + 1);
+
+	return (trans);
+}
 
-	CT_LOCK(&state->ct_sha_lock);
-	if ((trans = TAILQ_FIRST(&state->ct_sha_queue)) != NULL) {
-		TAILQ_REMOVE(&state->ct_sha_queue, trans, tr_next);
-		state->ct_sha_qlen--;
+/*
+ * Claim up to max consecutive entries with a single update of the tail.
+ * Returns the number of transactions stored in out.
+ */
+int
+ct_ring_get_batch(struct ct_ring *r, struct ct_trans **out, int max)
+{
+	struct ct_ring_cell	*c;
+	uint64_t		 pos, seq;
+	int			 i, n;
+
+	if ((uint64_t)max > r->r_mask + 1)
+		max = r->r_mask + 1;
+	for (;;) {
+		pos = CT_ATOMIC_LOAD(&r->r_tail);
+		for (n = 0; n < max; n++) {
+			c = &r->r_cells[(pos + n) & r->r_mask];
+			seq = CT_ATOMIC_LOAD(&c->rc_seq);
+			if (seq != pos + n + 1)
+				break;
+		}
+		if (n == 0) {
+			if ((int64_t)(seq - (pos + 1)) < 0)
+				return (0);
+			continue;
+		}
+		if (CT_ATOMIC_CAS(&r->r_tail, pos, pos + n))
+			break;
+	}
+	for (i = 0; i < n; i++) {
+		c = &r->r_cells[(pos + i) & r->r_mask];
+		out[i] = c->rc_trans;
+		CT_ATOMIC_STORE(&c->rc_seq, pos + i + r->r_mask + 1);
 	}
-	CT_UNLOCK(&state->ct_sha_lock);
+
+	return (n);
+}
+
+/* Racy by nature, but never needs a lock; good enough for display. */
+int
+ct_ring_len(struct ct_ring *r)
+{
+	uint64_t	head, tail;
+
+	tail = CT_ATOMIC_LOAD(&r->r_tail);
+	head = CT_ATOMIC_LOAD(&r->r_head);
+	if ((int64_t)(head - tail) <= 0)
+		return (0);
+	if (head - tail > r->r_mask + 1)
+		return (r->r_mask + 1);
+	return (head - tail);
+}
+
+int
+ct_ring_size(struct ct_ring *r)
+{
+	return (r->r_cells == NULL ? 0 : r->r_mask + 1);
+}
+
+/*
+ * Completion reorder buffer.  Ids are handed out in order by
+ * ct_queue_first() and no more than ro_mask + 1 of them are ever
+ * outstanding, so the slot for an id is always empty by the time that id
+ * completes and the drainer never sees a slot reused early.
+ */
+void
+ct_reorder_init(struct ct_reorder *ro, int nelem)
+{
+	uint64_t	size;
+
+	for (size = 2; size < (uint64_t)nelem; size <<= 1)
+		;
+	ro->ro_slots = e_calloc(size, sizeof(*ro->ro_slots));
+	ro->ro_mask = size - 1;
+	ro->ro_len = 0;
+}
+
+void
+ct_reorder_cleanup(struct ct_reorder *ro)
+{
+	if (ro->ro_slots == NULL)
+		return;
+	e_free(&ro->ro_slots);
+	ro->ro_mask = 0;
+}
+
+void
+ct_reorder_put(struct ct_reorder *ro, struct ct_trans *trans)
+{
+	struct ct_trans		**slot;
+
+	slot = &ro->ro_slots[trans->tr_trans_id & ro->ro_mask];
+	if (CT_ATOMIC_LOAD(slot) != NULL)
+		CABORTX("completion slot for trans %" PRIu64 " busy with %"
+		    PRIu64, trans->tr_trans_id, (*slot)->tr_trans_id);
+	CT_ATOMIC_ADD(&ro->ro_len, 1);
+	CT_ATOMIC_STORE(slot, trans);
+}
+
+/* Returns transaction id if it has completed, NULL otherwise. */
+struct ct_trans *
+ct_reorder_get(struct ct_reorder *ro, uint64_t id)
+{
+	struct ct_trans		**slot, *trans;
+
+	slot = &ro->ro_slots[id & ro->ro_mask];
+	if ((trans = CT_ATOMIC_LOAD(slot)) == NULL)
+		return (NULL);
+	if (trans->tr_trans_id != id)
+		CABORTX("out of window transaction in completion queue %"
+		    PRIu64 " %" PRIu64, trans->tr_trans_id, id);
+	*slot = NULL;
+	CT_ATOMIC_ADD(&ro->ro_len, -1);
 
 	return (trans);
 }
 
+int
+ct_reorder_len(struct ct_reorder *ro)
+{
+	return (CT_ATOMIC_LOAD(&ro->ro_len));
+}
+
+#define CT_MAX_LOCAL_TRANSACTIONS	(100)
+
+/*
+ * Every stage queue must be able to hold every transaction in flight, which
+ * is bounded by the negotiated queue depth plus the odd local transaction.
+ */
 void
-ct_queue_compress(struct ct_global_state *state, struct ct_trans *trans)
+ct_init_queues(struct ct_global_state *state)
 {
-	CT_LOCK(&state->ct_comp_lock);
-	TAILQ_INSERT_TAIL(&state->ct_comp_queue, trans, tr_next);
-	state->ct_comp_qlen++;
-	ct_wakeup_compress(state->event_state);
-	CT_UNLOCK(&state->ct_comp_lock);
+	int	nelem = 2 * (state->ct_max_trans + 1);
+
+	ct_ring_init(&state->ct_sha_ring, nelem);
+	ct_ring_init(&state->ct_comp_ring, nelem);
+	ct_ring_init(&state->ct_crypt_ring, nelem);
+	ct_ring_init(&state->ct_csha_ring, nelem);
+	ct_reorder_init(&state->ct_complete,
+	    state->ct_max_trans + 1 + CT_MAX_LOCAL_TRANSACTIONS);
+}
+
+void
+ct_cleanup_queues(struct ct_global_state *state)
+{
+	ct_ring_cleanup(&state->ct_sha_ring);
+	ct_ring_cleanup(&state->ct_comp_ring);
+	ct_ring_cleanup(&state->ct_crypt_ring);
+	ct_ring_cleanup(&state->ct_csha_ring);
+	ct_reorder_cleanup(&state->ct_complete);
+}
+
+/*
+ * The rings are sized so this should not happen; if it does, kick the
+ * consumers and wait for them to make room.
+ */
+static void
+ct_ring_put_wait(struct ct_ring *r, struct ct_trans *trans,
+    void (*wakeup)(struct ct_event_state *), struct ct_event_state *ev_st)
+{
+	while (ct_ring_put(r, trans) != 0) {
+#if CT_ENABLE_PTHREADS
+		wakeup(ev_st);
+		sched_yield();
+#else
+		CABORTX("stage queue full (%d entries)", ct_ring_size(r));
+#endif
+	}
+	wakeup(ev_st);
+}
+
+void
+ct_queue_sha(struct ct_global_state *state, struct ct_trans *trans)
+{
+	/*
+	 * freshly read chunks are ticketed in file order, see ct_compute_sha.
+	 * Only the file thread produces those so the ticket order matches
+	 * the ring order.
+	 */
+	if (trans->tr_state == TR_S_READ)
+		trans->tr_sha_ticket = CT_ATOMIC_ADD(&state->ct_sha_ticket, 1);
+	ct_ring_put_wait(&state->ct_sha_ring, trans, ct_wakeup_sha,
+	    state->event_state);
 }
 
 struct ct_trans *
-ct_dequeue_compress(struct ct_global_state *state)
+ct_dequeue_sha(struct ct_global_state *state)
 {
-	struct ct_trans	*trans;
+	return (ct_ring_get(&state->ct_sha_ring));
+}
+
+int
+ct_dequeue_sha_batch(struct ct_global_state *state, struct ct_trans **batch,
+    int max)
+{
+	return (ct_ring_get_batch(&state->ct_sha_ring, batch, max));
+}
 
-	CT_LOCK(&state->ct_comp_lock);
-	if ((trans = TAILQ_FIRST(&state->ct_comp_queue)) != NULL) {
-		TAILQ_REMOVE(&state->ct_comp_queue, trans, tr_next);
-		state->ct_comp_qlen--;
+void
+ct_queue_compress(struct ct_global_state *state, struct ct_trans *trans)
+{
+	if (state->ct_sched != NULL) {
+		trans->tr_sched_stage = CT_SCHED_COMPRESS;
+		ct_sched_push(state->ct_sched, trans);
+		return;
 	}
-	CT_UNLOCK(&state->ct_comp_lock);
+	ct_ring_put_wait(&state->ct_comp_ring, trans, ct_wakeup_compress,
+	    state->event_state);
+}
 
-	return (trans);
+struct ct_trans *
+ct_dequeue_compress(struct ct_global_state *state)
+{
+	return (ct_ring_get(&state->ct_comp_ring));
+}
+
+int
+ct_dequeue_compress_batch(struct ct_global_state *state, struct ct_trans **batch,
+    int max)
+{
+	return (ct_ring_get_batch(&state->ct_comp_ring, batch, max));
 }
 
 void
 ct_queue_encrypt(struct ct_global_state *state, struct ct_trans *trans)
 {
-	CT_LOCK(&state->ct_crypt_lock);
-	TAILQ_INSERT_TAIL(&state->ct_crypt_queue, trans, tr_next);
-	state->ct_crypt_qlen++;
-	ct_wakeup_encrypt(state->event_state);
-	CT_UNLOCK(&state->ct_crypt_lock);
+	if (state->ct_sched != NULL) {
+		trans->tr_sched_stage = CT_SCHED_ENCRYPT;
+		ct_sched_push(state->ct_sched, trans);
+		return;
+	}
+	ct_ring_put_wait(&state->ct_crypt_ring, trans, ct_wakeup_encrypt,
+	    state->event_state);
 }
 
 struct ct_trans *
 ct_dequeue_encrypt(struct ct_global_state *state)
 {
-	struct ct_trans	*trans;
-
-	CT_LOCK(&state->ct_crypt_lock);
-	if ((trans = TAILQ_FIRST(&state->ct_crypt_queue)) != NULL) {
-		TAILQ_REMOVE(&state->ct_crypt_queue, trans, tr_next);
-		state->ct_crypt_qlen--;
-	}
-	CT_UNLOCK(&state->ct_crypt_lock);
+	return (ct_ring_get(&state->ct_crypt_ring));
+}
 
-	return (trans);
+int
+ct_dequeue_encrypt_batch(struct ct_global_state *state, struct ct_trans **batch,
+    int max)
+{
+	return (ct_ring_get_batch(&state->ct_crypt_ring, batch, max));
 }
 
 void
 ct_queue_csha(struct ct_global_state *state, struct ct_trans *trans)
 {
-	CT_LOCK(&state->ct_csha_lock);
-	TAILQ_INSERT_TAIL(&state->ct_csha_queue, trans, tr_next);
-	state->ct_csha_qlen++;
-	ct_wakeup_csha(state->event_state);
-	CT_UNLOCK(&state->ct_csha_lock);
+	if (state->ct_sched != NULL) {
+		trans->tr_sched_stage = CT_SCHED_CSHA;
+		ct_sched_push(state->ct_sched, trans);
+		return;
+	}
+	ct_ring_put_wait(&state->ct_csha_ring, trans, ct_wakeup_csha,
+	    state->event_state);
 }
 
 struct ct_trans *
 ct_dequeue_csha(struct ct_global_state *state)
 {
-	struct ct_trans *trans;
-
-	CT_LOCK(&state->ct_csha_lock);
-	if ((trans = TAILQ_FIRST(&state->ct_csha_queue)) != NULL) {
-		TAILQ_REMOVE(&state->ct_csha_queue, trans, tr_next);
-		state->ct_csha_qlen--;
-	}
-	CT_UNLOCK(&state->ct_csha_lock);
+	return (ct_ring_get(&state->ct_csha_ring));
+}
 
-	return (trans);
+int
+ct_dequeue_csha_batch(struct ct_global_state *state, struct ct_trans **batch,
+    int max)
+{
+	return (ct_ring_get_batch(&state->ct_csha_ring, batch, max));
 }
 
 void
@@ -279,6 +625,37 @@ ct_dequeue_write(struct ct_global_state *state)
 	return (trans);
 }
 
+int
+ct_dequeue_write_batch(struct ct_global_state *state, struct ct_trans **batch,
+    int max)
+{
+	int	n = 0;
+
+	CT_LOCK(&state->ct_write_lock);
+	while (n < max &&
+	    (batch[n] = TAILQ_FIRST(&state->ct_write_queue)) != NULL) {
+		TAILQ_REMOVE(&state->ct_write_queue, batch[n], tr_next);
+		state->ct_write_qlen--;
+		n++;
+	}
+	CT_UNLOCK(&state->ct_write_lock);
+
+	return (n);
+}
+
+/* Put back the unsent tail of a batch, keeping its order. */
+static void
+ct_requeue_write_batch(struct ct_global_state *state, struct ct_trans **batch,
+    int n)
+{
+	CT_LOCK(&state->ct_write_lock);
+	while (n-- > 0) {
+		TAILQ_INSERT_HEAD(&state->ct_write_queue, batch[n], tr_next);
+		state->ct_write_qlen++;
+	}
+	CT_UNLOCK(&state->ct_write_lock);
+}
+
 void
 ct_queue_queued(struct ct_global_state *state, struct ct_trans *trans)
 {
@@ -301,31 +678,19 @@ ct_dequeue_queued(struct ct_global_state *state, struct ct_trans *trans)
 void
 ct_queue_complete(struct ct_global_state *state, struct ct_trans *trans)
 {
-	CT_LOCK(&state->ct_complete_lock);
-	RB_INSERT(ct_trans_lookup, &state->ct_complete, trans);
-	state->ct_complete_rblen++;
+	ct_reorder_put(&state->ct_complete, trans);
 	ct_wakeup_complete(state->event_state);
-	CT_UNLOCK(&state->ct_complete_lock);
 }
 
+/* Only called from the event loop, which owns ct_packet_id. */
 struct ct_trans *
 ct_dequeue_complete(struct ct_global_state *state)
 {
 	struct ct_trans	*trans;
 
-	CT_LOCK(&state->ct_complete_lock);
-	if ((trans = RB_MIN(ct_trans_lookup, &state->ct_complete)) != NULL &&
-	    trans->tr_trans_id == state->ct_packet_id) {
-		RB_REMOVE(ct_trans_lookup, &state->ct_complete, trans);
-		state->ct_complete_rblen--;
+	if ((trans = ct_reorder_get(&state->ct_complete,
+	    state->ct_packet_id)) != NULL)
 		state->ct_packet_id++;
-	} else if (trans != NULL && trans->tr_trans_id < state->ct_packet_id) {
-		CABORTX("old transaction found in completion queue %" PRIu64
-		    " %" PRIu64, trans->tr_trans_id, state->ct_packet_id);
-	} else {
-		trans = NULL;
-	}
-	CT_UNLOCK(&state->ct_complete_lock);
 
 	return (trans);
 }
@@ -712,7 +1077,6 @@ ct_queue_transfer(struct ct_global_state *state, struct ct_trans *trans)
  *
  * this number probably wants some careful tuning.
  */
-#define CT_MAX_LOCAL_TRANSACTIONS	(100)
 static struct ct_trans *
 ct_trans_alloc_local(struct ct_global_state *state)
 {
@@ -723,18 +1087,17 @@ ct_trans_alloc_local(struct ct_global_state *state)
 		return (NULL);
 	state->ct_num_local_transactions++;
 
-	/*
-	 * This should come from preallocated shared memory
-	 * however for now since this is unneeded just allocate on demand.
-	 */
-	trans = e_calloc(1, sizeof(*trans));
-
 	/*
 	 * No tag, body or compressed body. If they are needed then trans
 	 * is not local.
 	 */
-	trans->tr_data[0] = NULL;
-	trans->tr_data[1] = NULL;
+	if ((trans = TAILQ_FIRST(&state->ct_trans_local_free_head)) != NULL) {
+		TAILQ_REMOVE(&state->ct_trans_local_free_head, trans,
+		    tr_next);
+		bzero(trans, sizeof(*trans));
+	} else {
+		trans = e_calloc(1, sizeof(*trans));
+	}
 
 	trans->tr_local = 1;
 
@@ -769,6 +1132,69 @@ ct_trans_realloc_local(struct ct_global_state *state, struct ct_trans *trans)
 	return (tmp);
 }
 
+/*
+ * Data transactions are carved out of a single arena sized for
+ * ct_max_trans instead of being allocated one at a time. If the
+ * arena can't be mapped we fall back to allocating them individually.
+ */
+#define CT_HUGEPAGE_SIZE	(2 * 1024 * 1024)
+static void
+ct_trans_arena_init(struct ct_global_state *state)
+{
+	void	*arena = MAP_FAILED;
+	size_t	 stride, size;
+	int	 huge = state->ct_config->ct_trans_hugepages;
+
+	stride = sizeof(struct ct_trans) + 2 * state->ct_alloc_block_size;
+	stride = (stride + CT_CACHELINE - 1) & ~((size_t)CT_CACHELINE - 1);
+	size = stride * (state->ct_max_trans + 1);
+
+#if defined(MAP_HUGETLB)
+	if (huge) {
+		size_t	hsize;
+
+		hsize = (size + CT_HUGEPAGE_SIZE - 1) &
+		    ~((size_t)CT_HUGEPAGE_SIZE - 1);
+		arena = mmap(NULL, hsize, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANON | MAP_HUGETLB, -1, 0);
+		if (arena != MAP_FAILED) {
+			size = hsize;
+			huge = 0;
+		}
+	}
+#endif
+	if (arena == MAP_FAILED) {
+		arena = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANON, -1, 0);
+		if (arena == MAP_FAILED) {
+			CWARN("can't map %zu byte transaction arena", size);
+			return;
+		}
+#if defined(MADV_HUGEPAGE)
+		/* no reserved huge pages, ask for transparent ones */
+		if (huge)
+			(void)madvise(arena, size, MADV_HUGEPAGE);
+#endif
+	}
+
+	state->ct_trans_arena = arena;
+	state->ct_trans_arena_size = size;
+	state->ct_trans_stride = stride;
+	state->ct_trans_arena_nelem = state->ct_max_trans + 1;
+	CNDBG(CT_LOG_TRANS, "%d transactions in %zu byte arena",
+	    state->ct_trans_arena_nelem, size);
+}
+
+static int
+ct_trans_in_arena(struct ct_global_state *state, struct ct_trans *trans)
+{
+	uint8_t	*p = (uint8_t *)trans;
+
+	return (state->ct_trans_arena != NULL &&
+	    p >= state->ct_trans_arena &&
+	    p < state->ct_trans_arena + state->ct_trans_arena_size);
+}
+
 struct ct_trans *
 ct_trans_alloc(struct ct_global_state *state)
 {
@@ -776,7 +1202,6 @@ ct_trans_alloc(struct ct_global_state *state)
 	void *tr_data[2];
 	uint16_t tag;
 
-	/* This should come from preallocated shared memory */
 	if (!TAILQ_EMPTY(&state->ct_trans_free_head)) {
 		trans = TAILQ_FIRST(&state->ct_trans_free_head);
 		TAILQ_REMOVE(&state->ct_trans_free_head, trans, tr_next);
@@ -792,10 +1217,19 @@ ct_trans_alloc(struct ct_global_state *state)
 		if (state->ct_trans_alloc > state->ct_max_trans)
 			return NULL;
 
+		if (state->ct_trans_alloc == 0 &&
+		    state->ct_trans_arena == NULL)
+			ct_trans_arena_init(state);
+		if (state->ct_trans_alloc < state->ct_trans_arena_nelem) {
+			trans = (struct ct_trans *)(state->ct_trans_arena +
+			    state->ct_trans_alloc * state->ct_trans_stride);
+		} else {
+			/* the arena couldn't be mapped */
+			trans = e_calloc(1, state->ct_alloc_block_size * 2
+			    + sizeof(*trans));
+		}
 		state->ct_trans_alloc++;
 
-		trans = e_calloc(1, state->ct_alloc_block_size * 2
-		    + sizeof(*trans));
 		/* need to allocate body and compressed body */
 		trans->tr_data[0] = (uint8_t *)trans + sizeof(*trans);
 		trans->tr_data[1] = (uint8_t *)trans + sizeof(*trans)
@@ -812,11 +1246,10 @@ ct_trans_alloc(struct ct_global_state *state)
 void
 ct_trans_free(struct ct_global_state *state, struct ct_trans *trans)
 {
-	/* This should come from preallocated shared memory freelist */
 	if (trans->tr_local) {
-		/* just chuck local trans for now. */
 		state->ct_num_local_transactions--;
-		e_free(&trans);
+		TAILQ_INSERT_HEAD(&state->ct_trans_local_free_head, trans,
+		    tr_next);
 
 		return;
 	} else {
@@ -842,17 +1275,43 @@ ct_trans_cleanup(struct ct_global_state *state)
 	int count = 0;
 
 	CNDBG(CT_LOG_TRANS, "trans num free  %d", state->ct_trans_free);
-	/* free the transaction data block/or each element */
 	while (!TAILQ_EMPTY(&state->ct_trans_free_head)) {
 		trans = TAILQ_FIRST(&state->ct_trans_free_head);
 		TAILQ_REMOVE(&state->ct_trans_free_head, trans, tr_next);
-		e_free(&trans);
+		if (!ct_trans_in_arena(state, trans))
+			e_free(&trans);
 		count++;
 	}
+	while (!TAILQ_EMPTY(&state->ct_trans_local_free_head)) {
+		trans = TAILQ_FIRST(&state->ct_trans_local_free_head);
+		TAILQ_REMOVE(&state->ct_trans_local_free_head, trans,
+		    tr_next);
+		e_free(&trans);
+	}
+	/*
+	 * Transactions still out in a queue may yet be touched by the stage
+	 * threads, so the arena stays until ct_trans_arena_cleanup().
+	 */
+	if (state->ct_trans_free != state->ct_trans_alloc)
+		CNDBG(CT_LOG_TRANS, "%d transactions outstanding",
+		    state->ct_trans_alloc - state->ct_trans_free);
 	state->ct_trans_free = state->ct_trans_alloc = 0;
 	CNDBG(CT_LOG_TRANS, "freed %d transactions", count);
 }
 
+/* Unmap the transaction arena, only once the stage threads are gone. */
+void
+ct_trans_arena_cleanup(struct ct_global_state *state)
+{
+	if (state->ct_trans_arena == NULL)
+		return;
+	if (munmap(state->ct_trans_arena, state->ct_trans_arena_size) != 0)
+		CWARN("can't unmap transaction arena");
+	state->ct_trans_arena = NULL;
+	state->ct_trans_arena_size = 0;
+	state->ct_trans_arena_nelem = 0;
+}
+
 int
 ct_reconnect_internal(struct ct_global_state *state)
 {
@@ -1209,147 +1668,321 @@ ct_body_free(void *vctx, void *body, struct ct_header *hdr)
 	e_free(&body);
 }
 
-void
-ct_compute_sha(void *vctx)
+/*
+ * There may be several sha workers. The chunk sha is computed in parallel but
+ * the running file sha has to be fed in file order and the ctdb is not safe
+ * for concurrent use, so that part is serialised by ticket number.
+ */
+static void
+ct_sha_order_enter(struct ct_global_state *state, struct ct_trans *trans)
 {
-	struct ct_global_state	*state = vctx;
-	struct ct_trans		*trans;
-	struct fnode		*fnode;
-	char			shat[SHA_DIGEST_STRING_LENGTH];
-	int			slot;
+	CT_LOCK(&state->ct_sha_order_lock);
+	while (trans->tr_sha_ticket != state->ct_sha_ticket_done)
+		CT_COND_WAIT(&state->ct_sha_order_cv,
+		    &state->ct_sha_order_lock);
+}
 
-	while ((trans = ct_dequeue_sha(state)) != NULL) {
-		/*
-		 * Local transactions should only ever be seen in the file
-		 * and complete ``threads''.
-		 */
-		if (trans->tr_local)
-			CABORTX("%s: local sha found on list", __func__);
-		if (state->ct_dying)
-			goto out;
-		fnode = trans->tr_fl_node;
+/*
+ * Wait for our turn without keeping the lock. Only the holder of the turn
+ * moves it on, so it stays ours until ct_sha_order_leave().
+ */
+static void
+ct_sha_order_wait(struct ct_global_state *state, struct ct_trans *trans)
+{
+	ct_sha_order_enter(state, trans);
+	CT_UNLOCK(&state->ct_sha_order_lock);
+}
 
-		switch (trans->tr_state) {
-		case TR_S_READ:
-			/* compute sha */
-			break;
-		case TR_S_WRITTEN:
-		case TR_S_EXISTS:
-			if (clog_mask_is_set(CT_LOG_SHA)) {
-				ct_sha1_encode(trans->tr_sha, shat);
-				CNDBG(CT_LOG_SHA,
-				    "entering sha into db %" PRIu64 " %s",
-				    trans->tr_trans_id, shat);
-			}
-			/* if this was a db shortcut, update not insert */
-			if (trans->tr_old_genid != -1) {
-				ctdb_update_sha(state->ct_db_state,
-				    trans->tr_sha, trans->tr_current_genid);
-			} else {
-				ctdb_insert_sha(state->ct_db_state,
-				    trans->tr_sha, trans->tr_csha,
-				    trans->tr_iv, trans->tr_current_genid);
-			}
-			trans->tr_state = TR_S_WMD_READY;
-			ct_queue_transfer(state, trans);
-			continue;
-		default:
-			CABORTX("unexpected transaction state %d",
-			    trans->tr_state);
-		}
-		state->ct_stats->st_chunks_tot++;
-		slot = trans->tr_dataslot;
-		CNDBG(CT_LOG_SHA,
-		    "computing sha for trans %" PRIu64 " slot %d, size %d",
-		    trans->tr_trans_id, slot, trans->tr_size[slot]);
-		ct_sha1(trans->tr_data[slot], trans->tr_sha,
-		    trans->tr_size[slot]);
-		ct_sha1_add(trans->tr_data[slot], &fnode->fn_shactx,
-		    trans->tr_size[slot]);
+/* Has our turn come already? */
+static int
+ct_sha_order_ready(struct ct_global_state *state, struct ct_trans *trans)
+{
+	int	ready;
+
+	CT_LOCK(&state->ct_sha_order_lock);
+	ready = trans->tr_sha_ticket == state->ct_sha_ticket_done;
+	CT_UNLOCK(&state->ct_sha_order_lock);
+	return (ready);
+}
+
+static void
+ct_sha_order_leave(struct ct_global_state *state)
+{
+	state->ct_sha_ticket_done++;
+	CT_COND_BROADCAST(&state->ct_sha_order_cv);
+	CT_UNLOCK(&state->ct_sha_order_lock);
+}
+
+/*
+ * Digest that names a chunk. The server names chunks by the SHA1 of what it
+ * is sent, so only the plaintext digest of encrypted file data may differ.
+ */
+static int
+ct_trans_digest(struct ct_global_state *state, struct ct_trans *trans)
+{
+	if ((trans->hdr.c_flags & (C_HDR_F_ENCRYPTED | C_HDR_F_METADATA)) !=
+	    C_HDR_F_ENCRYPTED)
+		return (CT_DIGEST_SHA1);
+	return (state->ct_config->ct_digest);
+}
+
+/*
+ * Sha one transaction, tr_sha may already be there from ct_sha_batch().
+ * Handles the dying case itself since a freshly read chunk has to give up
+ * its ticket.
+ */
+static void
+ct_sha_one(struct ct_global_state *state, struct ct_trans *trans, int hashed)
+{
+	struct fnode		*fnode;
+	char			shat[SHA_DIGEST_STRING_LENGTH];
+	int			slot;
 
-		state->ct_stats->st_bytes_sha += trans->tr_size[slot];
+	if (state->ct_dying) {
+		/* give up our turn so nobody waits on us */
+		if (trans->tr_state == TR_S_READ) {
+			ct_sha_order_enter(state, trans);
+			ct_sha_order_leave(state);
+		}
+		return;
+	}
+	fnode = trans->tr_fl_node;
 
+	switch (trans->tr_state) {
+	case TR_S_READ:
+		/* compute sha */
+		break;
+	case TR_S_WRITTEN:
+	case TR_S_EXISTS:
 		if (clog_mask_is_set(CT_LOG_SHA)) {
 			ct_sha1_encode(trans->tr_sha, shat);
 			CNDBG(CT_LOG_SHA,
-			    "block tr_id %" PRIu64 " sha %s sz %d",
-			    trans->tr_trans_id, shat, trans->tr_size[slot]);
+			    "entering sha into db %" PRIu64 " %s",
+			    trans->tr_trans_id, shat);
 		}
+		/* no ordering needed, just keep other workers out */
+		CT_LOCK(&state->ct_sha_order_lock);
+		/* if this was a db shortcut, update not insert */
+		if (trans->tr_old_genid != -1) {
+			ctdb_update_sha(state->ct_db_state,
+			    trans->tr_sha, trans->tr_current_genid);
+		} else {
+			ctdb_insert_sha(state->ct_db_state,
+			    trans->tr_sha, trans->tr_csha,
+			    trans->tr_iv, trans->tr_current_genid);
+		}
+		CT_UNLOCK(&state->ct_sha_order_lock);
+		trans->tr_state = TR_S_WMD_READY;
+		return;
+	default:
+		CABORTX("unexpected transaction state %d",
+		    trans->tr_state);
+	}
+	slot = trans->tr_dataslot;
+	CNDBG(CT_LOG_SHA,
+	    "computing sha for trans %" PRIu64 " slot %d, size %d",
+	    trans->tr_trans_id, slot, trans->tr_size[slot]);
+	if (hashed == 0 && fnode != NULL) {
+		/* on our turn, feed both digests in one pass */
+		ct_sha_order_wait(state, trans);
+		ct_digest_dual(ct_trans_digest(state, trans),
+		    trans->tr_data[slot], trans->tr_sha, &fnode->fn_shactx,
+		    trans->tr_size[slot]);
+	} else {
+		if (hashed == 0)
+			ct_digest(ct_trans_digest(state, trans),
+			    trans->tr_data[slot], trans->tr_sha,
+			    trans->tr_size[slot]);
+		ct_sha_order_wait(state, trans);
+		/* packed files were summed as they were read */
+		if (fnode != NULL)
+			ct_digest_add(trans->tr_data[slot], &fnode->fn_shactx,
+			    trans->tr_size[slot]);
+	}
+	CT_LOCK(&state->ct_sha_order_lock);
+
+	if (clog_mask_is_set(CT_LOG_SHA)) {
+		ct_sha1_encode(trans->tr_sha, shat);
+		CNDBG(CT_LOG_SHA,
+		    "block tr_id %" PRIu64 " sha %s sz %d",
+		    trans->tr_trans_id, shat, trans->tr_size[slot]);
+	}
+
+	state->ct_stats->st_chunks_tot++;
+	state->ct_stats->st_bytes_sha += trans->tr_size[slot];
+
+	/*
+	 * trinary return:
+	 * yes, no, maybe. csha and iv valid for yes and maybe
+	 */
+	trans->tr_old_genid = -1;
+	switch (ctdb_lookup_sha(state->ct_db_state, trans->tr_sha,
+	    trans->tr_csha, trans->tr_iv, &trans->tr_old_genid)) {
+	case CTDB_SHA_EXISTS:
+		state->ct_stats->st_bytes_exists += trans->tr_chsize;
+		trans->tr_state = TR_S_WMD_READY;
+		break;
+	case CTDB_SHA_MAYBE_EXISTS:
 		/*
-		 * trinary return:
-		 * yes, no, maybe. csha and iv valid for yes and maybe
+		 * Skip the compress/encrypt and try exists stright off.
+		 * if it fails, we go around again, if it passes we
+		 * saved the effort on existing data.
+		 * tr_old_genid is now !-1 and can be used to tell we
+		 * took this path.
 		 */
-		trans->tr_old_genid = -1;
-		switch (ctdb_lookup_sha(state->ct_db_state, trans->tr_sha,
-		    trans->tr_csha, trans->tr_iv, &trans->tr_old_genid)) {
-		case CTDB_SHA_EXISTS:
-			state->ct_stats->st_bytes_exists += trans->tr_chsize;
-			trans->tr_state = TR_S_WMD_READY;
-			break;
-		case CTDB_SHA_MAYBE_EXISTS:
-			/*
-			 * Skip the compress/encrypt and try exists stright off.
-			 * if it fails, we go around again, if it passes we
-			 * saved the effort on existing data.
-			 * tr_old_genid is now !-1 and can be used to tell we
-			 * took this path.
-			 */
-			trans->tr_state = TR_S_COMPSHA_ED;
-			break;
-		case CTDB_SHA_NEXISTS:
-			trans->tr_state = TR_S_UNCOMPSHA_ED;
-			break;
-		default:
-			CABORTX("unexpected return value");
-		}
-out:
-		ct_queue_transfer(state, trans);
+		trans->tr_state = TR_S_COMPSHA_ED;
+		break;
+	case CTDB_SHA_NEXISTS:
+		trans->tr_state = TR_S_UNCOMPSHA_ED;
+		break;
+	default:
+		CABORTX("unexpected return value");
 	}
+	ct_sha_order_leave(state);
 }
 
-void
-ct_compute_csha(void *vctx)
+/*
+ * Digest the chunks of a batch that need it in one go, the sha backend can
+ * do several buffers at once. Fresh chunks get tr_sha, encrypted ones tr_csha.
+ * Chunks named by another digest are done one at a time, it spreads the work
+ * within a chunk instead.
+ */
+static void
+ct_sha_batch(struct ct_global_state *state, struct ct_trans **batch, int n,
+    int csha)
 {
-	struct ct_global_state	*state = vctx;
 	struct ct_trans		*trans;
-	char			shat[SHA_DIGEST_STRING_LENGTH];
-	int			slot;
+	uint8_t			*src[CT_DEQUEUE_BATCH], *dst[CT_DEQUEUE_BATCH];
+	size_t			 len[CT_DEQUEUE_BATCH];
+	int			 i, m = 0, slot, alg;
 
+	/* dying is never undone, the callers skip the rest of the batch too */
+	if (state->ct_dying)
+		return;
+	for (i = 0; i < n; i++) {
+		trans = batch[i];
+		if (csha == 0 && trans->tr_state != TR_S_READ)
+			continue;
+		slot = trans->tr_dataslot;
+		if (csha == 0 &&
+		    (alg = ct_trans_digest(state, trans)) != CT_DIGEST_SHA1) {
+			ct_digest(alg, trans->tr_data[slot], trans->tr_sha,
+			    trans->tr_size[slot]);
+			continue;
+		}
+		src[m] = trans->tr_data[slot];
+		dst[m] = csha ? trans->tr_csha : trans->tr_sha;
+		len[m] = trans->tr_size[slot];
+		m++;
+	}
+	ct_sha1_multi(src, dst, len, m);
+}
 
-	while ((trans = ct_dequeue_csha(state)) != NULL) {
+/*
+ * The ordered sha step for a batch off the sha queue, its fresh chunks hold
+ * a run of consecutive tickets. Once the turn of the first has come the
+ * others follow straight on, so each chunk is read once for both its own
+ * and its file's digest. If the turn is still elsewhere the chunk digests
+ * are done several at a time meanwhile, and the file digests fed after.
+ */
+static void
+ct_sha_run(struct ct_global_state *state, struct ct_trans **batch, int n)
+{
+	int			 i, hashed = 0;
+
+	for (i = 0; i < n; i++)
+		if (batch[i]->tr_state == TR_S_READ)
+			break;
+	if (i < n && ct_sha_order_ready(state, batch[i]) == 0) {
+		ct_sha_batch(state, batch, n, 0);
+		hashed = 1;
+	}
+	for (i = 0; i < n; i++) {
 		/*
-		 * Local transactions should only ever be seen in the file
-		 * and complete ``threads''.
+		 * Local transactions should only ever be seen in the
+		 * file and complete ``threads''.
 		 */
-		if (trans->tr_local)
+		if (batch[i]->tr_local)
 			CABORTX("%s: local sha found on list", __func__);
-		if (state->ct_dying)
-			goto out;
+		ct_sha_one(state, batch[i], hashed);
+	}
+}
 
-		slot = trans->tr_dataslot;
+void
+ct_compute_sha(void *vctx)
+{
+	struct ct_global_state	*state = vctx;
+	struct ct_trans		*batch[CT_DEQUEUE_BATCH];
+	int			 i, n;
+
+	/* batches are runs of sha tickets, so workers never wait on a hole */
+	while ((n = ct_dequeue_sha_batch(state, batch, CT_DEQUEUE_BATCH)) > 0) {
+		ct_sha_run(state, batch, n);
+		for (i = 0; i < n; i++)
+			ct_queue_transfer(state, batch[i]);
+	}
+}
+
+static void
+ct_csha_one(struct ct_global_state *state, struct ct_trans *trans,
+    uint64_t *cshaed, int hashed)
+{
+	char			shat[SHA_DIGEST_STRING_LENGTH];
+	int			slot;
+
+	slot = trans->tr_dataslot;
+	if (hashed == 0)
 		ct_sha1(trans->tr_data[slot], trans->tr_csha,
 		    trans->tr_size[slot]);
 
-		state->ct_stats->st_bytes_csha += trans->tr_size[slot];
+	*cshaed += trans->tr_size[slot];
 
-		if (clog_mask_is_set(CT_LOG_SHA)) {
-			ct_sha1_encode(trans->tr_csha, shat);
-			CNDBG(CT_LOG_SHA, "block tr_id %" PRIu64 " sha %s",
-			    trans->tr_trans_id, shat);
-		}
-		if (trans->tr_old_genid == -1) {
-			/* normal sha */
-			trans->tr_state = TR_S_COMPSHA_ED;
-		} else {
+	if (clog_mask_is_set(CT_LOG_SHA)) {
+		ct_sha1_encode(trans->tr_csha, shat);
+		CNDBG(CT_LOG_SHA, "block tr_id %" PRIu64 " sha %s",
+		    trans->tr_trans_id, shat);
+	}
+	if (trans->tr_old_genid == -1) {
+		/* normal sha */
+		trans->tr_state = TR_S_COMPSHA_ED;
+	} else {
+		/*
+		 * sha has already been exists as part of stale
+		 * database resolution, skip doing exists again.
+		 */
+		trans->tr_state = TR_S_NEXISTS;
+	}
+}
+
+void
+ct_compute_csha(void *vctx)
+{
+	struct ct_global_state	*state = vctx;
+	struct ct_trans		*trans, *batch[CT_DEQUEUE_BATCH];
+	uint64_t		cshaed = 0;
+	int			i, n;
+
+	while ((n = ct_dequeue_csha_batch(state, batch,
+	    CT_DEQUEUE_BATCH)) > 0) {
+		ct_sha_batch(state, batch, n, 1);
+		for (i = 0; i < n; i++) {
+			trans = batch[i];
 			/*
-			 * sha has already been exists as part of stale
-			 * database resolution, skip doing exists again.
+			 * Local transactions should only ever be seen in the
+			 * file and complete ``threads''.
 			 */
-			trans->tr_state = TR_S_NEXISTS;
+			if (trans->tr_local)
+				CABORTX("%s: local sha found on list",
+				    __func__);
+			if (state->ct_dying == 0)
+				ct_csha_one(state, trans, &cshaed, 1);
+			ct_queue_transfer(state, trans);
 		}
-out:
-		ct_queue_transfer(state, trans);
 	}
+
+	CT_LOCK(&state->ct_stats_lock);
+	state->ct_stats->st_bytes_csha += cshaed;
+	CT_UNLOCK(&state->ct_stats_lock);
 }
 
 void
@@ -1387,23 +2020,97 @@ ct_process_completions(void *vctx)
 	}
 }
 
-void
-ct_process_write(void *vctx)
+static void
+ct_write_one(struct ct_global_state *state, struct ct_trans *trans)
 {
-	struct ct_global_state	*state = vctx;
-	struct ct_trans		*trans;
 	struct ct_header	*hdr;
 	void			*data;
 	int			 nchunks;
 
+	CNDBG(CT_LOG_NET, "wakeup write going");
+	hdr = &trans->hdr;
+
+	nchunks = 0;
+	/* hdr->c_tag was set on transaction allocation */
+	switch(trans->tr_state) {
+	case TR_S_NEXISTS:
+	case TR_S_COMPRESSED:
+	case TR_S_ENCRYPTED: /* if dealing with metadata */
+	case TR_S_READ: /* if dealing with ctfile non-comp/non-crypt */
+		/* doesn't exist in backend, need to send chunk */
+		if (hdr->c_flags & C_HDR_F_METADATA)
+			ct_create_ctfile_write(hdr, &data, &nchunks,
+			    trans->tr_data[(int)trans->tr_dataslot],
+			    trans->tr_size[(int)trans->tr_dataslot],
+			    trans->tr_ctfile_chunkno);
+		else
+			ct_create_write(hdr, &data,
+			    trans->tr_data[(int)trans->tr_dataslot],
+			    trans->tr_size[(int)trans->tr_dataslot]);
+		state->ct_stats->st_bytes_sent +=
+		    trans->tr_size[(int)trans->tr_dataslot];
+		break;
+	case TR_S_COMPSHA_ED:
+		ct_create_exists(hdr, &data, trans->tr_csha,
+		    sizeof(trans->tr_csha));
+		break;
+	case TR_S_UNCOMPSHA_ED:
+		ct_create_exists(hdr, &data, trans->tr_sha,
+		    sizeof(trans->tr_sha));
+		break;
+	case TR_S_EX_SHA:
+		ct_create_read(hdr, &data, trans->tr_sha,
+		    sizeof(trans->tr_sha));
+		break;
+	case TR_S_XML_OPEN:
+	case TR_S_XML_CLOSING:
+	case TR_S_XML_LIST:
+	case TR_S_XML_DELETE:
+	case TR_S_XML_CULL_SEND:
+	case TR_S_XML_CULL_SHA_SEND:
+	case TR_S_XML_CULL_COMPLETE_SEND:
+	case TR_S_XML_EXT:
+		/* hdr populated previously */
+		data = trans->tr_data[2];
+		break;
+	default:
+		CABORTX("unexpected state in wakeup_write %d",
+		    trans->tr_state);
+	}
+
+	CNDBG(CT_LOG_NET, "queuing write of op %u trans %" PRIu64
+	    " iotrans %u tstate %d flags 0x%x",
+	    hdr->c_opcode, trans->tr_trans_id, hdr->c_tag,
+	    trans->tr_state, hdr->c_flags);
+
+	/* move transaction to pending RB tree */
+	ct_queue_queued(state, trans);
+
+	if (nchunks > 0) {
+		ct_assl_writev_op(state->ct_assl_ctx, hdr, data,
+		    nchunks);
+	} else {
+		ct_assl_write_op(state->ct_assl_ctx, hdr, data);
+	}
+}
+
+void
+ct_process_write(void *vctx)
+{
+	struct ct_global_state	*state = vctx;
+	struct ct_trans		*trans, *batch[CT_DEQUEUE_BATCH];
+	int			 i, n;
+
 	/*
 	 * If we fataled. just state transition all the transaction and don't
 	 * send any more. Else we will try and reconnect first, which is a
 	 * waste of time.
 	 */
 	if (state->ct_dying != 0) {
-		while ((trans = ct_dequeue_write(state)) != NULL) {
-			ct_queue_transfer(state, trans);
+		while ((n = ct_dequeue_write_batch(state, batch,
+		    CT_DEQUEUE_BATCH)) > 0) {
+			for (i = 0; i < n; i++)
+				ct_queue_transfer(state, batch[i]);
 		}
 		return;
 	}
@@ -1418,82 +2125,26 @@ ct_process_write(void *vctx)
 
 	CNDBG(CT_LOG_NET, "wakeup write");
 	while (state->ct_disconnected == 0 &&
-	    (trans = ct_dequeue_write(state)) != NULL) {
-		/*
-		 * Local transactions should only ever be seen in the file
-		 * and complete ``threads''.
-		 */
-		if (trans->tr_local)
-			CABORTX("%s: local sha found on list", __func__);
-		if (state->ct_dying) {
-			ct_queue_transfer(state, trans);
-			continue;
-		}
-
-		CNDBG(CT_LOG_NET, "wakeup write going");
-		hdr = &trans->hdr;
-
-		nchunks = 0;
-		/* hdr->c_tag was set on transaction allocation */
-		switch(trans->tr_state) {
-		case TR_S_NEXISTS:
-		case TR_S_COMPRESSED:
-		case TR_S_ENCRYPTED: /* if dealing with metadata */
-		case TR_S_READ: /* if dealing with ctfile non-comp/non-crypt */
-			/* doesn't exist in backend, need to send chunk */
-			if (hdr->c_flags & C_HDR_F_METADATA)
-				ct_create_ctfile_write(hdr, &data, &nchunks,
-				    trans->tr_data[(int)trans->tr_dataslot],
-				    trans->tr_size[(int)trans->tr_dataslot],
-				    trans->tr_ctfile_chunkno);
-			else
-				ct_create_write(hdr, &data,
-				    trans->tr_data[(int)trans->tr_dataslot],
-				    trans->tr_size[(int)trans->tr_dataslot]);
-			state->ct_stats->st_bytes_sent +=
-			    trans->tr_size[(int)trans->tr_dataslot];
-			break;
-		case TR_S_COMPSHA_ED:
-			ct_create_exists(hdr, &data, trans->tr_csha,
-			    sizeof(trans->tr_csha));
-			break;
-		case TR_S_UNCOMPSHA_ED:
-			ct_create_exists(hdr, &data, trans->tr_sha,
-			    sizeof(trans->tr_sha));
-			break;
-		case TR_S_EX_SHA:
-			ct_create_read(hdr, &data, trans->tr_sha,
-			    sizeof(trans->tr_sha));
-			break;
-		case TR_S_XML_OPEN:
-		case TR_S_XML_CLOSING:
-		case TR_S_XML_LIST:
-		case TR_S_XML_DELETE:
-		case TR_S_XML_CULL_SEND:
-		case TR_S_XML_CULL_SHA_SEND:
-		case TR_S_XML_CULL_COMPLETE_SEND:
-		case TR_S_XML_EXT:
-			/* hdr populated previously */
-			data = trans->tr_data[2];
-			break;
-		default:
-			CABORTX("unexpected state in wakeup_write %d",
-			    trans->tr_state);
-		}
-
-		CNDBG(CT_LOG_NET, "queuing write of op %u trans %" PRIu64
-		    " iotrans %u tstate %d flags 0x%x",
-		    hdr->c_opcode, trans->tr_trans_id, hdr->c_tag,
-		    trans->tr_state, hdr->c_flags);
-
-		/* move transaction to pending RB tree */
-		ct_queue_queued(state, trans);
+	    (n = ct_dequeue_write_batch(state, batch, CT_DEQUEUE_BATCH)) > 0) {
+		for (i = 0; i < n; i++) {
+			if (state->ct_disconnected) {
+				ct_requeue_write_batch(state, &batch[i], n - i);
+				break;
+			}
+			trans = batch[i];
+			/*
+			 * Local transactions should only ever be seen in the
+			 * file and complete ``threads''.
+			 */
+			if (trans->tr_local)
+				CABORTX("%s: local sha found on list",
+				    __func__);
+			if (state->ct_dying) {
+				ct_queue_transfer(state, trans);
+				continue;
+			}
 
-		if (nchunks > 0) {
-			ct_assl_writev_op(state->ct_assl_ctx, hdr, data,
-			    nchunks);
-		} else {
-			ct_assl_write_op(state->ct_assl_ctx, hdr, data);
+			ct_write_one(state, trans);
 		}
 	}
 }
@@ -1610,11 +2261,10 @@ out:
 	ct_header_free(NULL, hdr);
 }
 
-void
-ct_compute_compress(void *vctx)
+static void
+ct_compress_one(struct ct_global_state *state, struct ct_worker *w,
+    struct ct_trans *trans, uint64_t *compressed, uint64_t *uncompressed)
 {
-	struct ct_global_state	*state = vctx;
-	struct ct_trans		*trans;
 	uint8_t			*src, *dst;
 	size_t			newlen;
 	int			slot;
@@ -1623,220 +2273,498 @@ ct_compute_compress(void *vctx)
 	int			len;
 	int			ncompmode;
 
+	switch(trans->tr_state) {
+	case TR_S_EX_DECRYPTED:
+	case TR_S_EX_READ:
+		/* uncompress */
+		compress = 0;
+		ncompmode = (trans->hdr.c_flags & C_HDR_F_COMPRESSED_MASK);
+		break;
+	case TR_S_READ: /* if metadata */
+	case TR_S_UNCOMPSHA_ED:
+		compress = 1;
+		ncompmode = state->ct_config->ct_compress;
+		break;
+	default:
+		CABORTX("unexpected state for compress %d", trans->tr_state);
+	}
+
+	if (w->w_comp_ctx == NULL ||
+	    ct_compress_type(w->w_comp_ctx) != ncompmode) {
+		/* initial or (change in the middle!) mode */
+		if (w->w_comp_ctx != NULL)
+			ct_cleanup_compression(w->w_comp_ctx);
+		if ((w->w_comp_ctx = ct_init_compression(ncompmode)) == NULL) {
+			char errstr[11]; /* 32 bit int as str */
+			snprintf(errstr, sizeof(errstr), "%" PRIu32,
+			    ncompmode);
+			ct_fatal(state, errstr, CTE_SHRINK_INIT);
+			return;
+		}
+	}
 
-	while ((trans = ct_dequeue_compress(state)) != NULL) {
+	if (w->w_comp_ctx == NULL)
+		CABORTX("compression mode 0?");
+
+	slot = trans->tr_dataslot;
+	if (slot > 1) {
+		CABORTX("transaction with special slot in compress: %d",
+		    slot);
+	}
+	src = trans->tr_data[slot];
+	len = trans->tr_size[slot];
+	dst =  trans->tr_data[!slot];
+
+	if (compress) {
 		/*
-		 * Local transactions should only ever be seen in the file
-		 * and complete ``threads''.
+		 * XXX - we dont want compression to grow buffer so
+		 * limit to block size, s_compress_bounds(block_size)
+		 * however some compression algorithms appear to ignore
+		 * the dest size, so check for newlen after.
 		 */
-		if (trans->tr_local)
-			CABORTX("%s: local sha found on list", __func__);
-		if (state->ct_dying)
-			goto out;
-
-		switch(trans->tr_state) {
-		case TR_S_EX_DECRYPTED:
-		case TR_S_EX_READ:
-			/* uncompress */
-			compress = 0;
-			ncompmode = (trans->hdr.c_flags &
-			    C_HDR_F_COMPRESSED_MASK);
-			break;
-		case TR_S_READ: /* if metadata */
-		case TR_S_UNCOMPSHA_ED:
-			compress = 1;
-			ncompmode = state->ct_config->ct_compress;
-			break;
-		default:
-			CABORTX("unexpected state for compress %d",
-			    trans->tr_state);
+		newlen = len;
+		rv = ct_compress(w->w_comp_ctx, src, dst, len, &newlen);
+		if (newlen >= len) {
+			CNDBG(CT_LOG_TRANS,
+			    "use uncompressed buffer %d %lu", len,
+			    (unsigned long) newlen);
+			rv = 1; /* act like compression failed */
+			newlen = len;
 		}
-
-		if (state->ct_compress_state == NULL ||
-		    ct_compress_type(state->ct_compress_state) != ncompmode) {
-			/* initial or (change in the middle!) mode */
-			if (state->ct_compress_state != NULL)
-				ct_cleanup_compression(
-				    state->ct_compress_state);
-			if ((state->ct_compress_state =
-			    ct_init_compression(ncompmode)) == NULL) {
-				char errstr[11]; /* 32 bit int as str */
-				snprintf(errstr, sizeof(errstr), "%" PRIu32,
-				    ncompmode);
-				ct_fatal(state, errstr, CTE_SHRINK_INIT);
-				goto out;
-			}
+		if (rv == 0)
+			trans->hdr.c_flags |= ncompmode;
+		*compressed += newlen;
+		*uncompressed += trans->tr_chsize;
+	} else {
+		newlen = state->ct_max_block_size;
+		rv = ct_uncompress(w->w_comp_ctx, src, dst, len, &newlen);
+		if (rv) {
+			ct_fatal(state, NULL, CTE_DECOMPRESS_FAILED);
+			return;
 		}
+	}
 
-		if (state->ct_compress_state == NULL)
-			CABORTX("compression mode 0?");
+	CNDBG(CT_LOG_TRANS, "compress block of %d to %lu, rv %d", len,
+	    (unsigned long) newlen, rv);
 
-		slot = trans->tr_dataslot;
-		if (slot > 1) {
-			CABORTX("transaction with special slot in compress: %d",
-			    slot);
-		}
-		src = trans->tr_data[slot];
-		len = trans->tr_size[slot];
-		dst =  trans->tr_data[!slot];
+	/* if compression failed for whatever reason use input data */
+	if (rv == 0) {
+		trans->tr_size[!slot] = newlen;
+		trans->tr_dataslot = !slot;
+	}
 
-		if (compress) {
+	if (compress)
+		trans->tr_state = TR_S_COMPRESSED;
+	else
+		trans->tr_state = TR_S_EX_UNCOMPRESSED;
+}
+
+void
+ct_compute_compress(void *vctx)
+{
+	struct ct_global_state	*state = vctx;
+	struct ct_worker	*w;
+	struct ct_trans		*trans, *batch[CT_DEQUEUE_BATCH];
+	struct timeval		start;
+	uint64_t		compressed = 0, uncompressed = 0;
+	int			i, n;
+
+	w = ct_worker_get(&state->ct_comp_pool);
+
+	while ((n = ct_dequeue_compress_batch(state, batch,
+	    CT_DEQUEUE_BATCH)) > 0) {
+		for (i = 0; i < n; i++) {
+			trans = batch[i];
 			/*
-			 * XXX - we dont want compression to grow buffer so
-			 * limit to block size, s_compress_bounds(block_size)
-			 * however some compression algorithms appear to ignore
-			 * the dest size, so check for newlen after.
+			 * Local transactions should only ever be seen in the
+			 * file and complete ``threads''.
 			 */
-			newlen = len;
-			rv = ct_compress(state->ct_compress_state, src, dst,
-			    len, &newlen);
-			if (newlen >= len) {
-				CNDBG(CT_LOG_TRANS,
-				    "use uncompressed buffer %d %lu", len,
-				    (unsigned long) newlen);
-				rv = 1; /* act like compression failed */
-				newlen = len;
-			}
-			if (rv == 0)
-				trans->hdr.c_flags |= ncompmode;
-			state->ct_stats->st_bytes_compressed += newlen;
-			state->ct_stats->st_bytes_uncompressed +=
-			    trans->tr_chsize;
-		} else {
-			newlen = state->ct_max_block_size;
-			rv = ct_uncompress(state->ct_compress_state, src, dst,
-			    len, &newlen);
-			if (rv) {
-				ct_fatal(state, NULL, CTE_DECOMPRESS_FAILED);
-				goto out;
+			if (trans->tr_local)
+				CABORTX("%s: local sha found on list",
+				    __func__);
+			if (state->ct_dying == 0) {
+				gettimeofday(&start, NULL);
+				ct_compress_one(state, w, trans, &compressed,
+				    &uncompressed);
+				ct_worker_account(
+				    &state->ct_stats->st_comp_busy[w->w_id],
+				    &state->ct_stats->st_comp_chunks[w->w_id],
+				    &start);
 			}
+			ct_queue_transfer(state, trans);
 		}
+	}
 
-		CNDBG(CT_LOG_TRANS, "compress block of %d to %lu, rv %d", len,
-		    (unsigned long) newlen, rv);
-
-		/* if compression failed for whatever reason use input data */
-		if (rv == 0) {
-			trans->tr_size[!slot] = newlen;
-			trans->tr_dataslot = !slot;
-		}
+	CT_LOCK(&state->ct_stats_lock);
+	state->ct_stats->st_bytes_compressed += compressed;
+	state->ct_stats->st_bytes_uncompressed += uncompressed;
+	CT_UNLOCK(&state->ct_stats_lock);
+	ct_worker_put(&state->ct_comp_pool, w);
+}
 
-		if (compress)
-			trans->tr_state = TR_S_COMPRESSED;
-		else
-			trans->tr_state = TR_S_EX_UNCOMPRESSED;
-out:
-		ct_queue_transfer(state, trans);
+/* Is trans a data chunk that is about to be encrypted with a derived iv? */
+static int
+ct_trans_wants_iv(struct ct_trans *trans)
+{
+	switch (trans->tr_state) {
+	case TR_S_READ:
+	case TR_S_UNCOMPSHA_ED:
+	case TR_S_COMPRESSED:
+		return ((trans->hdr.c_flags & C_HDR_F_METADATA) == 0);
+	default:
+		return (0);
 	}
 }
 
-void
-ct_compute_encrypt(void *vctx)
+static struct ct_iv_ctx *
+ct_worker_iv(struct ct_global_state *state, struct ct_worker *w)
 {
-	struct ct_global_state	*state = vctx;
+	if (w->w_iv_ctx == NULL)
+		w->w_iv_ctx = ct_init_iv(state->ct_iv, sizeof(state->ct_iv));
+	return (w->w_iv_ctx);
+}
+
+/*
+ * Derive the ivs of all data chunks in a batch in one go, so that
+ * ct_encrypt_one() can skip it.
+ */
+static void
+ct_encrypt_ivs(struct ct_global_state *state, struct ct_worker *w,
+    struct ct_trans **batch, int n)
+{
+	uint8_t			*src[CT_DEQUEUE_BATCH];
+	uint8_t			*iv[CT_DEQUEUE_BATCH];
+	size_t			 len[CT_DEQUEUE_BATCH];
 	struct ct_trans		*trans;
+	int			 i, m, slot, ret;
+
+	for (i = m = 0; i < n; i++) {
+		trans = batch[i];
+		if (ct_trans_wants_iv(trans) == 0)
+			continue;
+		slot = trans->tr_dataslot;
+		src[m] = trans->tr_data[slot];
+		len[m] = trans->tr_size[slot];
+		iv[m] = trans->tr_iv;
+		m++;
+	}
+	if (m == 0)
+		return;
+
+	if ((ret = ct_iv_ctx_create_batch(ct_worker_iv(state, w), src, len,
+	    iv, sizeof(batch[0]->tr_iv), m)) != 0)
+		ct_fatal(state, "can't create iv", ret);
+}
+
+/*
+ * ived means the iv of a data chunk was made by ct_encrypt_ivs() already.
+ * With crypto_stitch the csha of a data chunk is made while encrypting it and
+ * the chunk skips the csha stage.
+ */
+static void
+ct_encrypt_one(struct ct_global_state *state, struct ct_worker *w,
+    struct ct_trans *trans, uint64_t *crypted, uint64_t *cshaed, int ived)
+{
+	struct ct_crypto_ctx	**ccc;
 	uint8_t			*src, *dst;
-	unsigned char		*key = NULL;
 	uint8_t			*iv;
 	size_t			ivlen;
-	size_t			keysz = -1;
 	ssize_t			newlen;
 	int			slot;
 	int			encr;
+	int			stitch = 0;
 	int			len;
 	int			ret;
 
-	while ((trans = ct_dequeue_encrypt(state)) != NULL) {
-		/*
-		 * Local transactions should only ever be seen in the file
-		 * and complete ``threads''.
-		 */
-		if (trans->tr_local)
-			CABORTX("%s: local sha found on list", __func__);
-		if (state->ct_dying)
-			goto out;
+	switch(trans->tr_state) {
+	case TR_S_EX_READ:
+		/* decrypt */
+		encr = 0;
+		break;
+	case TR_S_READ: /* uncompressed ctfile data */
+	case TR_S_UNCOMPSHA_ED:
+	case TR_S_COMPRESSED:
+		encr = 1;
+		break;
+	default:
+		CABORTX("unexpected state for encr %d", trans->tr_state);
+	}
+
+	slot = trans->tr_dataslot;
+	if (slot > 1) {
+		CABORTX("transaction with special slot in encr: %d", slot);
+	}
+	src = trans->tr_data[slot];
+	len = trans->tr_size[slot];
+	dst =  trans->tr_data[!slot];
+
+	/* the key never changes, so key schedule once per worker */
+	ccc = encr ? &w->w_enc_ctx : &w->w_dec_ctx;
+	if (*ccc == NULL && (*ccc = ct_init_crypto(state->ct_crypto_key,
+	    sizeof(state->ct_crypto_key), encr)) == NULL) {
+		ct_fatal(state, NULL, encr ? CTE_ENCRYPT_FAILED :
+		    CTE_DECRYPT_FAILED);
+		return;
+	}
+
+	iv = trans->tr_iv;
+	ivlen = sizeof trans->tr_iv;
+
+	if (encr) {
+		/* encr the chunk. */
+		if ((trans->hdr.c_flags & C_HDR_F_METADATA) == 0) {
+			if (ived == 0 && (ret = ct_iv_ctx_create(
+			    ct_worker_iv(state, w), src, len, iv,
+			    ivlen)) != 0) {
+				ct_fatal(state, "can't create iv", ret);
+				return;
+			}
+			stitch = state->ct_config->ct_crypto_stitch;
+		} else {
+			if ((ret = ct_create_iv_ctfile(
+			    trans->tr_ctfile_chunkno, iv, ivlen)) != 0) {
+				char errstr[27 + 11];
+				snprintf(errstr, sizeof(errstr),
+				   "can't create iv for crtfile %"
+				   PRIu32, trans->tr_ctfile_chunkno);
+				ct_fatal(state, errstr, ret);
+				return;
+			}
+		}
+	}
+	/* when decrypting the iv was taken from the ctfile */
+	if (stitch)
+		newlen = ct_crypto_ctx_crypt_sha(*ccc, iv, ivlen, src, len,
+		    dst, state->ct_alloc_block_size, trans->tr_csha);
+	else
+		newlen = ct_crypto_ctx_crypt(*ccc, iv, ivlen, src, len, dst,
+		    state->ct_alloc_block_size);
+
+	if (newlen < 0) {
+		ct_fatal(state, NULL, encr ? CTE_ENCRYPT_FAILED :
+		    CTE_DECRYPT_FAILED);
+		return;
+	}
+
+	CNDBG(CT_LOG_TRANS,
+	    "%scrypt block of %d to %lu", encr ? "en" : "de",
+	    len, (unsigned long) newlen);
+
+	*crypted += newlen;
+
+	trans->tr_size[!slot] = newlen;
+	trans->tr_dataslot = !slot;
 
-		switch(trans->tr_state) {
-		case TR_S_EX_READ:
-			/* decrypt */
-			encr = 0;
+	if (encr)
+		trans->tr_state = TR_S_ENCRYPTED;
+	else
+		trans->tr_state = TR_S_EX_DECRYPTED;
+	if (stitch)
+		ct_csha_one(state, trans, cshaed, 1);
+}
+
+void
+ct_compute_encrypt(void *vctx)
+{
+	struct ct_global_state	*state = vctx;
+	struct ct_worker	*w;
+	struct ct_trans		*trans, *batch[CT_DEQUEUE_BATCH];
+	struct timeval		start;
+	uint64_t		crypted = 0, cshaed = 0;
+	int			i, n;
+
+	w = ct_worker_get(&state->ct_crypt_pool);
+
+	while ((n = ct_dequeue_encrypt_batch(state, batch,
+	    CT_DEQUEUE_BATCH)) > 0) {
+		/* on failure we are dying and only pass the batch on */
+		if (state->ct_dying == 0)
+			ct_encrypt_ivs(state, w, batch, n);
+		for (i = 0; i < n; i++) {
+			trans = batch[i];
+			/*
+			 * Local transactions should only ever be seen in the
+			 * file and complete ``threads''.
+			 */
+			if (trans->tr_local)
+				CABORTX("%s: local sha found on list",
+				    __func__);
+			if (state->ct_dying == 0) {
+				gettimeofday(&start, NULL);
+				ct_encrypt_one(state, w, trans, &crypted,
+				    &cshaed, 1);
+				ct_worker_account(
+				    &state->ct_stats->st_crypt_busy[w->w_id],
+				    &state->ct_stats->st_crypt_chunks[w->w_id],
+				    &start);
+			}
+			ct_queue_transfer(state, trans);
+		}
+	}
+
+	CT_LOCK(&state->ct_stats_lock);
+	state->ct_stats->st_bytes_crypted += crypted;
+	state->ct_stats->st_bytes_csha += cshaed;
+	CT_UNLOCK(&state->ct_stats_lock);
+	ct_worker_put(&state->ct_crypt_pool, w);
+}
+
+/*
+ * Fused archive pipeline. Instead of handing a chunk from the sha thread to
+ * the compress, encrypt and csha threads in turn, every fused worker takes a
+ * freshly read chunk off the sha queue and runs all of the cpu bound stages
+ * on it while its data is still in cache. The ordered sha step has been done
+ * for the whole batch by ct_compute_fused() already. The routing mirrors
+ * ct_state_archive(); the chunk rejoins the normal path once it is ready to
+ * be written.
+ */
+static void
+ct_fused_one(struct ct_global_state *state, struct ct_worker *w,
+    struct ct_trans *trans, uint64_t *compressed, uint64_t *uncompressed,
+    uint64_t *crypted, uint64_t *cshaed)
+{
+	int	done;
+
+	for (done = 0; done == 0; ) {
+		if (state->ct_dying)
 			break;
-		case TR_S_READ: /* uncompressed ctfile data */
+
+		switch (trans->tr_state) {
 		case TR_S_UNCOMPSHA_ED:
+			if (state->ct_config->ct_compress) {
+				ct_compress_one(state, w, trans, compressed,
+				    uncompressed);
+				break;
+			}
+			/* FALLTHROUGH */
 		case TR_S_COMPRESSED:
-			encr = 1;
+			if (trans->hdr.c_flags & C_HDR_F_ENCRYPTED) {
+				ct_encrypt_one(state, w, trans, crypted,
+				    cshaed, 0);
+				break;
+			}
+			done = 1;
+			break;
+		case TR_S_ENCRYPTED:
+			ct_csha_one(state, trans, cshaed, 0);
 			break;
 		default:
-			CABORTX("unexpected state for encr %d",
-			    trans->tr_state);
+			done = 1;
+			break;
 		}
+	}
+}
 
+void
+ct_compute_fused(void *vctx)
+{
+	struct ct_global_state	*state = vctx;
+	struct ct_worker	*w;
+	struct ct_trans		*trans, *batch[CT_DEQUEUE_BATCH];
+	struct timeval		start;
+	uint64_t		compressed = 0, uncompressed = 0;
+	uint64_t		crypted = 0, cshaed = 0;
+	int			i, n;
 
-		slot = trans->tr_dataslot;
-		if (slot > 1) {
-			CABORTX("transaction with special slot in encr: %d",
-			    slot);
-		}
-		src = trans->tr_data[slot];
-		len = trans->tr_size[slot];
-		dst =  trans->tr_data[!slot];
-
-		key = state->ct_crypto_key;
-		keysz = sizeof(state->ct_crypto_key);
-
-		iv = trans->tr_iv;
-		ivlen = sizeof trans->tr_iv;
-
-		if (encr) {
-			/* encr the chunk. */
-			if ((trans->hdr.c_flags & C_HDR_F_METADATA) == 0) {
-				if ((ret = ct_create_iv(state->ct_iv,
-				    sizeof(state->ct_iv), src, len, iv,
-				    ivlen)) != 0) {
-					ct_fatal(state, "can't create iv", ret);
-					goto out;
-				}
-			} else {
-				if ((ret = ct_create_iv_ctfile(
-				    trans->tr_ctfile_chunkno, iv,
-				    ivlen)) != 0) {
-					char errstr[27 + 11];
-					snprintf(errstr, sizeof(errstr),
-					   "can't create iv for crtfile %"
-					   PRIu32, trans->tr_ctfile_chunkno);
-					ct_fatal(state, errstr, ret);
-					goto out;
-				}
-			}
+	w = ct_worker_get(&state->ct_fused_pool);
 
-			newlen = ct_encrypt(key, keysz, iv, ivlen, src,
-			    len, dst, state->ct_alloc_block_size);
-		} else {
-			/* iv was taken from ctfile or other information. */
-			newlen = ct_decrypt(key, keysz, iv, ivlen,
-			    src, len, dst, state->ct_alloc_block_size);
+	while ((n = ct_dequeue_sha_batch(state, batch, CT_DEQUEUE_BATCH)) > 0) {
+		/*
+		 * Take the whole batch through the ordered sha step first, so
+		 * the tickets of the next worker's batch come up while this
+		 * one is still compressing and encrypting.
+		 */
+		gettimeofday(&start, NULL);
+		ct_sha_run(state, batch, n);
+		/* the sha step is billed to the batch's first chunk */
+		for (i = 0; i < n; i++) {
+			trans = batch[i];
+			ct_fused_one(state, w, trans, &compressed,
+			    &uncompressed, &crypted, &cshaed);
+			ct_worker_account(
+			    &state->ct_stats->st_fused_busy[w->w_id],
+			    &state->ct_stats->st_fused_chunks[w->w_id], &start);
+			gettimeofday(&start, NULL);
+			ct_queue_transfer(state, trans);
 		}
+	}
 
-		if (newlen < 0) {
-			ct_fatal(state, NULL, encr ? CTE_ENCRYPT_FAILED :
-			    CTE_DECRYPT_FAILED);
-			goto out;
+	CT_LOCK(&state->ct_stats_lock);
+	state->ct_stats->st_bytes_compressed += compressed;
+	state->ct_stats->st_bytes_uncompressed += uncompressed;
+	state->ct_stats->st_bytes_crypted += crypted;
+	state->ct_stats->st_bytes_csha += cshaed;
+	CT_UNLOCK(&state->ct_stats_lock);
+	ct_worker_put(&state->ct_fused_pool, w);
+}
+
+/*
+ * Scheduler tasks. Compress, encrypt and csha work is pushed to the
+ * scheduler deques and may run on any worker; sha work stays on the ticketed
+ * sha ring and is polled in order. Either way the transaction goes back
+ * through ct_queue_transfer() and completion order is restored by
+ * ct_queue_complete() as usual.
+ */
+static void
+ct_sched_run(void *vctx, int id, struct ct_trans *trans)
+{
+	struct ct_global_state	*state = vctx;
+	struct ct_worker	*w = &state->ct_sched_pool.wp_workers[id];
+	struct timeval		start;
+	uint64_t		compressed = 0, uncompressed = 0;
+	uint64_t		crypted = 0, cshaed = 0;
+
+	if (trans->tr_local)
+		CABORTX("%s: local trans found on list", __func__);
+
+	if (state->ct_dying == 0) {
+		gettimeofday(&start, NULL);
+		switch (trans->tr_sched_stage) {
+		case CT_SCHED_COMPRESS:
+			ct_compress_one(state, w, trans, &compressed,
+			    &uncompressed);
+			break;
+		case CT_SCHED_ENCRYPT:
+			ct_encrypt_one(state, w, trans, &crypted, &cshaed, 0);
+			break;
+		case CT_SCHED_CSHA:
+			ct_csha_one(state, trans, &cshaed, 0);
+			break;
+		default:
+			CABORTX("invalid scheduler stage %d",
+			    trans->tr_sched_stage);
 		}
+		ct_worker_account(&state->ct_stats->st_sched_busy[id],
+		    &state->ct_stats->st_sched_chunks[id], &start);
+
+		CT_LOCK(&state->ct_stats_lock);
+		state->ct_stats->st_bytes_compressed += compressed;
+		state->ct_stats->st_bytes_uncompressed += uncompressed;
+		state->ct_stats->st_bytes_crypted += crypted;
+		state->ct_stats->st_bytes_csha += cshaed;
+		CT_UNLOCK(&state->ct_stats_lock);
+	}
+	ct_queue_transfer(state, trans);
+}
 
-		CNDBG(CT_LOG_TRANS,
-		    "%scrypt block of %d to %lu", encr ? "en" : "de",
-		    len, (unsigned long) newlen);
+static int
+ct_sched_poll(void *vctx, int id)
+{
+	struct ct_global_state	*state = vctx;
+	struct ct_trans		*batch[CT_DEQUEUE_BATCH];
+	int			 i, n;
 
-		state->ct_stats->st_bytes_crypted += newlen;
+	n = ct_dequeue_sha_batch(state, batch, CT_DEQUEUE_BATCH);
+	ct_sha_run(state, batch, n);
+	for (i = 0; i < n; i++)
+		ct_queue_transfer(state, batch[i]);
 
-		trans->tr_size[!slot] = newlen;
-		trans->tr_dataslot = !slot;
+	return (n);
+}
 
-		if (encr)
-			trans->tr_state = TR_S_ENCRYPTED;
-		else
-			trans->tr_state = TR_S_EX_DECRYPTED;
-out:
-		ct_queue_transfer(state, trans);
-	}
+struct ct_sched *
+ct_setup_sched(struct ct_global_state *state)
+{
+	return (ct_sched_init(state->ct_sched_pool.wp_nworkers, ct_sched_run,
+	    ct_sched_poll, state));
 }
@@ -0,0 +1,841 @@
+/*
+ * Copyright (c) 2012 Conformal Systems LLC <info@conformal.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Read-ahead pool for archiving. The file thread hands over files it will
+ * need soon together with the transactions their chunks should be read
+ * into; a pool of reader threads opens, stats and reads them so that one
+ * slow open or read does not stall the rest of the pipeline. Everything
+ * about ordering stays with the file thread: it takes chunks back one file
+ * at a time, in the order it handed them over, and only then queues them.
+ *
+ * A file's reads are serviced by one reader at a time and in order, the
+ * concurrency comes from having several files in flight.
+ *
+ * Where io_uring is available the pool can instead be driven by a ring:
+ * opens, stats and reads of every file in the window are prepared as they
+ * come and submitted together by ct_readahead_flush(), and a single thread
+ * reaps their completions, so there are many operations in flight for a
+ * handful of syscalls. A file's reads may then complete out of order; they
+ * are still handed back in order.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/sysmacros.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include <clog.h>
+#include <exude.h>
+
+#include <ct_threads.h>
+#include <cyphertite.h>
+#include <ct_internal.h>
+
+#if CT_ENABLE_PTHREADS
+
+#if defined(CT_HAVE_URING) && defined(STATX_BASIC_STATS)
+#define CT_RA_URING
+#endif
+
+#define CT_RA_FILES_PER_THREAD	4	/* files in flight per reader */
+#define CT_RA_URING_FILES	64	/* files in flight on a ring */
+#define CT_RA_URING_DEPTH	256
+
+/* ring cookies, the tag lives in the low bits of the pointer */
+#define CT_RA_OP_EXIT		(0)
+#define CT_RA_OP_OPEN		(1)
+#define CT_RA_OP_STAT		(2)
+#define CT_RA_OP_READ		(3)
+#define CT_RA_OP_MASK		(3)
+#define CT_RA_COOKIE(p, op)	((uint64_t)(uintptr_t)(p) | (op))
+
+struct ct_ra_file {
+	TAILQ_ENTRY(ct_ra_file)	 raf_entry;	/* job or dead queue */
+	int			 raf_dirfd;
+	char			*raf_path;
+	int			 raf_flags;
+	int			 raf_fd;
+	int			 raf_state;	/* CT_RA_* */
+	int			 raf_errno;
+	struct stat		 raf_sb;	/* at open */
+	int			 raf_enderrno;
+	struct stat		 raf_endsb;	/* after the final read */
+	int			 raf_queued;
+	int			 raf_busy;	/* readers or ring ops on it */
+	int			 raf_dead;
+	struct ct_ra_reads	 raf_reads;	/* in file order */
+	struct ct_trans		*raf_unsent;	/* ring: first not submitted */
+	int			 raf_opening;	/* ring: open submitted */
+#ifdef CT_RA_URING
+	struct statx		 raf_stx;
+#endif
+};
+
+struct ct_readahead {
+	struct ct_event_state	*ra_ev;
+	pthread_t		*ra_threads;
+	int			 ra_nthreads;
+	int			 ra_window;
+	int			 ra_blocksz;
+	struct ct_uring		*ra_uring;
+	pthread_mutex_t		 ra_mtx;
+	pthread_cond_t		 ra_cv;
+	TAILQ_HEAD(, ct_ra_file) ra_queue;	/* work to do or submit */
+	TAILQ_HEAD(, ct_ra_file) ra_dead;
+	int			 ra_exiting;
+};
+
+void	*ct_readahead_thread(void *);
+void	*ct_readahead_ring_thread(void *);
+
+/*
+ * Start a pool of nthreads readers, or with uring a ring if the system
+ * has a usable one.
+ */
+struct ct_readahead *
+ct_readahead_init(struct ct_event_state *ev_st, int nthreads, int blocksz,
+    int uring)
+{
+	struct ct_readahead	*ra;
+	int			 i;
+
+	if (nthreads < 1)
+		nthreads = 1;
+	if (nthreads > CT_MAX_WORKERS)
+		nthreads = CT_MAX_WORKERS;
+
+	ra = e_calloc(1, sizeof(*ra));
+	ra->ra_ev = ev_st;
+	ra->ra_blocksz = blocksz;
+	pthread_mutex_init(&ra->ra_mtx, NULL);
+	pthread_cond_init(&ra->ra_cv, NULL);
+	TAILQ_INIT(&ra->ra_queue);
+	TAILQ_INIT(&ra->ra_dead);
+
+#ifdef CT_RA_URING
+	if (uring && (ra->ra_uring = ct_uring_init(CT_RA_URING_DEPTH)) != NULL)
+		nthreads = 1;
+#endif
+	if (uring && ra->ra_uring == NULL)
+		CNDBG(CT_LOG_FILE, "no io_uring, reading with %d threads",
+		    nthreads);
+	ra->ra_nthreads = nthreads;
+	ra->ra_window = ra->ra_uring ? CT_RA_URING_FILES :
+	    CT_RA_FILES_PER_THREAD * nthreads;
+
+	ra->ra_threads = e_calloc(nthreads, sizeof(*ra->ra_threads));
+	for (i = 0; i < nthreads; i++)
+		if (pthread_create(&ra->ra_threads[i], NULL,
+		    ra->ra_uring ? ct_readahead_ring_thread :
+		    ct_readahead_thread, ra) != 0)
+			CABORT("can't create read-ahead thread");
+
+	return (ra);
+}
+
+static void
+ct_readahead_free_file(struct ct_ra_file *raf, struct ct_ra_reads *out)
+{
+	struct ct_trans	*trans;
+
+	while ((trans = TAILQ_FIRST(&raf->raf_reads)) != NULL) {
+		TAILQ_REMOVE(&raf->raf_reads, trans, tr_next);
+		TAILQ_INSERT_TAIL(out, trans, tr_next);
+	}
+	if (raf->raf_dirfd != -1)
+		close(raf->raf_dirfd);
+	if (raf->raf_fd != -1)
+		close(raf->raf_fd);
+	e_free(&raf->raf_path);
+	e_free(&raf);
+}
+
+/*
+ * Submit what has been prepared for the ring. What the kernel had no
+ * memory for is tried again once something completes, so if it took
+ * nothing at all keep at it here: the ring thread would wait forever.
+ * Called with the lock held.
+ */
+static void
+ct_readahead_ring_submit(struct ct_readahead *ra)
+{
+	int	error;
+
+	for (;;) {
+		if ((error = ct_uring_submit(ra->ra_uring, 0)) != 0)
+			CABORTX("io_uring submit: %s", strerror(error));
+		if (ct_uring_unsent(ra->ra_uring) == 0 ||
+		    ct_uring_inflight(ra->ra_uring) >
+		    ct_uring_unsent(ra->ra_uring))
+			break;
+		usleep(1000);
+	}
+}
+
+/*
+ * Stop the readers and hand every transaction the pool still holds back
+ * through out. Files not yet closed are the caller's problem.
+ */
+void
+ct_readahead_cleanup(struct ct_readahead *ra, struct ct_ra_reads *out)
+{
+	int	i;
+
+	if (ra == NULL)
+		return;
+
+	pthread_mutex_lock(&ra->ra_mtx);
+	ra->ra_exiting = 1;
+	if (ra->ra_uring != NULL) {
+		/* kick the ring thread out of its wait */
+		(void)ct_uring_nop(ra->ra_uring,
+		    CT_RA_COOKIE(NULL, CT_RA_OP_EXIT));
+		ct_readahead_ring_submit(ra);
+	}
+	pthread_cond_broadcast(&ra->ra_cv);
+	pthread_mutex_unlock(&ra->ra_mtx);
+	for (i = 0; i < ra->ra_nthreads; i++)
+		if (pthread_join(ra->ra_threads[i], NULL) != 0)
+			CABORT("can't join on read-ahead thread");
+
+	(void)ct_readahead_reap(ra, out);
+	ct_uring_cleanup(ra->ra_uring);
+	e_free(&ra->ra_threads);
+	pthread_cond_destroy(&ra->ra_cv);
+	pthread_mutex_destroy(&ra->ra_mtx);
+	e_free(&ra);
+}
+
+/* How many files the caller should keep in flight. */
+int
+ct_readahead_window(struct ct_readahead *ra)
+{
+	return (ra->ra_window);
+}
+
+/* Must be called with ra_mtx held. */
+static void
+ct_readahead_submit(struct ct_readahead *ra, struct ct_ra_file *raf)
+{
+	if (raf->raf_queued)
+		return;
+	/* a busy reader picks up new reads itself, a ring has no readers */
+	if (ra->ra_uring == NULL && raf->raf_busy)
+		return;
+	raf->raf_queued = 1;
+	TAILQ_INSERT_TAIL(&ra->ra_queue, raf, raf_entry);
+	if (ra->ra_uring == NULL)
+		pthread_cond_signal(&ra->ra_cv);
+}
+
+/*
+ * Start opening path, relative to dfd unless that is -1. The pool takes
+ * ownership of dfd.
+ */
+struct ct_ra_file *
+ct_readahead_open(struct ct_readahead *ra, int dfd, const char *path,
+    int flags)
+{
+	struct ct_ra_file	*raf;
+
+	raf = e_calloc(1, sizeof(*raf));
+	raf->raf_dirfd = dfd;
+	raf->raf_path = e_strdup(path);
+	raf->raf_flags = flags;
+	raf->raf_fd = -1;
+	raf->raf_state = CT_RA_PENDING;
+	TAILQ_INIT(&raf->raf_reads);
+
+	pthread_mutex_lock(&ra->ra_mtx);
+	ct_readahead_submit(ra, raf);
+	pthread_mutex_unlock(&ra->ra_mtx);
+
+	return (raf);
+}
+
+/*
+ * Read the chunk at offset into trans. The chunk is as long as the block
+ * size or what is left of the file as stat'd at open, whichever is less.
+ */
+void
+ct_readahead_read(struct ct_readahead *ra, struct ct_ra_file *raf,
+    struct ct_trans *trans, off_t offset)
+{
+	trans->tr_ra_offset = offset;
+	trans->tr_ra_done = 0;
+	trans->tr_ra_file = raf;
+
+	pthread_mutex_lock(&ra->ra_mtx);
+	TAILQ_INSERT_TAIL(&raf->raf_reads, trans, tr_next);
+	if (raf->raf_unsent == NULL)
+		raf->raf_unsent = trans;
+	ct_readahead_submit(ra, raf);
+	pthread_mutex_unlock(&ra->ra_mtx);
+}
+
+/* Returns CT_RA_PENDING until the file has been opened or failed to. */
+int
+ct_readahead_status(struct ct_readahead *ra, struct ct_ra_file *raf,
+    struct stat *sb, int *error)
+{
+	int	state;
+
+	pthread_mutex_lock(&ra->ra_mtx);
+	state = raf->raf_state;
+	pthread_mutex_unlock(&ra->ra_mtx);
+
+	if (state != CT_RA_PENDING) {
+		*sb = raf->raf_sb;
+		*error = raf->raf_errno;
+	}
+
+	return (state);
+}
+
+/*
+ * Take back the oldest read of raf if it has finished. The chunk length is
+ * left in tr_size[0], -1 on error with the errno in tr_errno. If this was
+ * the last chunk of the file, *final is set and endsb/enderror hold the
+ * result of stat'ing it afterwards.
+ */
+struct ct_trans *
+ct_readahead_next(struct ct_readahead *ra, struct ct_ra_file *raf,
+    int *final, struct stat *endsb, int *enderror)
+{
+	struct ct_trans	*trans;
+
+	pthread_mutex_lock(&ra->ra_mtx);
+	if ((trans = TAILQ_FIRST(&raf->raf_reads)) != NULL &&
+	    trans->tr_ra_done) {
+		TAILQ_REMOVE(&raf->raf_reads, trans, tr_next);
+		*final = (trans->tr_ra_done == CT_RA_DONE_FINAL);
+		if (*final) {
+			*endsb = raf->raf_endsb;
+			*enderror = raf->raf_enderrno;
+		}
+	} else {
+		trans = NULL;
+	}
+	pthread_mutex_unlock(&ra->ra_mtx);
+
+	return (trans);
+}
+
+/*
+ * Done with raf. Reads it still holds are handed back through out, unless
+ * a reader is busy with them, in which case they turn up from a later
+ * ct_readahead_reap().
+ */
+void
+ct_readahead_close(struct ct_readahead *ra, struct ct_ra_file *raf,
+    struct ct_ra_reads *out)
+{
+	pthread_mutex_lock(&ra->ra_mtx);
+	raf->raf_dead = 1;
+	if (raf->raf_queued) {
+		TAILQ_REMOVE(&ra->ra_queue, raf, raf_entry);
+		raf->raf_queued = 0;
+	}
+	if (raf->raf_busy) {
+		TAILQ_INSERT_TAIL(&ra->ra_dead, raf, raf_entry);
+		raf = NULL;
+	}
+	pthread_mutex_unlock(&ra->ra_mtx);
+
+	if (raf != NULL)
+		ct_readahead_free_file(raf, out);
+}
+
+/* Collect the transactions of closed files the readers have let go of. */
+int
+ct_readahead_reap(struct ct_readahead *ra, struct ct_ra_reads *out)
+{
+	struct ct_ra_file	*raf, *next;
+	TAILQ_HEAD(, ct_ra_file) idle;
+	struct ct_trans		*trans;
+	int			 count = 0;
+
+	TAILQ_INIT(&idle);
+	pthread_mutex_lock(&ra->ra_mtx);
+	TAILQ_FOREACH_SAFE(raf, &ra->ra_dead, raf_entry, next) {
+		if (raf->raf_busy)
+			continue;
+		TAILQ_REMOVE(&ra->ra_dead, raf, raf_entry);
+		TAILQ_INSERT_TAIL(&idle, raf, raf_entry);
+	}
+	pthread_mutex_unlock(&ra->ra_mtx);
+
+	while ((raf = TAILQ_FIRST(&idle)) != NULL) {
+		TAILQ_REMOVE(&idle, raf, raf_entry);
+		TAILQ_FOREACH(trans, &raf->raf_reads, tr_next)
+			count++;
+		ct_readahead_free_file(raf, out);
+	}
+
+	return (count);
+}
+
+/* Length of the chunk at the offset of trans. */
+static off_t
+ct_readahead_chunk(struct ct_readahead *ra, struct ct_ra_file *raf,
+    struct ct_trans *trans)
+{
+	off_t	rsz;
+
+	rsz = raf->raf_sb.st_size - trans->tr_ra_offset;
+	if (rsz > ra->ra_blocksz)
+		rsz = ra->ra_blocksz;
+	if (rsz < 0)
+		rsz = 0;
+
+	return (rsz);
+}
+
+/*
+ * trans has been read, rsz bytes were asked for. Mirrors the synchronous
+ * read in ct_archive(): a short read, a failed read or reaching the size
+ * seen at open ends the file, which is stat'd again and closed.
+ */
+static int
+ct_readahead_end(struct ct_ra_file *raf, struct ct_trans *trans, off_t rsz)
+{
+	off_t	rlen = trans->tr_size[0];
+
+	if (rsz == rlen && rlen != 0 &&
+	    trans->tr_ra_offset + rlen != raf->raf_sb.st_size)
+		return (CT_RA_DONE);
+
+	/* with a ring, a later chunk may have ended it already */
+	if (raf->raf_fd != -1) {
+		raf->raf_enderrno = 0;
+		if (fstat(raf->raf_fd, &raf->raf_endsb) != 0)
+			raf->raf_enderrno = errno;
+		close(raf->raf_fd);
+		raf->raf_fd = -1;
+	}
+
+	return (CT_RA_DONE_FINAL);
+}
+
+/* Open and stat raf, called without the lock held. */
+static int
+ct_readahead_do_open(struct ct_ra_file *raf)
+{
+	int	fd, state = CT_RA_OPEN, error = 0;
+
+#ifdef CT_NO_OPENAT
+	fd = open(raf->raf_path, raf->raf_flags);
+#else
+	fd = openat(raf->raf_dirfd, raf->raf_path, raf->raf_flags);
+#endif
+	if (fd == -1) {
+		state = CT_RA_EOPEN;
+		error = errno;
+	} else if (fstat(fd, &raf->raf_sb) != 0) {
+		state = CT_RA_ESTAT;
+		error = errno;
+		close(fd);
+		fd = -1;
+	} else if (!S_ISREG(raf->raf_sb.st_mode) ||
+	    raf->raf_sb.st_size == 0) {
+		/* nothing to read, the file thread deals with the rest */
+		close(fd);
+		fd = -1;
+	}
+	if (raf->raf_dirfd != -1) {
+		close(raf->raf_dirfd);
+		raf->raf_dirfd = -1;
+	}
+	raf->raf_fd = fd;
+	raf->raf_errno = error;
+
+	return (state);
+}
+
+/* Read one chunk, called without the lock held. */
+static int
+ct_readahead_do_read(struct ct_readahead *ra, struct ct_ra_file *raf,
+    struct ct_trans *trans, int dead)
+{
+	ssize_t	rlen = 0;
+	off_t	rsz;
+
+	if (raf->raf_fd == -1 || dead) {
+		trans->tr_size[0] = 0;
+		return (CT_RA_DONE);
+	}
+
+	rsz = ct_readahead_chunk(ra, raf, trans);
+	if (rsz > 0)
+		rlen = pread(raf->raf_fd, trans->tr_data[0], rsz,
+		    trans->tr_ra_offset);
+	trans->tr_size[0] = rlen;
+	trans->tr_errno = (rlen == -1) ? errno : 0;
+
+	return (ct_readahead_end(raf, trans, rsz));
+}
+
+void *
+ct_readahead_thread(void *arg)
+{
+	struct ct_readahead	*ra = arg;
+	struct ct_ra_file	*raf;
+	struct ct_trans		*trans;
+	int			 state, dead, done;
+
+	pthread_mutex_lock(&ra->ra_mtx);
+	for (;;) {
+		while ((raf = TAILQ_FIRST(&ra->ra_queue)) == NULL &&
+		    !ra->ra_exiting)
+			pthread_cond_wait(&ra->ra_cv, &ra->ra_mtx);
+		if (raf == NULL)
+			break;
+		TAILQ_REMOVE(&ra->ra_queue, raf, raf_entry);
+		raf->raf_queued = 0;
+		raf->raf_busy = 1;
+
+		if (raf->raf_state == CT_RA_PENDING) {
+			pthread_mutex_unlock(&ra->ra_mtx);
+			state = ct_readahead_do_open(raf);
+			pthread_mutex_lock(&ra->ra_mtx);
+			raf->raf_state = state;
+			if (!raf->raf_dead) {
+				pthread_mutex_unlock(&ra->ra_mtx);
+				ct_wakeup_file(ra->ra_ev);
+				pthread_mutex_lock(&ra->ra_mtx);
+			}
+		}
+		/*
+		 * The file thread takes finished reads off the head of the
+		 * list and passes them on, so rather than follow a link that
+		 * may no longer be ours look for the next unread one from the
+		 * head each time. Unread ones stay put.
+		 */
+		for (;;) {
+			TAILQ_FOREACH(trans, &raf->raf_reads, tr_next)
+				if (trans->tr_ra_done == 0)
+					break;
+			if (trans == NULL)
+				break;
+			dead = raf->raf_dead;
+			pthread_mutex_unlock(&ra->ra_mtx);
+			done = ct_readahead_do_read(ra, raf, trans, dead);
+			pthread_mutex_lock(&ra->ra_mtx);
+			trans->tr_ra_done = done;
+			if (!raf->raf_dead) {
+				pthread_mutex_unlock(&ra->ra_mtx);
+				ct_wakeup_file(ra->ra_ev);
+				pthread_mutex_lock(&ra->ra_mtx);
+			}
+		}
+		raf->raf_busy = 0;
+		/* its reads can be reaped now, the file thread may need them */
+		if (raf->raf_dead) {
+			pthread_mutex_unlock(&ra->ra_mtx);
+			ct_wakeup_file(ra->ra_ev);
+			pthread_mutex_lock(&ra->ra_mtx);
+		}
+	}
+	pthread_mutex_unlock(&ra->ra_mtx);
+
+	return (NULL);
+}
+
+#ifdef CT_RA_URING
+
+/*
+ * Prepare whatever the queued files are waiting for and submit it all.
+ * Returns 1 if a read was finished without going to the kernel. Called
+ * with the lock held.
+ */
+static int
+ct_readahead_ring_kick(struct ct_readahead *ra)
+{
+	struct ct_ra_file	*raf, *next;
+	struct ct_trans		*trans;
+	off_t			 rsz;
+	int			 done = 0;
+
+	/* nothing new once exiting, but a stat may still need to go in */
+	if (ra->ra_exiting)
+		goto submit;
+
+	TAILQ_FOREACH_SAFE(raf, &ra->ra_queue, raf_entry, next) {
+		if (raf->raf_state == CT_RA_PENDING) {
+			/* reads wait for the stat, which requeues us */
+			if (!raf->raf_opening) {
+				if (ct_uring_openat(ra->ra_uring,
+				    raf->raf_dirfd == -1 ? AT_FDCWD :
+				    raf->raf_dirfd, raf->raf_path,
+				    raf->raf_flags,
+				    CT_RA_COOKIE(raf, CT_RA_OP_OPEN)) == -1)
+					break;
+				raf->raf_opening = 1;
+				raf->raf_busy++;
+			}
+		} else {
+			while ((trans = raf->raf_unsent) != NULL) {
+				rsz = ct_readahead_chunk(ra, raf, trans);
+				if (raf->raf_fd == -1 || rsz == 0) {
+					trans->tr_size[0] = 0;
+					trans->tr_ra_done = raf->raf_fd == -1 ?
+					    CT_RA_DONE :
+					    ct_readahead_end(raf, trans, 0);
+					done = 1;
+				} else if (ct_uring_pread(ra->ra_uring,
+				    raf->raf_fd, trans->tr_data[0], rsz,
+				    trans->tr_ra_offset,
+				    CT_RA_COOKIE(trans, CT_RA_OP_READ)) == -1) {
+					goto submit;
+				} else {
+					raf->raf_busy++;
+				}
+				raf->raf_unsent = TAILQ_NEXT(trans, tr_next);
+			}
+		}
+		TAILQ_REMOVE(&ra->ra_queue, raf, raf_entry);
+		raf->raf_queued = 0;
+	}
+submit:
+	ct_readahead_ring_submit(ra);
+
+	return (done);
+}
+
+static void
+ct_readahead_statx(struct ct_ra_file *raf)
+{
+	struct statx	*stx = &raf->raf_stx;
+	struct stat	*sb = &raf->raf_sb;
+
+	bzero(sb, sizeof(*sb));
+	sb->st_dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+	sb->st_rdev = makedev(stx->stx_rdev_major, stx->stx_rdev_minor);
+	sb->st_ino = stx->stx_ino;
+	sb->st_mode = stx->stx_mode;
+	sb->st_nlink = stx->stx_nlink;
+	sb->st_uid = stx->stx_uid;
+	sb->st_gid = stx->stx_gid;
+	sb->st_size = stx->stx_size;
+	sb->st_blksize = stx->stx_blksize;
+	sb->st_blocks = stx->stx_blocks;
+	sb->st_atime = stx->stx_atime.tv_sec;
+	sb->st_mtime = stx->stx_mtime.tv_sec;
+	sb->st_ctime = stx->stx_ctime.tv_sec;
+}
+
+/*
+ * Deal with one completion. Returns 1 if the file thread has something
+ * new to look at. Called with the lock held.
+ */
+static int
+ct_readahead_ring_done(struct ct_readahead *ra, uint64_t cookie, int res)
+{
+	struct ct_ra_file	*raf;
+	struct ct_trans		*trans;
+
+	switch (cookie & CT_RA_OP_MASK) {
+	case CT_RA_OP_OPEN:
+		raf = (struct ct_ra_file *)(uintptr_t)(cookie & ~CT_RA_OP_MASK);
+		raf->raf_busy--;
+		if (raf->raf_dirfd != -1) {
+			close(raf->raf_dirfd);
+			raf->raf_dirfd = -1;
+		}
+		if (res < 0) {
+			raf->raf_state = CT_RA_EOPEN;
+			raf->raf_errno = -res;
+			break;
+		}
+		raf->raf_fd = res;
+		if (raf->raf_dead)
+			break;
+		/* we just reaped one, so there is room for this */
+		if (ct_uring_fstatx(ra->ra_uring, raf->raf_fd,
+		    STATX_BASIC_STATS, &raf->raf_stx,
+		    CT_RA_COOKIE(raf, CT_RA_OP_STAT)) == -1)
+			CABORTX("io_uring full after reaping");
+		raf->raf_busy++;
+		return (0);
+	case CT_RA_OP_STAT:
+		raf = (struct ct_ra_file *)(uintptr_t)(cookie & ~CT_RA_OP_MASK);
+		raf->raf_busy--;
+		if (res < 0) {
+			raf->raf_state = CT_RA_ESTAT;
+			raf->raf_errno = -res;
+			close(raf->raf_fd);
+			raf->raf_fd = -1;
+			break;
+		}
+		ct_readahead_statx(raf);
+		if (!S_ISREG(raf->raf_sb.st_mode) ||
+		    raf->raf_sb.st_size == 0) {
+			close(raf->raf_fd);
+			raf->raf_fd = -1;
+		}
+		raf->raf_state = CT_RA_OPEN;
+		if (raf->raf_unsent != NULL && !raf->raf_dead)
+			ct_readahead_submit(ra, raf);
+		break;
+	case CT_RA_OP_READ:
+		trans = (struct ct_trans *)(uintptr_t)(cookie & ~CT_RA_OP_MASK);
+		raf = trans->tr_ra_file;
+		raf->raf_busy--;
+		trans->tr_size[0] = res < 0 ? -1 : res;
+		trans->tr_errno = res < 0 ? -res : 0;
+		trans->tr_ra_done = ct_readahead_end(raf, trans,
+		    ct_readahead_chunk(ra, raf, trans));
+		break;
+	default:
+		return (0);
+	}
+
+	/* a dead file matters once its last operation is back */
+	return (!raf->raf_dead || raf->raf_busy == 0);
+}
+
+void *
+ct_readahead_ring_thread(void *arg)
+{
+	struct ct_readahead	*ra = arg;
+	uint64_t		 cookie;
+	int			 res, wake;
+
+	pthread_mutex_lock(&ra->ra_mtx);
+	for (;;) {
+		wake = 0;
+		while (ct_uring_reap(ra->ra_uring, &cookie, &res))
+			wake |= ct_readahead_ring_done(ra, cookie, res);
+		wake |= ct_readahead_ring_kick(ra);
+		if (ra->ra_exiting && ct_uring_inflight(ra->ra_uring) == 0)
+			break;
+		pthread_mutex_unlock(&ra->ra_mtx);
+
+		if (wake)
+			ct_wakeup_file(ra->ra_ev);
+		ct_uring_wait(ra->ra_uring);
+		pthread_mutex_lock(&ra->ra_mtx);
+	}
+	pthread_mutex_unlock(&ra->ra_mtx);
+
+	return (NULL);
+}
+
+/* Submit everything opened and read since the last call in one go. */
+void
+ct_readahead_flush(struct ct_readahead *ra)
+{
+	if (ra->ra_uring == NULL)
+		return;
+	pthread_mutex_lock(&ra->ra_mtx);
+	(void)ct_readahead_ring_kick(ra);
+	pthread_mutex_unlock(&ra->ra_mtx);
+}
+
+#else /* CT_RA_URING */
+
+void *
+ct_readahead_ring_thread(void *arg)
+{
+	CABORTX("no io_uring");
+	return (NULL);
+}
+
+void
+ct_readahead_flush(struct ct_readahead *ra)
+{
+}
+
+#endif /* CT_RA_URING */
+
+#else /* CT_ENABLE_PTHREADS */
+
+struct ct_readahead *
+ct_readahead_init(struct ct_event_state *ev_st, int nthreads, int blocksz,
+    int uring)
+{
+	return (NULL);
+}
+
+void
+ct_readahead_cleanup(struct ct_readahead *ra, struct ct_ra_reads *out)
+{
+}
+
+int
+ct_readahead_window(struct ct_readahead *ra)
+{
+	return (0);
+}
+
+void
+ct_readahead_flush(struct ct_readahead *ra)
+{
+}
+
+struct ct_ra_file *
+ct_readahead_open(struct ct_readahead *ra, int dfd, const char *path,
+    int flags)
+{
+	CABORTX("no read-ahead without threads");
+	return (NULL);
+}
+
+void
+ct_readahead_read(struct ct_readahead *ra, struct ct_ra_file *raf,
+    struct ct_trans *trans, off_t offset)
+{
+	CABORTX("no read-ahead without threads");
+}
+
+int
+ct_readahead_status(struct ct_readahead *ra, struct ct_ra_file *raf,
+    struct stat *sb, int *error)
+{
+	CABORTX("no read-ahead without threads");
+	return (CT_RA_EOPEN);
+}
+
+struct ct_trans *
+ct_readahead_next(struct ct_readahead *ra, struct ct_ra_file *raf,
+    int *final, struct stat *endsb, int *enderror)
+{
+	CABORTX("no read-ahead without threads");
+	return (NULL);
+}
+
+void
+ct_readahead_close(struct ct_readahead *ra, struct ct_ra_file *raf,
+    struct ct_ra_reads *out)
+{
+	CABORTX("no read-ahead without threads");
+}
+
+int
+ct_readahead_reap(struct ct_readahead *ra, struct ct_ra_reads *out)
+{
+	return (0);
+}
+
+#endif /* CT_ENABLE_PTHREADS */
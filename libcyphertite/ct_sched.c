@@ -0,0 +1,304 @@
+/*
+ * Copyright (c) 2012 Conformal Systems LLC <info@conformal.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Work stealing scheduler for the cpu bound stages. Each worker owns a deque
+ * of transactions; work it queues itself goes on the tail and is taken back
+ * from the tail while the chunk is still in cache, idle workers steal from
+ * the head of somebody else's deque. Work queued from outside the pool (the
+ * event loop) goes on a shared injection queue. Sources that have to be
+ * drained in order, like the ticketed sha queue, are polled rather than
+ * pushed so that no worker ever sits on an older entry than the one it is
+ * waiting for.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <clog.h>
+#include <exude.h>
+
+#include <ct_threads.h>
+#include <cyphertite.h>
+#include <ct_internal.h>
+
+#if CT_ENABLE_PTHREADS
+
+struct ct_sched_worker {
+	struct ct_sched		*sw_sched;
+	int			 sw_id;
+	pthread_t		 sw_thread;
+	CT_LOCK_STORE(sw_lock);
+	TAILQ_HEAD(ct_sched_deque, ct_trans) sw_deque;
+	char			 sw_pad[CT_CACHELINE];
+};
+
+struct ct_sched {
+	struct ct_sched_worker	*s_workers;
+	int			 s_nworkers;
+	ct_sched_run_cb		*s_run;
+	ct_sched_poll_cb	*s_poll;
+	void			*s_arg;
+	pthread_key_t		 s_self;
+
+	CT_LOCK_STORE(s_inject_lock);
+	TAILQ_HEAD(, ct_trans)	 s_inject;
+
+	/* idle workers sleep here, see ct_sched_idle() */
+	pthread_mutex_t		 s_idle_mtx;
+	pthread_cond_t		 s_idle_cv;
+	uint32_t		 s_pending;
+	uint32_t		 s_nidle;
+	int			 s_exiting;
+};
+
+void	*ct_sched_thread(void *);
+
+struct ct_sched *
+ct_sched_init(int nworkers, ct_sched_run_cb *run, ct_sched_poll_cb *poll,
+    void *arg)
+{
+	struct ct_sched		*s;
+	struct ct_sched_worker	*sw;
+	int			 i;
+
+	if (nworkers < 1)
+		nworkers = 1;
+	if (nworkers > CT_MAX_WORKERS)
+		nworkers = CT_MAX_WORKERS;
+
+	s = e_calloc(1, sizeof(*s));
+	s->s_nworkers = nworkers;
+	s->s_run = run;
+	s->s_poll = poll;
+	s->s_arg = arg;
+	if (pthread_key_create(&s->s_self, NULL) != 0) {
+		e_free(&s);
+		return (NULL);
+	}
+	CT_LOCK_INIT(&s->s_inject_lock);
+	TAILQ_INIT(&s->s_inject);
+	pthread_mutex_init(&s->s_idle_mtx, NULL);
+	pthread_cond_init(&s->s_idle_cv, NULL);
+
+	s->s_workers = e_calloc(nworkers, sizeof(*s->s_workers));
+	for (i = 0; i < nworkers; i++) {
+		sw = &s->s_workers[i];
+		sw->sw_sched = s;
+		sw->sw_id = i;
+		CT_LOCK_INIT(&sw->sw_lock);
+		TAILQ_INIT(&sw->sw_deque);
+	}
+	for (i = 0; i < nworkers; i++) {
+		sw = &s->s_workers[i];
+		if (pthread_create(&sw->sw_thread, NULL, ct_sched_thread,
+		    sw) != 0)
+			CABORT("can't create scheduler thread");
+	}
+
+	return (s);
+}
+
+void
+ct_sched_cleanup(struct ct_sched *s)
+{
+	struct ct_sched_worker	*sw;
+	int			 i;
+
+	if (s == NULL)
+		return;
+
+	pthread_mutex_lock(&s->s_idle_mtx);
+	s->s_exiting = 1;
+	pthread_cond_broadcast(&s->s_idle_cv);
+	pthread_mutex_unlock(&s->s_idle_mtx);
+
+	for (i = 0; i < s->s_nworkers; i++) {
+		sw = &s->s_workers[i];
+		if (pthread_join(sw->sw_thread, NULL) != 0)
+			CABORT("can't join on scheduler thread");
+		if (!TAILQ_EMPTY(&sw->sw_deque))
+			CWARNX("scheduler worker %d exiting with work", i);
+		CT_LOCK_RELEASE(&sw->sw_lock);
+	}
+	e_free(&s->s_workers);
+	pthread_cond_destroy(&s->s_idle_cv);
+	pthread_mutex_destroy(&s->s_idle_mtx);
+	CT_LOCK_RELEASE(&s->s_inject_lock);
+	pthread_key_delete(s->s_self);
+	e_free(&s);
+}
+
+int
+ct_sched_nworkers(struct ct_sched *s)
+{
+	return (s->s_nworkers);
+}
+
+/* Make sure somebody comes looking for the work that was just queued. */
+void
+ct_sched_wakeup(struct ct_sched *s)
+{
+	uint32_t	p;
+
+	do {
+		p = CT_ATOMIC_LOAD(&s->s_pending);
+		if (p >= (uint32_t)s->s_nworkers)
+			return;
+	} while (!CT_ATOMIC_CAS(&s->s_pending, p, p + 1));
+
+	if (CT_ATOMIC_LOAD(&s->s_nidle) != 0) {
+		pthread_mutex_lock(&s->s_idle_mtx);
+		pthread_cond_signal(&s->s_idle_cv);
+		pthread_mutex_unlock(&s->s_idle_mtx);
+	}
+}
+
+void
+ct_sched_push(struct ct_sched *s, struct ct_trans *trans)
+{
+	struct ct_sched_worker	*sw;
+
+	sw = pthread_getspecific(s->s_self);
+	if (sw != NULL) {
+		CT_LOCK(&sw->sw_lock);
+		TAILQ_INSERT_TAIL(&sw->sw_deque, trans, tr_next);
+		CT_UNLOCK(&sw->sw_lock);
+	} else {
+		CT_LOCK(&s->s_inject_lock);
+		TAILQ_INSERT_TAIL(&s->s_inject, trans, tr_next);
+		CT_UNLOCK(&s->s_inject_lock);
+	}
+	ct_sched_wakeup(s);
+}
+
+static struct ct_trans *
+ct_sched_take(struct ct_sched_worker *sw)
+{
+	struct ct_sched		*s = sw->sw_sched;
+	struct ct_trans		*trans;
+
+	CT_LOCK(&sw->sw_lock);
+	if ((trans = TAILQ_LAST(&sw->sw_deque, ct_sched_deque)) != NULL)
+		TAILQ_REMOVE(&sw->sw_deque, trans, tr_next);
+	CT_UNLOCK(&sw->sw_lock);
+	if (trans != NULL)
+		return (trans);
+
+	CT_LOCK(&s->s_inject_lock);
+	if ((trans = TAILQ_FIRST(&s->s_inject)) != NULL)
+		TAILQ_REMOVE(&s->s_inject, trans, tr_next);
+	CT_UNLOCK(&s->s_inject_lock);
+
+	return (trans);
+}
+
+static struct ct_trans *
+ct_sched_steal(struct ct_sched_worker *sw)
+{
+	struct ct_sched		*s = sw->sw_sched;
+	struct ct_sched_worker	*victim;
+	struct ct_trans		*trans = NULL;
+	int			 i;
+
+	for (i = 1; i < s->s_nworkers && trans == NULL; i++) {
+		victim = &s->s_workers[(sw->sw_id + i) % s->s_nworkers];
+		CT_LOCK(&victim->sw_lock);
+		if ((trans = TAILQ_FIRST(&victim->sw_deque)) != NULL)
+			TAILQ_REMOVE(&victim->sw_deque, trans, tr_next);
+		CT_UNLOCK(&victim->sw_lock);
+	}
+
+	return (trans);
+}
+
+/*
+ * Sleep until there is a wakeup to consume. A wakeup posted between our last
+ * look at the queues and here is still counted in s_pending, so it can't be
+ * lost. Returns non zero when the scheduler is shutting down.
+ */
+static int
+ct_sched_idle(struct ct_sched *s)
+{
+	int	exiting;
+
+	pthread_mutex_lock(&s->s_idle_mtx);
+	CT_ATOMIC_ADD(&s->s_nidle, 1);
+	while (s->s_exiting == 0 && CT_ATOMIC_LOAD(&s->s_pending) == 0)
+		pthread_cond_wait(&s->s_idle_cv, &s->s_idle_mtx);
+	CT_ATOMIC_ADD(&s->s_nidle, -1);
+	if ((exiting = s->s_exiting) == 0)
+		CT_ATOMIC_ADD(&s->s_pending, -1);
+	pthread_mutex_unlock(&s->s_idle_mtx);
+
+	return (exiting);
+}
+
+void *
+ct_sched_thread(void *vsw)
+{
+	struct ct_sched_worker	*sw = vsw;
+	struct ct_sched		*s = sw->sw_sched;
+	struct ct_trans		*trans;
+
+	pthread_setspecific(s->s_self, sw);
+	for (;;) {
+		if ((trans = ct_sched_take(sw)) == NULL &&
+		    s->s_poll(s->s_arg, sw->sw_id) != 0)
+			continue;
+		if (trans == NULL && (trans = ct_sched_steal(sw)) == NULL) {
+			if (ct_sched_idle(s) != 0)
+				break;
+			continue;
+		}
+		s->s_run(s->s_arg, sw->sw_id, trans);
+	}
+
+	pthread_exit(NULL);
+}
+
+#else /* CT_ENABLE_PTHREADS */
+
+struct ct_sched *
+ct_sched_init(int nworkers, ct_sched_run_cb *run, ct_sched_poll_cb *poll,
+    void *arg)
+{
+	return (NULL);
+}
+
+void
+ct_sched_cleanup(struct ct_sched *s)
+{
+}
+
+int
+ct_sched_nworkers(struct ct_sched *s)
+{
+	return (0);
+}
+
+void
+ct_sched_wakeup(struct ct_sched *s)
+{
+}
+
+void
+ct_sched_push(struct ct_sched *s, struct ct_trans *trans)
+{
+	CABORTX("no scheduler without threads");
+}
+
+#endif /* CT_ENABLE_PTHREADS */
@@ -0,0 +1,372 @@
+/*
+ * Copyright (c) 2012 Conformal Systems LLC <info@conformal.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Stat index of an archive. Every regular file written to a ctfile is
+ * remembered with what stat(2) said about it, and when the ctfile is closed
+ * they are written next to it sorted by directory and name. An incremental
+ * based on that ctfile maps the index and looks files up in it instead of
+ * parsing the whole ctfile to find out what changed; with a change journal
+ * it takes the stat of files the journal has nothing on from here too.
+ *
+ * The layout is a header, the fixed size entries and a table of the NUL
+ * terminated strings they point into, all in host byte order; an index
+ * from a machine that disagrees is ignored. It records the creation time
+ * and size of its ctfile, so one left behind by an older ctfile of the
+ * same name is ignored too.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include <clog.h>
+#include <exude.h>
+
+#include <cyphertite.h>
+#include <ct_internal.h>
+
+#define CT_STATIDX_MAGIC	"CTSTATIX"
+#define CT_STATIDX_VERSION	2
+#define CT_STATIDX_ORDER	0x01020304
+
+struct ct_statidx_hdr {
+	char		sh_magic[8];
+	uint32_t	sh_version;
+	uint32_t	sh_order;	/* CT_STATIDX_ORDER as written */
+	uint64_t	sh_count;
+	int64_t		sh_created;	/* of the ctfile */
+	int64_t		sh_ctfile_size;
+	uint64_t	sh_strsize;
+	uint64_t	sh_journal;	/* session seen by the archive, or 0 */
+	int64_t		sh_journal_off;	/* and how far it had got */
+};
+
+struct ct_statidx {
+	void				*si_map;
+	size_t				 si_len;
+	const struct ct_statidx_ent	*si_ents;
+	uint64_t			 si_count;
+	const char			*si_str;
+	uint64_t			 si_strsize;
+	uint64_t			 si_journal;
+	off_t				 si_journal_off;
+};
+
+struct ct_statidx_file {
+	const char		*sf_dir;	/* one of sb_dirs */
+	char			*sf_name;
+	struct ct_statidx_ent	 sf_ent;
+};
+
+struct ct_statidx_build {
+	struct ct_statidx_file	*sb_files;
+	size_t			 sb_nfiles;
+	size_t			 sb_maxfiles;
+	char			**sb_dirs;
+	size_t			 sb_ndirs;
+	size_t			 sb_maxdirs;
+	uint64_t		 sb_journal;
+	off_t			 sb_journal_off;
+};
+
+struct ct_statidx_build *
+ct_statidx_build_init(void)
+{
+	return (e_calloc(1, sizeof(struct ct_statidx_build)));
+}
+
+void
+ct_statidx_build_free(struct ct_statidx_build *sb)
+{
+	size_t	i;
+
+	if (sb == NULL)
+		return;
+	for (i = 0; i < sb->sb_nfiles; i++)
+		e_free(&sb->sb_files[i].sf_name);
+	for (i = 0; i < sb->sb_ndirs; i++)
+		e_free(&sb->sb_dirs[i]);
+	if (sb->sb_files != NULL)
+		e_free(&sb->sb_files);
+	if (sb->sb_dirs != NULL)
+		e_free(&sb->sb_dirs);
+	e_free(&sb);
+}
+
+/* dir is "" for files at the top of the archive; se's offsets are unused. */
+void
+ct_statidx_build_add(struct ct_statidx_build *sb, const char *dir,
+    const char *name, const struct ct_statidx_ent *se)
+{
+	struct ct_statidx_file	*sf;
+
+	/* files arrive a directory at a time, so only keep one copy */
+	if (sb->sb_ndirs == 0 || strcmp(sb->sb_dirs[sb->sb_ndirs - 1],
+	    dir) != 0) {
+		if (sb->sb_ndirs == sb->sb_maxdirs) {
+			sb->sb_maxdirs = sb->sb_maxdirs ?
+			    sb->sb_maxdirs * 2 : 64;
+			sb->sb_dirs = e_realloc(sb->sb_dirs,
+			    sb->sb_maxdirs * sizeof(*sb->sb_dirs));
+		}
+		sb->sb_dirs[sb->sb_ndirs++] = e_strdup(dir);
+	}
+	if (sb->sb_nfiles == sb->sb_maxfiles) {
+		sb->sb_maxfiles = sb->sb_maxfiles ? sb->sb_maxfiles * 2 : 1024;
+		sb->sb_files = e_realloc(sb->sb_files,
+		    sb->sb_maxfiles * sizeof(*sb->sb_files));
+	}
+	sf = &sb->sb_files[sb->sb_nfiles++];
+	sf->sf_dir = sb->sb_dirs[sb->sb_ndirs - 1];
+	sf->sf_name = e_strdup(name);
+	sf->sf_ent = *se;
+}
+
+/* Remember how far into which change journal the archive had looked. */
+void
+ct_statidx_build_journal(struct ct_statidx_build *sb, uint64_t session,
+    off_t off)
+{
+	sb->sb_journal = session;
+	sb->sb_journal_off = off;
+}
+
+static int
+ct_statidx_file_cmp(const void *a, const void *b)
+{
+	const struct ct_statidx_file	*f1 = a, *f2 = b;
+	int				 rv;
+
+	if (f1->sf_dir != f2->sf_dir &&
+	    (rv = strcmp(f1->sf_dir, f2->sf_dir)) != 0)
+		return (rv);
+	return (strcmp(f1->sf_name, f2->sf_name));
+}
+
+/* Append s to the string table, returning its offset. */
+static uint64_t
+ct_statidx_str(char **str, uint64_t *len, uint64_t *max, const char *s)
+{
+	uint64_t	off = *len;
+	size_t		slen = strlen(s) + 1;
+
+	while (*len + slen > *max) {
+		*max = *max ? *max * 2 : 65536;
+		*str = e_realloc(*str, *max);
+	}
+	memcpy(*str + *len, s, slen);
+	*len += slen;
+
+	return (off);
+}
+
+/*
+ * Write the index of the ctfile created at created and now size bytes long
+ * to path, replacing it in one go so a reader never sees half of one.
+ */
+int
+ct_statidx_build_write(struct ct_statidx_build *sb, const char *path,
+    int64_t created, off_t ctfile_size)
+{
+	struct ct_statidx_hdr	 hdr;
+	struct ct_statidx_ent	*ents;
+	struct ct_statidx_file	*sf;
+	FILE			*f = NULL;
+	char			*tmp, *str = NULL;
+	uint64_t		 strsize = 0, strmax = 0, diroff = 0;
+	size_t			 i;
+	int			 ret = 0, s_errno;
+
+	qsort(sb->sb_files, sb->sb_nfiles, sizeof(*sb->sb_files),
+	    ct_statidx_file_cmp);
+	ents = e_calloc(sb->sb_nfiles ? sb->sb_nfiles : 1, sizeof(*ents));
+	for (i = 0; i < sb->sb_nfiles; i++) {
+		sf = &sb->sb_files[i];
+		if (i == 0 || strcmp(sf->sf_dir, sb->sb_files[i - 1].sf_dir))
+			diroff = ct_statidx_str(&str, &strsize, &strmax,
+			    sf->sf_dir);
+		ents[i] = sf->sf_ent;
+		ents[i].se_dir = diroff;
+		ents[i].se_name = ct_statidx_str(&str, &strsize, &strmax,
+		    sf->sf_name);
+	}
+
+	bzero(&hdr, sizeof(hdr));
+	memcpy(hdr.sh_magic, CT_STATIDX_MAGIC, sizeof(hdr.sh_magic));
+	hdr.sh_version = CT_STATIDX_VERSION;
+	hdr.sh_order = CT_STATIDX_ORDER;
+	hdr.sh_count = sb->sb_nfiles;
+	hdr.sh_created = created;
+	hdr.sh_ctfile_size = ctfile_size;
+	hdr.sh_strsize = strsize;
+	hdr.sh_journal = sb->sb_journal;
+	hdr.sh_journal_off = sb->sb_journal_off;
+
+	e_asprintf(&tmp, "%s.tmp", path);
+	if ((f = fopen(tmp, "wb")) == NULL ||
+	    fwrite(&hdr, sizeof(hdr), 1, f) != 1 ||
+	    (sb->sb_nfiles != 0 &&
+	    fwrite(ents, sizeof(*ents), sb->sb_nfiles, f) != sb->sb_nfiles) ||
+	    (strsize != 0 && fwrite(str, strsize, 1, f) != 1) ||
+	    fflush(f) != 0) {
+		ret = CTE_ERRNO;
+	}
+	s_errno = errno;
+	if (f != NULL && fclose(f) != 0 && ret == 0) {
+		ret = CTE_ERRNO;
+		s_errno = errno;
+	}
+	if (ret == 0 && rename(tmp, path) != 0) {
+		ret = CTE_ERRNO;
+		s_errno = errno;
+	}
+	if (ret != 0)
+		unlink(tmp);
+
+	e_free(&tmp);
+	if (str != NULL)
+		e_free(&str);
+	e_free(&ents);
+	errno = s_errno;
+
+	return (ret);
+}
+
+/*
+ * Map the index at path if it belongs to the ctfile created at created and
+ * size bytes long.
+ */
+int
+ct_statidx_open(struct ct_statidx **sip, const char *path, int64_t created,
+    off_t ctfile_size)
+{
+	struct ct_statidx	*si;
+	struct ct_statidx_hdr	 hdr;
+	struct stat		 sb;
+	void			*map;
+	uint64_t		 entsize;
+	int			 fd, s_errno;
+
+	*sip = NULL;
+	if ((fd = open(path, O_RDONLY)) == -1)
+		return (CTE_ERRNO);
+	if (fstat(fd, &sb) != 0) {
+		s_errno = errno;
+		close(fd);
+		errno = s_errno;
+		return (CTE_ERRNO);
+	}
+	if (sb.st_size < (off_t)sizeof(hdr)) {
+		close(fd);
+		return (CTE_CTFILE_CORRUPT);
+	}
+	map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	s_errno = errno;
+	close(fd);
+	if (map == MAP_FAILED) {
+		errno = s_errno;
+		return (CTE_ERRNO);
+	}
+
+	memcpy(&hdr, map, sizeof(hdr));
+	entsize = sizeof(struct ct_statidx_ent);
+	if (memcmp(hdr.sh_magic, CT_STATIDX_MAGIC, sizeof(hdr.sh_magic)) ||
+	    hdr.sh_version != CT_STATIDX_VERSION ||
+	    hdr.sh_order != CT_STATIDX_ORDER ||
+	    hdr.sh_count > (sb.st_size - sizeof(hdr)) / entsize ||
+	    hdr.sh_strsize != sb.st_size - sizeof(hdr) -
+	    hdr.sh_count * entsize ||
+	    (hdr.sh_count != 0 && (hdr.sh_strsize == 0 ||
+	    ((char *)map)[sb.st_size - 1] != '\0'))) {
+		CNDBG(CT_LOG_CTFILE, "%s is not a stat index", path);
+		munmap(map, sb.st_size);
+		return (CTE_CTFILE_CORRUPT);
+	}
+	if (hdr.sh_created != created || hdr.sh_ctfile_size != ctfile_size) {
+		CNDBG(CT_LOG_CTFILE, "%s is for another ctfile", path);
+		munmap(map, sb.st_size);
+		return (CTE_CTFILE_CORRUPT);
+	}
+
+	si = e_calloc(1, sizeof(*si));
+	si->si_map = map;
+	si->si_len = sb.st_size;
+	si->si_ents = (const struct ct_statidx_ent *)
+	    ((char *)map + sizeof(hdr));
+	si->si_count = hdr.sh_count;
+	si->si_str = (const char *)map + sizeof(hdr) +
+	    hdr.sh_count * entsize;
+	si->si_strsize = hdr.sh_strsize;
+	si->si_journal = hdr.sh_journal;
+	si->si_journal_off = hdr.sh_journal_off;
+	*sip = si;
+
+	return (0);
+}
+
+void
+ct_statidx_close(struct ct_statidx *si)
+{
+	if (si == NULL)
+		return;
+	munmap(si->si_map, si->si_len);
+	e_free(&si);
+}
+
+/* Look up name in dir, "" for the top of the archive. */
+const struct ct_statidx_ent *
+ct_statidx_find(struct ct_statidx *si, const char *dir, const char *name)
+{
+	const struct ct_statidx_ent	*se;
+	uint64_t			 lo = 0, hi = si->si_count, mid;
+	int				 rv;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		se = &si->si_ents[mid];
+		/* the table ends in a NUL, so nothing runs off the end */
+		if (se->se_dir >= si->si_strsize ||
+		    se->se_name >= si->si_strsize)
+			return (NULL);
+		if ((rv = strcmp(dir, si->si_str + se->se_dir)) == 0)
+			rv = strcmp(name, si->si_str + se->se_name);
+		if (rv == 0)
+			return (se);
+		if (rv < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+
+	return (NULL);
+}
+
+/* The change journal session the archive saw and its offset then. */
+void
+ct_statidx_journal(struct ct_statidx *si, uint64_t *session, off_t *off)
+{
+	*session = si->si_journal;
+	*off = si->si_journal_off;
+}
@@ -37,11 +37,13 @@ struct fnode {
 	ino_t			fn_ino;
 	uint64_t		fn_idx;
 	dev_t			fn_rdev;
+	uint32_t		fn_nlink;
 	uint32_t		fn_uid;
 	uint32_t		fn_gid;
 	int			fn_mode;
 	int64_t			fn_atime;
 	int64_t			fn_mtime;
+	int64_t			fn_ctime;
 	int			fn_type;
 	off_t			fn_size;
 	off_t			fn_offset;
@@ -53,9 +55,12 @@ struct fnode {
 #define CT_FILE_START		(0)
 #define CT_FILE_PROCESSING	(1)
 #define CT_FILE_FINISHED	(2)
-	SHA_CTX			fn_shactx;
+	struct ct_digest_ctx	fn_shactx;
 	int			fn_skip_file;
 	int			fn_refcount;
+	struct fnode		*fn_pack_next;	/* packed into the same chunk */
+	off_t			fn_pack_off;	/* of the data in the chunk */
+	int			fn_sparse;	/* zeros are not read as chunks */
 	/* XXX LIST? */
 	TAILQ_HEAD(, fnode)	fn_hardlinks;
 };
@@ -176,7 +181,8 @@ struct ctfile_list_file {
 #define CTE_CAN_NOT_DELETE		58
 #define CTE_SNAPSHOT			59
 #define CTE_CANCELLED			60
-#define CTE_MAX				(CTE_CANCELLED + 1)
+#define CTE_JOURNAL_INVALID		61
+#define CTE_MAX				(CTE_JOURNAL_INVALID + 1)
 /*
  * NOTE: Update CTE_MAX when adding new error codes.  Also be sure to add an
  * appropriate error string to the ct_errmsgs array in ct_util.c.
@@ -0,0 +1,433 @@
+/*
+ * Copyright (c) 2012 Conformal Systems LLC <info@conformal.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Just enough of a Linux io_uring to batch file i/o: operations are
+ * prepared one at a time and handed to the kernel together by
+ * ct_uring_submit(), completions are taken back one at a time with the
+ * cookie they were prepared with. This talks to the kernel directly so
+ * there is no liburing to depend on; where io_uring is missing, too old
+ * or not permitted ct_uring_init() returns NULL and callers keep using
+ * plain syscalls.
+ *
+ * Not thread safe, callers serialise everything except ct_uring_wait().
+ * The number of operations in flight is capped at the size of the
+ * submission queue so the completion queue can never overflow.
+ */
+
+#include <sys/types.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include <clog.h>
+#include <exude.h>
+
+#include <cyphertite.h>
+#include <ct_internal.h>
+
+#ifdef CT_HAVE_URING
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+struct ct_uring {
+	int			 ur_fd;
+	unsigned		 ur_entries;
+	unsigned		 ur_inflight;	/* prepared, not reaped */
+	unsigned		 ur_tail;	/* next sqe to prepare */
+	unsigned		 ur_submitted;	/* up to here the kernel has */
+
+	void			*ur_sq_map;
+	size_t			 ur_sq_mapsz;
+	void			*ur_cq_map;
+	size_t			 ur_cq_mapsz;
+	struct io_uring_sqe	*ur_sqes;
+	size_t			 ur_sqes_mapsz;
+
+	unsigned		*ur_sq_tail;
+	unsigned		*ur_sq_mask;
+	unsigned		*ur_sq_array;
+	unsigned		*ur_cq_head;
+	unsigned		*ur_cq_tail;
+	unsigned		*ur_cq_mask;
+	struct io_uring_cqe	*ur_cqes;
+};
+
+static int
+ct_uring_enter(int fd, unsigned submit, unsigned wait)
+{
+	return (syscall(__NR_io_uring_enter, fd, submit, wait,
+	    wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0));
+}
+
+struct ct_uring *
+ct_uring_init(unsigned entries)
+{
+	struct io_uring_params	 p;
+	struct ct_uring		*ur;
+	int			 fd;
+
+	bzero(&p, sizeof(p));
+	if ((fd = syscall(__NR_io_uring_setup, entries, &p)) == -1) {
+		CNDBG(CT_LOG_FILE, "io_uring not available: %s",
+		    strerror(errno));
+		return (NULL);
+	}
+	/* openat, statx, read, write and close all arrived with this */
+	if ((p.features & IORING_FEAT_RW_CUR_POS) == 0) {
+		CNDBG(CT_LOG_FILE, "io_uring too old");
+		close(fd);
+		return (NULL);
+	}
+
+	ur = e_calloc(1, sizeof(*ur));
+	ur->ur_fd = fd;
+	ur->ur_entries = p.sq_entries;
+	ur->ur_sq_mapsz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ur->ur_cq_mapsz = p.cq_off.cqes +
+	    p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ur->ur_cq_mapsz > ur->ur_sq_mapsz)
+			ur->ur_sq_mapsz = ur->ur_cq_mapsz;
+		ur->ur_cq_mapsz = 0;
+	}
+
+	ur->ur_sq_map = mmap(NULL, ur->ur_sq_mapsz, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (ur->ur_sq_map == MAP_FAILED)
+		goto fail;
+	if (ur->ur_cq_mapsz == 0) {
+		ur->ur_cq_map = ur->ur_sq_map;
+	} else {
+		ur->ur_cq_map = mmap(NULL, ur->ur_cq_mapsz,
+		    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+		    IORING_OFF_CQ_RING);
+		if (ur->ur_cq_map == MAP_FAILED)
+			goto fail;
+	}
+	ur->ur_sqes_mapsz = p.sq_entries * sizeof(struct io_uring_sqe);
+	ur->ur_sqes = mmap(NULL, ur->ur_sqes_mapsz, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (ur->ur_sqes == MAP_FAILED)
+		goto fail;
+
+	ur->ur_sq_tail = (unsigned *)((char *)ur->ur_sq_map + p.sq_off.tail);
+	ur->ur_sq_mask = (unsigned *)((char *)ur->ur_sq_map +
+	    p.sq_off.ring_mask);
+	ur->ur_sq_array = (unsigned *)((char *)ur->ur_sq_map +
+	    p.sq_off.array);
+	ur->ur_cq_head = (unsigned *)((char *)ur->ur_cq_map + p.cq_off.head);
+	ur->ur_cq_tail = (unsigned *)((char *)ur->ur_cq_map + p.cq_off.tail);
+	ur->ur_cq_mask = (unsigned *)((char *)ur->ur_cq_map +
+	    p.cq_off.ring_mask);
+	ur->ur_cqes = (struct io_uring_cqe *)((char *)ur->ur_cq_map +
+	    p.cq_off.cqes);
+	ur->ur_tail = ur->ur_submitted = *ur->ur_sq_tail;
+
+	CNDBG(CT_LOG_FILE, "io_uring with %u entries", ur->ur_entries);
+	return (ur);
+
+fail:
+	CNDBG(CT_LOG_FILE, "can't map io_uring: %s", strerror(errno));
+	if (ur->ur_sqes != NULL && ur->ur_sqes != MAP_FAILED)
+		munmap(ur->ur_sqes, ur->ur_sqes_mapsz);
+	if (ur->ur_cq_mapsz != 0 && ur->ur_cq_map != NULL &&
+	    ur->ur_cq_map != MAP_FAILED)
+		munmap(ur->ur_cq_map, ur->ur_cq_mapsz);
+	if (ur->ur_sq_map != NULL && ur->ur_sq_map != MAP_FAILED)
+		munmap(ur->ur_sq_map, ur->ur_sq_mapsz);
+	close(fd);
+	e_free(&ur);
+	return (NULL);
+}
+
+/* Everything must have been reaped. */
+void
+ct_uring_cleanup(struct ct_uring *ur)
+{
+	if (ur == NULL)
+		return;
+	if (ur->ur_inflight != 0)
+		CABORTX("io_uring cleanup with %u in flight", ur->ur_inflight);
+
+	munmap(ur->ur_sqes, ur->ur_sqes_mapsz);
+	if (ur->ur_cq_mapsz != 0)
+		munmap(ur->ur_cq_map, ur->ur_cq_mapsz);
+	munmap(ur->ur_sq_map, ur->ur_sq_mapsz);
+	close(ur->ur_fd);
+	e_free(&ur);
+}
+
+unsigned
+ct_uring_inflight(struct ct_uring *ur)
+{
+	return (ur->ur_inflight);
+}
+
+/* Prepared but not taken by the kernel yet, see ct_uring_submit(). */
+unsigned
+ct_uring_unsent(struct ct_uring *ur)
+{
+	return (ur->ur_tail - ur->ur_submitted);
+}
+
+/* A zeroed sqe for data, or NULL if the ring is full. */
+static struct io_uring_sqe *
+ct_uring_sqe(struct ct_uring *ur, uint8_t op, int fd, uint64_t data)
+{
+	struct io_uring_sqe	*sqe;
+	unsigned		 idx;
+
+	if (ur->ur_inflight >= ur->ur_entries)
+		return (NULL);
+
+	/* the kernel has consumed everything up to ur_submitted */
+	idx = ur->ur_tail & *ur->ur_sq_mask;
+	sqe = &ur->ur_sqes[idx];
+	bzero(sqe, sizeof(*sqe));
+	sqe->opcode = op;
+	sqe->fd = fd;
+	sqe->user_data = data;
+	ur->ur_sq_array[idx] = idx;
+	ur->ur_tail++;
+	ur->ur_inflight++;
+
+	return (sqe);
+}
+
+int
+ct_uring_nop(struct ct_uring *ur, uint64_t data)
+{
+	return (ct_uring_sqe(ur, IORING_OP_NOP, -1, data) ? 0 : -1);
+}
+
+int
+ct_uring_openat(struct ct_uring *ur, int dfd, const char *path, int flags,
+    uint64_t data)
+{
+	struct io_uring_sqe	*sqe;
+
+	if ((sqe = ct_uring_sqe(ur, IORING_OP_OPENAT, dfd, data)) == NULL)
+		return (-1);
+	sqe->addr = (uintptr_t)path;
+	sqe->open_flags = flags;
+
+	return (0);
+}
+
+/* statx(2) of an open fd into buf, which is a struct statx. */
+int
+ct_uring_fstatx(struct ct_uring *ur, int fd, unsigned mask, void *buf,
+    uint64_t data)
+{
+	struct io_uring_sqe	*sqe;
+
+	if ((sqe = ct_uring_sqe(ur, IORING_OP_STATX, fd, data)) == NULL)
+		return (-1);
+	sqe->addr = (uintptr_t)"";
+	sqe->len = mask;
+	sqe->off = (uintptr_t)buf;
+	sqe->statx_flags = AT_EMPTY_PATH;
+
+	return (0);
+}
+
+int
+ct_uring_pread(struct ct_uring *ur, int fd, void *buf, size_t len,
+    off_t off, uint64_t data)
+{
+	struct io_uring_sqe	*sqe;
+
+	if ((sqe = ct_uring_sqe(ur, IORING_OP_READ, fd, data)) == NULL)
+		return (-1);
+	sqe->addr = (uintptr_t)buf;
+	sqe->len = len;
+	sqe->off = off;
+
+	return (0);
+}
+
+int
+ct_uring_pwrite(struct ct_uring *ur, int fd, const void *buf, size_t len,
+    off_t off, uint64_t data)
+{
+	struct io_uring_sqe	*sqe;
+
+	if ((sqe = ct_uring_sqe(ur, IORING_OP_WRITE, fd, data)) == NULL)
+		return (-1);
+	sqe->addr = (uintptr_t)buf;
+	sqe->len = len;
+	sqe->off = off;
+
+	return (0);
+}
+
+int
+ct_uring_close(struct ct_uring *ur, int fd, uint64_t data)
+{
+	return (ct_uring_sqe(ur, IORING_OP_CLOSE, fd, data) ? 0 : -1);
+}
+
+/*
+ * Hand everything prepared so far to the kernel in one go, then wait for
+ * at least wait completions to be ready. Returns 0 or an errno. If the
+ * kernel is short of memory the rest is left for the next call, without
+ * waiting; ct_uring_unsent() says how much that is.
+ */
+int
+ct_uring_submit(struct ct_uring *ur, unsigned wait)
+{
+	unsigned	n;
+	int		ret;
+
+	__atomic_store_n(ur->ur_sq_tail, ur->ur_tail, __ATOMIC_RELEASE);
+	for (;;) {
+		n = ur->ur_tail - ur->ur_submitted;
+		if (n == 0 && wait == 0)
+			return (0);
+		if ((ret = ct_uring_enter(ur->ur_fd, n, wait)) == -1) {
+			if (errno == EINTR)
+				continue;
+			/* short of memory, the rest goes with the next call */
+			if (errno == EAGAIN || errno == EBUSY)
+				return (0);
+			return (errno);
+		}
+		ur->ur_submitted += ret;
+		if (ur->ur_submitted == ur->ur_tail)
+			return (0);
+		wait = 0;
+	}
+}
+
+/*
+ * Block until a completion is ready without submitting anything. May run
+ * concurrently with the other calls.
+ */
+void
+ct_uring_wait(struct ct_uring *ur)
+{
+	while (ct_uring_enter(ur->ur_fd, 0, 1) == -1 && errno == EINTR)
+		;
+}
+
+/* Take back one completion, returns 0 if there is none. */
+int
+ct_uring_reap(struct ct_uring *ur, uint64_t *data, int *res)
+{
+	struct io_uring_cqe	*cqe;
+	unsigned		 head;
+
+	head = *ur->ur_cq_head;
+	if (head == __atomic_load_n(ur->ur_cq_tail, __ATOMIC_ACQUIRE))
+		return (0);
+	cqe = &ur->ur_cqes[head & *ur->ur_cq_mask];
+	*data = cqe->user_data;
+	*res = cqe->res;
+	__atomic_store_n(ur->ur_cq_head, head + 1, __ATOMIC_RELEASE);
+	ur->ur_inflight--;
+
+	return (1);
+}
+
+#else /* CT_HAVE_URING */
+
+struct ct_uring *
+ct_uring_init(unsigned entries)
+{
+	return (NULL);
+}
+
+void
+ct_uring_cleanup(struct ct_uring *ur)
+{
+}
+
+unsigned
+ct_uring_inflight(struct ct_uring *ur)
+{
+	return (0);
+}
+
+unsigned
+ct_uring_unsent(struct ct_uring *ur)
+{
+	return (0);
+}
+
+int
+ct_uring_nop(struct ct_uring *ur, uint64_t data)
+{
+	return (-1);
+}
+
+int
+ct_uring_openat(struct ct_uring *ur, int dfd, const char *path, int flags,
+    uint64_t data)
+{
+	return (-1);
+}
+
+int
+ct_uring_fstatx(struct ct_uring *ur, int fd, unsigned mask, void *buf,
+    uint64_t data)
+{
+	return (-1);
+}
+
+int
+ct_uring_pread(struct ct_uring *ur, int fd, void *buf, size_t len,
+    off_t off, uint64_t data)
+{
+	return (-1);
+}
+
+int
+ct_uring_pwrite(struct ct_uring *ur, int fd, const void *buf, size_t len,
+    off_t off, uint64_t data)
+{
+	return (-1);
+}
+
+int
+ct_uring_close(struct ct_uring *ur, int fd, uint64_t data)
+{
+	return (-1);
+}
+
+int
+ct_uring_submit(struct ct_uring *ur, unsigned wait)
+{
+	return (ENOSYS);
+}
+
+void
+ct_uring_wait(struct ct_uring *ur)
+{
+}
+
+int
+ct_uring_reap(struct ct_uring *ur, uint64_t *data, int *res)
+{
+	return (0);
+}
+
+#endif /* CT_HAVE_URING */
@@ -129,6 +129,7 @@ const char *ct_errmsgs[] = {
 	[CTE_SNAPSHOT] = "Failed to initialize operating system snapshot "
 	    "services.  Please review system logs for further details",
 	[CTE_CANCELLED] = "Cancelled by user",
+	[CTE_JOURNAL_INVALID] = "Change journal can not be used",
 };
 
 const char *
@@ -224,6 +225,10 @@ ct_init(struct ct_global_state **statep, struct ct_config *conf,
 
 fail:
 	if (state != NULL) {
+		ct_worker_pool_cleanup(&state->ct_comp_pool);
+		ct_worker_pool_cleanup(&state->ct_crypt_pool);
+		ct_worker_pool_cleanup(&state->ct_fused_pool);
+		ct_worker_pool_cleanup(&state->ct_sched_pool);
 		e_free(&state->ct_stats);
 		e_free(&state);
 	}
@@ -268,6 +273,30 @@ ct_set_log_fns(struct ct_global_state *state, void *logst,
 }
 
 
+static int
+ct_setup_stage_threads(struct ct_global_state *state)
+{
+	int ret;
+
+	/* fused workers take over the sha queue, see ct_compute_fused() */
+	if (state->ct_config->ct_fused_threads > 0)
+		ret = ct_setup_wakeup_sha(state->event_state, state,
+		    ct_compute_fused, state->ct_fused_pool.wp_nworkers);
+	else
+		ret = ct_setup_wakeup_sha(state->event_state, state,
+		    ct_compute_sha, state->ct_config->ct_sha_threads);
+	if (ret != 0)
+		return (ret);
+	if ((ret = ct_setup_wakeup_compress(state->event_state, state,
+	    ct_compute_compress, state->ct_comp_pool.wp_nworkers)) != 0)
+		return (ret);
+	if ((ret = ct_setup_wakeup_csha(state->event_state, state,
+	    ct_compute_csha)) != 0)
+		return (ret);
+	return (ct_setup_wakeup_encrypt(state->event_state, state,
+	    ct_compute_encrypt, state->ct_crypt_pool.wp_nworkers));
+}
+
 int
 ct_init_eventloop(struct ct_global_state *state,
     void (*info_cb)(evutil_socket_t, short, void *), int flags)
@@ -278,7 +307,8 @@ ct_init_eventloop(struct ct_global_state *state,
 
 	if ((flags & CT_NEED_DB) != 0) {
 		state->ct_db_state = ctdb_setup(state->ct_config->ct_localdb,
-		    state->ct_config->ct_crypto_secrets != NULL);
+		    state->ct_config->ct_crypto_secrets != NULL,
+		    state->ct_config->ct_digest);
 	} else {
 		state->ct_db_state = NULL;
 	}
@@ -294,28 +324,24 @@ ct_init_eventloop(struct ct_global_state *state,
 	    state->ct_assl_ctx->c->as_protocol);
 
 	ct_set_file_state(state, CT_S_STARTING);
-	CT_LOCK_INIT(&state->ct_sha_lock);
-	CT_LOCK_INIT(&state->ct_comp_lock);
-	CT_LOCK_INIT(&state->ct_crypt_lock);
-	CT_LOCK_INIT(&state->ct_csha_lock);
+	/* sized from ct_max_trans in the config */
+	ct_init_queues(state);
+	CT_LOCK_INIT(&state->ct_sha_order_lock);
+	CT_COND_INIT(&state->ct_sha_order_cv);
 	CT_LOCK_INIT(&state->ct_write_lock);
 	CT_LOCK_INIT(&state->ct_queued_lock);
-	CT_LOCK_INIT(&state->ct_complete_lock);
+	CT_LOCK_INIT(&state->ct_stats_lock);
 
 	if ((ret = ct_setup_wakeup_file(state->event_state, state,
 	    ct_nextop)) != 0)
 		goto fail;
-	if ((ret = ct_setup_wakeup_sha(state->event_state, state,
-	    ct_compute_sha)) != 0)
-		goto fail;
-	if ((ret = ct_setup_wakeup_compress(state->event_state, state,
-	    ct_compute_compress)) != 0)
-		goto fail;
-	if ((ret = ct_setup_wakeup_csha(state->event_state, state,
-	    ct_compute_csha)) != 0)
-		goto fail;
-	if ((ret = ct_setup_wakeup_encrypt(state->event_state, state,
-	    ct_compute_encrypt)) != 0)
+	/* the scheduler runs every cpu stage, see ct_sched.c */
+	if (state->ct_config->ct_sched_threads > 0 &&
+	    (state->ct_sched = ct_setup_sched(state)) != NULL) {
+		if ((ret = ct_setup_wakeup_sched(state->event_state,
+		    state->ct_sched)) != 0)
+			goto fail;
+	} else if ((ret = ct_setup_stage_threads(state)) != 0)
 		goto fail;
 	if ((ret = ct_setup_wakeup_write(state->event_state, state,
 	    ct_process_write)) != 0)
@@ -371,21 +397,29 @@ ct_cleanup_eventloop(struct ct_global_state *state)
 	ctdb_shutdown(state->ct_db_state);
 	state->ct_db_state = NULL;
 	// XXX: ct_lock_cleanup();
-	CT_LOCK_RELEASE(&state->ct_sha_lock);
-	CT_LOCK_RELEASE(&state->ct_comp_lock);
-	CT_LOCK_RELEASE(&state->ct_crypt_lock);
-	CT_LOCK_RELEASE(&state->ct_csha_lock);
+	CT_LOCK_RELEASE(&state->ct_sha_order_lock);
+	CT_COND_RELEASE(&state->ct_sha_order_cv);
 	CT_LOCK_RELEASE(&state->ct_write_lock);
 	CT_LOCK_RELEASE(&state->ct_queued_lock);
-	CT_LOCK_RELEASE(&state->ct_complete_lock);
+	CT_LOCK_RELEASE(&state->ct_stats_lock);
 
+	/* scheduler workers may still wake other stages up */
+	ct_sched_cleanup(state->ct_sched);
+	state->ct_sched = NULL;
 	ct_event_cleanup(state->event_state);
+	/* only once the stage threads are gone */
+	ct_cleanup_queues(state);
+	ct_trans_arena_cleanup(state);
 }
 
 void
 ct_cleanup(struct ct_global_state *state)
 {
 	ct_cleanup_eventloop(state);
+	ct_worker_pool_cleanup(&state->ct_comp_pool);
+	ct_worker_pool_cleanup(&state->ct_crypt_pool);
+	ct_worker_pool_cleanup(&state->ct_fused_pool);
+	ct_worker_pool_cleanup(&state->ct_sched_pool);
 	e_free(&state->ct_stats);
 	e_free(&state);
 }
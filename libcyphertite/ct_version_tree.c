@@ -355,6 +355,7 @@ nextfile:
 			}
 			break;
 		case XS_RET_FILE_END:
+		case XS_RET_ZERO:
 			break;
 		case XS_RET_SHA:
 			if ((rv = ctfile_parse_seek(&parse_state))) {
@@ -46,6 +46,7 @@ bool_t		ct_xdr_dedup_sha_crypto(XDR *, uint8_t *, uint8_t *,
 			uint8_t *);
 bool_t          ct_xdr_header(XDR *, struct ctfile_header *, int);
 bool_t          ct_xdr_trailer(XDR *, struct ctfile_trailer *);
+bool_t          ct_xdr_pack(XDR *, struct ctfile_pack *);
 bool_t          ct_xdr_stdin(XDR *, struct ctfile_stdin *);
 int		ct_xdr_gheader(XDR *, struct ctfile_gheader *, int,
 		    const char *);
@@ -125,6 +126,16 @@ ct_xdr_trailer(XDR *xdrs, struct ctfile_trailer *objp)
 	return (TRUE);
 }
 
+bool_t
+ct_xdr_pack(XDR *xdrs, struct ctfile_pack *objp)
+{
+	if (!xdr_u_int32_t(xdrs, &objp->cmp_offset))
+		return (FALSE);
+	if (!xdr_u_int32_t(xdrs, &objp->cmp_len))
+		return (FALSE);
+	return (TRUE);
+}
+
 bool_t
 ct_xdr_stdin(XDR *xdrs, struct ctfile_stdin *objp)
 {
@@ -273,7 +284,14 @@ ctfile_open_f(FILE *f, const char *ctfile_basedir, struct ctfile_gheader *gh,
 	}
 	if (gh->cmg_version > CT_MD_VERSION) {
 		CNDBG(CT_LOG_CTFILE, "%d is incorrect version value (%d exp)",
-		    gh->cmg_beacon, CT_MD_VERSION);
+		    gh->cmg_version, CT_MD_VERSION);
+		ret = CTE_CTFILE_CORRUPT;
+		goto cleanup;
+	}
+	/* a flag we don't know may well change how the file is laid out */
+	if (gh->cmg_flags & ~CT_MD_FLAGS) {
+		CNDBG(CT_LOG_CTFILE, "unknown flags 0x%x",
+		    gh->cmg_flags & ~CT_MD_FLAGS);
 		ret = CTE_CTFILE_CORRUPT;
 		goto cleanup;
 	}
@@ -464,6 +482,11 @@ ctfile_parse(struct ctfile_parse_state *ctx)
 			break;
 		}
 
+		/* consumers only need to know if they extract the data */
+		ctx->xs_packed = (ctx->xs_hdr.cmh_type & C_TY_PACKED) != 0;
+		ctx->xs_sparse = (ctx->xs_hdr.cmh_type & C_TY_SPARSE) != 0;
+		ctx->xs_hdr.cmh_type &= ~(C_TY_PACKED | C_TY_SPARSE);
+
 		if (C_ISLINK(ctx->xs_hdr.cmh_type)) {
 			ret = ctfile_parse_read_header(ctx, &ctx->xs_lnkhdr);
 			if (ret) {
@@ -485,6 +508,17 @@ ctfile_parse(struct ctfile_parse_state *ctx)
 		 */
 		 if (ctx->xs_sha_cnt > 0) {
 			ctx->xs_sha_cnt--;
+			if (ctx->xs_sparse) {
+				if (xdr_u_int64_t(&ctx->xs_xdr,
+				    &ctx->xs_zero) == FALSE) {
+					ctx->xs_errno = CTE_CTFILE_CORRUPT;
+					goto fail;
+				}
+				if (ctx->xs_zero != 0) {
+					rv = XS_RET_ZERO;
+					break;
+				}
+			}
 			/* XXX gh check? */
 			if (ctx->xs_sha_sz == 0)
 				pos0 = ftello(ctx->xs_f);
@@ -506,6 +540,11 @@ ctfile_parse(struct ctfile_parse_state *ctx)
 				pos1 = ftello(ctx->xs_f);
 				ctx->xs_sha_sz = pos1 - pos0;
 			}
+			if (ctx->xs_packed &&
+			    ct_xdr_pack(&ctx->xs_xdr, &ctx->xs_pack) == FALSE) {
+				ctx->xs_errno = CTE_CTFILE_CORRUPT;
+				goto fail;
+			}
 
 			/*
 			 * this stays in SHA state even if
@@ -578,6 +617,16 @@ ctfile_parse_seek(struct ctfile_parse_state *ctx)
 		    ctx->xs_state);
 	if (ctx->xs_sha_cnt <= 0)
 		return 0;
+	/* the one sha is followed by the slice, just read them */
+	if (ctx->xs_packed)
+		return (ctfile_parse(ctx) == XS_RET_FAIL);
+	/* zero runs are shorter than shas, read them all */
+	if (ctx->xs_sparse) {
+		while (ctx->xs_sha_cnt > 0)
+			if (ctfile_parse(ctx) == XS_RET_FAIL)
+				return 1;
+		return 0;
+	}
 
 	if (ctx->xs_sha_sz == 0) {
 		pos0 = ftello(ctx->xs_f);
@@ -651,6 +700,12 @@ struct ctfile_write_state {
 	int		 cws_flags;
 	int		 cws_block_size;
 	int64_t		 cws_dirnum;
+	off_t		 cws_hdrpos;	/* of the file if its shas are counted */
+	int64_t		 cws_nshas;
+	int		 cws_sparse;	/* file being written is C_TY_SPARSE */
+	int64_t		 cws_created;
+	struct ct_statidx_build	*cws_statidx;	/* archives only */
+	char		*cws_statidx_path;
 };
 static int	ctfile_alloc_dirnum(struct ctfile_write_state *,
 		    struct dnode *, struct dnode *);
@@ -667,7 +722,7 @@ int
 ctfile_write_init(struct ctfile_write_state **ctxp, const char *ctfile,
     const char *ctfile_basedir, int type, const char *basis, int lvl,
     char *cwd, char **filelist, int encrypted, int max_block_size,
-    int strip_slash)
+    int strip_slash, int cdc, int pack, int sparse, int digest)
 {
 	struct ctfile_write_state	*ctx;
 	char				**fptr;
@@ -676,9 +731,8 @@ ctfile_write_init(struct ctfile_write_state **ctxp, const char *ctfile,
 
 	ctx = e_calloc(1, sizeof(*ctx));
 
-	/* always save to the current version */
-	ctx->cws_version = CT_MD_VERSION;
 	ctx->cws_dirnum = -1;
+	ctx->cws_hdrpos = -1;
 
 	if (lvl != 0 && basis == NULL)
 		CABORTX("multilevel archive with no basis");
@@ -692,7 +746,6 @@ ctfile_write_init(struct ctfile_write_state **ctxp, const char *ctfile,
 	/* prepare header */
 	bzero(&gh, sizeof gh);
 	gh.cmg_beacon = CT_MD_BEACON;
-	gh.cmg_version = CT_MD_VERSION;
 	gh.cmg_chunk_size = ctx->cws_block_size = max_block_size;
 	gh.cmg_created = time(NULL);
 	gh.cmg_type = type;
@@ -702,6 +755,21 @@ ctfile_write_init(struct ctfile_write_state **ctxp, const char *ctfile,
 		gh.cmg_flags |= CT_MD_CRYPTO;
 	if (strip_slash)
 		gh.cmg_flags |= CT_MD_STRIP_SLASH;
+	if (cdc)
+		gh.cmg_flags |= CT_MD_CDC;
+	if (pack)
+		gh.cmg_flags |= CT_MD_PACK;
+	if (sparse)
+		gh.cmg_flags |= CT_MD_SPARSE;
+	if (digest == CT_DIGEST_BLAKE3)
+		gh.cmg_flags |= CT_MD_BLAKE3;
+	/*
+	 * Older versions could read a file with none of the new flags, so
+	 * only bump the version for those that have them.
+	 */
+	gh.cmg_version = (gh.cmg_flags & CT_MD_V4_FLAGS) ? CT_MD_VERSION :
+	    CT_MD_V3;
+	ctx->cws_version = gh.cmg_version;
 	gh.cmg_prevlvl_filename = basis ? (char *)basis : "";
 	gh.cmg_cur_lvl = lvl;
 	gh.cmg_cwd = cwd;
@@ -720,6 +788,14 @@ ctfile_write_init(struct ctfile_write_state **ctxp, const char *ctfile,
 		goto fail;
 	}
 
+	/* the next incremental looks here rather than parse the ctfile */
+	if (type == CT_MD_REGULAR) {
+		ctx->cws_created = gh.cmg_created;
+		ctx->cws_statidx = ct_statidx_build_init();
+		e_asprintf(&ctx->cws_statidx_path, "%s%s", ctfile,
+		    CT_STATIDX_SUFFIX);
+	}
+
 	*ctxp = ctx;
 	return (0);
 fail:
@@ -771,6 +847,7 @@ ctfile_write_header(struct ctfile_write_state *ctx, struct fnode *fnode,
     char *filename, int base)
 {
 	int64_t nr_shas = 0;
+	int	type = fnode->fn_type;
 
 	CNDBG(CT_LOG_CTFILE, "writing file header %s %s", fnode->fn_fullname,
 	    filename);
@@ -791,9 +868,11 @@ ctfile_write_header(struct ctfile_write_state *ctx, struct fnode *fnode,
 		nr_shas = fnode->fn_size / ctx->cws_block_size;
 		if (fnode->fn_size % ctx->cws_block_size)
 			nr_shas++;
+		if (fnode->fn_sparse)
+			type |= C_TY_SPARSE;
 	}
 
-	return (ctfile_write_header_entry(ctx, filename, fnode->fn_type,
+	return (ctfile_write_header_entry(ctx, filename, type,
 	    nr_shas, fnode->fn_uid, fnode->fn_gid, fnode->fn_mode,
 	    fnode->fn_rdev, fnode->fn_atime, fnode->fn_mtime,
 	    fnode->fn_parent_dir, base));
@@ -836,6 +915,21 @@ ctfile_write_header_entry(struct ctfile_write_state *ctx, char *filename,
 	else
 		hdr.cmh_filename = filename;
 	hdr.cmh_type = type;
+
+	/*
+	 * When chunking by content, or when runs of zeros may stand in for
+	 * blocks, the number of shas is not known until the file has been
+	 * read. Remember where the count goes, it is put in when the file
+	 * ends.
+	 */
+	ctx->cws_hdrpos = -1;
+	ctx->cws_sparse = (type & C_TY_SPARSE) != 0;
+	if (((ctx->cws_flags & CT_MD_CDC) || ctx->cws_sparse) &&
+	    C_ISREG(type) && (type & C_TY_PACKED) == 0 && nr_shas > 0) {
+		if ((ctx->cws_hdrpos = ftello(ctx->cws_f)) == -1)
+			return 1;
+		ctx->cws_nshas = 0;
+	}
 	if (ct_xdr_header(&ctx->cws_xdr, &hdr, ctx->cws_version) == FALSE)
 		return 1;
 
@@ -913,19 +1007,35 @@ int
 ctfile_write_file_sha(struct ctfile_write_state *ctx, uint8_t *sha,
     uint8_t *csha, uint8_t *iv)
 {
-	bool_t	ret;
+	uint64_t	zero = 0;
+	bool_t		ret;
 
 	CNDBG(CT_LOG_CTFILE, "writing sha %s", ctx->cws_flags & CT_MD_CRYPTO ?
 	    "crypto" : "no crypto");
+	if (ctx->cws_sparse && xdr_u_int64_t(&ctx->cws_xdr, &zero) == FALSE)
+		return (1);
 	if (ctx->cws_flags & CT_MD_CRYPTO) {
 		ret = ct_xdr_dedup_sha_crypto(&ctx->cws_xdr, sha, csha, iv);
 	} else {
 		ret = ct_xdr_dedup_sha(&ctx->cws_xdr, sha);
 	}
+	ctx->cws_nshas++;
 
 	return (ret == FALSE);
 }
 
+/* Write a run of len zeros where a sha would go. */
+int
+ctfile_write_file_zero(struct ctfile_write_state *ctx, uint64_t len)
+{
+	if (ctx->cws_sparse == 0)
+		CABORTX("zero run in a file that isn't sparse");
+	CNDBG(CT_LOG_CTFILE, "writing zero run %" PRIu64, len);
+	ctx->cws_nshas++;
+
+	return (xdr_u_int64_t(&ctx->cws_xdr, &len) == FALSE);
+}
+
 int
 ctfile_write_file_pad(struct ctfile_write_state *ctx, struct fnode *fn)
 {
@@ -950,10 +1060,58 @@ out:
 	return (ret);
 }
 
+/*
+ * Write the whole entry of a file whose data is the fn_size bytes at
+ * fn_pack_off of the chunk sha.
+ */
+int
+ctfile_write_file_packed(struct ctfile_write_state *ctx, struct fnode *fnode,
+    uint8_t *sha, uint8_t *csha, uint8_t *iv)
+{
+	struct ctfile_pack	pack;
+	int			type = fnode->fn_type;
+	int			ret;
+
+	fnode->fn_type |= C_TY_PACKED; /* cheat */
+	ret = ctfile_write_header(ctx, fnode, fnode->fn_fullname, 1);
+	fnode->fn_type = type; /* restore */
+	if (ret != 0 || ctfile_write_file_sha(ctx, sha, csha, iv) != 0)
+		return (1);
+
+	pack.cmp_offset = fnode->fn_pack_off;
+	pack.cmp_len = fnode->fn_size;
+	if (ct_xdr_pack(&ctx->cws_xdr, &pack) == FALSE)
+		return (1);
+
+	return (ctfile_write_file_end(ctx, fnode));
+}
+
+/* Fill in the sha count of the file header written at cws_hdrpos. */
+static int
+ctfile_write_nshas(struct ctfile_write_state *ctx)
+{
+	off_t	pos;
+	int	beacon = CT_HDR_BEACON, ret = 0;
+
+	if ((pos = ftello(ctx->cws_f)) == -1 ||
+	    fseeko(ctx->cws_f, ctx->cws_hdrpos, SEEK_SET) != 0)
+		return (1);
+	/* cmh_nr_shas directly follows the beacon */
+	if (xdr_int(&ctx->cws_xdr, &beacon) == FALSE ||
+	    xdr_int64_t(&ctx->cws_xdr, &ctx->cws_nshas) == FALSE)
+		ret = 1;
+	if (fseeko(ctx->cws_f, pos, SEEK_SET) != 0)
+		ret = 1;
+	ctx->cws_hdrpos = -1;
+
+	return (ret);
+}
+
 int
 ctfile_write_file_end(struct ctfile_write_state *ctx, struct fnode *fnode)
 {
 	struct ctfile_trailer	trl;
+	struct ct_statidx_ent	se;
 
 	if ((ctx->cws_flags & CT_MD_MLB_ALLFILES) == 0 && fnode->fn_skip_file)
 		return (0);
@@ -964,11 +1122,45 @@ ctfile_write_file_end(struct ctfile_write_state *ctx, struct fnode *fnode)
 	    !!(ctx->cws_flags & CT_MD_MLB_ALLFILES));
 	CNDBG(CT_LOG_CTFILE, "writing file trailer %s", fnode->fn_fullname);
 
-	ct_sha1_final(trl.cmt_sha, &fnode->fn_shactx);
+	ct_digest_final(trl.cmt_sha, &fnode->fn_shactx);
 	trl.cmt_orig_size = fnode->fn_size;
 	trl.cmt_comp_size = fnode->fn_comp_size;
 
-	return (ct_xdr_trailer(&ctx->cws_xdr, &trl) == FALSE);
+	if (ctx->cws_hdrpos != -1 && ctfile_write_nshas(ctx) != 0)
+		return (1);
+
+	if (ct_xdr_trailer(&ctx->cws_xdr, &trl) == FALSE)
+		return (1);
+
+	if (ctx->cws_statidx != NULL && C_ISREG(fnode->fn_type) &&
+	    !fnode->fn_hardlink) {
+		bzero(&se, sizeof(se));
+		se.se_size = fnode->fn_size;
+		se.se_mtime = fnode->fn_mtime;
+		se.se_ctime = fnode->fn_ctime;
+		se.se_atime = fnode->fn_atime;
+		se.se_ino = fnode->fn_ino;
+		se.se_dev = fnode->fn_dev;
+		se.se_mode = fnode->fn_mode;
+		se.se_uid = fnode->fn_uid;
+		se.se_gid = fnode->fn_gid;
+		se.se_nlink = fnode->fn_nlink;
+		ct_statidx_build_add(ctx->cws_statidx,
+		    fnode->fn_parent_dir == NULL ||
+		    fnode->fn_parent_dir->d_num == -3 ? "" :
+		    fnode->fn_parent_dir->d_name, fnode->fn_name, &se);
+	}
+
+	return (0);
+}
+
+/* Record the change journal position the archive started from. */
+void
+ctfile_write_set_journal(struct ctfile_write_state *ctx, uint64_t session,
+    off_t off)
+{
+	if (ctx->cws_statidx != NULL)
+		ct_statidx_build_journal(ctx->cws_statidx, session, off);
 }
 
 int
@@ -976,6 +1168,7 @@ ctfile_write_close(struct ctfile_write_state *ctx)
 {
 	struct ctfile_header	hdr;
 	char			fake[1];
+	off_t			size = -1;
 	int			ret = 0;
 
 	/* Write EOF header on close */
@@ -985,9 +1178,19 @@ ctfile_write_close(struct ctfile_write_state *ctx)
 	hdr.cmh_beacon = CT_HDR_EOF;
 	if (ct_xdr_header(&ctx->cws_xdr, &hdr, ctx->cws_version) == FALSE)
 		ret = 1;
+	if (ret == 0 && fflush(ctx->cws_f) == 0)
+		size = ftello(ctx->cws_f);
 
 	ctfile_close(ctx->cws_f, &ctx->cws_xdr);
 
+	if (ctx->cws_statidx != NULL) {
+		/* without it the next incremental parses the ctfile instead */
+		if (size != -1 && ct_statidx_build_write(ctx->cws_statidx,
+		    ctx->cws_statidx_path, ctx->cws_created, size) != 0)
+			CWARN("can't write %s", ctx->cws_statidx_path);
+		ct_statidx_build_free(ctx->cws_statidx);
+		e_free(&ctx->cws_statidx_path);
+	}
 	e_free(&ctx);
 
 	return (ret);
@@ -1000,5 +1203,9 @@ ctfile_write_abort(struct ctfile_write_state *ctx)
 	/* XXX consider unlinking? */
 	ctfile_close(ctx->cws_f, &ctx->cws_xdr);
 
+	if (ctx->cws_statidx != NULL) {
+		ct_statidx_build_free(ctx->cws_statidx);
+		e_free(&ctx->cws_statidx_path);
+	}
 	e_free(&ctx);
 }
@@ -44,6 +44,7 @@ struct ct_config {
 	char	*ct_crypto_passphrase;
 	char	*ct_polltype;
 	char	*ct_ctfile_cachedir;
+	char	*ct_change_journal;	/* kept by ctctl watch, or NULL */
 	char	*ct_config_file;
 
 	int	ct_max_trans;
@@ -61,6 +62,30 @@ struct ct_config {
 	int	ct_sock_rcvbuf;
 #define CT_DEFAULT_SNDBUF	(64*1024)
 	int	ct_sock_sndbuf;
+	int	ct_sha_threads;
+#define CT_MAX_WORKERS		64	/* upper bound on a stage's threads */
+	int	ct_compress_threads;
+	int	ct_crypto_threads;
+	int	ct_crypto_stitch;	/* csha while encrypting */
+	int	ct_fused_threads;	/* 0 for the staged pipeline */
+	int	ct_sched_threads;	/* 0 for a thread pool per stage */
+#define CT_WAKEUP_PIPE		(0)	/* pipes and condition variables */
+#define CT_WAKEUP_FUTEX		(1)	/* eventfd and futexes, linux only */
+	int	ct_wakeup_type;
+	int	ct_trans_hugepages;
+	int	ct_readahead_threads;	/* 0 to read files inline */
+	int	ct_io_uring;		/* batch file i/o where possible */
+#define CT_CHUNK_FIXED		(0)	/* every ct_max_block_size bytes */
+#define CT_CHUNK_CDC		(1)	/* where the content says */
+	int	ct_chunking;
+	int	ct_pack_threshold;	/* pack files this small, 0 not to */
+	int	ct_sparse_files;	/* skip holes and zero blocks */
+	int	ct_traverse_threads;	/* 0 to scan directories inline */
+#define CT_READ_SCAN		(0)	/* as the tree is walked */
+#define CT_READ_INODE		(1)	/* by inode number */
+#define CT_READ_EXTENT		(2)	/* by first extent, else inode */
+	int	ct_read_order;
+	int	ct_digest;		/* names chunks and files */
 };
 
 int			 ct_load_config(struct ct_config **, char **);
@@ -100,16 +125,76 @@ struct ct_statistics {
 	uint64_t		st_bytes_csha;
 
 	uint64_t		st_files_completed;
+
+	/* per worker usage, busy time is in usec */
+	int			st_comp_workers;
+	uint64_t		st_comp_busy[CT_MAX_WORKERS];
+	uint64_t		st_comp_chunks[CT_MAX_WORKERS];
+	int			st_crypt_workers;
+	uint64_t		st_crypt_busy[CT_MAX_WORKERS];
+	uint64_t		st_crypt_chunks[CT_MAX_WORKERS];
+	int			st_fused_workers;
+	uint64_t		st_fused_busy[CT_MAX_WORKERS];
+	uint64_t		st_fused_chunks[CT_MAX_WORKERS];
+	int			st_sched_workers;
+	uint64_t		st_sched_busy[CT_MAX_WORKERS];
+	uint64_t		st_sched_chunks[CT_MAX_WORKERS];
 } ;
 
 
 
 #define STR_PAD(n) int pad ## n [8];
 
+/*
+ * Bounded multi producer, multi consumer queue of transactions. Producers
+ * and consumers only contend on the cell they claim, and the length may be
+ * read at any time without a lock.
+ */
+struct ct_trans;
+struct ct_ring_cell {
+	uint64_t			rc_seq;
+	struct ct_trans			*rc_trans;
+};
+
+#define CT_CACHELINE	64
+struct ct_ring {
+	struct ct_ring_cell		*r_cells;
+	uint64_t			 r_mask;
+	char				 r_pad0[CT_CACHELINE];
+	uint64_t			 r_head;	/* next slot to fill */
+	char				 r_pad1[CT_CACHELINE];
+	uint64_t			 r_tail;	/* next slot to drain */
+	char				 r_pad2[CT_CACHELINE];
+};
+
+void			 ct_ring_init(struct ct_ring *, int);
+void			 ct_ring_cleanup(struct ct_ring *);
+int			 ct_ring_put(struct ct_ring *, struct ct_trans *);
+struct ct_trans		*ct_ring_get(struct ct_ring *);
+int			 ct_ring_get_batch(struct ct_ring *, struct ct_trans **,
+			     int);
+int			 ct_ring_len(struct ct_ring *);
+int			 ct_ring_size(struct ct_ring *);
+
+/*
+ * Completion reorder buffer, one slot per outstanding transaction id.  Any
+ * thread may fill the slot for the id it completed; the event loop drains
+ * the slots in id order.
+ */
+struct ct_reorder {
+	struct ct_trans			**ro_slots;
+	uint64_t			  ro_mask;
+	int				  ro_len;
+};
+
+void			 ct_reorder_init(struct ct_reorder *, int);
+void			 ct_reorder_cleanup(struct ct_reorder *);
+void			 ct_reorder_put(struct ct_reorder *, struct ct_trans *);
+struct ct_trans		*ct_reorder_get(struct ct_reorder *, uint64_t);
+int			 ct_reorder_len(struct ct_reorder *);
+
 RB_HEAD(ct_iotrans_lookup, ct_trans);
 RB_PROTOTYPE(ct_iotrans_lookup, ct_trans, tr_trans_id, ct_cmp_iotrans);
-RB_HEAD(ct_trans_lookup, ct_trans);
-RB_PROTOTYPE(ct_trans_lookup, ct_trans, tr_trans_id, ct_cmp_trans);
 
 
 struct ctfile_gheader;
@@ -122,6 +207,26 @@ typedef		void	(ct_log_traverse_end_fn)(void *, char **);
 typedef		void	(ct_log_chown_failed_fn)(void *, struct fnode *,
 			    struct dnode *);
 
+/*
+ * Per thread state for the stages that run on several threads. A thread
+ * borrows a worker from its stage's pool, so the contexts are never shared.
+ */
+struct ct_worker {
+	TAILQ_ENTRY(ct_worker)		w_link;
+	int				w_id;
+	struct ct_compress_ctx		*w_comp_ctx;
+	struct ct_crypto_ctx		*w_enc_ctx;	/* keyed on first use */
+	struct ct_crypto_ctx		*w_dec_ctx;
+	struct ct_iv_ctx		*w_iv_ctx;	/* keyed on first use */
+};
+
+struct ct_worker_pool {
+	struct ct_worker		*wp_workers;
+	int				 wp_nworkers;
+	TAILQ_HEAD(, ct_worker)		 wp_idle;
+	CT_LOCK_STORE(wp_lock);
+};
+
 struct ct_global_state {
 	/* PADs? */
 	struct ct_assl_io_ctx		*ct_assl_ctx; /* Connection state */
@@ -131,6 +236,11 @@ struct ct_global_state {
 	struct ct_archive_state		*archive_state;
 	struct ct_statistics		*ct_stats;
 	TAILQ_HEAD(,ct_trans)		ct_trans_free_head;
+	TAILQ_HEAD(,ct_trans)		ct_trans_local_free_head;
+	uint8_t				*ct_trans_arena; /* data trans */
+	size_t				ct_trans_arena_size;
+	size_t				ct_trans_stride;
+	int				ct_trans_arena_nelem;
 	int				ct_trans_id; /* next transaction id */
 	uint64_t			ct_packet_id; /* next complete id */
 	int				ct_tr_tag; /* next packet tag */
@@ -146,21 +256,16 @@ struct ct_global_state {
 	int				ct_comp_state;
 	int				ct_crypt_state;
 	STR_PAD(0);
-	TAILQ_HEAD(, ct_trans)		ct_sha_queue;
-	int				ct_sha_qlen;
-	CT_LOCK_STORE(ct_sha_lock);
-	STR_PAD(1);
-	TAILQ_HEAD(, ct_trans)		ct_comp_queue;
-	int				ct_comp_qlen;
-	CT_LOCK_STORE(ct_comp_lock);
-	STR_PAD(2);
-	TAILQ_HEAD(, ct_trans)		ct_crypt_queue;
-	int				ct_crypt_qlen;
-	CT_LOCK_STORE(ct_crypt_lock);
-	STR_PAD(3);
-	TAILQ_HEAD(, ct_trans)		ct_csha_queue;
-	int				ct_csha_qlen;
-	CT_LOCK_STORE(ct_csha_lock);
+	/* the cpu stage queues, sized in ct_init_queues() */
+	struct ct_ring			ct_sha_ring;
+	struct ct_ring			ct_comp_ring;
+	struct ct_ring			ct_crypt_ring;
+	struct ct_ring			ct_csha_ring;
+	uint64_t			ct_sha_ticket; /* next sha ticket */
+	/* serialises fn_shactx and ctdb use between sha workers */
+	uint64_t			ct_sha_ticket_done;
+	CT_LOCK_STORE(ct_sha_order_lock);
+	CT_COND_STORE(ct_sha_order_cv);
 	STR_PAD(4);
 	TAILQ_HEAD(, ct_trans)		ct_write_queue;
 	int				ct_write_qlen;
@@ -173,9 +278,7 @@ struct ct_global_state {
 	struct ct_iotrans_lookup	ct_inflight;
 	int				ct_inflight_rblen;
 	STR_PAD(7);
-	struct ct_trans_lookup		ct_complete;
-	int				ct_complete_rblen;
-	CT_LOCK_STORE(ct_complete_lock);
+	struct ct_reorder		ct_complete;
 	TAILQ_HEAD(ct_ops, ct_op)	ct_operations;
 	struct ctdb_state		*ct_db_state;
 
@@ -192,7 +295,13 @@ struct ct_global_state {
 	unsigned char			ct_iv[CT_IV_LEN];
 	unsigned char			ct_crypto_key[CT_KEY_LEN];
 
-	struct ct_compress_ctx		*ct_compress_state;
+	struct ct_worker_pool		ct_comp_pool;
+	struct ct_worker_pool		ct_crypt_pool;
+	struct ct_worker_pool		ct_fused_pool;
+	struct ct_worker_pool		ct_sched_pool;
+	struct ct_sched			*ct_sched; /* replaces the cpu stages */
+	/* byte counters summed by the worker threads */
+	CT_LOCK_STORE(ct_stats_lock);
 	struct ct_event_state		*event_state;
 	struct bw_limit_ctx		*bw_limit;
 
@@ -267,6 +376,7 @@ void			ct_compute_sha(void *);
 void			ct_compute_compress(void *);
 void			ct_compute_encrypt(void *);
 void			ct_compute_csha(void *);
+void			ct_compute_fused(void *);
 void			ct_process_completions(void *);
 void			ct_process_write(void *);
 
@@ -328,6 +438,15 @@ struct ct_trans {
 	struct fnode		*tr_fl_node;
 	struct ctfile_write_state *tr_ctfile;
 	uint64_t tr_trans_id;
+	uint64_t tr_sha_ticket;		/* file order for sha workers */
+	int	tr_sched_stage;		/* CT_SCHED_* when on a sched deque */
+	off_t	tr_ra_offset;		/* file offset of a read-ahead chunk */
+	int	tr_ra_done;		/* CT_RA_DONE* once it has been read */
+	struct ct_ra_file *tr_ra_file;	/* file being read into us */
+	struct fnode *tr_pack;	/* files packed into the chunk, archive */
+	int	tr_pack_off;	/* slice of the chunk to extract, if */
+	int	tr_pack_len;	/* tr_pack_len isn't 0 */
+	off_t	tr_zero;	/* run of zeros in place of a chunk */
 	int	tr_errno;
 	int tr_type;
 /* DIR is another special */
@@ -398,6 +517,7 @@ struct ct_trans		*ct_trans_realloc_local(struct ct_global_state *,
 void			ct_trans_free(struct ct_global_state *,
 			    struct ct_trans *);
 void			ct_trans_cleanup(struct ct_global_state *);
+void			ct_trans_arena_cleanup(struct ct_global_state *);
 
 /* Util path functions */
 char	*ct_dirname(const char *);
@@ -583,6 +703,8 @@ struct ct_extract_state;
 int			 ct_file_extract_init(struct ct_extract_state **,
 			     const char *, int, int, int, void *,
 			     ct_log_chown_failed_fn *);
+void			 ct_file_extract_uring(struct ct_extract_state *,
+			     size_t);
 struct dnode		*ct_file_extract_get_rootdir(struct ct_extract_state *);
 struct dnode		*ct_file_extract_insert_dir(struct ct_extract_state *,
 			     struct dnode *);
@@ -592,6 +714,12 @@ int			 ct_file_extract_open(struct ct_extract_state *,
 			     struct fnode *fnode);
 int			 ct_file_extract_write(struct ct_extract_state *,
 			     struct fnode *, uint8_t *buf, size_t size);
+int			 ct_file_extract_hole(struct ct_extract_state *,
+			     struct fnode *, off_t);
+void			 ct_file_extract_setpack(struct ct_extract_state *,
+			     uint8_t *, size_t);
+uint8_t			*ct_file_extract_getpack(struct ct_extract_state *,
+			     size_t, size_t);
 void			 ct_file_extract_close(struct ct_extract_state *,
 			     struct fnode *fnode);
 void			 ct_file_extract_special(struct ct_extract_state *,
@@ -612,6 +740,9 @@ struct dnode		*ct_archive_lookup_dir(struct ct_archive_state *,
 			     const char *);
 void			 ct_archive_cleanup(struct ct_archive_state *);
 
+/* keep a change journal for archives to use, ct_journal.c */
+int			 ct_journal_watch(const char *, char **, int);
+
 
 /* length of a ctfile tag's time string */
 #define			TIMEDATA_LEN	17	/* including NUL */
@@ -0,0 +1,224 @@
+/*
+ * Copyright (c) 2012 Conformal Systems LLC <info@conformal.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Compare fixed and content defined chunking. A buffer of random data is
+ * chunked, then edited (a byte inserted near the start, or many small
+ * inserts and deletes all over) and chunked again; the share of the edited
+ * data whose chunks were already there is what the server would not have
+ * to store again. Chunking throughput is measured on its own, without the
+ * SHA. Chunk sizes are checked against the bounds on the way.
+ */
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/time.h>
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <inttypes.h>
+
+#include <clog.h>
+#include <exude.h>
+
+#include <ctutil.h>
+#include <cyphertite.h>
+#include <ct_internal.h>
+
+extern char *__progname;
+
+struct bench_chunk {
+	uint8_t		bc_sha[SHA_DIGEST_LENGTH];
+	size_t		bc_len;
+};
+
+__dead void
+usage(void)
+{
+	fprintf(stderr, "usage: %s [-b blocksize] [-e edits] [-m megabytes]\n",
+	    __progname);
+	exit(1);
+}
+
+static int
+bench_cmp(const void *a, const void *b)
+{
+	return (memcmp(a, b, SHA_DIGEST_LENGTH));
+}
+
+static int
+bench_cmp_off(const void *a, const void *b)
+{
+	const size_t	*x = a, *y = b;
+
+	return (*x < *y ? -1 : *x > *y);
+}
+
+/* Chunk len bytes at p into *chunks, by content if cdc isn't NULL. */
+static size_t
+bench_chunk(struct ct_cdc *cdc, size_t blocksz, uint8_t *p, size_t len,
+    struct bench_chunk **chunks)
+{
+	struct bench_chunk	*bc;
+	size_t			 n = 0, off, clen;
+
+	*chunks = bc = e_calloc(len / (blocksz / CT_CDC_MIN_DIV) + 2,
+	    sizeof(*bc));
+	for (off = 0; off < len; off += clen, n++) {
+		if (cdc == NULL)
+			clen = MIN(blocksz, len - off);
+		else
+			clen = ct_cdc_cut(cdc, p + off, len - off);
+		if (clen == 0 || clen > blocksz || (cdc != NULL &&
+		    off + clen != len && clen < cdc->cdc_min))
+			CFATALX("chunk of %zu at %zu out of bounds", clen,
+			    off);
+		ct_sha1(p + off, bc[n].bc_sha, clen);
+		bc[n].bc_len = clen;
+	}
+
+	return (n);
+}
+
+static void
+bench_dedup(const char *edit, struct ct_cdc *cdc, size_t blocksz,
+    uint8_t *orig, size_t olen, uint8_t *edited, size_t elen)
+{
+	struct bench_chunk	*old, *new;
+	size_t			 nold, nnew, i, dup = 0;
+
+	nold = bench_chunk(cdc, blocksz, orig, olen, &old);
+	nnew = bench_chunk(cdc, blocksz, edited, elen, &new);
+	qsort(old, nold, sizeof(*old), bench_cmp);
+	for (i = 0; i < nnew; i++)
+		if (bsearch(new[i].bc_sha, old, nold, sizeof(*old),
+		    bench_cmp) != NULL)
+			dup += new[i].bc_len;
+
+	printf("%-8s %-6s %8zu chunks %8zu avg\t%6.2f%% dedup\n", edit,
+	    cdc ? "cdc" : "fixed", nnew, elen / nnew, 100.0 * dup / elen);
+	e_free(&old);
+	e_free(&new);
+}
+
+/* Apply nedits random inserts and deletes of up to 64 bytes. */
+static size_t
+bench_edit(uint8_t *dst, const uint8_t *src, size_t len, int nedits)
+{
+	size_t	 *at, s = 0, d = 0, n;
+	int	  i;
+
+	at = e_calloc(nedits, sizeof(*at));
+	for (i = 0; i < nedits; i++)
+		at[i] = arc4random_uniform(len);
+	qsort(at, nedits, sizeof(*at), bench_cmp_off);
+	for (i = 0; i < nedits; i++) {
+		if (at[i] < s)
+			continue;
+		memcpy(dst + d, src + s, at[i] - s);
+		d += at[i] - s;
+		s = at[i];
+		n = 1 + arc4random_uniform(64);
+		if (arc4random_uniform(2)) {
+			arc4random_buf(dst + d, n);
+			d += n;
+		} else {
+			s = MIN(len, s + n);
+		}
+	}
+	memcpy(dst + d, src + s, len - s);
+	d += len - s;
+	e_free(&at);
+
+	return (d);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct ct_cdc	 cdc;
+	struct timeval	 start, end;
+	const char	*errstr;
+	uint8_t		*orig, *edited;
+	size_t		 len, elen, off;
+	double		 secs;
+	int		 blocksz = 256 * 1024, mb = 64, nedits = 100, c, pass;
+
+	clog_init(1);
+	(void)clog_set_flags(CLOG_F_STDERR | CLOG_F_ENABLE);
+
+	while ((c = getopt(argc, argv, "b:e:m:")) != -1) {
+		switch (c) {
+		case 'b':
+			blocksz = strtonum(optarg, 4 * CT_CDC_MIN_DIV,
+			    INT_MAX, &errstr);
+			if (errstr)
+				CFATALX("blocksize %s: %s", optarg, errstr);
+			break;
+		case 'e':
+			nedits = strtonum(optarg, 1, 1000000, &errstr);
+			if (errstr)
+				CFATALX("edits %s: %s", optarg, errstr);
+			break;
+		case 'm':
+			mb = strtonum(optarg, 1, 4096, &errstr);
+			if (errstr)
+				CFATALX("megabytes %s: %s", optarg, errstr);
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc != 0)
+		usage();
+
+	len = (size_t)mb * 1024 * 1024;
+	orig = e_malloc(len);
+	edited = e_malloc(len + (size_t)nedits * 64 + 1);
+	arc4random_buf(orig, len);
+	ct_cdc_init(&cdc, blocksz);
+
+	gettimeofday(&start, NULL);
+	for (pass = 0; pass < 4; pass++)
+		for (off = 0; off < len; )
+			off += ct_cdc_cut(&cdc, orig + off, len - off);
+	gettimeofday(&end, NULL);
+	timersub(&end, &start, &end);
+	secs = end.tv_sec + end.tv_usec / 1000000.0;
+	printf("cdc chunking %d/%d/%d\t%10.1f MB/s\n", (int)cdc.cdc_min,
+	    (int)cdc.cdc_avg, (int)cdc.cdc_max, 4.0 * mb / secs);
+
+	/* one byte in near the start shifts everything after it */
+	memcpy(edited, orig, 100);
+	edited[100] = 0x5a;
+	memcpy(edited + 101, orig + 100, len - 100);
+	bench_dedup("insert", NULL, blocksz, orig, len, edited, len + 1);
+	bench_dedup("insert", &cdc, blocksz, orig, len, edited, len + 1);
+
+	elen = bench_edit(edited, orig, len, nedits);
+	bench_dedup("edits", NULL, blocksz, orig, len, edited, elen);
+	bench_dedup("edits", &cdc, blocksz, orig, len, edited, elen);
+
+	e_free(&orig);
+	e_free(&edited);
+
+	return (0);
+}
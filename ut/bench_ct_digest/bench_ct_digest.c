@@ -0,0 +1,302 @@
+/*
+ * Copyright (c) 2012 Conformal Systems LLC <info@conformal.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Time the digest passes an archive makes over its data with each digest
+ * and backend the cpu has: the chunk digest over batches of chunks the way
+ * the sha stage dequeues them, the file digest streamed a chunk at a time,
+ * and for SHA1 the csha over batches of chunks of uneven, encrypted looking
+ * sizes. Then the chunk and file digests fed together from one pass, as the
+ * sha stage does when it doesn't have to wait its turn. Every backend's
+ * digests are checked against those made without cpu specific code.
+ */
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/time.h>
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <inttypes.h>
+
+#include <clog.h>
+#include <exude.h>
+
+#include <ctutil.h>
+#include <cyphertite.h>
+#include <ct_internal.h>
+
+#define NDIGESTS	2
+
+extern char *__progname;
+
+struct bench_backend {
+	int		 bb_digest;
+	const char	*bb_name;
+	int		 bb_mask;
+} bench_backends[] = {
+	{ CT_DIGEST_SHA1,	"libcrypto",	0 },
+	{ CT_DIGEST_SHA1,	"sha-ni",	CT_DIGEST_F_SHANI },
+	{ CT_DIGEST_SHA1,	"avx2",		CT_DIGEST_F_AVX2 },
+	{ CT_DIGEST_SHA1,	"default",	~0 },
+	{ CT_DIGEST_BLAKE3,	"portable",	0 },
+	{ CT_DIGEST_BLAKE3,	"avx2",		CT_DIGEST_F_AVX2 },
+};
+#define NBACKENDS	(sizeof(bench_backends) / sizeof(bench_backends[0]))
+
+struct bench_state {
+	uint8_t		*b_data;
+	size_t		 b_nchunks;
+	size_t		*b_len;		/* chunk sizes */
+	size_t		*b_clen;	/* csha sizes */
+	uint8_t		*b_sha[NDIGESTS];	/* portable digests */
+	uint8_t		*b_csha;
+	uint8_t		 b_fsha[NDIGESTS][CT_DIGEST_LENGTH];
+	uint8_t		 b_fsum[CT_DIGEST_LENGTH];
+	uint8_t		*b_out;
+	int		 b_batch;
+	int		 b_errors;
+};
+
+__dead void
+usage(void)
+{
+	fprintf(stderr, "usage: %s [-b blocksize] [-m megabytes] "
+	    "[-n batch]\n", __progname);
+	exit(1);
+}
+
+static double
+bench_secs(struct timeval *start)
+{
+	struct timeval	end;
+
+	gettimeofday(&end, NULL);
+	timersub(&end, start, &end);
+	return (end.tv_sec + end.tv_usec / 1000000.0);
+}
+
+/* Digest every chunk, b_batch of them at a time. */
+static void
+bench_chunks(struct bench_state *b, int alg, size_t *len, size_t blocksz)
+{
+	uint8_t		*src[CT_DEQUEUE_BATCH * 4], *dst[CT_DEQUEUE_BATCH * 4];
+	size_t		 i, j, n;
+
+	for (i = 0; i < b->b_nchunks; i += n) {
+		n = MIN(b->b_batch, b->b_nchunks - i);
+		for (j = 0; j < n; j++) {
+			src[j] = b->b_data + (i + j) * blocksz;
+			dst[j] = b->b_out + (i + j) * CT_DIGEST_LENGTH;
+		}
+		ct_digest_multi(alg, src, dst, len + i, n);
+	}
+}
+
+static void
+bench_file(struct bench_state *b, int alg, size_t blocksz)
+{
+	struct ct_digest_ctx	ctx;
+	size_t			i;
+
+	ct_digest_setup(&ctx, alg);
+	for (i = 0; i < b->b_nchunks; i++)
+		ct_digest_add(b->b_data + i * blocksz, &ctx, b->b_len[i]);
+	ct_digest_final(b->b_out, &ctx);
+}
+
+static void
+bench_dual(struct bench_state *b, int alg, size_t blocksz)
+{
+	struct ct_digest_ctx	ctx;
+	size_t			i;
+
+	ct_digest_setup(&ctx, alg);
+	for (i = 0; i < b->b_nchunks; i++)
+		ct_digest_dual(alg, b->b_data + i * blocksz,
+		    b->b_out + i * CT_DIGEST_LENGTH, &ctx, b->b_len[i]);
+	ct_digest_final(b->b_fsum, &ctx);
+}
+
+static void
+bench_check(struct bench_state *b, const char *what, const char *name,
+    uint8_t *want, size_t n)
+{
+	if (memcmp(b->b_out, want, n * CT_DIGEST_LENGTH) != 0) {
+		CWARNX("%s: %s digests differ from the portable ones", name,
+		    what);
+		b->b_errors++;
+	}
+}
+
+static void
+bench_bytes(struct bench_state *b, size_t *len, uint64_t *bytes)
+{
+	size_t		i;
+
+	for (*bytes = 0, i = 0; i < b->b_nchunks; i++)
+		*bytes += len[i];
+}
+
+int
+main(int argc, char **argv)
+{
+	struct bench_state	 b;
+	struct bench_backend	*bb;
+	struct timeval		 start;
+	const char		*errstr;
+	char			 csha[16];
+	uint64_t		 bytes, cbytes;
+	size_t			 len, i, blocksz = 256 * 1024;
+	double			 chunk, file, dual;
+	int			 mb = 256, c, have, pass, passes = 4, alg;
+
+	clog_init(1);
+	(void)clog_set_flags(CLOG_F_STDERR | CLOG_F_ENABLE);
+
+	bzero(&b, sizeof(b));
+	b.b_batch = CT_DEQUEUE_BATCH;
+	while ((c = getopt(argc, argv, "b:m:n:")) != -1) {
+		switch (c) {
+		case 'b':
+			blocksz = strtonum(optarg, 64, INT_MAX, &errstr);
+			if (errstr)
+				CFATALX("blocksize %s: %s", optarg, errstr);
+			break;
+		case 'm':
+			mb = strtonum(optarg, 1, 4096, &errstr);
+			if (errstr)
+				CFATALX("megabytes %s: %s", optarg, errstr);
+			break;
+		case 'n':
+			b.b_batch = strtonum(optarg, 1, CT_DEQUEUE_BATCH * 4,
+			    &errstr);
+			if (errstr)
+				CFATALX("batch %s: %s", optarg, errstr);
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc != 0)
+		usage();
+
+	len = (size_t)mb * 1024 * 1024;
+	b.b_nchunks = len / blocksz;
+	if (b.b_nchunks == 0)
+		CFATALX("less than a block of data");
+	b.b_data = e_malloc(b.b_nchunks * blocksz);
+	arc4random_buf(b.b_data, b.b_nchunks * blocksz);
+	b.b_len = e_calloc(b.b_nchunks, sizeof(*b.b_len));
+	b.b_clen = e_calloc(b.b_nchunks, sizeof(*b.b_clen));
+	for (alg = 0; alg < NDIGESTS; alg++)
+		b.b_sha[alg] = e_calloc(b.b_nchunks, CT_DIGEST_LENGTH);
+	b.b_csha = e_calloc(b.b_nchunks, CT_DIGEST_LENGTH);
+	b.b_out = e_calloc(b.b_nchunks, CT_DIGEST_LENGTH);
+	for (i = 0; i < b.b_nchunks; i++) {
+		b.b_len[i] = blocksz;
+		/* compressed somewhat, then padded to the cipher block */
+		b.b_clen[i] = blocksz / 2 + arc4random_uniform(blocksz / 2);
+		b.b_clen[i] = roundup(b.b_clen[i], 16);
+	}
+	bench_bytes(&b, b.b_len, &bytes);
+	bench_bytes(&b, b.b_clen, &cbytes);
+
+	ct_digest_restrict(0);
+	for (i = 0; i < b.b_nchunks; i++) {
+		for (alg = 0; alg < NDIGESTS; alg++)
+			ct_digest(alg, b.b_data + i * blocksz,
+			    b.b_sha[alg] + i * CT_DIGEST_LENGTH, b.b_len[i]);
+		ct_sha1(b.b_data + i * blocksz,
+		    b.b_csha + i * CT_DIGEST_LENGTH, b.b_clen[i]);
+	}
+	for (alg = 0; alg < NDIGESTS; alg++) {
+		bench_file(&b, alg, blocksz);
+		memcpy(b.b_fsha[alg], b.b_out, CT_DIGEST_LENGTH);
+	}
+
+	ct_digest_restrict(~0);
+	have = ct_digest_features();
+	printf("%zu chunks of %zu, batches of %d\n", b.b_nchunks, blocksz,
+	    b.b_batch);
+	printf("%-7s %-10s %12s %12s %12s %12s\n", "digest", "backend",
+	    "chunk GB/s", "file GB/s", "csha GB/s", "both GB/s");
+	for (bb = bench_backends; bb < bench_backends + NBACKENDS; bb++) {
+		alg = bb->bb_digest;
+		if (bb->bb_mask != ~0 && (bb->bb_mask & have) != bb->bb_mask) {
+			printf("%-7s %-10s %12s\n", ct_digest_name(alg),
+			    bb->bb_name, "n/a");
+			continue;
+		}
+		ct_digest_restrict(bb->bb_mask);
+
+		gettimeofday(&start, NULL);
+		for (pass = 0; pass < passes; pass++)
+			bench_chunks(&b, alg, b.b_len, blocksz);
+		chunk = passes * bytes / bench_secs(&start) / 1e9;
+		bench_check(&b, "chunk", bb->bb_name, b.b_sha[alg],
+		    b.b_nchunks);
+
+		gettimeofday(&start, NULL);
+		for (pass = 0; pass < passes; pass++)
+			bench_file(&b, alg, blocksz);
+		file = passes * bytes / bench_secs(&start) / 1e9;
+		bench_check(&b, "file", bb->bb_name, b.b_fsha[alg], 1);
+
+		/* the server names chunks by sha1, so the csha always is */
+		strlcpy(csha, "-", sizeof(csha));
+		if (alg == CT_DIGEST_SHA1) {
+			gettimeofday(&start, NULL);
+			for (pass = 0; pass < passes; pass++)
+				bench_chunks(&b, alg, b.b_clen, blocksz);
+			snprintf(csha, sizeof(csha), "%.2f",
+			    passes * cbytes / bench_secs(&start) / 1e9);
+			bench_check(&b, "csha", bb->bb_name, b.b_csha,
+			    b.b_nchunks);
+		}
+
+		gettimeofday(&start, NULL);
+		for (pass = 0; pass < passes; pass++)
+			bench_dual(&b, alg, blocksz);
+		dual = passes * bytes / bench_secs(&start) / 1e9;
+		bench_check(&b, "chunk", bb->bb_name, b.b_sha[alg],
+		    b.b_nchunks);
+		if (memcmp(b.b_fsum, b.b_fsha[alg], CT_DIGEST_LENGTH) != 0) {
+			CWARNX("%s: file digest differs from the portable one",
+			    bb->bb_name);
+			b.b_errors++;
+		}
+
+		printf("%-7s %-10s %12.2f %12.2f %12s %12.2f\n",
+		    ct_digest_name(alg), bb->bb_name, chunk, file, csha, dual);
+	}
+	ct_digest_restrict(~0);
+
+	e_free(&b.b_data);
+	e_free(&b.b_len);
+	e_free(&b.b_clen);
+	for (alg = 0; alg < NDIGESTS; alg++)
+		e_free(&b.b_sha[alg]);
+	e_free(&b.b_csha);
+	e_free(&b.b_out);
+
+	return (b.b_errors != 0);
+}
@@ -0,0 +1,424 @@
+/*
+ * Copyright (c) 2012 Conformal Systems LLC <info@conformal.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Measure file i/o over a tree of small files the way archive and extract
+ * do it. Reading is done inline (open, stat, read, stat, close one file at
+ * a time, as ct_archive() does without read-ahead), by the read-ahead
+ * threads and by the read-ahead io_uring. Writing goes through the extract
+ * code with and without io_uring. Files/s matters more than MB/s here; the
+ * tree is in the page cache after the first pass, so this measures system
+ * call overhead rather than the disk.
+ */
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <inttypes.h>
+#include <fcntl.h>
+
+#include <clog.h>
+#include <exude.h>
+
+#include <ctutil.h>
+#include <cyphertite.h>
+#include <ct_internal.h>
+
+extern char *__progname;
+
+#define BENCH_BLOCKSZ	(256 * 1024)
+#define BENCH_DEPTH	100
+
+struct bench_file {
+	off_t			 bf_size;
+	off_t			 bf_next;	/* next read to hand out */
+	struct ct_ra_file	*bf_raf;
+};
+
+struct bench_state {
+	struct ct_global_state	*b_state;
+	struct ct_readahead	*b_ra;
+	char			 b_dir[PATH_MAX];
+	struct bench_file	*b_files;
+	int			 b_nfiles;
+	int			 b_head;
+	int			 b_tail;
+	int			 b_window;
+	TAILQ_HEAD(, ct_trans)	 b_free;
+	uint64_t		 b_bytes;
+};
+
+void	bench_step(void *);
+void	bench_reconnect(evutil_socket_t, short, void *);
+
+__dead void
+usage(void)
+{
+	fprintf(stderr, "usage: %s [-n files] [-s maxsize] [-t maxthreads]\n",
+	    __progname);
+	exit(1);
+}
+
+void
+bench_reconnect(evutil_socket_t unused, short event, void *varg)
+{
+	/* never connected */
+}
+
+static void
+bench_report(const char *what, const char *how, int nthreads,
+    struct bench_state *b, struct timeval *start)
+{
+	struct timeval	end;
+	double		secs;
+
+	gettimeofday(&end, NULL);
+	timersub(&end, start, &end);
+	secs = end.tv_sec + end.tv_usec / 1000000.0;
+	printf("%s\t%s %3d\t%10.0f files/s\t%8.1f MB/s\n", what, how,
+	    nthreads, b->b_nfiles / secs, b->b_bytes / secs / (1024 * 1024));
+}
+
+static void
+bench_mkfiles(struct bench_state *b, off_t maxsize)
+{
+	struct bench_file	*bf;
+	uint8_t	*buf;
+	char	 path[PATH_MAX];
+	int	 fd, i;
+
+	strlcpy(b->b_dir, "/tmp/bench_ct_io.XXXXXXXXXX", sizeof(b->b_dir));
+	if (mkdtemp(b->b_dir) == NULL)
+		CFATAL("can't make %s", b->b_dir);
+	buf = e_calloc(1, maxsize);
+	arc4random_buf(buf, maxsize);
+	for (i = 0; i < b->b_nfiles; i++) {
+		bf = &b->b_files[i];
+		/* mostly small with the odd larger one */
+		bf->bf_size = arc4random_uniform(maxsize / 8 + 1);
+		if (i % 16 == 0)
+			bf->bf_size = arc4random_uniform(maxsize + 1);
+		snprintf(path, sizeof(path), "%s/f%d", b->b_dir, i);
+		if ((fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0600)) == -1)
+			CFATAL("can't create %s", path);
+		if (write(fd, buf, bf->bf_size) != bf->bf_size)
+			CFATAL("can't write %s", path);
+		close(fd);
+	}
+	e_free(&buf);
+}
+
+static void
+bench_rmfiles(struct bench_state *b, const char *dir)
+{
+	char	path[PATH_MAX];
+	int	i;
+
+	for (i = 0; i < b->b_nfiles; i++) {
+		snprintf(path, sizeof(path), "%s/f%d", dir, i);
+		unlink(path);
+	}
+	rmdir(dir);
+}
+
+/* As ct_archive() does it without read-ahead. */
+static void
+bench_read_inline(struct bench_state *b)
+{
+	struct timeval	 start;
+	struct stat	 sb;
+	uint8_t		*buf;
+	char		 path[PATH_MAX];
+	ssize_t		 rlen;
+	int		 dfd, fd, i;
+
+	buf = e_malloc(BENCH_BLOCKSZ);
+	b->b_bytes = 0;
+	gettimeofday(&start, NULL);
+	if ((dfd = open(b->b_dir, O_RDONLY | O_DIRECTORY)) == -1)
+		CFATAL("can't open %s", b->b_dir);
+	for (i = 0; i < b->b_nfiles; i++) {
+		snprintf(path, sizeof(path), "f%d", i);
+		if ((fd = openat(dfd, path, O_RDONLY)) == -1)
+			CFATAL("can't open %s", path);
+		if (fstat(fd, &sb) != 0)
+			CFATAL("can't stat %s", path);
+		while ((rlen = read(fd, buf, BENCH_BLOCKSZ)) > 0)
+			b->b_bytes += rlen;
+		if (fstat(fd, &sb) != 0)
+			CFATAL("can't stat %s", path);
+		close(fd);
+	}
+	close(dfd);
+	bench_report("read", "inline ", 1, b, &start);
+	e_free(&buf);
+}
+
+static void
+bench_issue(struct bench_state *b)
+{
+	struct bench_file	*bf;
+	struct ct_trans		*trans;
+	int			 i;
+
+	for (i = b->b_head; i < b->b_tail; i++) {
+		bf = &b->b_files[i];
+		while (bf->bf_next < bf->bf_size &&
+		    (trans = TAILQ_FIRST(&b->b_free)) != NULL) {
+			TAILQ_REMOVE(&b->b_free, trans, tr_next);
+			ct_readahead_read(b->b_ra, bf->bf_raf, trans,
+			    bf->bf_next);
+			bf->bf_next += BENCH_BLOCKSZ;
+		}
+	}
+}
+
+static void
+bench_close(struct bench_state *b, struct bench_file *bf)
+{
+	struct ct_ra_reads	 reads;
+	struct ct_trans		*trans;
+
+	TAILQ_INIT(&reads);
+	ct_readahead_close(b->b_ra, bf->bf_raf, &reads);
+	while ((trans = TAILQ_FIRST(&reads)) != NULL) {
+		TAILQ_REMOVE(&reads, trans, tr_next);
+		TAILQ_INSERT_TAIL(&b->b_free, trans, tr_next);
+	}
+	b->b_head++;
+}
+
+/* A cut down version of the read-ahead loop in ct_archive(). */
+void
+bench_step(void *vctx)
+{
+	struct bench_state	*b = vctx;
+	struct bench_file	*bf;
+	struct ct_trans		*trans;
+	struct stat		 sb;
+	char			 path[PATH_MAX];
+	int			 error, final;
+
+	for (;;) {
+		while (b->b_tail < b->b_nfiles &&
+		    b->b_tail - b->b_head < b->b_window) {
+			bf = &b->b_files[b->b_tail++];
+			bf->bf_next = 0;
+			snprintf(path, sizeof(path), "f%d", b->b_tail - 1);
+			bf->bf_raf = ct_readahead_open(b->b_ra,
+			    open(b->b_dir, O_RDONLY | O_DIRECTORY), path,
+			    O_RDONLY);
+		}
+		bench_issue(b);
+		ct_readahead_flush(b->b_ra);
+
+		if (b->b_head == b->b_nfiles) {
+			ct_event_loopbreak(b->b_state->event_state);
+			return;
+		}
+		bf = &b->b_files[b->b_head];
+		switch (ct_readahead_status(b->b_ra, bf->bf_raf, &sb,
+		    &error)) {
+		case CT_RA_PENDING:
+			return;
+		case CT_RA_OPEN:
+			break;
+		default:
+			errno = error;
+			CFATAL("can't open f%d", b->b_head);
+		}
+		if (sb.st_size == 0) {
+			bench_close(b, bf);
+			continue;
+		}
+		if ((trans = ct_readahead_next(b->b_ra, bf->bf_raf, &final,
+		    &sb, &error)) == NULL)
+			return;
+		b->b_bytes += trans->tr_size[0];
+		TAILQ_INSERT_TAIL(&b->b_free, trans, tr_next);
+		if (final)
+			bench_close(b, bf);
+	}
+}
+
+static void
+bench_read_ahead(struct bench_state *b, int nthreads, int uring)
+{
+	struct ct_config	 conf;
+	struct ct_ra_reads	 reads;
+	struct ct_trans		*pool;
+	struct timeval		 start;
+	uint8_t			*bufs;
+	int			 ret, i;
+
+	ct_default_config(&conf);
+	if ((ret = ct_setup_state(&b->b_state, &conf)) != 0)
+		CFATALX("can't setup state: %s", ct_strerror(ret));
+	if ((b->b_state->event_state = ct_event_init(b->b_state,
+	    bench_reconnect, NULL)) == NULL)
+		CFATALX("can't initialise event state");
+	if ((ret = ct_setup_wakeup_file(b->b_state->event_state, b,
+	    bench_step)) != 0)
+		CFATALX("can't setup wakeup: %s", ct_strerror(ret));
+
+	TAILQ_INIT(&b->b_free);
+	pool = e_calloc(BENCH_DEPTH, sizeof(*pool));
+	bufs = e_malloc((size_t)BENCH_DEPTH * BENCH_BLOCKSZ);
+	for (i = 0; i < BENCH_DEPTH; i++) {
+		pool[i].tr_data[0] = bufs + (size_t)i * BENCH_BLOCKSZ;
+		TAILQ_INSERT_TAIL(&b->b_free, &pool[i], tr_next);
+	}
+	b->b_head = b->b_tail = 0;
+	b->b_bytes = 0;
+
+	gettimeofday(&start, NULL);
+	if ((b->b_ra = ct_readahead_init(b->b_state->event_state, nthreads,
+	    BENCH_BLOCKSZ, uring)) == NULL)
+		CFATALX("can't start read-ahead");
+	b->b_window = ct_readahead_window(b->b_ra);
+	ct_wakeup_file(b->b_state->event_state);
+	if (ct_event_dispatch(b->b_state->event_state) == -1)
+		CFATALX("event loop failed");
+	TAILQ_INIT(&reads);
+	ct_readahead_cleanup(b->b_ra, &reads);
+	bench_report("read", uring ? "uring  " : "threads", nthreads, b,
+	    &start);
+
+	ct_event_cleanup(b->b_state->event_state);
+	b->b_state->event_state = NULL;
+	ct_cleanup(b->b_state);
+	e_free(&bufs);
+	e_free(&pool);
+	free(conf.ct_host);
+	free(conf.ct_hostport);
+}
+
+/* As the extract does it, through the ct_file_extract_* calls. */
+static void
+bench_write(struct bench_state *b, int uring)
+{
+	struct ct_extract_state	*ces;
+	struct fnode		*fnode;
+	struct timeval		 start;
+	char			 dir[PATH_MAX];
+	uint8_t			*buf;
+	off_t			 off, len;
+	int			 ret, i;
+
+	snprintf(dir, sizeof(dir), "%s.out", b->b_dir);
+	buf = e_calloc(1, BENCH_BLOCKSZ);
+	b->b_bytes = 0;
+	gettimeofday(&start, NULL);
+	if ((ret = ct_file_extract_init(&ces, dir, 0, 0, 0, NULL,
+	    NULL)) != 0)
+		CFATALX("can't initialise extract: %s", ct_strerror(ret));
+	if (uring)
+		ct_file_extract_uring(ces, BENCH_BLOCKSZ);
+	for (i = 0; i < b->b_nfiles; i++) {
+		fnode = ct_alloc_fnode();
+		fnode->fn_parent_dir = ct_file_extract_get_rootdir(ces);
+		e_asprintf(&fnode->fn_name, "f%d", i);
+		fnode->fn_fullname = e_strdup(fnode->fn_name);
+		fnode->fn_mode = 0600;
+		if (ct_file_extract_open(ces, fnode) != 0)
+			CFATAL("can't create %s", fnode->fn_fullname);
+		for (off = 0; off < b->b_files[i].bf_size; off += len) {
+			len = MIN(BENCH_BLOCKSZ, b->b_files[i].bf_size - off);
+			if ((ret = ct_file_extract_write(ces, fnode, buf,
+			    len)) != 0)
+				CFATAL("can't write %s", fnode->fn_fullname);
+			b->b_bytes += len;
+		}
+		ct_file_extract_close(ces, fnode);
+		ct_free_fnode(fnode);
+	}
+	ct_file_extract_cleanup(ces);
+	bench_report("write", uring ? "uring  " : "inline ", 1, b, &start);
+
+	bench_rmfiles(b, dir);
+	e_free(&buf);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct bench_state	 b;
+	struct ct_uring		*ur;
+	const char		*errstr;
+	off_t			 maxsize = 64 * 1024;
+	int			 maxthreads = 8, nthreads, c;
+
+	clog_init(1);
+	(void)clog_set_flags(CLOG_F_STDERR | CLOG_F_ENABLE);
+
+	bzero(&b, sizeof(b));
+	b.b_nfiles = 20000;
+	while ((c = getopt(argc, argv, "n:s:t:")) != -1) {
+		switch (c) {
+		case 'n':
+			b.b_nfiles = strtonum(optarg, 1, INT_MAX, &errstr);
+			if (errstr)
+				CFATALX("files %s: %s", optarg, errstr);
+			break;
+		case 's':
+			maxsize = strtonum(optarg, 1, 64 * 1024 * 1024,
+			    &errstr);
+			if (errstr)
+				CFATALX("maxsize %s: %s", optarg, errstr);
+			break;
+		case 't':
+			maxthreads = strtonum(optarg, 1, CT_MAX_WORKERS,
+			    &errstr);
+			if (errstr)
+				CFATALX("maxthreads %s: %s", optarg, errstr);
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc != 0)
+		usage();
+
+	b.b_files = e_calloc(b.b_nfiles, sizeof(*b.b_files));
+	bench_mkfiles(&b, maxsize);
+
+	bench_read_inline(&b);
+	for (nthreads = 1; nthreads <= maxthreads; nthreads *= 2)
+		bench_read_ahead(&b, nthreads, 0);
+	if ((ur = ct_uring_init(1)) != NULL) {
+		ct_uring_cleanup(ur);
+		bench_read_ahead(&b, 1, 1);
+	}
+	bench_write(&b, 0);
+	if (ur != NULL)
+		bench_write(&b, 1);
+	else
+		printf("no io_uring\n");
+
+	bench_rmfiles(&b, b.b_dir);
+	e_free(&b.b_files);
+
+	return (0);
+}
@@ -0,0 +1,370 @@
+/*
+ * Copyright (c) 2012 Conformal Systems LLC <info@conformal.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Read a tree of files from a cold cache in the orders read_order offers:
+ * as the directories list them, by inode and by first extent, sorted a
+ * window at a time as the archive does. Files are written in random order
+ * so that neither of the first two matches the disk. A seek is counted
+ * whenever a file does not start where the previous one's blocks ended;
+ * the distance is how far the head had to go for that. Only the data of
+ * the bench's own files is dropped between passes. Run it as root on the
+ * disk of interest (-d) with -D to drop the whole page, dentry and inode
+ * caches instead; that flushes them for everything else on the host too.
+ */
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <dirent.h>
+
+#include <clog.h>
+#include <exude.h>
+
+#include <ctutil.h>
+#include <cyphertite.h>
+#include <ct_internal.h>
+
+extern char *__progname;
+
+#define BENCH_PERDIR	1000
+#define BENCH_BUFSZ	(256 * 1024)
+
+struct bench_file {
+	char		*f_path;
+	ino_t		 f_ino;
+	off_t		 f_phys;	/* -1 if not known */
+	off_t		 f_alloc;	/* bytes allocated */
+	off_t		 f_size;
+};
+
+struct bench_state {
+	char			 b_dir[1024];
+	int			 b_nfiles;
+	int			 b_window;
+	int			 b_dropsys;	/* -D */
+	int			 b_dropall;	/* drop_caches worked */
+	struct bench_file	*b_files;	/* as listed */
+	struct bench_file	*b_order;	/* being read */
+	uint8_t			*b_buf;
+};
+
+__dead void
+usage(void)
+{
+	fprintf(stderr, "usage: %s [-D] [-d dir] [-n files] [-s maxsize] "
+	    "[-w window]\n", __progname);
+	exit(1);
+}
+
+static void
+bench_path(struct bench_state *b, int i, char *path, size_t len)
+{
+	snprintf(path, len, "%s/d%d/f%d", b->b_dir, i / BENCH_PERDIR, i);
+}
+
+/* Write the files in random order, so their blocks are shuffled too. */
+static void
+bench_mkfiles(struct bench_state *b, off_t maxsize)
+{
+	char	 path[PATH_MAX];
+	off_t	 size;
+	int	*perm, fd, i, j, t;
+
+	for (i = 0; i < b->b_nfiles; i += BENCH_PERDIR) {
+		snprintf(path, sizeof(path), "%s/d%d", b->b_dir,
+		    i / BENCH_PERDIR);
+		if (mkdir(path, 0700) != 0)
+			CFATAL("can't create %s", path);
+	}
+	perm = e_calloc(b->b_nfiles, sizeof(*perm));
+	for (i = 0; i < b->b_nfiles; i++)
+		perm[i] = i;
+	for (i = b->b_nfiles - 1; i > 0; i--) {
+		j = arc4random_uniform(i + 1);
+		t = perm[i];
+		perm[i] = perm[j];
+		perm[j] = t;
+	}
+	arc4random_buf(b->b_buf, BENCH_BUFSZ);
+	for (i = 0; i < b->b_nfiles; i++) {
+		bench_path(b, perm[i], path, sizeof(path));
+		size = 1 + arc4random_uniform(maxsize);
+		if ((fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0600)) == -1)
+			CFATAL("can't create %s", path);
+		while (size > 0) {
+			t = MIN(size, BENCH_BUFSZ);
+			if (write(fd, b->b_buf, t) != t)
+				CFATAL("can't write %s", path);
+			size -= t;
+		}
+		close(fd);
+	}
+	e_free(&perm);
+	/* get the blocks allocated before asking where they are */
+	sync();
+}
+
+static void
+bench_rmfiles(struct bench_state *b)
+{
+	char	path[PATH_MAX];
+	int	i;
+
+	for (i = 0; i < b->b_nfiles; i++) {
+		unlink(b->b_files[i].f_path);
+		e_free(&b->b_files[i].f_path);
+		if (i % BENCH_PERDIR == BENCH_PERDIR - 1 ||
+		    i == b->b_nfiles - 1) {
+			snprintf(path, sizeof(path), "%s/d%d", b->b_dir,
+			    i / BENCH_PERDIR);
+			rmdir(path);
+		}
+	}
+	rmdir(b->b_dir);
+}
+
+/* List the files the way the scan finds them, in readdir order. */
+static void
+bench_list(struct bench_state *b)
+{
+	struct bench_file	*f;
+	struct dirent		*de;
+	struct stat		 sb;
+	DIR			*dirp;
+	char			 path[PATH_MAX];
+	int			 i, n = 0;
+
+	for (i = 0; i < b->b_nfiles; i += BENCH_PERDIR) {
+		snprintf(path, sizeof(path), "%s/d%d", b->b_dir,
+		    i / BENCH_PERDIR);
+		if ((dirp = opendir(path)) == NULL)
+			CFATAL("can't open %s", path);
+		while ((de = readdir(dirp)) != NULL) {
+			if (de->d_name[0] == '.')
+				continue;
+			if (n == b->b_nfiles)
+				CFATALX("more files than made");
+			f = &b->b_files[n++];
+			e_asprintf(&f->f_path, "%s/%s", path, de->d_name);
+			if (stat(f->f_path, &sb) != 0)
+				CFATAL("can't stat %s", f->f_path);
+			f->f_ino = sb.st_ino;
+			f->f_size = sb.st_size;
+			f->f_alloc = (off_t)sb.st_blocks * 512;
+			if (ct_extent_start(f->f_path, 0, &f->f_phys) != 0)
+				f->f_phys = -1;
+		}
+		closedir(dirp);
+	}
+	if (n != b->b_nfiles)
+		CFATALX("listed %d files of %d", n, b->b_nfiles);
+}
+
+static int
+bench_cmp_inode(const void *a, const void *b)
+{
+	const struct bench_file	*f1 = a, *f2 = b;
+
+	if (f1->f_ino != f2->f_ino)
+		return (f1->f_ino < f2->f_ino ? -1 : 1);
+	return (0);
+}
+
+/* As ct_scan_order_cmp(): by extent where known, then by inode. */
+static int
+bench_cmp_extent(const void *a, const void *b)
+{
+	const struct bench_file	*f1 = a, *f2 = b;
+
+	if ((f1->f_phys == -1) != (f2->f_phys == -1))
+		return (f1->f_phys != -1 ? -1 : 1);
+	if (f1->f_phys != f2->f_phys)
+		return (f1->f_phys < f2->f_phys ? -1 : 1);
+	return (bench_cmp_inode(a, b));
+}
+
+static void
+bench_sort(struct bench_state *b, int (*cmp)(const void *, const void *))
+{
+	int	i, n;
+
+	memcpy(b->b_order, b->b_files, b->b_nfiles * sizeof(*b->b_order));
+	if (cmp == NULL)
+		return;
+	for (i = 0; i < b->b_nfiles; i += b->b_window) {
+		n = MIN(b->b_window, b->b_nfiles - i);
+		qsort(b->b_order + i, n, sizeof(*b->b_order), cmp);
+	}
+}
+
+static void
+bench_drop(struct bench_state *b)
+{
+	int	fd, i;
+
+	if (b->b_dropsys) {
+		sync();
+		if ((fd = open("/proc/sys/vm/drop_caches", O_WRONLY)) != -1) {
+			b->b_dropall = write(fd, "3\n", 2) == 2;
+			close(fd);
+			if (b->b_dropall)
+				return;
+		}
+	}
+#ifdef POSIX_FADV_DONTNEED
+	/* dirty pages aren't dropped, so write ours out first */
+	for (i = 0; i < b->b_nfiles; i++) {
+		if ((fd = open(b->b_files[i].f_path, O_RDONLY)) == -1)
+			continue;
+		(void)fsync(fd);
+		(void)posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+		close(fd);
+	}
+#endif
+}
+
+static void
+bench_read(struct bench_state *b, const char *name)
+{
+	struct bench_file	*f;
+	struct timeval		 start, end;
+	double			 secs;
+	uint64_t		 bytes = 0, seeks = 0, dist = 0;
+	off_t			 next = -1;
+	ssize_t			 rlen;
+	int			 fd, i;
+
+	for (i = 0; i < b->b_nfiles; i++) {
+		f = &b->b_order[i];
+		if (f->f_phys == -1)
+			continue;
+		if (next != -1 && f->f_phys != next) {
+			seeks++;
+			dist += f->f_phys > next ? f->f_phys - next :
+			    next - f->f_phys;
+		}
+		next = f->f_phys + f->f_alloc;
+	}
+
+	bench_drop(b);
+	gettimeofday(&start, NULL);
+	for (i = 0; i < b->b_nfiles; i++) {
+		f = &b->b_order[i];
+		if ((fd = open(f->f_path, O_RDONLY)) == -1)
+			CFATAL("can't open %s", f->f_path);
+		while ((rlen = read(fd, b->b_buf, BENCH_BUFSZ)) > 0)
+			bytes += rlen;
+		if (rlen == -1)
+			CFATAL("can't read %s", f->f_path);
+		close(fd);
+	}
+	gettimeofday(&end, NULL);
+
+	timersub(&end, &start, &end);
+	secs = end.tv_sec + end.tv_usec / 1000000.0;
+	printf("%-8s %10.0f files/s %8.1f MB/s %9" PRIu64 " seeks "
+	    "%10.1f MB sought\n", name, b->b_nfiles / secs,
+	    bytes / secs / (1024 * 1024), seeks, dist / (1024.0 * 1024));
+}
+
+int
+main(int argc, char **argv)
+{
+	struct bench_state	 b;
+	const char		*errstr, *dir = "/tmp";
+	off_t			 maxsize = 65536;
+	int			 c, nphys = 0, i;
+
+	clog_init(1);
+	(void)clog_set_flags(CLOG_F_STDERR | CLOG_F_ENABLE);
+
+	bzero(&b, sizeof(b));
+	b.b_nfiles = 20000;
+	b.b_window = 4096;	/* CT_ORDER_SEGMENT */
+	while ((c = getopt(argc, argv, "Dd:n:s:w:")) != -1) {
+		switch (c) {
+		case 'D':
+			b.b_dropsys = 1;
+			break;
+		case 'd':
+			dir = optarg;
+			break;
+		case 'n':
+			b.b_nfiles = strtonum(optarg, 1, INT_MAX, &errstr);
+			if (errstr)
+				CFATALX("files %s: %s", optarg, errstr);
+			break;
+		case 's':
+			maxsize = strtonum(optarg, 1, INT_MAX, &errstr);
+			if (errstr)
+				CFATALX("maxsize %s: %s", optarg, errstr);
+			break;
+		case 'w':
+			b.b_window = strtonum(optarg, 1, INT_MAX, &errstr);
+			if (errstr)
+				CFATALX("window %s: %s", optarg, errstr);
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc != 0)
+		usage();
+
+	if (snprintf(b.b_dir, sizeof(b.b_dir), "%s/bench_ct_order.XXXXXXXXXX",
+	    dir) >= (int)sizeof(b.b_dir))
+		CFATALX("%s: too long", dir);
+	if (mkdtemp(b.b_dir) == NULL)
+		CFATAL("can't make %s", b.b_dir);
+	b.b_buf = e_malloc(BENCH_BUFSZ);
+	b.b_files = e_calloc(b.b_nfiles, sizeof(*b.b_files));
+	b.b_order = e_calloc(b.b_nfiles, sizeof(*b.b_order));
+	bench_mkfiles(&b, maxsize);
+	bench_list(&b);
+	for (i = 0; i < b.b_nfiles; i++)
+		if (b.b_files[i].f_phys != -1)
+			nphys++;
+	printf("%d files, %d with a known extent, window %d\n", b.b_nfiles,
+	    nphys, b.b_window);
+
+	bench_sort(&b, NULL);
+	bench_read(&b, "scan");
+	bench_sort(&b, bench_cmp_inode);
+	bench_read(&b, "inode");
+	bench_sort(&b, bench_cmp_extent);
+	bench_read(&b, "extent");
+	printf("cache    %s\n", b.b_dropall ? "dropped" :
+	    b.b_dropsys ? "file data only, not root?" : "file data only");
+
+	bench_rmfiles(&b);
+	e_free(&b.b_order);
+	e_free(&b.b_files);
+	e_free(&b.b_buf);
+
+	return (0);
+}
@@ -0,0 +1,371 @@
+/*
+ * Copyright (c) 2012 Conformal Systems LLC <info@conformal.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Archive a tree of many small files with and without packing, as far as
+ * that can be done without a server: files are read as ct_archive() reads
+ * them, every chunk is hashed and the ctfile is written. Each chunk also
+ * costs a ctdb lookup, compression, encryption and an exists round trip in
+ * a real archive, so the chunk count matters as much as the time here.
+ * The packed ctfile is then parsed back and checked.
+ */
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <inttypes.h>
+#include <fcntl.h>
+
+#include <clog.h>
+#include <exude.h>
+
+#include <ctutil.h>
+#include <cyphertite.h>
+#include <ct_ctfile.h>
+#include <ct_internal.h>
+
+extern char *__progname;
+
+#define BENCH_BLOCKSZ	(256 * 1024)
+#define BENCH_PERDIR	1000
+
+struct bench_state {
+	char			 b_dir[64];
+	int			 b_nfiles;
+	off_t			 b_threshold;
+	uint8_t			*b_buf;		/* chunk being filled */
+	size_t			 b_used;
+	struct fnode		*b_pack;	/* files in it */
+	struct fnode		**b_tail;
+	uint64_t		 b_bytes;
+	uint64_t		 b_chunks;
+};
+
+__dead void
+usage(void)
+{
+	fprintf(stderr, "usage: %s [-n files] [-p threshold] [-s maxsize]\n",
+	    __progname);
+	exit(1);
+}
+
+static void
+bench_path(struct bench_state *b, int i, char *path, size_t len)
+{
+	snprintf(path, len, "%s/d%d/f%d", b->b_dir, i / BENCH_PERDIR, i);
+}
+
+static void
+bench_mkfiles(struct bench_state *b, off_t maxsize)
+{
+	uint8_t	*buf;
+	char	 path[PATH_MAX];
+	off_t	 size;
+	int	 fd, i;
+
+	strlcpy(b->b_dir, "/tmp/bench_ct_pack.XXXXXXXXXX", sizeof(b->b_dir));
+	if (mkdtemp(b->b_dir) == NULL)
+		CFATAL("can't make %s", b->b_dir);
+	buf = e_calloc(1, maxsize);
+	arc4random_buf(buf, maxsize);
+	for (i = 0; i < b->b_nfiles; i++) {
+		if (i % BENCH_PERDIR == 0) {
+			snprintf(path, sizeof(path), "%s/d%d", b->b_dir,
+			    i / BENCH_PERDIR);
+			if (mkdir(path, 0700) != 0)
+				CFATAL("can't create %s", path);
+		}
+		/* mostly small with the odd larger one */
+		size = arc4random_uniform(maxsize / 8 + 1);
+		if (i % 16 == 0)
+			size = arc4random_uniform(maxsize + 1);
+		bench_path(b, i, path, sizeof(path));
+		if ((fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0600)) == -1)
+			CFATAL("can't create %s", path);
+		if (write(fd, buf, size) != size)
+			CFATAL("can't write %s", path);
+		close(fd);
+	}
+	e_free(&buf);
+}
+
+static void
+bench_rmfiles(struct bench_state *b)
+{
+	char	path[PATH_MAX];
+	int	i;
+
+	for (i = 0; i < b->b_nfiles; i++) {
+		bench_path(b, i, path, sizeof(path));
+		unlink(path);
+		if (i % BENCH_PERDIR == BENCH_PERDIR - 1 ||
+		    i == b->b_nfiles - 1) {
+			snprintf(path, sizeof(path), "%s/d%d", b->b_dir,
+			    i / BENCH_PERDIR);
+			rmdir(path);
+		}
+	}
+	rmdir(b->b_dir);
+}
+
+/* What the sha stage does to a chunk before it goes any further. */
+static void
+bench_chunk(struct bench_state *b, uint8_t *data, size_t len, uint8_t *sha)
+{
+	ct_sha1(data, sha, len);
+	b->b_chunks++;
+}
+
+static void
+bench_flush(struct bench_state *b, struct ctfile_write_state *cws)
+{
+	struct fnode	*fnode;
+	uint8_t		 sha[SHA_DIGEST_LENGTH], iv[CT_IV_LEN];
+
+	if (b->b_pack == NULL)
+		return;
+	bench_chunk(b, b->b_buf, b->b_used, sha);
+	while ((fnode = b->b_pack) != NULL) {
+		b->b_pack = fnode->fn_pack_next;
+		if (ctfile_write_file_packed(cws, fnode, sha, sha, iv) != 0)
+			CFATALX("can't write packed %s", fnode->fn_fullname);
+		ct_free_fnode(fnode);
+	}
+	b->b_used = 0;
+	b->b_tail = &b->b_pack;
+}
+
+/* Read the file at fd into the chunk being packed, as ct_archive_pack(). */
+static void
+bench_pack(struct bench_state *b, struct ctfile_write_state *cws,
+    struct fnode *fnode, int fd)
+{
+	ssize_t	rlen;
+
+	if (b->b_used + fnode->fn_size > BENCH_BLOCKSZ)
+		bench_flush(b, cws);
+	if ((rlen = read(fd, b->b_buf + b->b_used, fnode->fn_size)) !=
+	    fnode->fn_size)
+		CFATAL("short read on %s", fnode->fn_fullname);
+	ct_digest_add(b->b_buf + b->b_used, &fnode->fn_shactx, rlen);
+	fnode->fn_pack_off = b->b_used;
+	b->b_used += rlen;
+	b->b_bytes += rlen;
+	*b->b_tail = fnode;
+	b->b_tail = &fnode->fn_pack_next;
+}
+
+/* One chunk per block of the file at fd, as ct_archive() without packing. */
+static void
+bench_single(struct bench_state *b, struct ctfile_write_state *cws,
+    struct fnode *fnode, int fd)
+{
+	uint8_t	sha[SHA_DIGEST_LENGTH], iv[CT_IV_LEN];
+	ssize_t	rlen;
+
+	if (ctfile_write_file_start(cws, fnode) != 0)
+		CFATALX("can't write header of %s", fnode->fn_fullname);
+	while ((rlen = read(fd, b->b_buf, BENCH_BLOCKSZ)) > 0) {
+		bench_chunk(b, b->b_buf, rlen, sha);
+		ct_digest_add(b->b_buf, &fnode->fn_shactx, rlen);
+		if (ctfile_write_file_sha(cws, sha, sha, iv) != 0)
+			CFATALX("can't write sha of %s", fnode->fn_fullname);
+		b->b_bytes += rlen;
+	}
+	if (ctfile_write_file_end(cws, fnode) != 0)
+		CFATALX("can't write trailer of %s", fnode->fn_fullname);
+	ct_free_fnode(fnode);
+}
+
+static void
+bench_archive(struct bench_state *b, const char *ctfile, int pack)
+{
+	struct ctfile_write_state	*cws;
+	struct fnode			*fnode;
+	struct timeval			 start, end;
+	struct stat			 sb;
+	char				 path[PATH_MAX];
+	char				*list[] = { b->b_dir, NULL };
+	double				 secs;
+	int				 fd, i, ret;
+
+	b->b_bytes = b->b_chunks = 0;
+	b->b_used = 0;
+	b->b_pack = NULL;
+	b->b_tail = &b->b_pack;
+
+	gettimeofday(&start, NULL);
+	if ((ret = ctfile_write_init(&cws, ctfile, NULL, CT_MD_REGULAR, NULL,
+	    0, b->b_dir, list, 0, BENCH_BLOCKSZ, 0, 0, pack, 0,
+	    CT_DIGEST_SHA1)) != 0)
+		CFATALX("can't create ctfile: %s", ct_strerror(ret));
+	for (i = 0; i < b->b_nfiles; i++) {
+		bench_path(b, i, path, sizeof(path));
+		if ((fd = open(path, O_RDONLY)) == -1)
+			CFATAL("can't open %s", path);
+		if (fstat(fd, &sb) != 0)
+			CFATAL("can't stat %s", path);
+		fnode = ct_alloc_fnode();
+		fnode->fn_fullname = e_strdup(path + strlen(b->b_dir) + 1);
+		fnode->fn_name = e_strdup(fnode->fn_fullname);
+		fnode->fn_type = C_TY_REG;
+		fnode->fn_mode = sb.st_mode;
+		fnode->fn_mtime = sb.st_mtime;
+		fnode->fn_size = sb.st_size;
+		ct_digest_setup(&fnode->fn_shactx, CT_DIGEST_SHA1);
+		if (pack && sb.st_size > 0 && sb.st_size <= b->b_threshold)
+			bench_pack(b, cws, fnode, fd);
+		else
+			bench_single(b, cws, fnode, fd);
+		if (fstat(fd, &sb) != 0)
+			CFATAL("can't stat %s", path);
+		close(fd);
+	}
+	bench_flush(b, cws);
+	if (ctfile_write_close(cws) != 0)
+		CFATALX("can't close ctfile");
+	gettimeofday(&end, NULL);
+
+	timersub(&end, &start, &end);
+	secs = end.tv_sec + end.tv_usec / 1000000.0;
+	if (stat(ctfile, &sb) != 0)
+		CFATAL("can't stat %s", ctfile);
+	printf("%-8s %10.0f files/s %8.1f MB/s %9" PRIu64 " chunks "
+	    "%8" PRIu64 " avg %10lld ctfile\n", pack ? "packed" : "single",
+	    b->b_nfiles / secs, b->b_bytes / secs / (1024 * 1024), b->b_chunks,
+	    b->b_chunks ? b->b_bytes / b->b_chunks : 0,
+	    (long long)sb.st_size);
+}
+
+/* Parse the packed ctfile back, seeking past every other file's sha. */
+static void
+bench_check(struct bench_state *b, const char *ctfile)
+{
+	struct ctfile_parse_state	xs;
+	int				nfiles = 0, npacked = 0, ret;
+
+	if ((ret = ctfile_parse_init(&xs, ctfile, NULL)) != 0)
+		CFATALX("can't parse ctfile: %s", ct_strerror(ret));
+	if ((xs.xs_gh.cmg_flags & CT_MD_PACK) == 0)
+		CFATALX("ctfile not flagged as packed");
+	while ((ret = ctfile_parse(&xs)) != XS_RET_EOF) {
+		switch (ret) {
+		case XS_RET_FILE:
+			/* the packed bit is the parser's business */
+			if (xs.xs_hdr.cmh_type != C_TY_REG)
+				CFATALX("%s: type %d", xs.xs_hdr.cmh_filename,
+				    xs.xs_hdr.cmh_type);
+			nfiles++;
+			if ((nfiles & 1) && xs.xs_sha_cnt > 0 &&
+			    ctfile_parse_seek(&xs) != 0)
+				CFATALX("can't seek past %s",
+				    xs.xs_hdr.cmh_filename);
+			break;
+		case XS_RET_SHA:
+			if (!xs.xs_packed)
+				break;
+			npacked++;
+			if (xs.xs_pack.cmp_offset + xs.xs_pack.cmp_len >
+			    BENCH_BLOCKSZ || xs.xs_pack.cmp_len == 0)
+				CFATALX("%s: slice %u+%u out of bounds",
+				    xs.xs_hdr.cmh_filename,
+				    xs.xs_pack.cmp_offset, xs.xs_pack.cmp_len);
+			break;
+		case XS_RET_FILE_END:
+			if (xs.xs_packed &&
+			    xs.xs_trl.cmt_orig_size != xs.xs_pack.cmp_len)
+				CFATALX("%s: size %" PRIu64 " slice %u",
+				    xs.xs_hdr.cmh_filename,
+				    xs.xs_trl.cmt_orig_size,
+				    xs.xs_pack.cmp_len);
+			break;
+		default:
+			CFATALX("can't parse ctfile: %s",
+			    ct_strerror(xs.xs_errno));
+		}
+	}
+	ctfile_parse_close(&xs);
+	if (nfiles != b->b_nfiles)
+		CFATALX("%d files in ctfile, %d archived", nfiles, b->b_nfiles);
+	printf("check    %d files, %d of those read packed\n", nfiles,
+	    npacked);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct bench_state	 b;
+	char			 ctfile[PATH_MAX], idx[PATH_MAX];
+	const char		*errstr;
+	off_t			 maxsize = 32768;
+	int			 c;
+
+	clog_init(1);
+	(void)clog_set_flags(CLOG_F_STDERR | CLOG_F_ENABLE);
+
+	bzero(&b, sizeof(b));
+	b.b_nfiles = 1000000;
+	b.b_threshold = 16384;
+	while ((c = getopt(argc, argv, "n:p:s:")) != -1) {
+		switch (c) {
+		case 'n':
+			b.b_nfiles = strtonum(optarg, 1, INT_MAX, &errstr);
+			if (errstr)
+				CFATALX("files %s: %s", optarg, errstr);
+			break;
+		case 'p':
+			b.b_threshold = strtonum(optarg, 1, BENCH_BLOCKSZ - 1,
+			    &errstr);
+			if (errstr)
+				CFATALX("threshold %s: %s", optarg, errstr);
+			break;
+		case 's':
+			maxsize = strtonum(optarg, 8, BENCH_BLOCKSZ, &errstr);
+			if (errstr)
+				CFATALX("maxsize %s: %s", optarg, errstr);
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc != 0)
+		usage();
+
+	b.b_buf = e_malloc(BENCH_BLOCKSZ);
+	bench_mkfiles(&b, maxsize);
+	snprintf(ctfile, sizeof(ctfile), "%s.ctfile", b.b_dir);
+	snprintf(idx, sizeof(idx), "%s.ctfile.idx", b.b_dir);
+
+	bench_archive(&b, ctfile, 0);
+	bench_archive(&b, ctfile, 1);
+	bench_check(&b, ctfile);
+
+	unlink(ctfile);
+	unlink(idx);
+	bench_rmfiles(&b);
+	e_free(&b.b_buf);
+
+	return (0);
+}
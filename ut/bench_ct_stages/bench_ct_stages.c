@@ -0,0 +1,368 @@
+/*
+ * Copyright (c) 2012 Conformal Systems LLC <info@conformal.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Push synthetic archive chunks through the cpu bound stages of the
+ * transaction pipeline and report throughput for a range of worker counts.
+ * Either a single stage is timed, the encrypt and csha pair as two stages or
+ * stitched into one, or the whole sha, compress, encrypt and csha sequence in
+ * its staged or fused form. No server connection or ctfile
+ * is involved, chunks are handed back to the benchmark as soon as they are
+ * ready to be written.
+ */
+
+#include <sys/time.h>
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <inttypes.h>
+#include <pthread.h>
+
+#include <clog.h>
+#include <exude.h>
+
+#include <ctutil.h>
+#include <cyphertite.h>
+#include <ct_crypto.h>
+#include <ct_internal.h>
+
+extern char *__progname;
+
+#define BENCH_SHA	0	/* sha stage only */
+#define BENCH_COMPRESS	1	/* compress stage only */
+#define BENCH_STAGED	2	/* every cpu stage, one thread pool each */
+#define BENCH_FUSED	3	/* every cpu stage, on the fused workers */
+#define BENCH_SCHED	4	/* every cpu stage, on the scheduler */
+#define BENCH_CRYPT	5	/* encrypt and csha only */
+
+struct bench_stage {
+	const char		*bs_name;
+	int			 bs_mode;
+	int			 bs_compress;
+	int			 bs_stitch;
+} bench_stages[] = {
+	{ "sha",	BENCH_SHA,	0,			0 },
+	{ "lzo",	BENCH_COMPRESS,	C_HDR_F_COMP_LZO,	0 },
+	{ "lzw",	BENCH_COMPRESS,	C_HDR_F_COMP_LZW,	0 },
+	{ "lzma",	BENCH_COMPRESS,	C_HDR_F_COMP_LZMA,	0 },
+	{ "crypt",	BENCH_CRYPT,	0,			0 },
+	{ "stitch",	BENCH_CRYPT,	0,			1 },
+	{ "staged",	BENCH_STAGED,	C_HDR_F_COMP_LZO,	0 },
+	{ "fused",	BENCH_FUSED,	C_HDR_F_COMP_LZO,	0 },
+	{ "sched",	BENCH_SCHED,	C_HDR_F_COMP_LZO,	0 },
+};
+#define NSTAGES	(sizeof(bench_stages) / sizeof(bench_stages[0]))
+
+struct bench_state {
+	pthread_mutex_t		 b_mtx;
+	pthread_cond_t		 b_cv;
+	TAILQ_HEAD(, ct_trans)	 b_free;
+	uint64_t		 b_done;
+	struct bench_stage	*b_stage;
+};
+
+void	bench_statemachine(struct ct_global_state *, struct ct_trans *);
+void	bench_reconnect(evutil_socket_t, short, void *);
+double	bench_run(struct bench_stage *, int, int, uint64_t);
+
+__dead void
+usage(void)
+{
+	fprintf(stderr, "usage: %s [-b blocksize] [-m megabytes] "
+	    "[-s sha|lzo|lzw|lzma|crypt|stitch|staged|fused|sched] "
+	    "[-t maxthreads]\n", __progname);
+	exit(1);
+}
+
+/*
+ * Only the stages under test are wired up, anything that comes out of them
+ * goes straight back to the free list.
+ */
+void
+bench_statemachine(struct ct_global_state *state, struct ct_trans *trans)
+{
+	struct bench_state	*b = state->ct_userptr;
+
+	switch (b->b_stage->bs_mode) {
+	case BENCH_SHA:
+		if (trans->tr_state == TR_S_READ) {
+			ct_queue_sha(state, trans);
+			return;
+		}
+		break;
+	case BENCH_COMPRESS:
+		if (trans->tr_state == TR_S_UNCOMPSHA_ED) {
+			ct_queue_compress(state, trans);
+			return;
+		}
+		break;
+	default:
+		switch (trans->tr_state) {
+		case TR_S_COMPSHA_ED:
+		case TR_S_NEXISTS:
+		case TR_S_WMD_READY:
+			/* would be written now */
+			break;
+		default:
+			ct_state_archive(state, trans);
+			return;
+		}
+		break;
+	}
+
+	pthread_mutex_lock(&b->b_mtx);
+	TAILQ_INSERT_TAIL(&b->b_free, trans, tr_next);
+	b->b_done++;
+	pthread_cond_signal(&b->b_cv);
+	pthread_mutex_unlock(&b->b_mtx);
+}
+
+void
+bench_reconnect(evutil_socket_t unused, short event, void *varg)
+{
+	/* never connected */
+}
+
+double
+bench_run(struct bench_stage *stage, int nthreads, int blocksize,
+    uint64_t nchunks)
+{
+	struct ct_config	 conf;
+	struct ct_global_state	*state;
+	struct bench_state	 b;
+	struct ct_trans		*trans;
+	struct fnode		*fnode;
+	struct timeval		 start, end;
+	uint8_t			*data;
+	uint64_t		 i;
+	int			 ret, depth, j;
+
+	ct_default_config(&conf);
+	conf.ct_sha_threads = nthreads;
+	conf.ct_compress_threads = nthreads;
+	conf.ct_crypto_threads = nthreads;
+	if (stage->bs_mode == BENCH_FUSED)
+		conf.ct_fused_threads = nthreads;
+	if (stage->bs_mode == BENCH_SCHED)
+		conf.ct_sched_threads = nthreads;
+	conf.ct_compress = stage->bs_compress;
+	conf.ct_crypto_stitch = stage->bs_stitch;
+	if ((ret = ct_setup_state(&state, &conf)) != 0)
+		CFATALX("can't setup state: %s", ct_strerror(ret));
+	state->ct_max_block_size = blocksize;
+	if (conf.ct_compress)
+		state->ct_alloc_block_size = ct_compress_bounds(
+		    state->ct_comp_pool.wp_workers[0].w_comp_ctx, blocksize);
+	else
+		state->ct_alloc_block_size = blocksize;
+	state->ct_alloc_block_size += ct_crypto_blocksz();
+	arc4random_buf(state->ct_crypto_key, sizeof(state->ct_crypto_key));
+	arc4random_buf(state->ct_iv, sizeof(state->ct_iv));
+
+	pthread_mutex_init(&b.b_mtx, NULL);
+	pthread_cond_init(&b.b_cv, NULL);
+	TAILQ_INIT(&b.b_free);
+	b.b_done = 0;
+	b.b_stage = stage;
+	state->ct_userptr = &b;
+
+	if ((state->event_state = ct_event_init(state, bench_reconnect,
+	    NULL)) == NULL)
+		CFATALX("can't initialise event state");
+	ct_init_queues(state);
+	CT_LOCK_INIT(&state->ct_sha_order_lock);
+	CT_COND_INIT(&state->ct_sha_order_cv);
+	CT_LOCK_INIT(&state->ct_stats_lock);
+	switch (stage->bs_mode) {
+	case BENCH_SHA:
+		ret = ct_setup_wakeup_sha(state->event_state, state,
+		    ct_compute_sha, nthreads);
+		break;
+	case BENCH_COMPRESS:
+		ret = ct_setup_wakeup_compress(state->event_state, state,
+		    ct_compute_compress, nthreads);
+		break;
+	case BENCH_STAGED:
+		if ((ret = ct_setup_wakeup_sha(state->event_state, state,
+		    ct_compute_sha, nthreads)) != 0)
+			break;
+		if ((ret = ct_setup_wakeup_compress(state->event_state, state,
+		    ct_compute_compress, nthreads)) != 0)
+			break;
+		if ((ret = ct_setup_wakeup_encrypt(state->event_state, state,
+		    ct_compute_encrypt, nthreads)) != 0)
+			break;
+		ret = ct_setup_wakeup_csha(state->event_state, state,
+		    ct_compute_csha);
+		break;
+	case BENCH_CRYPT:
+		if ((ret = ct_setup_wakeup_encrypt(state->event_state, state,
+		    ct_compute_encrypt, nthreads)) != 0)
+			break;
+		/* stitched chunks never get here, it just sleeps */
+		ret = ct_setup_wakeup_csha(state->event_state, state,
+		    ct_compute_csha);
+		break;
+	case BENCH_FUSED:
+		ret = ct_setup_wakeup_sha(state->event_state, state,
+		    ct_compute_fused, nthreads);
+		break;
+	case BENCH_SCHED:
+		if ((state->ct_sched = ct_setup_sched(state)) == NULL)
+			CFATALX("can't setup scheduler");
+		ret = ct_setup_wakeup_sched(state->event_state,
+		    state->ct_sched);
+		break;
+	}
+	if (ret != 0)
+		CFATALX("can't setup %s stage: %s", stage->bs_name,
+		    ct_strerror(ret));
+
+	fnode = ct_alloc_fnode();
+	ct_digest_setup(&fnode->fn_shactx, CT_DIGEST_SHA1);
+
+	/* roughly half entropy so the compressors have work to do */
+	data = e_malloc(blocksize);
+	for (j = 0; j < blocksize; j++)
+		data[j] = arc4random() & 0x0f;
+
+	/* enough in flight to keep every worker busy */
+	depth = state->ct_max_trans;
+	for (j = 0; j < depth; j++) {
+		if ((trans = ct_trans_alloc(state)) == NULL)
+			break;
+		memcpy(trans->tr_data[0], data, blocksize);
+		TAILQ_INSERT_TAIL(&b.b_free, trans, tr_next);
+	}
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < nchunks; i++) {
+		pthread_mutex_lock(&b.b_mtx);
+		while ((trans = TAILQ_FIRST(&b.b_free)) == NULL)
+			pthread_cond_wait(&b.b_cv, &b.b_mtx);
+		TAILQ_REMOVE(&b.b_free, trans, tr_next);
+		pthread_mutex_unlock(&b.b_mtx);
+
+		trans->tr_statemachine = bench_statemachine;
+		trans->tr_fl_node = fnode;
+		trans->tr_dataslot = 0;
+		trans->tr_size[0] = trans->tr_chsize = blocksize;
+		trans->hdr.c_flags = 0;
+		switch (stage->bs_mode) {
+		case BENCH_SHA:
+			trans->tr_state = TR_S_READ;
+			break;
+		case BENCH_COMPRESS:
+			trans->tr_state = TR_S_UNCOMPSHA_ED;
+			break;
+		case BENCH_CRYPT:
+			/* as if compressed, and not known to the server */
+			trans->hdr.c_flags = C_HDR_F_ENCRYPTED;
+			trans->tr_old_genid = -1;
+			trans->tr_state = TR_S_COMPRESSED;
+			break;
+		default:
+			/* encryption overwrote the plaintext last time */
+			memcpy(trans->tr_data[0], data, blocksize);
+			trans->hdr.c_flags = C_HDR_F_ENCRYPTED;
+			trans->tr_state = TR_S_READ;
+			break;
+		}
+		ct_queue_first(state, trans);
+	}
+	pthread_mutex_lock(&b.b_mtx);
+	while (b.b_done < nchunks)
+		pthread_cond_wait(&b.b_cv, &b.b_mtx);
+	pthread_mutex_unlock(&b.b_mtx);
+	gettimeofday(&end, NULL);
+
+	while ((trans = TAILQ_FIRST(&b.b_free)) != NULL) {
+		TAILQ_REMOVE(&b.b_free, trans, tr_next);
+		ct_trans_free(state, trans);
+	}
+	e_free(&data);
+	ct_free_fnode(fnode);
+	ct_cleanup(state);
+	free(conf.ct_host);
+	free(conf.ct_hostport);
+	pthread_cond_destroy(&b.b_cv);
+	pthread_mutex_destroy(&b.b_mtx);
+
+	timersub(&end, &start, &end);
+	return ((double)nchunks * blocksize /
+	    (end.tv_sec + end.tv_usec / 1000000.0) / (1024 * 1024 * 1024));
+}
+
+int
+main(int argc, char **argv)
+{
+	struct bench_stage	*stage = &bench_stages[0];
+	const char	*errstr;
+	uint64_t	 nchunks;
+	size_t		 i;
+	int		 blocksize = 256 * 1024, megabytes = 1024;
+	int		 maxthreads = 8, nthreads, c;
+
+	clog_init(1);
+	(void)clog_set_flags(CLOG_F_STDERR | CLOG_F_ENABLE);
+
+	while ((c = getopt(argc, argv, "b:m:s:t:")) != -1) {
+		switch (c) {
+		case 'b':
+			blocksize = strtonum(optarg, 1, 16 * 1024 * 1024,
+			    &errstr);
+			if (errstr)
+				CFATALX("blocksize %s: %s", optarg, errstr);
+			break;
+		case 'm':
+			megabytes = strtonum(optarg, 1, INT_MAX, &errstr);
+			if (errstr)
+				CFATALX("megabytes %s: %s", optarg, errstr);
+			break;
+		case 's':
+			for (i = 0; i < NSTAGES; i++)
+				if (strcmp(optarg, bench_stages[i].bs_name) == 0)
+					break;
+			if (i == NSTAGES)
+				usage();
+			stage = &bench_stages[i];
+			break;
+		case 't':
+			maxthreads = strtonum(optarg, 1, CT_MAX_WORKERS,
+			    &errstr);
+			if (errstr)
+				CFATALX("maxthreads %s: %s", optarg, errstr);
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc != 0)
+		usage();
+
+	nchunks = (uint64_t)megabytes * 1024 * 1024 / blocksize;
+	for (nthreads = 1; nthreads <= maxthreads; nthreads *= 2)
+		printf("%s\tthreads %3d\t%6.2f GB/s\n", stage->bs_name,
+		    nthreads, bench_run(stage, nthreads, blocksize, nchunks));
+
+	return (0);
+}
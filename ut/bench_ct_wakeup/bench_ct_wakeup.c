@@ -0,0 +1,217 @@
+/*
+ * Copyright (c) 2012 Conformal Systems LLC <info@conformal.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Measure how many stage wakeups per second each wakeup type sustains.
+ * A producer posts work items one at a time and wakes the consumer after
+ * each; the consumer takes whatever has been posted. Either a threaded
+ * stage (the sha context) or an event loop stage (the write context) is
+ * used as the consumer. The number of callbacks shows how well redundant
+ * wakeups are coalesced.
+ */
+
+#include <sys/time.h>
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include <clog.h>
+#include <exude.h>
+
+#include <ctutil.h>
+#include <ct_threads.h>
+#include <cyphertite.h>
+#include <ct_internal.h>
+
+extern char *__progname;
+
+struct bench_state {
+	struct ct_global_state	*b_state;
+	uint64_t		 b_total;
+	uint64_t		 b_queued;	/* posted, not yet taken */
+	uint64_t		 b_served;
+	uint64_t		 b_calls;
+	int			 b_loop;
+};
+
+void	bench_consume(void *);
+void	*bench_produce(void *);
+void	bench_reconnect(evutil_socket_t, short, void *);
+void	bench_run(const char *, int, int, int, uint64_t);
+
+__dead void
+usage(void)
+{
+	fprintf(stderr, "usage: %s [-l] [-n wakeups] [-t maxthreads] "
+	    "[-w pipe|futex]\n", __progname);
+	exit(1);
+}
+
+void
+bench_consume(void *vctx)
+{
+	struct bench_state	*b = vctx;
+	uint64_t		 n;
+
+	CT_ATOMIC_ADD(&b->b_calls, 1);
+	while ((n = CT_ATOMIC_LOAD(&b->b_queued)) != 0) {
+		if (!CT_ATOMIC_CAS(&b->b_queued, n, 0))
+			continue;
+		if (CT_ATOMIC_ADD(&b->b_served, n) + n == b->b_total &&
+		    b->b_loop)
+			ct_event_loopbreak(b->b_state->event_state);
+	}
+}
+
+void *
+bench_produce(void *vctx)
+{
+	struct bench_state	*b = vctx;
+	struct ct_event_state	*ev_st = b->b_state->event_state;
+	uint64_t		 i;
+
+	for (i = 0; i < b->b_total; i++) {
+		CT_ATOMIC_ADD(&b->b_queued, 1);
+		if (b->b_loop)
+			ct_wakeup_write(ev_st);
+		else
+			ct_wakeup_sha(ev_st);
+	}
+
+	return (NULL);
+}
+
+void
+bench_reconnect(evutil_socket_t unused, short event, void *varg)
+{
+	/* never connected */
+}
+
+void
+bench_run(const char *name, int type, int loop, int nthreads, uint64_t total)
+{
+	struct ct_config	 conf;
+	struct bench_state	 b;
+	struct timeval		 start, end;
+	pthread_t		 producer;
+	double			 secs;
+	int			 ret;
+
+	ct_default_config(&conf);
+	conf.ct_wakeup_type = type;
+	bzero(&b, sizeof(b));
+	b.b_total = total;
+	b.b_loop = loop;
+	if ((ret = ct_setup_state(&b.b_state, &conf)) != 0)
+		CFATALX("can't setup state: %s", ct_strerror(ret));
+	if ((b.b_state->event_state = ct_event_init(b.b_state,
+	    bench_reconnect, NULL)) == NULL)
+		CFATALX("can't initialise event state");
+	if (loop)
+		ret = ct_setup_wakeup_write(b.b_state->event_state, &b,
+		    bench_consume);
+	else
+		ret = ct_setup_wakeup_sha(b.b_state->event_state, &b,
+		    bench_consume, nthreads);
+	if (ret != 0)
+		CFATALX("can't setup wakeup: %s", ct_strerror(ret));
+
+	gettimeofday(&start, NULL);
+	if (pthread_create(&producer, NULL, bench_produce, &b) != 0)
+		CFATALX("can't create producer");
+	if (loop) {
+		if (ct_event_dispatch(b.b_state->event_state) == -1)
+			CFATALX("event loop failed");
+	} else {
+		while (CT_ATOMIC_LOAD(&b.b_served) != total)
+			sched_yield();
+	}
+	gettimeofday(&end, NULL);
+	pthread_join(producer, NULL);
+
+	ct_event_cleanup(b.b_state->event_state);
+	b.b_state->event_state = NULL;
+	ct_cleanup(b.b_state);
+	free(conf.ct_host);
+	free(conf.ct_hostport);
+
+	timersub(&end, &start, &end);
+	secs = end.tv_sec + end.tv_usec / 1000000.0;
+	printf("%s\t%s\tthreads %3d\t%10.0f wakeups/s\t%10" PRIu64
+	    " callbacks\n", name, loop ? "loop" : "stage", loop ? 1 : nthreads,
+	    total / secs, b.b_calls);
+}
+
+int
+main(int argc, char **argv)
+{
+	const char	*errstr, *name = "pipe";
+	uint64_t	 total = 1000000;
+	int		 type = CT_WAKEUP_PIPE, maxthreads = 4, loop = 0;
+	int		 nthreads, c;
+
+	clog_init(1);
+	(void)clog_set_flags(CLOG_F_STDERR | CLOG_F_ENABLE);
+
+	while ((c = getopt(argc, argv, "ln:t:w:")) != -1) {
+		switch (c) {
+		case 'l':
+			loop = 1;
+			break;
+		case 'n':
+			total = strtonum(optarg, 1, LLONG_MAX, &errstr);
+			if (errstr)
+				CFATALX("wakeups %s: %s", optarg, errstr);
+			break;
+		case 't':
+			maxthreads = strtonum(optarg, 1, CT_MAX_WORKERS,
+			    &errstr);
+			if (errstr)
+				CFATALX("maxthreads %s: %s", optarg, errstr);
+			break;
+		case 'w':
+			if (strcmp(optarg, "pipe") == 0)
+				type = CT_WAKEUP_PIPE;
+			else if (strcmp(optarg, "futex") == 0)
+				type = CT_WAKEUP_FUTEX;
+			else
+				usage();
+			name = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc != 0)
+		usage();
+
+	if (loop) {
+		bench_run(name, type, loop, 1, total);
+		return (0);
+	}
+	for (nthreads = 1; nthreads <= maxthreads; nthreads *= 2)
+		bench_run(name, type, loop, nthreads, total);
+
+	return (0);
+}
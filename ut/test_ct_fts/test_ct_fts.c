@@ -36,14 +36,27 @@ main(int argc, char **argv)
 {
 	CT_FTS			*ftsp;
 	CT_FTSENT		*fe;
-	int			 fts_options;
-	char			**paths = argv + 1;
+	int			 fts_options, c, threads = 0;
+	char			**paths;
 
 	clog_init(1);
 	(void)clog_set_flags(CLOG_F_STDERR | CLOG_F_ENABLE);
 
-	if (argc < 2) {
-		CFATALX("usage: %s <list of paths >", __progname);
+	while ((c = getopt(argc, argv, "t:")) != -1) {
+		switch (c) {
+		case 't':
+			threads = atoi(optarg);
+			break;
+		default:
+			CFATALX("usage: %s [-t threads] <list of paths >",
+			    __progname);
+		}
+	}
+	argc -= optind;
+	paths = argv + optind;
+
+	if (argc < 1) {
+		CFATALX("usage: %s [-t threads] <list of paths >", __progname);
 	}
 
 	fts_options = CT_FTS_NOCHDIR;
@@ -60,6 +73,9 @@ main(int argc, char **argv)
 	if (ftsp == NULL) {
 		CFATAL("ct_fts_open");
 	}
+	/* prefetching must not change the order */
+	if (ct_fts_prefetch(ftsp, threads))
+		CFATAL("ct_fts_prefetch");
 
 	while ((fe = ct_fts_read(ftsp)) != NULL) {
 		switch (fe->fts_info) {
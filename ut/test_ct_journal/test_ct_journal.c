@@ -0,0 +1,350 @@
+/*
+ * Copyright (c) 2012 Conformal Systems LLC <info@conformal.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Keep a change journal for a small tree from a child process, change the
+ * tree the ways an archive cares about and check that the journal read
+ * from where it was before has exactly the changed paths dirty, also while
+ * another file is changed all the time. Then check that moving a directory
+ * starts a new session and that a journal no one keeps any more isn't used.
+ */
+
+#ifdef NEED_LIBCLENS
+#include <clens.h>
+#endif
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <signal.h>
+
+#include <clog.h>
+#include <exude.h>
+
+#include <ctutil.h>
+#include <cyphertite.h>
+#include <ct_internal.h>
+
+#define TEST_WAIT	10000	/* ms to wait for the watcher */
+#define TEST_CHURN	20	/* ms between changes to the busy file */
+
+extern char *__progname;
+
+struct test_state {
+	char		 t_dir[PATH_MAX];
+	char		 t_journal[PATH_MAX];
+	pid_t		 t_pid;
+	pid_t		 t_churn;
+	int		 t_fanotify;
+	int		 t_errors;
+};
+
+static void
+test_path(struct test_state *t, char *path, size_t len, const char *name)
+{
+	if (snprintf(path, len, "%s/%s", t->t_dir, name) >= (int)len)
+		CFATALX("path too long");
+}
+
+static void
+test_write(struct test_state *t, const char *name, int flags)
+{
+	char	path[PATH_MAX];
+	int	fd;
+
+	test_path(t, path, sizeof(path), name);
+	if ((fd = open(path, O_WRONLY | O_CREAT | flags, 0600)) == -1)
+		CFATAL("open %s", path);
+	if (write(fd, name, strlen(name)) != strlen(name))
+		CFATAL("write %s", path);
+	close(fd);
+}
+
+static void
+test_mkdir(struct test_state *t, const char *name)
+{
+	char	path[PATH_MAX];
+
+	test_path(t, path, sizeof(path), name);
+	if (mkdir(path, 0700) != 0)
+		CFATAL("mkdir %s", path);
+}
+
+static void
+test_rename(struct test_state *t, const char *from, const char *to)
+{
+	char	pfrom[PATH_MAX], pto[PATH_MAX];
+
+	test_path(t, pfrom, sizeof(pfrom), from);
+	test_path(t, pto, sizeof(pto), to);
+	if (rename(pfrom, pto) != 0)
+		CFATAL("rename %s", pfrom);
+}
+
+/* Open the journal for the tree, waiting for the watcher to be up. */
+static struct ct_journal *
+test_open(struct test_state *t)
+{
+	struct ct_journal	*cj;
+	char			*filelist[] = { t->t_dir, NULL };
+	int			 i, ret;
+
+	for (i = 0; i < TEST_WAIT / 10; i++) {
+		if ((ret = ct_journal_open(&cj, t->t_journal, filelist,
+		    "/")) == 0)
+			return (cj);
+		usleep(10000);
+	}
+	CFATALX("%s: %s", t->t_journal, ct_strerror(ret));
+}
+
+static void
+test_start(struct test_state *t)
+{
+	char	*paths[] = { t->t_dir, NULL };
+	int	 ret;
+
+	if ((t->t_pid = fork()) == -1)
+		CFATAL("fork");
+	if (t->t_pid == 0) {
+		ret = ct_journal_watch(t->t_journal, paths, t->t_fanotify);
+		CFATALX("watch: %s", ct_strerror(ret));
+	}
+}
+
+static void
+test_stop(struct test_state *t)
+{
+	int	status;
+
+	kill(t->t_pid, SIGTERM);
+	if (waitpid(t->t_pid, &status, 0) == -1)
+		CFATAL("waitpid");
+}
+
+/* Keep appending to name until stopped, as a busy log would be. */
+static void
+test_churn_start(struct test_state *t, const char *name)
+{
+	if ((t->t_churn = fork()) == -1)
+		CFATAL("fork");
+	if (t->t_churn == 0) {
+		for (;;) {
+			test_write(t, name, O_APPEND);
+			usleep(TEST_CHURN * 1000);
+		}
+	}
+}
+
+static void
+test_churn_stop(struct test_state *t)
+{
+	int	status;
+
+	kill(t->t_churn, SIGTERM);
+	if (waitpid(t->t_churn, &status, 0) == -1)
+		CFATAL("waitpid");
+}
+
+static void
+test_check(struct test_state *t, struct ct_journal *cj, const char *name,
+    int dirty)
+{
+	char	path[PATH_MAX];
+
+	test_path(t, path, sizeof(path), name);
+	if (ct_journal_dirty(cj, path) != dirty) {
+		CWARNX("%s: %s, should be %s", name, dirty ? "clean" : "dirty",
+		    dirty ? "dirty" : "clean");
+		t->t_errors++;
+	}
+}
+
+int
+test_run(int fanotify)
+{
+	struct test_state	 t;
+	struct ct_journal	*cj;
+	char			 path[PATH_MAX], *filelist[2], *cmd;
+	uint64_t		 session;
+	off_t			 off;
+	int			 i, ret;
+
+	bzero(&t, sizeof(t));
+	t.t_fanotify = fanotify;
+	strlcpy(path, "/tmp/test_ct_journal.XXXXXXXXXX", sizeof(path));
+	if (mkdtemp(path) == NULL)
+		CFATAL("mkdtemp");
+	/* the journal wants real paths */
+	if (realpath(path, t.t_dir) == NULL)
+		CFATAL("realpath");
+	strlcpy(t.t_journal, t.t_dir, sizeof(t.t_journal));
+	strlcat(t.t_journal, ".journal", sizeof(t.t_journal));
+
+	test_mkdir(&t, "a");
+	test_mkdir(&t, "a/b");
+	for (i = 0; i < 8; i++) {
+		snprintf(path, sizeof(path), "a/f%d", i);
+		test_write(&t, path, 0);
+		snprintf(path, sizeof(path), "a/b/g%d", i);
+		test_write(&t, path, 0);
+	}
+
+	test_start(&t);
+	cj = test_open(&t);
+	session = ct_journal_session(cj);
+	if (ct_journal_read(cj, -1) != 0)
+		CFATALX("can't read journal");
+	off = ct_journal_end(cj);
+	ct_journal_close(cj);
+
+	test_write(&t, "a/f1", O_APPEND);
+	test_path(&t, path, sizeof(path), "a/b/g2");
+	chmod(path, 0400);
+	test_write(&t, "a/new", 0);
+	test_path(&t, path, sizeof(path), "a/f3");
+	unlink(path);
+	test_mkdir(&t, "a/c");
+	test_write(&t, "a/c/x", 0);
+	test_rename(&t, "a/f4", "a/b/f4");
+	/* well past the time the watcher lets changes settle for */
+	usleep(1000000);
+
+	cj = test_open(&t);
+	if (ct_journal_session(cj) != session)
+		CFATALX("journal restarted");
+	if ((ret = ct_journal_read(cj, off)) != 0)
+		CFATALX("can't read journal: %s", ct_strerror(ret));
+	test_check(&t, cj, "a/f1", 1);
+	test_check(&t, cj, "a/b/g2", 1);
+	test_check(&t, cj, "a/new", 1);
+	test_check(&t, cj, "a/f3", 1);
+	test_check(&t, cj, "a/c/x", 1);
+	test_check(&t, cj, "a/c/not/yet", 1);
+	test_check(&t, cj, "a/f4", 1);
+	test_check(&t, cj, "a/b/f4", 1);
+	test_check(&t, cj, "a/f0", 0);
+	test_check(&t, cj, "a/f2", 0);
+	test_check(&t, cj, "a/b/g0", 0);
+	test_check(&t, cj, "a/b/g7", 0);
+	off = ct_journal_end(cj);
+	ct_journal_close(cj);
+
+	/* a change must not wait for a busy tree to go quiet */
+	test_churn_start(&t, "a/log");
+	usleep(1000000);
+	test_write(&t, "a/f5", O_APPEND);
+	cj = test_open(&t);
+	if ((ret = ct_journal_read(cj, off)) != 0)
+		CFATALX("can't read journal: %s", ct_strerror(ret));
+	test_check(&t, cj, "a/log", 1);
+	test_check(&t, cj, "a/f5", 1);
+	test_check(&t, cj, "a/f6", 0);
+	ct_journal_close(cj);
+	test_churn_stop(&t);
+
+	/* only the tree it watches */
+	filelist[0] = "/";
+	filelist[1] = NULL;
+	if (ct_journal_open(&cj, t.t_journal, filelist, "/") == 0) {
+		CWARNX("journal covers /");
+		ct_journal_close(cj);
+		t.t_errors++;
+	}
+
+	/* inotify's watches below a moved directory have the wrong path */
+	if (!fanotify) {
+		test_rename(&t, "a/b", "a/d");
+		for (i = 0; i < TEST_WAIT / 10; i++) {
+			cj = test_open(&t);
+			ret = ct_journal_session(cj) != session;
+			ct_journal_close(cj);
+			if (ret)
+				break;
+			usleep(10000);
+		}
+		if (i == TEST_WAIT / 10) {
+			CWARNX("no new session after a directory moved");
+			t.t_errors++;
+		}
+	}
+
+	test_stop(&t);
+	filelist[0] = t.t_dir;
+	if (ct_journal_open(&cj, t.t_journal, filelist, "/") == 0) {
+		CWARNX("journal used without a watcher");
+		ct_journal_close(cj);
+		t.t_errors++;
+	}
+
+	e_asprintf(&cmd, "rm -rf %s %s", t.t_dir, t.t_journal);
+	if (system(cmd) != 0)
+		CWARNX("can't remove %s", t.t_dir);
+	e_free(&cmd);
+
+	printf("%s\t%s\n", fanotify ? "fanotify" : "inotify ",
+	    t.t_errors ? "FAILED" : "ok");
+
+	return (t.t_errors != 0);
+}
+
+__dead void
+usage(void)
+{
+	fprintf(stderr, "usage: %s [-f]\n", __progname);
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	int	 fanotify = 0, c, failed = 0;
+
+	clog_init(1);
+	(void)clog_set_flags(CLOG_F_STDERR | CLOG_F_ENABLE);
+
+	while ((c = getopt(argc, argv, "f")) != -1) {
+		switch (c) {
+		case 'f':
+			/* needs root */
+			fanotify = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc != 0)
+		usage();
+
+#ifdef __linux__
+	failed |= test_run(0);
+	if (fanotify)
+		failed |= test_run(1);
+#else
+	printf("change journals need linux, skipped\n");
+#endif
+
+	return (failed);
+}
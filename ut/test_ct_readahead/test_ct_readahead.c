@@ -0,0 +1,467 @@
+/*
+ * Copyright (c) 2012 Conformal Systems LLC <info@conformal.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Drive the read-ahead pool the way ct_archive() does.  A directory of
+ * files of awkward sizes, with a few missing ones, is read through the
+ * pool from the event loop with a window of files in flight; every chunk
+ * must come back in order and hold what was written.  Some files are
+ * dropped half way through to exercise closing files the readers are
+ * still busy with.
+ */
+
+#include <sys/param.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <inttypes.h>
+
+#include <clog.h>
+#include <exude.h>
+
+#include <ctutil.h>
+#include <ct_threads.h>
+#include <cyphertite.h>
+#include <ct_internal.h>
+
+#define TEST_BLOCKSZ	4096
+
+extern char *__progname;
+
+struct test_file {
+	off_t			 tf_size;
+	int			 tf_missing;
+	int			 tf_drop;
+	struct ct_ra_file	*tf_raf;
+	off_t			 tf_next;	/* next offset to read */
+	off_t			 tf_got;	/* next offset expected back */
+};
+
+struct test_state {
+	struct ct_global_state	*t_state;
+	struct ct_readahead	*t_ra;
+	char			 t_dir[PATH_MAX];
+	struct test_file	*t_files;
+	int			 t_nfiles;
+	int			 t_head;	/* oldest file in the window */
+	int			 t_tail;	/* next file to open */
+	int			 t_window;
+	struct ct_ra_reads	 t_free;
+	int			 t_ntrans;
+	int			 t_nfree;
+	uint64_t		 t_chunks;
+	uint64_t		 t_errors;
+};
+
+void	test_step(void *);
+void	test_reconnect(evutil_socket_t, short, void *);
+int	test_run(int, int, int, int);
+
+__dead void
+test_reconnect(evutil_socket_t unused, short event, void *varg)
+{
+	/* never connected */
+}
+
+static uint8_t
+test_byte(int file, off_t off)
+{
+	return ((file * 131 + off * 7 + (off >> 8)) & 0xff);
+}
+
+static off_t
+test_size(int i)
+{
+	switch (i % 8) {
+	case 0:
+		return (0);
+	case 1:
+		return (1);
+	case 2:
+		return (TEST_BLOCKSZ - 1);
+	case 3:
+		return (TEST_BLOCKSZ);
+	case 4:
+		return (TEST_BLOCKSZ + 1);
+	case 5:
+		return (3 * TEST_BLOCKSZ);
+	default:
+		return (arc4random_uniform(16 * TEST_BLOCKSZ));
+	}
+}
+
+static void
+test_put(struct test_state *t, struct ct_ra_reads *reads)
+{
+	struct ct_trans	*trans;
+
+	while ((trans = TAILQ_FIRST(reads)) != NULL) {
+		TAILQ_REMOVE(reads, trans, tr_next);
+		TAILQ_INSERT_TAIL(&t->t_free, trans, tr_next);
+		t->t_nfree++;
+	}
+}
+
+static void
+test_close(struct test_state *t, struct test_file *tf)
+{
+	struct ct_ra_reads	reads;
+
+	TAILQ_INIT(&reads);
+	ct_readahead_close(t->t_ra, tf->tf_raf, &reads);
+	tf->tf_raf = NULL;
+	test_put(t, &reads);
+	t->t_head++;
+}
+
+static void
+test_issue(struct test_state *t)
+{
+	struct test_file	*tf;
+	struct ct_trans		*trans;
+	struct stat		 sb;
+	off_t			 end;
+	int			 i, share, error;
+
+	/* as in ct_archive_ra_issue(), leave some for the head */
+	share = t->t_ntrans / 2;
+	for (i = t->t_head; i < t->t_tail; i++) {
+		tf = &t->t_files[i];
+		switch (ct_readahead_status(t->t_ra, tf->tf_raf, &sb,
+		    &error)) {
+		case CT_RA_PENDING:
+			end = TEST_BLOCKSZ;
+			break;
+		case CT_RA_OPEN:
+			end = sb.st_size;
+			break;
+		default:
+			continue;
+		}
+		while (tf->tf_next < end &&
+		    (trans = TAILQ_FIRST(&t->t_free)) != NULL) {
+			if (i != t->t_head &&
+			    t->t_ntrans - t->t_nfree >= share)
+				return;
+			TAILQ_REMOVE(&t->t_free, trans, tr_next);
+			t->t_nfree--;
+			ct_readahead_read(t->t_ra, tf->tf_raf, trans,
+			    tf->tf_next);
+			tf->tf_next += TEST_BLOCKSZ;
+		}
+	}
+}
+
+static void
+test_finish(struct test_state *t)
+{
+	struct ct_ra_reads	reads;
+
+	TAILQ_INIT(&reads);
+	ct_readahead_cleanup(t->t_ra, &reads);
+	t->t_ra = NULL;
+	test_put(t, &reads);
+	if (t->t_nfree != t->t_ntrans) {
+		CWARNX("%d of %d transactions returned", t->t_nfree,
+		    t->t_ntrans);
+		t->t_errors++;
+	}
+	ct_event_loopbreak(t->t_state->event_state);
+}
+
+/* The file thread's part: fill the window, hand out reads, consume. */
+void
+test_step(void *vctx)
+{
+	struct test_state	*t = vctx;
+	struct ct_ra_reads	 reads;
+	struct test_file	*tf;
+	struct ct_trans		*trans;
+	struct stat		 sb;
+	char			 path[PATH_MAX];
+	off_t			 len, o;
+	int			 status, error, final;
+
+	if (t->t_ra == NULL)
+		return;
+
+	TAILQ_INIT(&reads);
+	(void)ct_readahead_reap(t->t_ra, &reads);
+	test_put(t, &reads);
+
+	for (;;) {
+		while (t->t_tail < t->t_nfiles &&
+		    t->t_tail - t->t_head < t->t_window) {
+			tf = &t->t_files[t->t_tail];
+			snprintf(path, sizeof(path), "f%d", t->t_tail);
+			tf->tf_raf = ct_readahead_open(t->t_ra,
+			    open(t->t_dir, O_RDONLY), path, O_RDONLY);
+			t->t_tail++;
+		}
+		test_issue(t);
+		ct_readahead_flush(t->t_ra);
+
+		if (t->t_head == t->t_nfiles) {
+			test_finish(t);
+			return;
+		}
+		tf = &t->t_files[t->t_head];
+
+		status = ct_readahead_status(t->t_ra, tf->tf_raf, &sb,
+		    &error);
+		if (status == CT_RA_PENDING)
+			return;
+		if (status != CT_RA_OPEN) {
+			if (!tf->tf_missing || status != CT_RA_EOPEN) {
+				CWARNX("file %d: status %d errno %d",
+				    t->t_head, status, error);
+				t->t_errors++;
+			}
+			test_close(t, tf);
+			continue;
+		}
+		if (tf->tf_missing || sb.st_size != tf->tf_size) {
+			CWARNX("file %d: size %" PRId64 " expected %"
+			    PRId64, t->t_head, (int64_t)sb.st_size,
+			    (int64_t)tf->tf_size);
+			t->t_errors++;
+		}
+		if (tf->tf_size == 0 ||
+		    (tf->tf_drop && tf->tf_got >= TEST_BLOCKSZ)) {
+			test_close(t, tf);
+			continue;
+		}
+
+		if ((trans = ct_readahead_next(t->t_ra, tf->tf_raf, &final,
+		    &sb, &error)) == NULL)
+			return;
+		len = tf->tf_size - tf->tf_got;
+		if (len > TEST_BLOCKSZ)
+			len = TEST_BLOCKSZ;
+		if (trans->tr_ra_offset != tf->tf_got ||
+		    trans->tr_size[0] != len) {
+			CWARNX("file %d: got %d at %" PRId64 " expected %d "
+			    "at %" PRId64, t->t_head, trans->tr_size[0],
+			    (int64_t)trans->tr_ra_offset, (int)len,
+			    (int64_t)tf->tf_got);
+			t->t_errors++;
+		} else {
+			for (o = 0; o < len; o++)
+				if (trans->tr_data[0][o] !=
+				    test_byte(t->t_head, tf->tf_got + o))
+					break;
+			if (o != len) {
+				CWARNX("file %d: bad data at %" PRId64,
+				    t->t_head, (int64_t)(tf->tf_got + o));
+				t->t_errors++;
+			}
+		}
+		tf->tf_got += len;
+		t->t_chunks++;
+		TAILQ_INSERT_TAIL(&t->t_free, trans, tr_next);
+		t->t_nfree++;
+
+		if (final != (tf->tf_got == tf->tf_size)) {
+			CWARNX("file %d: final %d at %" PRId64, t->t_head,
+			    final, (int64_t)tf->tf_got);
+			t->t_errors++;
+		}
+		if (final) {
+			if (error != 0 || sb.st_size != tf->tf_size) {
+				CWARNX("file %d: end stat %d", t->t_head,
+				    error);
+				t->t_errors++;
+			}
+			test_close(t, tf);
+		}
+	}
+}
+
+static void
+test_mkfiles(struct test_state *t)
+{
+	uint8_t		 buf[TEST_BLOCKSZ];
+	char		 path[PATH_MAX];
+	off_t		 off, o;
+	size_t		 len;
+	int		 i, fd;
+
+	strlcpy(t->t_dir, "/tmp/test_ct_readahead.XXXXXXXXXX",
+	    sizeof(t->t_dir));
+	if (mkdtemp(t->t_dir) == NULL)
+		CFATAL("mkdtemp");
+
+	for (i = 0; i < t->t_nfiles; i++) {
+		t->t_files[i].tf_size = test_size(i);
+		t->t_files[i].tf_drop = arc4random_uniform(8) == 0;
+		if (i % 13 == 7) {
+			t->t_files[i].tf_missing = 1;
+			continue;
+		}
+		snprintf(path, sizeof(path), "%s/f%d", t->t_dir, i);
+		if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600)) == -1)
+			CFATAL("open %s", path);
+		for (off = 0; off < t->t_files[i].tf_size; off += len) {
+			len = MIN(sizeof(buf), t->t_files[i].tf_size - off);
+			for (o = 0; o < len; o++)
+				buf[o] = test_byte(i, off + o);
+			if (write(fd, buf, len) != len)
+				CFATAL("write %s", path);
+		}
+		close(fd);
+	}
+}
+
+static void
+test_rmfiles(struct test_state *t)
+{
+	char	path[PATH_MAX];
+	int	i;
+
+	for (i = 0; i < t->t_nfiles; i++) {
+		if (t->t_files[i].tf_missing)
+			continue;
+		snprintf(path, sizeof(path), "%s/f%d", t->t_dir, i);
+		unlink(path);
+	}
+	rmdir(t->t_dir);
+}
+
+int
+test_run(int depth, int nthreads, int nfiles, int uring)
+{
+	struct ct_config	 conf;
+	struct test_state	 t;
+	struct ct_trans		*pool;
+	uint8_t			*bufs;
+	int			 ret, i;
+
+	ct_default_config(&conf);
+	conf.ct_max_trans = depth;
+	bzero(&t, sizeof(t));
+	t.t_nfiles = nfiles;
+	t.t_files = e_calloc(nfiles, sizeof(*t.t_files));
+	TAILQ_INIT(&t.t_free);
+	test_mkfiles(&t);
+
+	if ((ret = ct_setup_state(&t.t_state, &conf)) != 0)
+		CFATALX("can't setup state: %s", ct_strerror(ret));
+	if ((t.t_state->event_state = ct_event_init(t.t_state,
+	    test_reconnect, NULL)) == NULL)
+		CFATALX("can't initialise event state");
+	ct_init_queues(t.t_state);
+	if ((ret = ct_setup_wakeup_file(t.t_state->event_state, &t,
+	    test_step)) != 0)
+		CFATALX("can't setup wakeup: %s", ct_strerror(ret));
+
+	if ((t.t_ra = ct_readahead_init(t.t_state->event_state, nthreads,
+	    TEST_BLOCKSZ, uring)) == NULL)
+		CFATALX("can't start read-ahead");
+	t.t_window = ct_readahead_window(t.t_ra);
+
+	t.t_ntrans = t.t_state->ct_max_trans + 1;
+	pool = e_calloc(t.t_ntrans, sizeof(*pool));
+	bufs = e_calloc(t.t_ntrans, TEST_BLOCKSZ);
+	for (i = 0; i < t.t_ntrans; i++) {
+		pool[i].tr_data[0] = bufs + i * TEST_BLOCKSZ;
+		TAILQ_INSERT_TAIL(&t.t_free, &pool[i], tr_next);
+	}
+	t.t_nfree = t.t_ntrans;
+
+	ct_wakeup_file(t.t_state->event_state);
+	if (ct_event_dispatch(t.t_state->event_state) == -1)
+		CFATALX("event loop failed");
+
+	ct_event_cleanup(t.t_state->event_state);
+	t.t_state->event_state = NULL;
+	ct_cleanup_queues(t.t_state);
+	ct_cleanup(t.t_state);
+	test_rmfiles(&t);
+	e_free(&bufs);
+	e_free(&pool);
+	e_free(&t.t_files);
+	free(conf.ct_host);
+	free(conf.ct_hostport);
+
+	printf("depth %4d\t%s %3d\t%8d files\t%10" PRIu64 " chunks\t%s\n",
+	    depth, uring ? "uring  " : "threads", uring ? 1 : nthreads, nfiles,
+	    t.t_chunks, t.t_errors ? "FAILED" : "ok");
+
+	return (t.t_errors != 0);
+}
+
+__dead void
+usage(void)
+{
+	fprintf(stderr, "usage: %s [-d queue_depth] [-n files] "
+	    "[-t maxthreads]\n", __progname);
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	const char	*errstr;
+	int		 depth = 100, maxthreads = 8, nfiles = 1000;
+	int		 nthreads, c, failed = 0;
+
+	clog_init(1);
+	(void)clog_set_flags(CLOG_F_STDERR | CLOG_F_ENABLE);
+
+	while ((c = getopt(argc, argv, "d:n:t:")) != -1) {
+		switch (c) {
+		case 'd':
+			depth = strtonum(optarg, 1, INT_MAX / 2, &errstr);
+			if (errstr)
+				CFATALX("queue depth %s: %s", optarg, errstr);
+			break;
+		case 'n':
+			nfiles = strtonum(optarg, 1, INT_MAX, &errstr);
+			if (errstr)
+				CFATALX("files %s: %s", optarg, errstr);
+			break;
+		case 't':
+			maxthreads = strtonum(optarg, 1, CT_MAX_WORKERS,
+			    &errstr);
+			if (errstr)
+				CFATALX("maxthreads %s: %s", optarg, errstr);
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc != 0)
+		usage();
+
+	for (nthreads = 1; nthreads <= maxthreads; nthreads *= 2)
+		failed |= test_run(depth, nthreads, nfiles, 0);
+	/* one transaction for the head, one to read ahead with */
+	failed |= test_run(1, maxthreads, nfiles / 10 + 1, 0);
+
+	/* threads again if there is no io_uring */
+	failed |= test_run(depth, 1, nfiles, 1);
+	failed |= test_run(1, 1, nfiles / 10 + 1, 1);
+
+	return (failed);
+}
@@ -0,0 +1,259 @@
+/*
+ * Copyright (c) 2012 Conformal Systems LLC <info@conformal.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Stress the completion reorder buffer.  Worker threads take transactions
+ * from a pool sized like the real one, number them in order, shuffle them
+ * and complete them after a random delay.  The event loop drains the
+ * completions and checks that they come out in id order with none lost.
+ */
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <inttypes.h>
+#include <pthread.h>
+
+#include <clog.h>
+#include <exude.h>
+
+#include <ctutil.h>
+#include <ct_threads.h>
+#include <cyphertite.h>
+#include <ct_internal.h>
+
+#define TEST_BATCH	8	/* max transactions a worker takes at once */
+
+extern char *__progname;
+
+struct test_state {
+	struct ct_global_state	*t_state;
+	pthread_mutex_t		 t_mtx;
+	pthread_cond_t		 t_cv;
+	TAILQ_HEAD(, ct_trans)	 t_free;
+	uint64_t		 t_total;
+	uint64_t		 t_issued;
+	uint64_t		 t_drained;
+	uint64_t		 t_errors;
+};
+
+void	test_drain(void *);
+void	*test_worker(void *);
+void	test_reconnect(evutil_socket_t, short, void *);
+int	test_run(int, int, uint64_t);
+
+__dead void
+usage(void)
+{
+	fprintf(stderr, "usage: %s [-d queue_depth] [-n completions] "
+	    "[-t maxthreads]\n", __progname);
+	exit(1);
+}
+
+void
+test_drain(void *vctx)
+{
+	struct test_state	*t = vctx;
+	struct ct_trans		*trans;
+
+	while ((trans = ct_dequeue_complete(t->t_state)) != NULL) {
+		if (trans->tr_trans_id != t->t_drained) {
+			CWARNX("completed %" PRIu64 " expected %" PRIu64,
+			    trans->tr_trans_id, t->t_drained);
+			t->t_errors++;
+		}
+		t->t_drained++;
+
+		pthread_mutex_lock(&t->t_mtx);
+		TAILQ_INSERT_TAIL(&t->t_free, trans, tr_next);
+		pthread_cond_signal(&t->t_cv);
+		pthread_mutex_unlock(&t->t_mtx);
+	}
+	if (t->t_drained == t->t_total)
+		ct_event_loopbreak(t->t_state->event_state);
+}
+
+void *
+test_worker(void *vctx)
+{
+	struct test_state	*t = vctx;
+	struct ct_trans		*batch[TEST_BATCH], *trans;
+	unsigned int		 seed = (unsigned int)(uintptr_t)&batch;
+	volatile int		 spin;
+	int			 n, want, i, j, delay;
+
+	for (;;) {
+		want = 1 + rand_r(&seed) % TEST_BATCH;
+		pthread_mutex_lock(&t->t_mtx);
+		while (TAILQ_EMPTY(&t->t_free) && t->t_issued < t->t_total)
+			pthread_cond_wait(&t->t_cv, &t->t_mtx);
+		for (n = 0; n < want && t->t_issued < t->t_total &&
+		    (trans = TAILQ_FIRST(&t->t_free)) != NULL; n++) {
+			TAILQ_REMOVE(&t->t_free, trans, tr_next);
+			/* as ct_queue_first() does */
+			trans->tr_trans_id = t->t_state->ct_trans_id++;
+			t->t_issued++;
+			batch[n] = trans;
+		}
+		pthread_mutex_unlock(&t->t_mtx);
+		if (n == 0)
+			break;
+
+		for (i = n - 1; i > 0; i--) {
+			j = rand_r(&seed) % (i + 1);
+			trans = batch[i];
+			batch[i] = batch[j];
+			batch[j] = trans;
+		}
+		for (i = 0; i < n; i++) {
+			delay = rand_r(&seed) % 1024;
+			for (spin = 0; spin < delay; spin++)
+				;
+			ct_queue_complete(t->t_state, batch[i]);
+		}
+	}
+
+	/* let the others see we ran out */
+	pthread_mutex_lock(&t->t_mtx);
+	pthread_cond_broadcast(&t->t_cv);
+	pthread_mutex_unlock(&t->t_mtx);
+
+	return (NULL);
+}
+
+void
+test_reconnect(evutil_socket_t unused, short event, void *varg)
+{
+	/* never connected */
+}
+
+int
+test_run(int depth, int nthreads, uint64_t total)
+{
+	struct ct_config	 conf;
+	struct test_state	 t;
+	struct ct_trans		*pool, *trans;
+	pthread_t		 workers[CT_MAX_WORKERS];
+	int			 ret, ntrans, i;
+
+	ct_default_config(&conf);
+	conf.ct_max_trans = depth;
+	bzero(&t, sizeof(t));
+	t.t_total = total;
+	pthread_mutex_init(&t.t_mtx, NULL);
+	pthread_cond_init(&t.t_cv, NULL);
+	TAILQ_INIT(&t.t_free);
+
+	if ((ret = ct_setup_state(&t.t_state, &conf)) != 0)
+		CFATALX("can't setup state: %s", ct_strerror(ret));
+	if ((t.t_state->event_state = ct_event_init(t.t_state,
+	    test_reconnect, NULL)) == NULL)
+		CFATALX("can't initialise event state");
+	ct_init_queues(t.t_state);
+	if ((ret = ct_setup_wakeup_complete(t.t_state->event_state, &t,
+	    test_drain)) != 0)
+		CFATALX("can't setup wakeup: %s", ct_strerror(ret));
+
+	/* as many as ct_trans_alloc() hands out */
+	ntrans = t.t_state->ct_max_trans + 1;
+	pool = e_calloc(ntrans, sizeof(*pool));
+	for (i = 0; i < ntrans; i++)
+		TAILQ_INSERT_TAIL(&t.t_free, &pool[i], tr_next);
+
+	for (i = 0; i < nthreads; i++)
+		if (pthread_create(&workers[i], NULL, test_worker, &t) != 0)
+			CFATALX("can't create worker");
+	if (ct_event_dispatch(t.t_state->event_state) == -1)
+		CFATALX("event loop failed");
+	for (i = 0; i < nthreads; i++)
+		pthread_join(workers[i], NULL);
+
+	if (ct_reorder_len(&t.t_state->ct_complete) != 0) {
+		CWARNX("%d completions left over",
+		    ct_reorder_len(&t.t_state->ct_complete));
+		t.t_errors++;
+	}
+	i = 0;
+	TAILQ_FOREACH(trans, &t.t_free, tr_next)
+		i++;
+	if (i != ntrans) {
+		CWARNX("%d of %d transactions returned", i, ntrans);
+		t.t_errors++;
+	}
+
+	ct_event_cleanup(t.t_state->event_state);
+	t.t_state->event_state = NULL;
+	ct_cleanup_queues(t.t_state);
+	ct_cleanup(t.t_state);
+	e_free(&pool);
+	free(conf.ct_host);
+	free(conf.ct_hostport);
+	pthread_cond_destroy(&t.t_cv);
+	pthread_mutex_destroy(&t.t_mtx);
+
+	printf("depth %4d\tthreads %3d\t%10" PRIu64 " completions\t%s\n",
+	    depth, nthreads, t.t_drained, t.t_errors ? "FAILED" : "ok");
+
+	return (t.t_errors != 0);
+}
+
+int
+main(int argc, char **argv)
+{
+	const char	*errstr;
+	uint64_t	 total = 1000000;
+	int		 depth = 100, maxthreads = 8, failed = 0;
+	int		 nthreads, c;
+
+	clog_init(1);
+	(void)clog_set_flags(CLOG_F_STDERR | CLOG_F_ENABLE);
+
+	while ((c = getopt(argc, argv, "d:n:t:")) != -1) {
+		switch (c) {
+		case 'd':
+			depth = strtonum(optarg, 1, INT_MAX / 2, &errstr);
+			if (errstr)
+				CFATALX("queue depth %s: %s", optarg, errstr);
+			break;
+		case 'n':
+			total = strtonum(optarg, 1, LLONG_MAX, &errstr);
+			if (errstr)
+				CFATALX("completions %s: %s", optarg, errstr);
+			break;
+		case 't':
+			maxthreads = strtonum(optarg, 1, CT_MAX_WORKERS,
+			    &errstr);
+			if (errstr)
+				CFATALX("maxthreads %s: %s", optarg, errstr);
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc != 0)
+		usage();
+
+	for (nthreads = 1; nthreads <= maxthreads; nthreads *= 2)
+		failed |= test_run(depth, nthreads, total);
+	/* a tiny window wraps the buffer constantly */
+	failed |= test_run(1, maxthreads, total / 10 + 1);
+
+	return (failed);
+}